@@ -0,0 +1,128 @@
+#include "BusMonitorWidget.h"
+
+#include <QDir>
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QLabel>
+#include <QMessageBox>
+#include <QPushButton>
+#include <QScrollBar>
+#include <QSpinBox>
+#include <QStandardPaths>
+#include <QTableView>
+#include <QVBoxLayout>
+
+#include "TransferLogModel.h"
+
+BusMonitorWidget::BusMonitorWidget(UsbThread& thread, QWidget* parent)
+	: QWidget(parent), usbThread(thread)
+{
+	busSpinBox = new QSpinBox(this);
+	busSpinBox->setRange(0, 255);
+	busSpinBox->setSpecialValueText("All buses");
+	busSpinBox->setPrefix("Bus ");
+
+	startStopButton = new QPushButton("Start", this);
+
+	summaryLabel = new QLabel(this);
+	summaryLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
+
+	transferModel = new TransferLogModel(this);
+	transferView = new QTableView(this);
+	transferView->setModel(transferModel);
+	transferView->setSelectionBehavior(QAbstractItemView::SelectRows);
+	transferView->verticalHeader()->hide();
+	// Every row is the same height, which lets the view skip measuring them.
+	transferView->verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+	transferView->horizontalHeader()->setStretchLastSection(true);
+
+	QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+	QDir().mkpath(cacheDir);
+	capturePath = cacheDir + "/bus-monitor.capture";
+
+	QHBoxLayout* controls = new QHBoxLayout();
+	controls->addWidget(busSpinBox);
+	controls->addWidget(startStopButton);
+	controls->addWidget(summaryLabel, 1);
+
+	QVBoxLayout* layout = new QVBoxLayout(this);
+	layout->addLayout(controls);
+	layout->addWidget(transferView, 1);
+
+	connect(startStopButton, &QPushButton::clicked, this, &BusMonitorWidget::onStartStopClicked);
+	connect(&summaryTimer, &QTimer::timeout, this, &BusMonitorWidget::updateSummary);
+
+	updateSummary();
+}
+
+BusMonitorWidget::~BusMonitorWidget()
+{
+	if (running)
+		usbThread.stopBusMonitor();
+}
+
+void BusMonitorWidget::onStartStopClicked()
+{
+	if (running)
+	{
+		// This finishes the capture, so the reload picks up its index.
+		usbThread.stopBusMonitor();
+		running = false;
+		summaryTimer.stop();
+		startStopButton->setText("Start");
+		busSpinBox->setEnabled(true);
+		updateSummary();
+		return;
+	}
+
+	// Let go of the last run's capture before it is replaced.
+	transferModel->close();
+
+	bus = busSpinBox->value();
+	SResult<void> res = usbThread.startBusMonitor(bus, capturePath);
+	if (!res)
+	{
+		QMessageBox::warning(this, "Couldn't start the bus monitor", QString::fromStdString(res.unwrap_err()));
+		return;
+	}
+	// The writer has created it, so this only fails if it has gone already.
+	transferModel->open(capturePath);
+
+	running = true;
+	startStopButton->setText("Stop");
+	busSpinBox->setEnabled(false);
+	summaryTimer.start(250);
+	updateSummary();
+}
+
+void BusMonitorWidget::updateSummary()
+{
+	// Keep following the newest transfers, unless the user has scrolled up to look at one.
+	QScrollBar* scrollBar = transferView->verticalScrollBar();
+	bool atBottom = scrollBar->value() == scrollBar->maximum();
+	transferModel->reload();
+	if (atBottom)
+		transferView->scrollToBottom();
+
+	UsbMonTotals totals = usbThread.busMonitorTotals();
+	if (!running && totals.submissions == 0 && totals.completions == 0 && totals.errors == 0)
+	{
+		summaryLabel->setText("Watches every transfer on a bus with usbmon (Linux only).");
+		return;
+	}
+
+	UsbMonStats stats = usbThread.busMonitorStats();
+	QString text = QString("%1: %2 submitted, %3 completed (%4 bytes), %5 errors")
+	                   .arg(bus == 0 ? QString("All buses") : QString("Bus %1").arg(bus))
+	                   .arg(totals.submissions)
+	                   .arg(totals.completions)
+	                   .arg(totals.bytes)
+	                   .arg(totals.errors);
+	if (stats.kernelDropped > 0)
+		text += QString("; %1 dropped by the kernel").arg(stats.kernelDropped);
+	if (stats.malformed > 0)
+		text += QString("; %1 malformed").arg(stats.malformed);
+	if (!running)
+		text += " (stopped)";
+	summaryLabel->setText(text);
+}
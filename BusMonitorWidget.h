@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QTimer>
+#include <QWidget>
+
+#include "UsbThread.h"
+
+class QLabel;
+class QPushButton;
+class QSpinBox;
+class QTableView;
+class TransferLogModel;
+
+// Starts and stops UsbThread's bus monitor (see UsbMon.h), and shows a running summary of the
+// events it has counted. The events are also written to a capture in the cache directory,
+// which is listed below the summary with a TransferLogModel.
+class BusMonitorWidget : public QWidget
+{
+	Q_OBJECT
+public:
+	// `thread` must outlive this object.
+	explicit BusMonitorWidget(UsbThread& thread, QWidget* parent = nullptr);
+	// Stops the monitor if it is running.
+	~BusMonitorWidget();
+
+private slots:
+	void onStartStopClicked();
+	void updateSummary();
+
+private:
+	UsbThread& usbThread;
+
+	QSpinBox* busSpinBox = nullptr;
+	QPushButton* startStopButton = nullptr;
+	QLabel* summaryLabel = nullptr;
+	QTableView* transferView = nullptr;
+	TransferLogModel* transferModel = nullptr;
+
+	// The capture of the last run.
+	QString capturePath;
+
+	// The monitor's counts and capture change with every batch, thousands of times a
+	// second, so the summary is redrawn (and the capture reloaded) on a timer.
+	QTimer summaryTimer;
+
+	bool running = false;
+	int bus = 0;
+};
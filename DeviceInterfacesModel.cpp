@@ -30,7 +30,11 @@ QVariant DeviceInterfacesModel::data(const QModelIndex& index, int role) const
 			int c = nodes[id].data.configuration;
 			if (c < 0 || c >= descriptor.configurations.size())
 				return "";
-			return "bConfigurationValue " + QString::number(descriptor.configurations[c].bConfigurationValue);
+			const ConfigurationDescriptor& config = descriptor.configurations[c];
+			QString text = "bConfigurationValue " + QString::number(config.bConfigurationValue);
+			if (!config.sConfiguration.empty())
+				text += " (" + QString::fromStdU16String(config.sConfiguration) + ")";
+			return text;
 		}
 		case NodeType::Interface:
 		{
@@ -40,7 +44,11 @@ QVariant DeviceInterfacesModel::data(const QModelIndex& index, int role) const
 			int i = nodes[id].data.interface_;
 			if (i < 0 || i >= descriptor.configurations[c].interfaces.size())
 				return "";
-			return "bInterfaceNumber " + QString::number(descriptor.configurations[c].interfaces[i].bInterfaceNumber);
+			const InterfaceDescriptor& iface = descriptor.configurations[c].interfaces[i];
+			QString text = "bInterfaceNumber " + QString::number(iface.bInterfaceNumber);
+			if (!iface.sInterface.empty())
+				text += " (" + QString::fromStdU16String(iface.sInterface) + ")";
+			return text;
 		}
 		case NodeType::Endpoint:
 		{
@@ -3,6 +3,8 @@
 #include "Metatypes.h"
 
 #include <QDebug>
+#include <QBrush>
+#include <QFont>
 
 DeviceListModel::DeviceListModel(QObject *parent) : QAbstractListModel(parent)
 {
@@ -30,6 +32,22 @@ QVariant DeviceListModel::data(const QModelIndex& index, int role) const
 	case Qt::UserRole:
 		qDebug() << "Returning address:" << QString::fromStdString(DeviceIdToString(devices[i].id));
 		return QVariant::fromValue(devices[i].id);
+	case Qt::ForegroundRole:
+		if (lastKnown)
+			return QBrush(Qt::gray);
+		break;
+	case Qt::FontRole:
+		if (lastKnown)
+		{
+			QFont font;
+			font.setItalic(true);
+			return font;
+		}
+		break;
+	case Qt::ToolTipRole:
+		if (lastKnown)
+			return "Last known device; checking whether it is still connected.";
+		break;
 	default:
 		break;
 	}
@@ -44,6 +62,20 @@ QVariant DeviceListModel::headerData(int section, Qt::Orientation orientation, i
 	return "Device";
 }
 
+void DeviceListModel::setLastKnown(bool lk)
+{
+	if (lk == lastKnown)
+		return;
+	lastKnown = lk;
+	if (!devices.empty())
+		emit dataChanged(index(0), index(devices.size() - 1));
+}
+
+bool DeviceListModel::isLastKnown() const
+{
+	return lastKnown;
+}
+
 void DeviceListModel::updateData(const QVector<DeviceInfo>& newDevices)
 {
 	// For now we use a simple method of detecting device removal/addition. If every
@@ -16,10 +16,16 @@ public:
 	
 	void updateData(const QVector<DeviceInfo>& newDevices);
 	
+	// While this is set the devices are shown greyed out, because they are from the
+	// snapshot of the last run and might not be there any more.
+	void setLastKnown(bool lastKnown);
+	bool isLastKnown() const;
+	
 signals:
 	
 public slots:
 	
 private:
 	QVector<DeviceInfo> devices;
+	bool lastKnown = false;
 };
@@ -0,0 +1,120 @@
+#include "DeviceListSnapshot.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+
+using std::string;
+
+namespace
+{
+
+const quint32 SNAPSHOT_MAGIC = 0x55544453; // "UTDS"
+// Bump this if the format changes, including SerializeDeviceDescriptor()'s.
+const quint32 SNAPSHOT_VERSION = 2;
+
+QString PathToQString(const DeviceId& id)
+{
+#if defined(_WIN32) && !defined(USBTOOL_FAKE_USB)
+	return QString::fromStdWString(id.path);
+#else
+	return QString::fromStdString(id.path);
+#endif
+}
+
+DeviceId PathFromQString(const QString& s)
+{
+	DeviceId id;
+#if defined(_WIN32) && !defined(USBTOOL_FAKE_USB)
+	id.path = s.toStdWString();
+#else
+	id.path = s.toStdString();
+#endif
+	return id;
+}
+
+}
+
+SResult<std::vector<DeviceSnapshotEntry>> LoadDeviceListSnapshot(const QString& path)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+		return Err("Couldn't open " + path.toStdString() + ": " + file.errorString().toStdString());
+
+	QDataStream in(&file);
+	in.setVersion(QDataStream::Qt_5_0);
+
+	quint32 magic = 0;
+	quint32 version = 0;
+	quint32 count = 0;
+	in >> magic >> version >> count;
+	if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION)
+		return Err(string("Device list snapshot has the wrong version"));
+
+	std::vector<DeviceSnapshotEntry> entries;
+	for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i)
+	{
+		QString id;
+		QString manufacturer;
+		QString product;
+		QString serial;
+		DeviceSnapshotEntry e;
+		QByteArray blob;
+
+		in >> id >> manufacturer >> product >> serial >> e.info.vendorId >> e.info.productId >> e.hasDescriptors >> blob;
+
+		e.info.id = PathFromQString(id);
+		e.info.manufacturer = manufacturer.toStdString();
+		e.info.product = product.toStdString();
+		e.info.serial = serial.toStdString();
+
+		if (e.hasDescriptors)
+		{
+			SResult<DeviceDescriptor> desc = DeserializeDeviceDescriptor(reinterpret_cast<const uint8_t*>(blob.constData()), blob.size());
+			e.hasDescriptors = static_cast<bool>(desc);
+			if (desc)
+				e.descriptors = desc.unwrap();
+		}
+		entries.push_back(e);
+	}
+
+	if (in.status() != QDataStream::Ok)
+		return Err(string("Device list snapshot is truncated"));
+
+	return Ok(entries);
+}
+
+SResult<void> SaveDeviceListSnapshot(const QString& path, const std::vector<DeviceSnapshotEntry>& entries)
+{
+	QSaveFile file(path);
+	if (!file.open(QIODevice::WriteOnly))
+		return Err("Couldn't open " + path.toStdString() + ": " + file.errorString().toStdString());
+
+	QDataStream out(&file);
+	out.setVersion(QDataStream::Qt_5_0);
+
+	out << SNAPSHOT_MAGIC << SNAPSHOT_VERSION << quint32(entries.size());
+	for (const DeviceSnapshotEntry& e : entries)
+	{
+		QByteArray blob;
+		if (e.hasDescriptors)
+		{
+			std::vector<uint8_t> bytes = SerializeDeviceDescriptor(e.descriptors);
+			blob = QByteArray(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		}
+
+		out << PathToQString(e.info.id)
+		    << QString::fromStdString(e.info.manufacturer)
+		    << QString::fromStdString(e.info.product)
+		    << QString::fromStdString(e.info.serial)
+		    << e.info.vendorId
+		    << e.info.productId
+		    << e.hasDescriptors
+		    << blob;
+	}
+
+	if (!file.commit())
+		return Err("Couldn't write " + path.toStdString() + ": " + file.errorString().toStdString());
+
+	return Ok();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <QString>
+#include <vector>
+
+#include "util/Result.h"
+#include "usb/DeviceInfo.h"
+#include "usb/Descriptors.h"
+
+// The device list (and descriptors, if we fetched them) from the last time the program
+// ran, so it can be shown immediately at startup while the real enumeration runs.
+struct DeviceSnapshotEntry
+{
+	DeviceInfo info;
+	bool hasDescriptors = false;
+	DeviceDescriptor descriptors;
+};
+
+// Read a snapshot. Fails if the file doesn't exist or is from a different version.
+SResult<std::vector<DeviceSnapshotEntry>> LoadDeviceListSnapshot(const QString& path);
+
+// Write a snapshot. The file is replaced atomically so a crash can't leave half of one.
+SResult<void> SaveDeviceListSnapshot(const QString& path, const std::vector<DeviceSnapshotEntry>& entries);
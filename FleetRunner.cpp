@@ -0,0 +1,223 @@
+#include "FleetRunner.h"
+
+#include "usb/Dfu.h"
+
+#include <chrono>
+#include <string.h>
+
+using std::string;
+
+bool DeviceFilter::matches(const DeviceInfo& info) const
+{
+	if (vendorId >= 0 && info.vendorId != vendorId)
+		return false;
+	if (productId >= 0 && info.productId != productId)
+		return false;
+	if (info.product.find(productContains) == string::npos)
+		return false;
+	if (info.serial.find(serialContains) == string::npos)
+		return false;
+	return true;
+}
+
+FleetRunner::FleetRunner(PostFunc post, int maxPerHub) : post(post), maxPerHub(maxPerHub < 1 ? 1 : maxPerHub)
+{
+}
+
+int FleetRunner::start(const std::vector<DeviceInfo>& all, const DeviceFilter& filter, FleetJob j, UpdateFunc u)
+{
+	std::vector<FleetDeviceStatus> queued;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		job = j;
+		update = u;
+		startTime = HighResClock::now();
+
+		for (const DeviceInfo& info : all)
+		{
+			if (!filter.matches(info))
+				continue;
+
+			FleetDeviceStatus status;
+			status.info = info;
+			hubQueues[HubIdOf(info.id)].push_back(devices.size());
+			devices.push_back(status);
+			deviceStarts.push_back(startTime);
+		}
+		counts.total = devices.size();
+		queued = devices;
+	}
+
+	// Report everything as queued before anything starts, so listeners see every device.
+	if (update)
+		for (const FleetDeviceStatus& status : queued)
+			update(status, stats());
+
+	std::unique_lock<std::mutex> lock(mutex);
+	for (const auto& it : hubQueues)
+		startNext(it.first);
+
+	if (counts.total == 0)
+		finishedCondition.notify_all();
+
+	return counts.total;
+}
+
+void FleetRunner::startNext(const string& hub)
+{
+	std::deque<size_t>& queue = hubQueues[hub];
+	int& running = hubRunning[hub];
+
+	while (running < maxPerHub && !queue.empty())
+	{
+		size_t index = queue.front();
+		queue.pop_front();
+
+		++running;
+		++counts.running;
+		devices[index].state = FleetJobState::Running;
+		deviceStarts[index] = HighResClock::now();
+
+		std::shared_ptr<FleetRunner> self = shared_from_this();
+		post(devices[index].info.id, [self, index, hub] { self->runOne(index, hub); });
+	}
+}
+
+void FleetRunner::runOne(size_t index, const string& hub)
+{
+	DeviceInfo info;
+	bool skip = false;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		info = devices[index].info;
+		skip = cancelled;
+	}
+
+	auto progress = [this, index](double fraction, const string& message) {
+		FleetDeviceStatus status;
+		FleetStats s;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			devices[index].fraction = fraction;
+			devices[index].message = message;
+			devices[index].seconds = std::chrono::duration<double>(HighResClock::now() - deviceStarts[index]).count();
+			status = devices[index];
+			s = statsLocked();
+		}
+		if (update)
+			update(status, s);
+	};
+
+	if (!skip)
+		progress(0.0, "Started");
+
+	SResult<void> result = skip ? SResult<void>(Err(string("Cancelled"))) : job(info, progress);
+
+	FleetDeviceStatus status;
+	FleetStats s;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		FleetDeviceStatus& d = devices[index];
+		d.seconds = std::chrono::duration<double>(HighResClock::now() - deviceStarts[index]).count();
+		if (result)
+		{
+			d.state = FleetJobState::Succeeded;
+			d.fraction = 1.0;
+			d.message = "Done";
+			++counts.succeeded;
+		}
+		else
+		{
+			d.state = FleetJobState::Failed;
+			d.message = result.unwrap_err();
+			++counts.failed;
+		}
+		--counts.running;
+		--hubRunning[hub];
+
+		status = d;
+		s = statsLocked();
+
+		startNext(hub);
+
+		if (counts.finished() == counts.total)
+			finishedCondition.notify_all();
+	}
+
+	if (update)
+		update(status, s);
+}
+
+void FleetRunner::cancel()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	cancelled = true;
+}
+
+void FleetRunner::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	finishedCondition.wait(lock, [this] { return counts.finished() == counts.total; });
+}
+
+FleetStats FleetRunner::stats() const
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return statsLocked();
+}
+
+FleetStats FleetRunner::statsLocked() const
+{
+	FleetStats s = counts;
+	s.seconds = std::chrono::duration<double>(HighResClock::now() - startTime).count();
+	return s;
+}
+
+std::vector<FleetDeviceStatus> FleetRunner::statuses() const
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return devices;
+}
+
+FleetJob MakeDfuFleetJob(std::function<SResult<std::shared_ptr<Device>>(const DeviceId&)> open,
+                         std::shared_ptr<MappedFile> image)
+{
+	return [open, image](const DeviceInfo& info, const FleetProgressFunc& progress) -> SResult<void> {
+		std::shared_ptr<Device> dev = TRY(open(info.id));
+		DfuDevice dfu = TRY(DfuDevice::open(dev));
+
+		bool verify = dfu.functionalDescriptor().canUpload;
+		// Downloading is most of the time, so give it most of the bar.
+		double downloadShare = verify ? 0.7 : 1.0;
+
+		DfuProgress down = TRY(dfu.download(*image, [&](const DfuProgress& p) {
+			double fraction = p.bytesTotal ? downloadShare * p.bytesDone / p.bytesTotal : downloadShare;
+			progress(fraction, "Downloading at " + std::to_string(static_cast<int>(p.kilobytesPerSecond())) + " KB/s");
+			return true;
+		}));
+
+		if (!verify)
+			return Ok();
+
+		// Compare the uploaded data with the image as it arrives.
+		uint64_t offset = 0;
+		auto compare = [&](const uint8_t* data, size_t size) -> SResult<void> {
+			if (offset + size > image->size() || memcmp(image->data() + offset, data, size) != 0)
+				return Err("Verify failed near offset " + std::to_string(offset));
+			offset += size;
+			return Ok();
+		};
+
+		MSTRY(dfu.upload(compare, image->size(), [&](const DfuProgress& p) {
+			double fraction = downloadShare + (1.0 - downloadShare) * p.bytesDone / image->size();
+			progress(fraction, "Verifying");
+			return true;
+		}));
+
+		if (offset != image->size())
+			return Err("Verify failed: device returned " + std::to_string(offset) + " of " + std::to_string(image->size()) + " bytes");
+
+		progress(1.0, "Downloaded at " + std::to_string(static_cast<int>(down.kilobytesPerSecond())) + " KB/s and verified");
+		return Ok();
+	};
+}
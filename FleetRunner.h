@@ -0,0 +1,134 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/HighResClock.h"
+#include "util/MappedFile.h"
+#include "usb/DeviceInfo.h"
+#include "usb/Device.h"
+
+// Selects devices for a fleet job. Fields left at their defaults match anything.
+struct DeviceFilter
+{
+	int vendorId = -1;
+	int productId = -1;
+	// Case-sensitive substrings.
+	std::string productContains;
+	std::string serialContains;
+
+	bool matches(const DeviceInfo& info) const;
+};
+
+enum class FleetJobState
+{
+	Queued,
+	Running,
+	Succeeded,
+	Failed,
+};
+
+// The progress of the job on one device.
+struct FleetDeviceStatus
+{
+	DeviceInfo info;
+	FleetJobState state = FleetJobState::Queued;
+	// 0 to 1, as reported by the job.
+	double fraction = 0.0;
+	// The job's latest progress message, or the error if it failed.
+	std::string message;
+	// How long the job has been running on this device.
+	double seconds = 0.0;
+};
+
+struct FleetStats
+{
+	int total = 0;
+	int succeeded = 0;
+	int failed = 0;
+	int running = 0;
+	// Since start().
+	double seconds = 0.0;
+
+	int finished() const { return succeeded + failed; }
+	double devicesPerMinute() const { return seconds > 0.0 ? finished() * 60.0 / seconds : 0.0; }
+};
+
+// Jobs report how far they have got with this.
+typedef std::function<void(double fraction, const std::string& message)> FleetProgressFunc;
+
+// The work done on each device. It is run on a pool thread, and may block.
+typedef std::function<SResult<void>(const DeviceInfo& info, const FleetProgressFunc& progress)> FleetJob;
+
+// Runs a job on a set of devices concurrently. Devices on the same hub share its bandwidth
+// (and often its power budget) so at most `maxPerHub` jobs run on each hub at once.
+//
+// The runner doesn't own any threads. `post` is given each device's job to run wherever is
+// appropriate (UsbThread uses the device's strand so the job doesn't race its other requests).
+//
+// Must be created with std::make_shared, since queued jobs keep a reference to it.
+class FleetRunner : public std::enable_shared_from_this<FleetRunner>
+{
+public:
+	typedef std::function<void(const DeviceId& id, std::function<void()> job)> PostFunc;
+	// Called from the job threads whenever a device's status changes.
+	typedef std::function<void(const FleetDeviceStatus& status, const FleetStats& stats)> UpdateFunc;
+
+	FleetRunner(PostFunc post, int maxPerHub);
+
+	// Start `job` on every device in `devices` that matches `filter`. Returns the number of
+	// matching devices. Only call this once.
+	int start(const std::vector<DeviceInfo>& devices, const DeviceFilter& filter, FleetJob job, UpdateFunc update);
+
+	// Fail devices that haven't started yet. Running jobs are left to finish.
+	void cancel();
+
+	// Block until every device has finished.
+	void wait();
+
+	FleetStats stats() const;
+	std::vector<FleetDeviceStatus> statuses() const;
+
+private:
+	FleetRunner(const FleetRunner&) = delete;
+	FleetRunner& operator=(const FleetRunner&) = delete;
+
+	// Start queued devices on `hub` until it is at its limit. `mutex` must be locked.
+	void startNext(const std::string& hub);
+	void runOne(size_t index, const std::string& hub);
+
+	// `mutex` must be locked.
+	FleetStats statsLocked() const;
+
+	PostFunc post;
+	int maxPerHub;
+
+	FleetJob job;
+	UpdateFunc update;
+
+	mutable std::mutex mutex;
+	std::condition_variable finishedCondition;
+
+	std::vector<FleetDeviceStatus> devices;
+	std::vector<HighResClock::time_point> deviceStarts;
+	// Indices into `devices` waiting to run, and the number running, per HubIdOf().
+	std::map<std::string, std::deque<size_t>> hubQueues;
+	std::map<std::string, int> hubRunning;
+
+	FleetStats counts;
+	HighResClock::time_point startTime;
+	bool cancelled = false;
+};
+
+// A fleet job that opens each device with `open`, downloads `image` with DFU, and
+// uploads it again to verify it if the device supports upload.
+FleetJob MakeDfuFleetJob(std::function<SResult<std::shared_ptr<Device>>(const DeviceId&)> open,
+                         std::shared_ptr<MappedFile> image);
@@ -1,10 +1,13 @@
 #include "MainWindow.h"
 #include "ui_MainWindow.h"
 
+#include <QDockWidget>
 #include <QMessageBox>
 #include <QDebug>
 
 #include "usb/UsbSpecification.h"
+#include "StartupTiming.h"
+#include "BusMonitorWidget.h"
 
 MainWindow::MainWindow(UsbThread& thread, QWidget *parent) :
     QMainWindow(parent),
@@ -23,9 +26,16 @@ MainWindow::MainWindow(UsbThread& thread, QWidget *parent) :
 	
 	ui->interfacesTreeView->setModel(&interfacesModel);
 	
-	// Start a timer to enumerate devices periodically.
+	busMonitorDock = new QDockWidget("Bus Monitor", this);
+	busMonitorDock->setObjectName("busMonitorDock");
+	busMonitorDock->setWidget(new BusMonitorWidget(usbThread, busMonitorDock));
+	addDockWidget(Qt::BottomDockWidgetArea, busMonitorDock);
+	busMonitorDock->hide();
+	ui->menuView->addAction(busMonitorDock->toggleViewAction());
+	
 	connect(this, &MainWindow::requestEnumerateDevices, &usbThread, &UsbThread::enumerateDevices);
 	connect(this, &MainWindow::requestDeviceDescriptors, &usbThread, &UsbThread::deviceDescriptors);
+	connect(this, &MainWindow::requestCancelDeviceDescriptors, &usbThread, &UsbThread::cancelDeviceDescriptors);
 	connect(this, &MainWindow::requestControlInTransfer, &usbThread, &UsbThread::controlInTransfer);
 	connect(this, &MainWindow::requestControlOutTransfer, &usbThread, &UsbThread::controlOutTransfer);
 	
@@ -33,16 +43,13 @@ MainWindow::MainWindow(UsbThread& thread, QWidget *parent) :
 	connect(&usbThread, &UsbThread::deviceDescriptorsResult, this, &MainWindow::onDeviceDescriptorsResult);
 	connect(&usbThread, &UsbThread::controlInTransferResult, this, &MainWindow::onControlInTransferResult);
 	connect(&usbThread, &UsbThread::controlOutTransferResult, this, &MainWindow::onControlOutTransferResult);
+	connect(&usbThread, &UsbThread::endpointCountersResult, this, &MainWindow::onEndpointCountersResult);
 			
 	connect(ui->deviceList->selectionModel(), &QItemSelectionModel::selectionChanged, this, &MainWindow::onDeviceSelectionChanged);
 	
 	connect(ui->interfacesTreeView->selectionModel(), &QItemSelectionModel::selectionChanged, this, &MainWindow::onInterfaceSelectionChanged);
 	
-	connect(&enumerateTimer, &QTimer::timeout, &usbThread, &UsbThread::enumerateDevices);
-#ifdef _WIN32
-	enumerateTimer.start(1000);
-#endif
-	
+	// The USB thread enumerates periodically itself; this is just so we don't wait for its timer.
 	emit requestEnumerateDevices();
 }
 
@@ -51,16 +58,57 @@ MainWindow::~MainWindow()
 	delete ui;
 }
 
+void MainWindow::showLastKnownDevices(const std::vector<DeviceSnapshotEntry>& entries)
+{
+	if (entries.empty())
+		return;
+	
+	QVector<DeviceInfo> devices;
+	for (const DeviceSnapshotEntry& e : entries)
+		devices.append(e.info);
+	
+	devicesModel.updateData(devices);
+	devicesModel.setLastKnown(true);
+	ui->statusBar->showMessage("Showing last known devices while enumerating...");
+}
+
+void MainWindow::paintEvent(QPaintEvent* event)
+{
+	QMainWindow::paintEvent(event);
+	
+	if (!painted)
+	{
+		painted = true;
+		MarkStartupPhase("first paint");
+	}
+}
+
 void MainWindow::onEnumerateDevicesResult(const QVector<DeviceInfo>& devices)
 {
 	qDebug() << "Updating data with" << devices.size() << "device";
+	// This only adds and removes the differences, so devices that are still there
+	// stay selected.
 	devicesModel.updateData(devices);
+	
+	if (devicesModel.isLastKnown())
+	{
+		devicesModel.setLastKnown(false);
+		ui->statusBar->clearMessage();
+	}
+	
+	if (!enumerated)
+	{
+		enumerated = true;
+		MarkStartupPhase("first enumeration");
+		LogStartupPhases();
+	}
 }
 
 void MainWindow::onDeviceDescriptorsResult(DeviceId loc, bool success, DeviceDescriptor desc)
 {
-	// TODO: We should really verify that it is for the same device
-	// in case they click wildly.
+	// Ignore late results for a device they have clicked away from.
+	if (!selectedLoc || !(loc == selectedLoc))
+		return;
 	
 	if (!success)
 	{
@@ -80,6 +128,9 @@ void MainWindow::onDeviceDescriptorsResult(DeviceId loc, bool success, DeviceDes
 <tr><td>Vendor ID:</td><td>0x%8</td></tr>
 <tr><td>Product ID:</td><td>0x%9</td></tr>
 <tr><td>Device release:</td><td>%10.%11</td></tr>
+<tr><td>Manufacturer:</td><td>%12</td></tr>
+<tr><td>Product:</td><td>%13</td></tr>
+<tr><td>Serial number:</td><td>%14</td></tr>
 </table>
 )#")
 	        .arg("Device Descriptor")
@@ -92,7 +143,10 @@ void MainWindow::onDeviceDescriptorsResult(DeviceId loc, bool success, DeviceDes
 	        .arg(desc.idVendor, 4, 16, QChar('0'))
 	        .arg(desc.idProduct, 4, 16, QChar('0'))
 	        .arg(desc.bcdDevice >> 8)
-	        .arg(desc.bcdDevice & 0xFF);
+	        .arg(desc.bcdDevice & 0xFF)
+	        .arg(QString::fromStdU16String(desc.sManufacturer).toHtmlEscaped())
+	        .arg(QString::fromStdU16String(desc.sProduct).toHtmlEscaped())
+	        .arg(QString::fromStdU16String(desc.sSerialNumber).toHtmlEscaped());
 	
 	ui->deviceDescriptorLabel->setText(text);
 	
@@ -122,14 +176,31 @@ void MainWindow::onControlInTransferResult(DeviceId loc, bool success, const QBy
 	ui->controlReceiveDataLabelAscii->setText(asLatin1);
 }
 
+void MainWindow::onEndpointCountersResult(DeviceId loc, const QVector<EndpointCounterSnapshot>& counters)
+{
+	// Only show the counters for the selected device.
+	if (!selectedLoc || !(loc == selectedLoc))
+		return;
+	
+	QStringList lines;
+	for (const EndpointCounterSnapshot& c : counters)
+		lines << QString::fromStdString(to_string(c));
+	
+	ui->statusBar->showMessage(lines.join("; "));
+}
+
 void MainWindow::onDeviceSelectionChanged(const QItemSelection& selected, const QItemSelection& deselected)
 {
 	ui->deviceDescriptorLabel->clear();
+	ui->statusBar->clearMessage();
 	selectedLoc = DeviceId();
 	interfacesModel.setDescriptors(DeviceDescriptor());
 	
 	if (selected.indexes().empty())
+	{
+		emit requestCancelDeviceDescriptors();
 		return;
+	}
 	
 	// Get the device location.
 	QVariant locVar = devicesModel.data(selected.indexes().first(), Qt::UserRole);
@@ -9,6 +9,8 @@
 #include "Metatypes.h"
 #include "DeviceInterfacesModel.h"
 
+class QDockWidget;
+
 namespace Ui {
 class MainWindow;
 }
@@ -22,6 +24,12 @@ public:
 	MainWindow(UsbThread& thread, QWidget *parent = 0);
 	~MainWindow();
 	
+	// Show the devices from the last run until the first enumeration replaces them.
+	void showLastKnownDevices(const std::vector<DeviceSnapshotEntry>& entries);
+	
+protected:
+	void paintEvent(QPaintEvent* event) override;
+	
 signals:
 	// Ask the USB thread to enumerate available deviecs and return the
 	// results in onEnumerationResults.
@@ -29,6 +37,8 @@ signals:
 	// Ask the USB thread to get the device descriptors of a device and return
 	// the result (as a string for now) in onDeviceDescriptors.
 	void requestDeviceDescriptors(DeviceId loc);
+	// Tell the USB thread that we no longer want the result of any previous requestDeviceDescriptors().
+	void requestCancelDeviceDescriptors();
 	
 	void requestControlOutTransfer(DeviceId loc,
 	                               Device::Recipient recipient,
@@ -51,6 +61,7 @@ private slots:
 	void onDeviceDescriptorsResult(DeviceId loc, bool success, DeviceDescriptor deviceDescriptor);
 	void onControlOutTransferResult(DeviceId loc, bool success);
 	void onControlInTransferResult(DeviceId loc, bool success, const QByteArray& data);
+	void onEndpointCountersResult(DeviceId loc, const QVector<EndpointCounterSnapshot>& counters);
 	
 	
 	
@@ -72,7 +83,12 @@ private:
 	DeviceListModel devicesModel;
 	DeviceInterfacesModel interfacesModel;
 	
-	QTimer enumerateTimer;
-	
 	DeviceId selectedLoc;
+	
+	// Shown from the View menu.
+	QDockWidget* busMonitorDock = nullptr;
+	
+	// For the startup timing.
+	bool painted = false;
+	bool enumerated = false;
 };
@@ -3,6 +3,7 @@
 #include "usb/DeviceId.h"
 #include "usb/DeviceInfo.h"
 #include "usb/Device.h"
+#include "FleetRunner.h"
 
 #include <QObject>
 
@@ -11,3 +12,6 @@ Q_DECLARE_METATYPE(DeviceInfo)
 Q_DECLARE_METATYPE(DeviceId)
 Q_DECLARE_METATYPE(Device::Recipient)
 Q_DECLARE_METATYPE(Device::Type)
+Q_DECLARE_METATYPE(EndpointCounterSnapshot)
+Q_DECLARE_METATYPE(FleetDeviceStatus)
+Q_DECLARE_METATYPE(FleetStats)
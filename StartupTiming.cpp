@@ -0,0 +1,49 @@
+#include "StartupTiming.h"
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <QDebug>
+
+#include "util/HighResClock.h"
+
+namespace
+{
+
+struct Phase
+{
+	const char* name;
+	HighResClock::time_point time;
+};
+
+std::mutex phasesMutex;
+std::vector<Phase> phases;
+bool logged = false;
+
+}
+
+void MarkStartupPhase(const char* name)
+{
+	HighResClock::time_point now = HighResClock::now();
+	std::unique_lock<std::mutex> lock(phasesMutex);
+	phases.push_back({name, now});
+}
+
+void LogStartupPhases()
+{
+	std::unique_lock<std::mutex> lock(phasesMutex);
+	if (logged || phases.empty())
+		return;
+	logged = true;
+
+	HighResClock::time_point start = phases.front().time;
+	HighResClock::time_point prev = start;
+	for (const Phase& p : phases)
+	{
+		double total = std::chrono::duration<double, std::milli>(p.time - start).count();
+		double delta = std::chrono::duration<double, std::milli>(p.time - prev).count();
+		qDebug().nospace() << "Startup: " << p.name << " at " << total << " ms (+" << delta << " ms)";
+		prev = p.time;
+	}
+}
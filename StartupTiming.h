@@ -0,0 +1,10 @@
+#pragma once
+
+// Records how long each phase of startup takes, so we can keep an eye on the time until
+// the window is painted with a useful device list. Times are relative to the first call.
+// Safe to call from any thread.
+void MarkStartupPhase(const char* name);
+
+// Log all the phases so far with qDebug(). Only the first call does anything, so it can
+// be called from wherever startup is considered finished.
+void LogStartupPhases();
@@ -0,0 +1,341 @@
+#include "TransferLogModel.h"
+
+#include <QBrush>
+
+#include <limits>
+
+#include "usb/UsbSpecification.h"
+
+namespace
+{
+QString Hex(unsigned v, int width)
+{
+	return QString("0x%1").arg(v, width, 16, QChar('0'));
+}
+
+QString TransferTypeName(EndpointInfo::Type type)
+{
+	switch (type)
+	{
+	case EndpointInfo::Type::Control:
+		return "Control";
+	case EndpointInfo::Type::Isochronous:
+		return "Isochronous";
+	case EndpointInfo::Type::Bulk:
+		return "Bulk";
+	case EndpointInfo::Type::Interrupt:
+		return "Interrupt";
+	}
+	return "?";
+}
+
+QString StandardRequestName(uint8_t bRequest)
+{
+	switch (bRequest)
+	{
+	case USB_GET_STATUS_REQUEST:
+		return "GET_STATUS";
+	case USB_CLEAR_FEATURE_REQUEST:
+		return "CLEAR_FEATURE";
+	case USB_SET_FEATURE_REQUEST:
+		return "SET_FEATURE";
+	case USB_SET_ADDRESS_REQUEST:
+		return "SET_ADDRESS";
+	case USB_GET_DESCRIPTOR_REQUEST:
+		return "GET_DESCRIPTOR";
+	case USB_SET_DESCRIPTOR_REQUEST:
+		return "SET_DESCRIPTOR";
+	case USB_GET_CONFIGURATION_REQUEST:
+		return "GET_CONFIGURATION";
+	case USB_SET_CONFIGURATION_REQUEST:
+		return "SET_CONFIGURATION";
+	case USB_GET_INTERFACE_REQUEST:
+		return "GET_INTERFACE";
+	case USB_SET_INTERFACE_REQUEST:
+		return "SET_INTERFACE";
+	case USB_SYNCH_FRAME_REQUEST:
+		return "SYNCH_FRAME";
+	default:
+		return QString();
+	}
+}
+
+QString DescriptorTypeName(uint8_t type)
+{
+	switch (type)
+	{
+	case USB_DEVICE_DESCRIPTOR_TYPE:
+		return "Device";
+	case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+		return "Configuration";
+	case USB_STRING_DESCRIPTOR_TYPE:
+		return "String";
+	case USB_INTERFACE_DESCRIPTOR_TYPE:
+		return "Interface";
+	case USB_ENDPOINT_DESCRIPTOR_TYPE:
+		return "Endpoint";
+	case USB_DEVICE_QUALIFIER_DESCRIPTOR_TYPE:
+		return "Device Qualifier";
+	case USB_OTHER_SPEED_CONFIGURATION_DESCRIPTOR_TYPE:
+		return "Other Speed Configuration";
+	default:
+		return Hex(type, 2);
+	}
+}
+
+// E.g. "GET_DESCRIPTOR Device index 0, wIndex 0x0000, wLength 18".
+QString DecodeSetup(const uint8_t* setup)
+{
+	uint8_t bmRequestType = setup[0];
+	uint8_t bRequest = setup[1];
+	uint16_t wValue = setup[2] | (setup[3] << 8);
+	uint16_t wIndex = setup[4] | (setup[5] << 8);
+	uint16_t wLength = setup[6] | (setup[7] << 8);
+
+	static const char* const types[] = {"Standard", "Class", "Vendor", "Reserved"};
+	static const char* const recipients[] = {"Device", "Interface", "Endpoint", "Other"};
+	int type = (bmRequestType >> 5) & 3;
+	int recipient = bmRequestType & 0x1F;
+
+	QString request;
+	if (type == 0 && !StandardRequestName(bRequest).isEmpty())
+	{
+		request = StandardRequestName(bRequest);
+		if (bRequest == USB_GET_DESCRIPTOR_REQUEST || bRequest == USB_SET_DESCRIPTOR_REQUEST)
+			return QString("%1 %2 index %3, wIndex %4, wLength %5")
+			        .arg(request, DescriptorTypeName(wValue >> 8))
+			        .arg(wValue & 0xFF)
+			        .arg(Hex(wIndex, 4))
+			        .arg(wLength);
+	}
+	else
+	{
+		request = QString("%1 %2 request %3")
+		          .arg(types[type], recipient < 4 ? recipients[recipient] : "?")
+		          .arg(Hex(bRequest, 2));
+	}
+
+	return QString("%1 %2, wValue %3, wIndex %4, wLength %5")
+	        .arg(bmRequestType & 0x80 ? "IN" : "OUT", request)
+	        .arg(Hex(wValue, 4))
+	        .arg(Hex(wIndex, 4))
+	        .arg(wLength);
+}
+}
+
+TransferLogModel::TransferLogModel(QObject* parent) : QAbstractTableModel(parent)
+{
+}
+
+SResult<void> TransferLogModel::open(const QString& newPath)
+{
+	auto readerRes = CaptureReader::open(newPath.toStdString());
+	if (!readerRes)
+		return Err(readerRes.unwrap_err());
+
+	beginResetModel();
+	path = newPath;
+	reader = readerRes.unwrap();
+	// Views can't show more rows than an int can count.
+	rows = static_cast<int>(std::min<uint64_t>(reader->size(), std::numeric_limits<int>::max()));
+	startTime = rows > 0 ? reader->record(0).timestampNs : 0;
+	cache.clear();
+	cacheIndex.clear();
+	endResetModel();
+	return Ok();
+}
+
+void TransferLogModel::close()
+{
+	beginResetModel();
+	path.clear();
+	reader.reset();
+	rows = 0;
+	cache.clear();
+	cacheIndex.clear();
+	endResetModel();
+}
+
+void TransferLogModel::reload()
+{
+	if (path.isEmpty())
+		return;
+
+	auto readerRes = CaptureReader::open(path.toStdString());
+	if (!readerRes)
+		return;
+	auto newReader = readerRes.unwrap();
+	int newRows = static_cast<int>(std::min<uint64_t>(newReader->size(), std::numeric_limits<int>::max()));
+
+	// Records are never changed once written, so if there are more of them the rows we
+	// have (and their cached text) are still right.
+	if (newRows < rows)
+	{
+		open(path);
+		return;
+	}
+
+	reader = newReader;
+	if (newRows > rows)
+	{
+		beginInsertRows(QModelIndex(), rows, newRows - 1);
+		if (rows == 0)
+			startTime = reader->record(0).timestampNs;
+		rows = newRows;
+		endInsertRows();
+	}
+}
+
+int TransferLogModel::rowCount(const QModelIndex& parent) const
+{
+	return parent.isValid() ? 0 : rows;
+}
+
+int TransferLogModel::columnCount(const QModelIndex& parent) const
+{
+	return parent.isValid() ? 0 : NUM_COLUMNS;
+}
+
+QVariant TransferLogModel::data(const QModelIndex& index, int role) const
+{
+	int row = index.row();
+	int column = index.column();
+	if (!reader || row < 0 || row >= rows || column < 0 || column >= NUM_COLUMNS)
+		return QVariant();
+
+	switch (role)
+	{
+	case Qt::DisplayRole:
+		return rowText(row)[column];
+	case Qt::ForegroundRole:
+	{
+		const CaptureRecord& rec = reader->record(row);
+		if (rec.type == static_cast<char>(UsbMonEventType::Error) ||
+		    (rec.type == static_cast<char>(UsbMonEventType::Complete) && rec.status != 0))
+			return QBrush(Qt::red);
+		break;
+	}
+	case Qt::TextAlignmentRole:
+		if (column == LengthColumn || column == TimeColumn)
+			return int(Qt::AlignRight | Qt::AlignVCenter);
+		break;
+	default:
+		break;
+	}
+	return QVariant();
+}
+
+QVariant TransferLogModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+	if (role != Qt::DisplayRole || orientation != Qt::Horizontal)
+		return QVariant();
+
+	switch (section)
+	{
+	case TimeColumn:
+		return "Time";
+	case EventColumn:
+		return "Event";
+	case DeviceColumn:
+		return "Device";
+	case EndpointColumn:
+		return "Endpoint";
+	case TypeColumn:
+		return "Type";
+	case StatusColumn:
+		return "Status";
+	case LengthColumn:
+		return "Length";
+	case SetupColumn:
+		return "Setup";
+	case DataColumn:
+		return "Data";
+	default:
+		return QVariant();
+	}
+}
+
+int TransferLogModel::rowAtTime(double seconds) const
+{
+	if (!reader)
+		return 0;
+	uint64_t offset = seconds > 0.0 ? static_cast<uint64_t>(seconds * 1e9) : 0;
+	uint64_t row = reader->findTime(startTime + offset);
+	return static_cast<int>(std::min<uint64_t>(row, rows));
+}
+
+const TransferLogModel::RowText& TransferLogModel::rowText(int row) const
+{
+	auto it = cacheIndex.find(row);
+	if (it != cacheIndex.end())
+	{
+		// Move it to the most recently used end.
+		cache.splice(cache.end(), cache, it->second);
+		return it->second->second;
+	}
+
+	if (cache.size() >= CACHE_ROWS)
+	{
+		cacheIndex.erase(cache.front().first);
+		cache.pop_front();
+	}
+	cache.emplace_back(row, decodeRow(row));
+	cacheIndex[row] = std::prev(cache.end());
+	return cache.back().second;
+}
+
+TransferLogModel::RowText TransferLogModel::decodeRow(int row) const
+{
+	const CaptureRecord& rec = reader->record(row);
+	RowText text;
+
+	// usbmon's timestamps aren't strictly in order, so a record can be from before the first.
+	int64_t sinceStart = static_cast<int64_t>(rec.timestampNs) - static_cast<int64_t>(startTime);
+	text[TimeColumn] = QString::number(sinceStart / 1e9, 'f', 6);
+
+	switch (static_cast<UsbMonEventType>(rec.type))
+	{
+	case UsbMonEventType::Submit:
+		text[EventColumn] = "Submit";
+		break;
+	case UsbMonEventType::Complete:
+		text[EventColumn] = "Complete";
+		break;
+	case UsbMonEventType::Error:
+		text[EventColumn] = "Error";
+		break;
+	}
+
+	text[DeviceColumn] = QString("%1.%2").arg(rec.bus).arg(rec.deviceAddress);
+	text[EndpointColumn] = QString("%1 %2").arg(Hex(rec.endpoint, 2), rec.endpoint & 0x80 ? "IN" : "OUT");
+	text[TypeColumn] = TransferTypeName(static_cast<EndpointInfo::Type>(rec.transferType));
+
+	// Submissions are always -EINPROGRESS, so that isn't worth showing.
+	if (rec.type != static_cast<char>(UsbMonEventType::Submit))
+		text[StatusColumn] = rec.status == 0 ? QString("OK") : QString::number(rec.status);
+
+	text[LengthColumn] = QString::number(rec.urbLength);
+
+	if (rec.setupFlag == 0)
+		text[SetupColumn] = DecodeSetup(rec.setup);
+
+	// Skip any isochronous descriptors; only the start of the data is read.
+	uint32_t size = 0;
+	const uint8_t* payload = reader->payload(row, size);
+	uint32_t skip = rec.isoDescriptorCount * static_cast<uint32_t>(USBMON_ISO_DESCRIPTOR_SIZE);
+	if (payload != nullptr && size > skip)
+	{
+		uint32_t n = std::min(size - skip, PREVIEW_BYTES);
+		QString hex;
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			if (i > 0)
+				hex += ' ';
+			hex += QString("%1").arg(payload[skip + i], 2, 16, QChar('0'));
+		}
+		if (size - skip > n)
+			hex += " ...";
+		text[DataColumn] = hex;
+	}
+	return text;
+}
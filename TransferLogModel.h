@@ -0,0 +1,80 @@
+#pragma once
+
+#include <QAbstractTableModel>
+#include <QString>
+#include <QVariant>
+
+#include <array>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "usb/Capture.h"
+
+// Lists every transfer in a capture (see Capture.h). Nothing is loaded up front: rows are
+// read from the mapped capture when the view asks for them, and the text of the most
+// recently shown rows is kept in a small cache. Memory use is the same for ten rows as for
+// ten million.
+//
+// For a capture that is still being written, call reload() now and then to show the rows
+// that have been added.
+class TransferLogModel : public QAbstractTableModel
+{
+	Q_OBJECT
+public:
+	enum Column
+	{
+		TimeColumn,
+		EventColumn,
+		DeviceColumn,
+		EndpointColumn,
+		TypeColumn,
+		StatusColumn,
+		LengthColumn,
+		SetupColumn,
+		DataColumn,
+		NUM_COLUMNS
+	};
+
+	explicit TransferLogModel(QObject* parent = nullptr);
+
+	// Show a capture, replacing any that was shown.
+	SResult<void> open(const QString& path);
+	void close();
+
+	int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+	int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+	QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+	QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+
+	// The record number of the first transfer at or after a time since the start of the
+	// capture, e.g. to scroll to it.
+	int rowAtTime(double seconds) const;
+
+	std::shared_ptr<CaptureReader> capture() const { return reader; }
+
+public slots:
+	// Open the capture again, and add any rows that have been written since.
+	void reload();
+
+private:
+	// The text of every column of a row.
+	typedef std::array<QString, NUM_COLUMNS> RowText;
+
+	const RowText& rowText(int row) const;
+	RowText decodeRow(int row) const;
+
+	// How many rows' text to keep. A few screens' worth.
+	static const size_t CACHE_ROWS = 1024;
+	// How much of the data to show.
+	static const uint32_t PREVIEW_BYTES = 16;
+
+	QString path;
+	std::shared_ptr<CaptureReader> reader;
+	int rows = 0;
+	uint64_t startTime = 0;
+
+	// Least recently used first. The map points into the list.
+	mutable std::list<std::pair<int, RowText>> cache;
+	mutable std::unordered_map<int, std::list<std::pair<int, RowText>>::iterator> cacheIndex;
+};
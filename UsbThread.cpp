@@ -4,6 +4,10 @@
 #include <QDebug>
 #include <QList>
 
+#include <algorithm>
+
+#include "util/FastLog.h"
+
 //int LIBUSB_CALL hotplugCallback(libusb_context* ctx,
 //                                libusb_device* device,
 //                                libusb_hotplug_event event,
@@ -51,6 +55,13 @@ void UsbThread::destructSlot()
 	usbEventThreadRun = false;
 	usbEventThread.join();
 	
+	stopBusMonitor();
+	
+	// Wait for any running requests and drop the rest.
+	pool.stop();
+	
+	saveSnapshot();
+	
 	// Move this object back to the main thread.
 	moveToThread(QApplication::instance()->thread());
 	// Exit the background thread.
@@ -59,6 +70,8 @@ void UsbThread::destructSlot()
 
 UsbThread::UsbThread()
 {
+	enumerateStrand = std::make_shared<Strand>(pool);
+	
 	// Move this object to it so slots are evaluated by that thread.
 	moveToThread(&workerThread);
 	
@@ -72,10 +85,15 @@ UsbThread::UsbThread()
 	// Execute constructSlot() in the workerThread context, but block until it is finished.
 	emit constructSignal();
 	
-	// TODO: Re-implement hotplug support.
+	// TODO: Re-implement hotplug support. Until then this is the only thing that
+	// enumerates periodically, on all platforms.
 	connect(&enumerateTimer, &QTimer::timeout, this, &UsbThread::enumerateDevices);
 	
 	enumerateTimer.start(1000);
+	
+	connect(&countersTimer, &QTimer::timeout, this, &UsbThread::pollEndpointCounters);
+	
+	countersTimer.start(500);
 }
 
 UsbThread::~UsbThread()
@@ -84,9 +102,252 @@ UsbThread::~UsbThread()
 	emit destructSignal();
 }
 
+std::vector<DeviceSnapshotEntry> UsbThread::loadSnapshot(const QString& path)
+{
+	snapshotPath = path;
+	
+	SResult<std::vector<DeviceSnapshotEntry>> entries = LoadDeviceListSnapshot(path);
+	if (!entries)
+	{
+		qDebug() << "No device list snapshot:" << QString::fromStdString(entries.unwrap_err());
+		return std::vector<DeviceSnapshotEntry>();
+	}
+	
+	std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+	for (const DeviceSnapshotEntry& e : entries.unwrap())
+	{
+		std::string key = DeviceIdToString(e.info.id);
+		snapshotDevices[key] = e.info;
+		if (e.hasDescriptors)
+			descriptorCache[key] = e.descriptors;
+	}
+	return entries.unwrap();
+}
+
+void UsbThread::saveSnapshot()
+{
+	if (snapshotPath.isEmpty())
+		return;
+	
+	std::vector<DeviceSnapshotEntry> entries;
+	{
+		std::unique_lock<std::mutex> lock(lastDevicesMutex);
+		// Don't replace the last snapshot with nothing if we never got a device list.
+		if (!haveEnumerated)
+			return;
+		
+		std::unique_lock<std::mutex> cacheLock(descriptorCacheMutex);
+		for (const DeviceInfo& info : lastDevices)
+		{
+			DeviceSnapshotEntry e;
+			e.info = info;
+			auto it = descriptorCache.find(DeviceIdToString(info.id));
+			if (it != descriptorCache.end())
+			{
+				e.hasDescriptors = true;
+				e.descriptors = it->second;
+			}
+			entries.push_back(e);
+		}
+	}
+	
+	SResult<void> res = SaveDeviceListSnapshot(snapshotPath, entries);
+	if (!res)
+		qDebug() << "Couldn't save device list snapshot:" << QString::fromStdString(res.unwrap_err());
+}
+
+std::shared_ptr<Strand> UsbThread::strandFor(DeviceId loc)
+{
+	std::unique_lock<std::mutex> lock(deviceStrandsMutex);
+	std::shared_ptr<Strand>& strand = deviceStrands[DeviceIdToString(loc)];
+	if (!strand)
+		strand = std::make_shared<Strand>(pool);
+	return strand;
+}
+
+std::shared_ptr<FleetRunner> UsbThread::runFleetJob(const DeviceFilter& filter, FleetJob job, int maxPerHub)
+{
+	std::vector<DeviceInfo> devices;
+	{
+		std::unique_lock<std::mutex> lock(lastDevicesMutex);
+		devices = lastDevices;
+	}
+	
+	// Fleet jobs are long and nobody is waiting on any one of them, so the user's own
+	// requests to a device go ahead of its queued flash job.
+	auto post = [this](const DeviceId& id, std::function<void()> deviceJob) {
+		strandFor(id)->post(deviceJob, JobPriority::Background);
+	};
+	auto update = [this](const FleetDeviceStatus& status, const FleetStats& stats) {
+		emit fleetProgress(status, stats);
+	};
+	
+	auto runner = std::make_shared<FleetRunner>(post, maxPerHub);
+	runner->start(devices, filter, job, update);
+	return runner;
+}
+
+std::shared_ptr<FleetRunner> UsbThread::runDfuFleetJob(const DeviceFilter& filter, std::shared_ptr<MappedFile> image, int maxPerHub)
+{
+	// The jobs run on the device's strand so they can use the open device.
+	auto open = [this](const DeviceId& id) { return openDevice(id); };
+	return runFleetJob(filter, MakeDfuFleetJob(open, image), maxPerHub);
+}
+
+SResult<void> UsbThread::startBusMonitor(int bus, const QString& capturePath)
+{
+	stopBusMonitor();
+	
+	std::shared_ptr<PcapngWriter> pcapng;
+	std::shared_ptr<CaptureWriter> capture;
+	if (capturePath.endsWith(".pcapng", Qt::CaseInsensitive))
+	{
+		auto captureRes = PcapngWriter::create(capturePath.toStdString());
+		if (!captureRes)
+			return Err(captureRes.unwrap_err());
+		pcapng = captureRes.unwrap();
+	}
+	else if (!capturePath.isEmpty())
+	{
+		auto captureRes = CaptureWriter::create(capturePath.toStdString());
+		if (!captureRes)
+			return Err(captureRes.unwrap_err());
+		capture = captureRes.unwrap();
+	}
+	
+	// When the capture was last flushed so a reader (e.g. the bus monitor's transfer log)
+	// sees it. Batches come far more often than anyone looks.
+	auto lastFlush = std::chrono::steady_clock::now();
+	auto callback = [this, pcapng, capture, lastFlush](const std::vector<UsbMonRecord>& records) mutable {
+		for (const auto& record : records)
+		{
+			if (!pcapng && !capture)
+				break;
+			auto res = pcapng ? WriteUsbMonRecord(*pcapng, record) : capture->append(record);
+			if (!res)
+			{
+				FLOG_ERROR("Error writing bus capture: {}", res.unwrap_err());
+				break;
+			}
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (capture && now - lastFlush >= std::chrono::milliseconds(250))
+		{
+			lastFlush = now;
+			auto res = capture->flush();
+			if (!res)
+				FLOG_ERROR("Error flushing bus capture: {}", res.unwrap_err());
+		}
+		// Batches can come thousands of times a second, so rather than sending each one to
+		// the GUI they are only counted, and the GUI reads the counts when it redraws.
+		std::unique_lock<std::mutex> lock(busMonitorMutex);
+		AddUsbMonTotals(records, busMonitorCounts);
+	};
+	
+	{
+		std::unique_lock<std::mutex> lock(busMonitorMutex);
+		busMonitorCounts = UsbMonTotals();
+	}
+	auto monitorRes = UsbMonSniffer::start(bus, callback);
+	if (!monitorRes)
+		return Err(monitorRes.unwrap_err());
+	
+	std::shared_ptr<UsbMonSniffer> previous;
+	{
+		std::unique_lock<std::mutex> lock(busMonitorMutex);
+		previous = busMonitor;
+		busMonitor = monitorRes.unwrap();
+	}
+	// In case another one was started at the same time.
+	previous.reset();
+	return Ok();
+}
+
+void UsbThread::stopBusMonitor()
+{
+	std::shared_ptr<UsbMonSniffer> monitor;
+	{
+		std::unique_lock<std::mutex> lock(busMonitorMutex);
+		monitor.swap(busMonitor);
+	}
+	// This waits for the last batch, and closes the capture file (writing its index).
+	monitor.reset();
+}
+
+UsbMonStats UsbThread::busMonitorStats()
+{
+	std::unique_lock<std::mutex> lock(busMonitorMutex);
+	return busMonitor ? busMonitor->stats() : UsbMonStats();
+}
+
+UsbMonTotals UsbThread::busMonitorTotals()
+{
+	std::unique_lock<std::mutex> lock(busMonitorMutex);
+	return busMonitorCounts;
+}
+
 void UsbThread::enumerateDevices()
 {
-	qDebug() << "Enumerating devices.";
+	// If one is already queued it will see the same devices as this one would.
+	if (enumerateQueued.exchange(true))
+		return;
+	
+	enumerateStrand->post([this] {
+		// Clear this first so a request that arrives while we are enumerating still
+		// gets a fresh enumeration afterwards.
+		enumerateQueued = false;
+		enumerateDevicesJob();
+	}, JobPriority::Background);
+}
+
+void UsbThread::deviceDescriptors(DeviceId loc)
+{
+	uint64_t generation = ++descriptorsGeneration;
+	setSelectedDevice(DeviceIdToString(loc));
+	
+	// Answer straight away if it has been prefetched.
+	{
+		std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+		auto it = descriptorCache.find(DeviceIdToString(loc));
+		if (it != descriptorCache.end())
+		{
+			DeviceDescriptor desc = it->second;
+			lock.unlock();
+			emit deviceDescriptorsResult(loc, true, desc);
+			return;
+		}
+	}
+	
+	strandFor(loc)->post([this, loc, generation] {
+		// The user has clicked on something else since this was requested.
+		if (descriptorsGeneration != generation)
+		{
+			qDebug() << "Dropping stale descriptors request for" << QString::fromStdString(DeviceIdToString(loc));
+			return;
+		}
+		deviceDescriptorsJob(loc);
+	}, JobPriority::Interactive);
+}
+
+void UsbThread::cancelDeviceDescriptors()
+{
+	++descriptorsGeneration;
+	setSelectedDevice(std::string());
+}
+
+void UsbThread::controlOutTransfer(DeviceId loc, Device::Recipient recipient, Device::Type type, quint8 bRequest, quint16 wValue, quint16 wIndex, const QByteArray& data)
+{
+	strandFor(loc)->post([=] { controlOutTransferJob(loc, recipient, type, bRequest, wValue, wIndex, data); }, JobPriority::Interactive);
+}
+
+void UsbThread::controlInTransfer(DeviceId loc, Device::Recipient recipient, Device::Type type, quint8 bRequest, quint16 wValue, quint16 wIndex, int length)
+{
+	strandFor(loc)->post([=] { controlInTransferJob(loc, recipient, type, bRequest, wValue, wIndex, length); }, JobPriority::Interactive);
+}
+
+void UsbThread::enumerateDevicesJob()
+{
+	FLOG_DEBUG("Enumerating devices");
 	
 	SResult<std::vector<DeviceInfo>> devices = EnumerateAvailableDevices();
 	
@@ -96,43 +357,282 @@ void UsbThread::enumerateDevices()
 		return;
 	}
 	
-	qDebug() << "Got" << devices.unwrap().size() << "devices";
+	FLOG_DEBUG("Got {} devices", devices.unwrap().size());
+	
+	std::set<std::string> present;
+	for (const DeviceInfo& info : devices.unwrap())
+		present.insert(DeviceIdToString(info.id));
+	
+	// Forget any open devices that have been unplugged. Requests that are still running
+	// keep their own reference to the device.
+	{
+		std::unique_lock<std::mutex> lock(openDevicesMutex);
+		for (auto it = openDevices.begin(); it != openDevices.end(); )
+		{
+			if (present.count(it->first) != 0)
+				++it;
+			else
+				it = openDevices.erase(it);
+		}
+	}
+	
+	// And their strands. One that still has requests queued is kept until a later enumeration,
+	// so a device plugged back into the same place can't have two strands running at once.
+	{
+		std::unique_lock<std::mutex> lock(deviceStrandsMutex);
+		for (auto it = deviceStrands.begin(); it != deviceStrands.end(); )
+		{
+			if (present.count(it->first) != 0 || it->second->pending() != 0)
+				++it;
+			else
+				it = deviceStrands.erase(it);
+		}
+	}
+	
+	// And their prefetch failures, so a device that is plugged back in is tried straight away.
+	{
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		for (auto it = prefetchFailures.begin(); it != prefetchFailures.end(); )
+		{
+			if (present.count(it->first) != 0)
+				++it;
+			else
+				it = prefetchFailures.erase(it);
+		}
+	}
+	
+	// And their descriptors, in case something different is plugged into the same place.
+	{
+		std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+		for (auto it = descriptorCache.begin(); it != descriptorCache.end(); )
+		{
+			if (present.count(it->first) != 0)
+				++it;
+			else
+				it = descriptorCache.erase(it);
+		}
+		
+		// The descriptors from the snapshot are only trusted if the same device is still there.
+		for (const DeviceInfo& info : devices.unwrap())
+		{
+			auto it = snapshotDevices.find(DeviceIdToString(info.id));
+			if (it != snapshotDevices.end() && !(it->second == info))
+				descriptorCache.erase(it->first);
+		}
+		snapshotDevices.clear();
+	}
+	
+	{
+		std::unique_lock<std::mutex> lock(lastDevicesMutex);
+		lastDevices = devices.unwrap();
+		haveEnumerated = true;
+	}
 
 	// Qt will automatically convert the reference to a copy, so don't worry about us referencing 
 	// a temporary object.
 	emit enumerateDevicesResult(QVector<DeviceInfo>::fromStdVector(devices.unwrap()));
+	
+	prefetchDescriptors(devices.unwrap());
 }
 
-void UsbThread::deviceDescriptors(DeviceId loc)
+void UsbThread::prefetchDescriptors(const std::vector<DeviceInfo>& devices)
 {
-	SResult<std::shared_ptr<Device>> devRes = OpenUsbDevice(loc);
-	if (!devRes)
 	{
-		qDebug() << "Error opening device:" << QString::fromStdString(devRes.unwrap_err());
-		emit deviceDescriptorsResult(loc, false, DeviceDescriptor());
-		return;
+		std::unique_lock<std::mutex> cacheLock(descriptorCacheMutex);
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		auto now = std::chrono::steady_clock::now();
+		for (const DeviceInfo& info : devices)
+		{
+			std::string key = DeviceIdToString(info.id);
+			if (descriptorCache.count(key) != 0 || prefetchPending.count(key) != 0)
+				continue;
+			auto failure = prefetchFailures.find(key);
+			if (failure != prefetchFailures.end() && now < failure->second.retryAt)
+				continue;
+			prefetchPending.insert(key);
+			prefetchQueue.push_back(info.id);
+		}
+	}
+	startPrefetches();
+}
+
+void UsbThread::startPrefetches()
+{
+	std::unique_lock<std::mutex> lock(prefetchMutex);
+	while (prefetchesRunning < MAX_CONCURRENT_PREFETCHES && !prefetchQueue.empty())
+	{
+		DeviceId loc = prefetchQueue.front();
+		prefetchQueue.pop_front();
+		++prefetchesRunning;
+		
+		strandFor(loc)->post([this, loc] {
+			prefetchJob(loc);
+			
+			{
+				std::unique_lock<std::mutex> lock(prefetchMutex);
+				--prefetchesRunning;
+				prefetchPending.erase(DeviceIdToString(loc));
+			}
+			startPrefetches();
+		}, JobPriority::Background);
 	}
+}
+
+void UsbThread::prefetchJob(DeviceId loc)
+{
+	std::string key = DeviceIdToString(loc);
 	
-	std::shared_ptr<Device> dev = devRes.unwrap();
+	{
+		// The user may have selected it in the meantime.
+		std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+		if (descriptorCache.count(key) != 0)
+			return;
+	}
+	
+	// Use the device if it is already open. Otherwise read the descriptors without opening
+	// it, since opening seizes it from any other program and sets its configuration.
+	std::shared_ptr<Device> dev;
+	{
+		std::unique_lock<std::mutex> lock(openDevicesMutex);
+		auto it = openDevices.find(key);
+		if (it != openDevices.end() && it->second->isOpen())
+			dev = it->second;
+	}
+	SResult<DeviceDescriptor> descRes = dev ? dev->descriptorsWithStrings() : ReadUsbDeviceDescriptors(loc);
 	
-	SResult<DeviceDescriptor> descRes = dev->descriptors();
 	if (!descRes)
 	{
-		qDebug() << "Error getting device descriptor:" << QString::fromStdString(devRes.unwrap_err());
-		emit deviceDescriptorsResult(loc, false, DeviceDescriptor());
+		qDebug() << "Error prefetching descriptors:" << QString::fromStdString(descRes.unwrap_err());
+		
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		PrefetchFailure& failure = prefetchFailures[key];
+		failure.backoff = std::min(std::max(failure.backoff * 2, std::chrono::milliseconds(PREFETCH_FIRST_BACKOFF_MS)),
+		                           std::chrono::milliseconds(PREFETCH_MAX_BACKOFF_MS));
+		failure.retryAt = std::chrono::steady_clock::now() + failure.backoff;
 		return;
 	}
 	
-	DeviceDescriptor desc = descRes.unwrap();
+	{
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		prefetchFailures.erase(key);
+	}
 	
-	emit deviceDescriptorsResult(loc, true, desc);
+	std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+	descriptorCache[key] = descRes.unwrap();
 }
 
-void UsbThread::controlOutTransfer(DeviceId loc, Device::Recipient recipient, Device::Type type, quint8 bRequest, quint16 wValue, quint16 wIndex, const QByteArray& data)
+SResult<DeviceDescriptor> UsbThread::fetchDescriptors(DeviceId loc)
+{
+	std::string key = DeviceIdToString(loc);
+	
+	// Use the device if it is already open, but otherwise don't keep it open
+	// just because we read its descriptors.
+	std::shared_ptr<Device> dev;
+	{
+		std::unique_lock<std::mutex> lock(openDevicesMutex);
+		auto it = openDevices.find(key);
+		if (it != openDevices.end() && it->second->isOpen())
+			dev = it->second;
+	}
+	if (!dev)
+		dev = TRY(OpenUsbDevice(loc));
+	
+	DeviceDescriptor desc = TRY(dev->descriptorsWithStrings());
+	
+	std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+	descriptorCache[key] = desc;
+	return Ok(desc);
+}
+
+SResult<std::shared_ptr<Device>> UsbThread::openDevice(DeviceId loc)
+{
+	std::string key = DeviceIdToString(loc);
+	{
+		std::unique_lock<std::mutex> lock(openDevicesMutex);
+		auto it = openDevices.find(key);
+		if (it != openDevices.end() && it->second->isOpen())
+			return Ok(it->second);
+	}
+	
+	// Open it without holding the lock, since it can be slow. Nobody else can be
+	// opening the same device because we are on its strand.
+	std::shared_ptr<Device> dev = TRY(OpenUsbDevice(loc));
+	
+	// Anything else, e.g. a fleet job's device, is closed when the caller is done with it.
+	std::unique_lock<std::mutex> lock(openDevicesMutex);
+	if (key == selectedDeviceKey)
+		openDevices[key] = dev;
+	return Ok(dev);
+}
+
+void UsbThread::setSelectedDevice(const std::string& key)
+{
+	std::vector<std::shared_ptr<Device>> closing;
+	{
+		std::unique_lock<std::mutex> lock(openDevicesMutex);
+		selectedDeviceKey = key;
+		for (auto it = openDevices.begin(); it != openDevices.end(); )
+		{
+			if (it->first == key)
+			{
+				++it;
+				continue;
+			}
+			closing.push_back(it->second);
+			it = openDevices.erase(it);
+		}
+	}
+	// Closing can be slow, so the devices are released here, outside the lock.
+}
+
+void UsbThread::pollEndpointCounters()
+{
+	std::vector<std::shared_ptr<Device>> devices;
+	{
+		std::unique_lock<std::mutex> lock(openDevicesMutex);
+		for (const auto& it : openDevices)
+			devices.push_back(it.second);
+	}
+	
+	for (const std::shared_ptr<Device>& dev : devices)
+	{
+		if (!dev->isOpen())
+			continue;
+		
+		std::vector<EndpointCounterSnapshot> counters = dev->endpointCounters();
+		emit endpointCountersResult(dev->address().unwrap_or_default(), QVector<EndpointCounterSnapshot>::fromStdVector(counters));
+	}
+}
+
+void UsbThread::deviceDescriptorsJob(DeviceId loc)
 {
-	// TODO: Remember which devices are open so we don't have to re-open them for each request which sucks.
+	// A prefetch may have finished while this was queued.
+	{
+		std::unique_lock<std::mutex> lock(descriptorCacheMutex);
+		auto it = descriptorCache.find(DeviceIdToString(loc));
+		if (it != descriptorCache.end())
+		{
+			DeviceDescriptor desc = it->second;
+			lock.unlock();
+			emit deviceDescriptorsResult(loc, true, desc);
+			return;
+		}
+	}
+	
+	SResult<DeviceDescriptor> descRes = fetchDescriptors(loc);
+	if (!descRes)
+	{
+		qDebug() << "Error getting device descriptors:" << QString::fromStdString(descRes.unwrap_err());
+		emit deviceDescriptorsResult(loc, false, DeviceDescriptor());
+		return;
+	}
 	
-	SResult<std::shared_ptr<Device>> devRes = OpenUsbDevice(loc);
+	emit deviceDescriptorsResult(loc, true, descRes.unwrap());
+}
+
+void UsbThread::controlOutTransferJob(DeviceId loc, Device::Recipient recipient, Device::Type type, quint8 bRequest, quint16 wValue, quint16 wIndex, const QByteArray& data)
+{
+	SResult<std::shared_ptr<Device>> devRes = openDevice(loc);
 	if (!devRes)
 	{
 		qDebug() << "Error opening device:" << QString::fromStdString(devRes.unwrap_err());
@@ -158,11 +658,9 @@ void UsbThread::controlOutTransfer(DeviceId loc, Device::Recipient recipient, De
 	emit controlOutTransferResult(loc, true);
 }
 
-void UsbThread::controlInTransfer(DeviceId loc, Device::Recipient recipient, Device::Type type, quint8 bRequest, quint16 wValue, quint16 wIndex, int length)
+void UsbThread::controlInTransferJob(DeviceId loc, Device::Recipient recipient, Device::Type type, quint8 bRequest, quint16 wValue, quint16 wIndex, int length)
 {
-	// TODO: Remember which devices are open so we don't have to re-open them for each request which sucks.
-	
-	SResult<std::shared_ptr<Device>> devRes = OpenUsbDevice(loc);
+	SResult<std::shared_ptr<Device>> devRes = openDevice(loc);
 	if (!devRes)
 	{
 		qDebug() << "Error opening device:" << QString::fromStdString(devRes.unwrap_err());
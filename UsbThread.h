@@ -2,6 +2,11 @@
 
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
 #include <QThread>
 #include <QVector>
 #include <stdint.h>
@@ -9,9 +14,28 @@
 
 #include "usb/Discovery.h"
 #include "usb/Device.h"
+#include "usb/UsbMon.h"
+#include "usb/Pcapng.h"
+#include "usb/Capture.h"
+#include "util/ThreadPool.h"
+#include "DeviceListSnapshot.h"
+#include "FleetRunner.h"
 
 #include "Metatypes.h"
 
+// The slots of this object are run on its own thread, but they only dispatch work. Each
+// device has a Strand on a shared ThreadPool, so requests to one device run in order but
+// a device that takes seconds to respond doesn't hold up any other device. Enumeration
+// has its own strand too. The result signals are emitted from the pool threads.
+//
+// Requests from the user run at JobPriority::Interactive so they overtake the periodic
+// enumeration, which runs at JobPriority::Background. Enumeration requests are coalesced
+// so at most one is ever queued, and descriptor requests are dropped if the user has
+// asked for a different device's descriptors before they ran.
+//
+// When a new device is enumerated its descriptors and strings are prefetched in the
+// background into a cache, so that deviceDescriptors() usually answers immediately.
+// Prefetching never opens a device, so it can't take one away from another program.
 class UsbThread : public QObject
 {
 	Q_OBJECT
@@ -19,6 +43,31 @@ public:
 	// This can't have any parents.
 	UsbThread();
 	~UsbThread();
+	
+	// Load the device list saved by the last run, and remember `path` so the list can be
+	// saved there again on exit. The saved descriptors are used to answer deviceDescriptors()
+	// until the first enumeration has confirmed the devices are still the same.
+	// Call this before any requests are made.
+	std::vector<DeviceSnapshotEntry> loadSnapshot(const QString& path);
+	
+	// Run `job` on every device from the last enumeration that matches `filter`, at most
+	// `maxPerHub` at once on each hub. Each device's job runs on its strand. Progress is
+	// reported with fleetProgress(). Can be called from any thread.
+	std::shared_ptr<FleetRunner> runFleetJob(const DeviceFilter& filter, FleetJob job, int maxPerHub);
+	
+	// The same with a job that downloads `image` to each device with DFU and verifies it.
+	std::shared_ptr<FleetRunner> runDfuFleetJob(const DeviceFilter& filter, std::shared_ptr<MappedFile> image, int maxPerHub);
+	
+	// Watch all the traffic on `bus` (0 for every bus) with usbmon, including other programs'.
+	// The events are counted (see busMonitorTotals()), and written to `capturePath` unless it
+	// is empty: as pcapng if it ends in .pcapng, otherwise as an indexed capture (see
+	// Capture.h). A monitor that is already running is stopped first. Linux only. Can be
+	// called from any thread.
+	SResult<void> startBusMonitor(int bus, const QString& capturePath);
+	void stopBusMonitor();
+	UsbMonStats busMonitorStats();
+	// Since the monitor was last started. These are kept after it stops.
+	UsbMonTotals busMonitorTotals();
 
 signals:
 	void constructSignal();
@@ -28,10 +77,18 @@ signals:
 	void deviceDescriptorsResult(DeviceId loc, bool success, const DeviceDescriptor& deviceDescriptor);
 	void controlOutTransferResult(DeviceId loc, bool success);
 	void controlInTransferResult(DeviceId loc, bool success, const QByteArray& data);
+	// Sent periodically for the selected device while it is open.
+	void endpointCountersResult(DeviceId loc, const QVector<EndpointCounterSnapshot>& counters);
+	// Sent whenever a device in a fleet job changes state or reports progress.
+	void fleetProgress(const FleetDeviceStatus& status, const FleetStats& stats);
 
 public slots:
 	void enumerateDevices();
+	// This also marks `loc` as the selected device; see openDevice().
 	void deviceDescriptors(DeviceId loc);
+	// Drop any queued deviceDescriptors() requests, e.g. because nothing is selected now.
+	// Any device kept open for the previous selection is closed.
+	void cancelDeviceDescriptors();
 
 	void controlOutTransfer(DeviceId loc,
 	                        Device::Recipient recipient,
@@ -51,14 +108,129 @@ public slots:
 private slots:
 	void constructSlot();
 	void destructSlot();
+	
+	// Emit endpointCountersResult() for the selected device if it is open.
+	void pollEndpointCounters();
 
 private:
+	// These do the actual work of the slots above, on the device's strand.
+	void enumerateDevicesJob();
+	void deviceDescriptorsJob(DeviceId loc);
+	void controlOutTransferJob(DeviceId loc,
+	                           Device::Recipient recipient,
+	                           Device::Type type,
+	                           quint8 bRequest,
+	                           quint16 wValue,
+	                           quint16 wIndex,
+	                           const QByteArray& data);
+	void controlInTransferJob(DeviceId loc,
+	                          Device::Recipient recipient,
+	                          Device::Type type,
+	                          quint8 bRequest,
+	                          quint16 wValue,
+	                          quint16 wIndex,
+	                          int length);
+	
+	// Get the strand for a device, creating it if necessary.
+	std::shared_ptr<Strand> strandFor(DeviceId loc);
+	
+	// Open the device if necessary and read its descriptors and strings into the cache.
+	// Only call this from the device's strand.
+	SResult<DeviceDescriptor> fetchDescriptors(DeviceId loc);
+	
+	// Queue prefetches for any devices that aren't in the descriptor cache, unless the last
+	// attempt failed too recently.
+	void prefetchDescriptors(const std::vector<DeviceInfo>& devices);
+	// Start queued prefetches until MAX_CONCURRENT_PREFETCHES are running.
+	void startPrefetches();
+	void prefetchJob(DeviceId loc);
+	
+	// Get an already open device, or open it. Only the selected device is kept open
+	// afterwards, so its endpoint counters accumulate across requests without holding every
+	// other device seized. Only call this from the device's strand.
+	SResult<std::shared_ptr<Device>> openDevice(DeviceId loc);
+	
+	// Remember which device is selected and close any other device we are keeping open.
+	// Requests that are still running keep their own reference to the device.
+	void setSelectedDevice(const std::string& key);
+	
+	// Save the last device list and descriptors to snapshotPath, if we have one.
+	void saveSnapshot();
+	
 	QThread workerThread;
 	
-	QVector<Device> openDevices;
+	// Enough that a rack full of slow devices won't starve the rest. The threads
+	// spend nearly all their time blocked in the kernel.
+	static const int NUM_WORKER_THREADS = 32;
+	
+	ThreadPool pool{NUM_WORKER_THREADS};
+	
+	// Enumeration is serialised separately from the devices.
+	std::shared_ptr<Strand> enumerateStrand;
+	// True while an enumeration is queued but hasn't started yet.
+	std::atomic_bool enumerateQueued{false};
+	
+	// Incremented for every deviceDescriptors() or cancelDeviceDescriptors() call. A queued
+	// descriptors request only runs if this hasn't changed since it was posted.
+	std::atomic<uint64_t> descriptorsGeneration{0};
+	
+	// Map from DeviceIdToString() to the device's strand. Entries are removed when the device
+	// disappears.
+	std::mutex deviceStrandsMutex;
+	std::map<std::string, std::shared_ptr<Strand>> deviceStrands;
+	
+	// Map from DeviceIdToString() to the descriptors (with strings) of devices that
+	// are plugged in. Entries are removed when the device disappears.
+	std::mutex descriptorCacheMutex;
+	std::map<std::string, DeviceDescriptor> descriptorCache;
+	
+	// The devices from the snapshot that seeded descriptorCache, to check against the
+	// first enumeration. Protected by descriptorCacheMutex.
+	std::map<std::string, DeviceInfo> snapshotDevices;
+	QString snapshotPath;
+	
+	// The result of the last successful enumeration, for saving the snapshot.
+	std::mutex lastDevicesMutex;
+	std::vector<DeviceInfo> lastDevices;
+	bool haveEnumerated = false;
+	
+	// Prefetching is limited so that plugging in a rack of devices doesn't tie up
+	// every pool thread, and so we don't have hundreds of devices open at once.
+	static const int MAX_CONCURRENT_PREFETCHES = 8;
+	
+	std::mutex prefetchMutex;
+	std::deque<DeviceId> prefetchQueue;
+	// DeviceIdToString() of everything queued or running.
+	std::set<std::string> prefetchPending;
+	int prefetchesRunning = 0;
+	
+	// A device whose prefetch failed isn't tried again until retryAt, and the wait doubles
+	// with each failure, so a device that can't be read isn't asked again on every enumeration.
+	// Entries are removed when the device disappears. Protected by prefetchMutex.
+	struct PrefetchFailure
+	{
+		std::chrono::steady_clock::time_point retryAt;
+		std::chrono::milliseconds backoff{0};
+	};
+	std::map<std::string, PrefetchFailure> prefetchFailures;
+	static const int PREFETCH_FIRST_BACKOFF_MS = 2000;
+	static const int PREFETCH_MAX_BACKOFF_MS = 5 * 60 * 1000;
+	
+	// Map from DeviceIdToString() to the open device. This is accessed from all the strands.
+	// It only ever holds the selected device.
+	std::mutex openDevicesMutex;
+	std::map<std::string, std::shared_ptr<Device>> openDevices;
+	// DeviceIdToString() of the selected device, or empty. Protected by openDevicesMutex.
+	std::string selectedDeviceKey;
+	
+	std::mutex busMonitorMutex;
+	std::shared_ptr<UsbMonSniffer> busMonitor;
+	// Added to by the monitor's thread with each batch. Protected by busMonitorMutex.
+	UsbMonTotals busMonitorCounts;
 	
 	std::thread usbEventThread;
 	std::atomic_bool usbEventThreadRun{false};
 	
 	QTimer enumerateTimer;
+	QTimer countersTimer;
 };
@@ -13,9 +13,36 @@ SOURCES += \
 	UsbThread.cpp \
 	DeviceListModel.cpp \
 	DeviceInterfacesModel.cpp \
+	DeviceListSnapshot.cpp \
+	StartupTiming.cpp \
+	FleetRunner.cpp \
+	TransferLogModel.cpp \
+	BusMonitorWidget.cpp \
 	util/HighResClock.cpp \
+	util/ThreadPool.cpp \
+	util/MappedFile.cpp \
+	util/Crc32.cpp \
+	util/ByteRing.cpp \
+	util/MirroredMemory.cpp \
+	util/LockedMemory.cpp \
+	util/SharedMemory.cpp \
+	util/ThreadPolicy.cpp \
+	util/FastLog.cpp \
 	usb/EndpointInfo.cpp \
+	usb/EndpointCounters.cpp \
+	usb/DescriptorCache.cpp \
+	usb/Dfu.cpp \
+	usb/DeltaFlash.cpp \
 	usb/IsochronousStream.cpp \
+	usb/IsochronousInStream.cpp \
+	usb/IsochFeedback.cpp \
+	usb/IsochJitterBuffer.cpp \
+	usb/IsochSharedRing.cpp \
+	usb/IsochStreamGroup.cpp \
+	usb/UsbMon.cpp \
+	usb/Pcapng.cpp \
+	usb/Capture.cpp \
+	usb/CaptureQuery.cpp \
 	usb/mac/RunLoop.cpp \
     usb/windows/Util_Win.cpp \
     usb/mac/Util_Mac.cpp \
@@ -36,12 +63,41 @@ HEADERS += \
 	Metatypes.h \
 	PaddedSpinBox.h \
 	DeviceInterfacesModel.h \
+	DeviceListSnapshot.h \
+	StartupTiming.h \
+	FleetRunner.h \
+	TransferLogModel.h \
+	BusMonitorWidget.h \
 	util/EnumCasts.h \
 	util/HighResClock.h \
+	util/ThreadPool.h \
+	util/MappedFile.h \
+	util/Crc32.h \
+	util/ByteRing.h \
+	util/MirroredMemory.h \
+	util/LockedMemory.h \
+	util/SharedMemory.h \
+	util/ThreadPolicy.h \
+	util/FastLog.h \
 	util/Result.h \
 	util/scope_exit.h \
+	util/BinaryIO.h \
 	usb/EndpointInfo.h \
+	usb/EndpointCounters.h \
+	usb/DescriptorCache.h \
+	usb/Dfu.h \
+	usb/DeltaFlash.h \
 	usb/IsochronousStream.h \
+	usb/IsochronousInStream.h \
+	usb/IsochFrame.h \
+	usb/IsochFeedback.h \
+	usb/IsochJitterBuffer.h \
+	usb/IsochSharedRing.h \
+	usb/IsochStreamGroup.h \
+	usb/UsbMon.h \
+	usb/Pcapng.h \
+	usb/Capture.h \
+	usb/CaptureQuery.h \
 	usb/UsbSpecification.h \
 	usb/mac/RunLoop.h \
     usb/mac/TypeWrappers_Mac.h \
@@ -63,7 +119,7 @@ INCLUDEPATH += dependencies
 
 
 mac:LIBS += -framework CoreFoundation
-win32:LIBS += -lwinusb -lsetupapi
+win32:LIBS += -lwinusb -lsetupapi -lcfgmgr32
 
 # Set icons
 mac:ICON = UsbTool.icns
@@ -1,19 +1,37 @@
 #include <QApplication>
+#include <QStandardPaths>
+#include <QDir>
+#include <QDebug>
 
 #include "MainWindow.h"
 #include "UsbThread.h"
 #include "Metatypes.h"
 
 #include "DeviceInterfacesModel.h"
+#include "usb/DescriptorCache.h"
+#include "StartupTiming.h"
+#include "util/FastLog.h"
+#include "util/scope_exit.h"
 
 int main(int argc, char *argv[])
 {
+	MarkStartupPhase("main");
+	
+	// The USB code logs through this so it never blocks on the console. Stopping it last
+	// makes sure everything logged while shutting down is still printed.
+	StartFastLog();
+	auto stopLog = make_scope_exit([] { StopFastLog(); });
+	
 	qRegisterMetaType<DeviceInfo>();
 	qRegisterMetaType<DeviceDescriptor>();
 	qRegisterMetaType<DeviceId>();
 	qRegisterMetaType<Device::Recipient>();
 	qRegisterMetaType<Device::Type>();
 	qRegisterMetaType<QVector<DeviceInfo>>();
+	qRegisterMetaType<EndpointCounterSnapshot>();
+	qRegisterMetaType<QVector<EndpointCounterSnapshot>>();
+	qRegisterMetaType<FleetDeviceStatus>();
+	qRegisterMetaType<FleetStats>();
 	qRegisterMetaType<DeviceInterfacesModel::TreeNodeData>();
 	qRegisterMetaType<DeviceInterfacesModel::NodeType>();
 
@@ -23,13 +41,30 @@ int main(int argc, char *argv[])
 
 	QApplication a(argc, argv);
 	
+	MarkStartupPhase("QApplication");
+	
+	// Remember the descriptors of devices we have seen so reopening them is quicker.
+	// The device list snapshot goes in the same place.
+	QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+	QDir().mkpath(cacheDir);
+	SResult<void> cacheRes = DescriptorCache::global().open(QDir(cacheDir).filePath("descriptors.cache").toStdString());
+	if (!cacheRes)
+		qDebug() << "Couldn't open descriptor cache:" << QString::fromStdString(cacheRes.unwrap_err());
+	
 	// UsbThread uses its own Qt event loop so it requires QApplication
 	// to have been initialised already. When this is destroyed it will block
 	// until any outstanding operations are complete. Mabe.
 	UsbThread usbThread;
 	
+	std::vector<DeviceSnapshotEntry> lastKnown = usbThread.loadSnapshot(QDir(cacheDir).filePath("devices.snapshot"));
+	
+	MarkStartupPhase("UsbThread and snapshot");
+	
 	MainWindow w(usbThread);
+	w.showLastKnownDevices(lastKnown);
 	w.show();
 	
+	MarkStartupPhase("MainWindow");
+	
 	return a.exec();
 }
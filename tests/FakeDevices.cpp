@@ -0,0 +1,292 @@
+#include "FakeDevices.h"
+
+#include "Test.h"
+#include "usb/Discovery.h"
+#include "util/Crc32.h"
+#include "util/EnumCasts.h"
+
+#include <algorithm>
+
+std::shared_ptr<Device> OpenFake(const std::string& path, std::shared_ptr<FakeUsbDevice> fake)
+{
+	AddFakeUsbDevice(path, fake);
+	DeviceId id;
+	id.path = path;
+	return REQUIRE_OK(OpenUsbDevice(id)).unwrap();
+}
+
+double MsSince(HighResClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(HighResClock::now() - start).count();
+}
+
+std::vector<uint8_t> FakeVendorDevice::deviceDescriptor()
+{
+	return MakeFakeDeviceDescriptor(0x1234, 0x0001, 0x0100, 1, 2, 3);
+}
+
+std::vector<std::vector<uint8_t>> FakeVendorDevice::configurationDescriptors()
+{
+	return {{
+		// Configuration.
+		9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 18, 0, 1, 1, 0, 0x80, 50,
+		// Interface 0, vendor-specific.
+		9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, 0xFF, 0, 0, 0,
+	}};
+}
+
+FakeControlReply FakeVendorDevice::control(const FakeSetup& setup, const std::vector<uint8_t>&)
+{
+	if ((setup.bmRequestType & 0x60) != 0x40)
+		return FakeControlReply::stall();
+
+	std::vector<uint8_t> reply;
+	if (setup.in())
+		for (int i = 0; i < setup.wLength; ++i)
+			reply.push_back(static_cast<uint8_t>(setup.wValue + i));
+
+	switch (setup.bRequest)
+	{
+	case ECHO:
+		return FakeControlReply::ok(reply);
+	case SLOW:
+		return FakeControlReply::ok(reply, setup.wIndex);
+	case HANG:
+		return FakeControlReply::hang();
+	default:
+		return FakeControlReply::stall();
+	}
+}
+
+FakeDfuDevice::FakeDfuDevice(uint16_t transferSize, uint32_t pollTimeoutMs)
+	: mTransferSize(transferSize), mPollTimeoutMs(pollTimeoutMs)
+{
+}
+
+std::vector<uint8_t> FakeDfuDevice::deviceDescriptor()
+{
+	return MakeFakeDeviceDescriptor(0x1234, 0x0002, 0x0100, 1, 2, 3);
+}
+
+std::vector<std::vector<uint8_t>> FakeDfuDevice::configurationDescriptors()
+{
+	return {{
+		// Configuration.
+		9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 27, 0, 1, 1, 0, 0x80, 50,
+		// Interface 0, DFU mode.
+		9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, USB_DFU_INTERFACE_CLASS, USB_DFU_INTERFACE_SUBCLASS, 2, 0,
+		// Functional: can download and upload, manifestation tolerant, wDetachTimeOut 1000.
+		9, USB_DFU_FUNCTIONAL_DESCRIPTOR_TYPE, 0x07, 0xE8, 0x03,
+		static_cast<uint8_t>(mTransferSize), static_cast<uint8_t>(mTransferSize >> 8), 0x10, 0x01,
+	}};
+}
+
+std::vector<uint8_t> FakeDfuDevice::firmware()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mFirmware;
+}
+
+void FakeDfuDevice::setFirmware(std::vector<uint8_t> firmware)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mFirmware = std::move(firmware);
+}
+
+int FakeDfuDevice::blocksWritten()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mBlocksWritten;
+}
+
+int FakeDfuDevice::earlyPolls()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mEarlyPolls;
+}
+
+FakeControlReply FakeDfuDevice::status()
+{
+	std::vector<uint8_t> reply(6);
+	reply[0] = mStatus;
+	// bwPollTimeout is only non-zero while the device is busy.
+	uint32_t poll = mState == DfuState::DfuDnBusy || mState == DfuState::DfuManifest ? mPollTimeoutMs : 0;
+	reply[1] = poll & 0xFF;
+	reply[2] = (poll >> 8) & 0xFF;
+	reply[3] = (poll >> 16) & 0xFF;
+	reply[4] = to_integral(mState);
+	return FakeControlReply::ok(reply);
+}
+
+FakeControlReply FakeDfuDevice::control(const FakeSetup& setup, const std::vector<uint8_t>& data)
+{
+	// Class requests to the interface.
+	if ((setup.bmRequestType & 0x7F) != 0x21 || setup.wIndex != 0)
+		return FakeControlReply::stall();
+
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	auto fail = [&] {
+		// errSTALLEDPKT.
+		mStatus = 0x0F;
+		mState = DfuState::DfuError;
+		return FakeControlReply::stall();
+	};
+
+	switch (setup.bRequest)
+	{
+	case USB_DFU_DNLOAD_REQUEST:
+		if (mState != DfuState::DfuIdle && mState != DfuState::DfuDnloadIdle)
+			return fail();
+		if (mState == DfuState::DfuIdle)
+			mDownload.clear();
+		if (data.empty())
+		{
+			if (mState != DfuState::DfuDnloadIdle)
+				return fail();
+			mState = DfuState::DfuManifestSync;
+			return FakeControlReply::ok({});
+		}
+		if (data.size() > mTransferSize || static_cast<size_t>(setup.wValue) * mTransferSize != mDownload.size())
+			return fail();
+		mDownload.insert(mDownload.end(), data.begin(), data.end());
+		++mBlocksWritten;
+		mState = DfuState::DfuDnloadSync;
+		return FakeControlReply::ok({});
+
+	case USB_DFU_UPLOAD_REQUEST:
+	{
+		if (mState != DfuState::DfuIdle && mState != DfuState::DfuUploadIdle)
+			return fail();
+		size_t offset = static_cast<size_t>(setup.wValue) * mTransferSize;
+		size_t n = std::min<size_t>(setup.wLength, offset < mFirmware.size() ? mFirmware.size() - offset : 0);
+		std::vector<uint8_t> block(mFirmware.begin() + offset, mFirmware.begin() + offset + n);
+		mState = n < mTransferSize ? DfuState::DfuIdle : DfuState::DfuUploadIdle;
+		return FakeControlReply::ok(block);
+	}
+
+	case USB_DFU_GETSTATUS_REQUEST:
+	{
+		bool busy = mState == DfuState::DfuDnBusy || mState == DfuState::DfuManifest;
+		if (busy && HighResClock::now() < mBusyUntil)
+		{
+			++mEarlyPolls;
+			return fail();
+		}
+
+		switch (mState)
+		{
+		case DfuState::DfuDnloadSync:
+			mState = DfuState::DfuDnBusy;
+			mBusyUntil = HighResClock::now() + std::chrono::milliseconds(mPollTimeoutMs);
+			break;
+		case DfuState::DfuDnBusy:
+			mState = DfuState::DfuDnloadIdle;
+			break;
+		case DfuState::DfuManifestSync:
+			mState = DfuState::DfuManifest;
+			mBusyUntil = HighResClock::now() + std::chrono::milliseconds(mPollTimeoutMs);
+			break;
+		case DfuState::DfuManifest:
+			mFirmware = mDownload;
+			mState = DfuState::DfuIdle;
+			break;
+		default:
+			break;
+		}
+		return status();
+	}
+
+	case USB_DFU_CLRSTATUS_REQUEST:
+		if (mState != DfuState::DfuError)
+			return fail();
+		mStatus = 0;
+		mState = DfuState::DfuIdle;
+		return FakeControlReply::ok({});
+
+	case USB_DFU_GETSTATE_REQUEST:
+		return FakeControlReply::ok({to_integral(mState)});
+
+	case USB_DFU_ABORT_REQUEST:
+		mState = DfuState::DfuIdle;
+		return FakeControlReply::ok({});
+
+	default:
+		return fail();
+	}
+}
+
+FakeDeltaFlashDevice::FakeDeltaFlashDevice(std::vector<uint8_t> flash, uint32_t eraseBlocks)
+	: mEraseBlocks(std::max<uint32_t>(eraseBlocks, 1)), mFlash(std::move(flash))
+{
+	mFlash.resize((mFlash.size() + mProtocol.blockSize - 1) / mProtocol.blockSize * mProtocol.blockSize, mProtocol.padding);
+}
+
+std::vector<uint8_t> FakeDeltaFlashDevice::deviceDescriptor()
+{
+	return MakeFakeDeviceDescriptor(0x1234, 0x0003, 0x0100, 1, 2, 3);
+}
+
+std::vector<std::vector<uint8_t>> FakeDeltaFlashDevice::configurationDescriptors()
+{
+	return FakeVendorDevice().configurationDescriptors();
+}
+
+std::vector<uint8_t> FakeDeltaFlashDevice::flash()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mFlash;
+}
+
+int FakeDeltaFlashDevice::blocksWritten()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mBlocksWritten;
+}
+
+FakeControlReply FakeDeltaFlashDevice::control(const FakeSetup& setup, const std::vector<uint8_t>& data)
+{
+	// Vendor requests to the device.
+	if ((setup.bmRequestType & 0x7F) != 0x40 || setup.wIndex != mProtocol.wIndex)
+		return FakeControlReply::stall();
+
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	const size_t blockSize = mProtocol.blockSize;
+	const size_t blocks = mFlash.size() / blockSize;
+
+	if (setup.bRequest == mProtocol.hashRequest)
+	{
+		std::vector<uint8_t> reply;
+		for (size_t block = setup.wValue; block < blocks && reply.size() + 4 <= setup.wLength; ++block)
+		{
+			uint32_t crc = Crc32(mFlash.data() + block * blockSize, blockSize);
+			for (int i = 0; i < 4; ++i)
+				reply.push_back(static_cast<uint8_t>(crc >> (i * 8)));
+		}
+		return FakeControlReply::ok(reply);
+	}
+
+	if (setup.bRequest == mProtocol.readRequest)
+	{
+		if (setup.wValue >= blocks)
+			return FakeControlReply::stall();
+		auto begin = mFlash.begin() + setup.wValue * blockSize;
+		return FakeControlReply::ok(std::vector<uint8_t>(begin, begin + std::min<size_t>(setup.wLength, blockSize)));
+	}
+
+	if (setup.bRequest == mProtocol.writeRequest)
+	{
+		if (setup.wValue >= blocks || data.size() != blockSize)
+			return FakeControlReply::stall();
+
+		size_t first = setup.wValue / mEraseBlocks * mEraseBlocks;
+		size_t last = std::min(first + mEraseBlocks, blocks);
+		std::fill(mFlash.begin() + first * blockSize, mFlash.begin() + last * blockSize, mProtocol.padding);
+		std::copy(data.begin(), data.end(), mFlash.begin() + setup.wValue * blockSize);
+		++mBlocksWritten;
+		return FakeControlReply::ok({});
+	}
+
+	return FakeControlReply::stall();
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "usb/DeltaFlash.h"
+#include "usb/Device.h"
+#include "usb/Dfu.h"
+#include "usb/fake/FakeUsbDevice.h"
+
+// Fakes shared by several tests.
+
+// Register `fake` at `path` and open it, ending the test if that fails.
+std::shared_ptr<Device> OpenFake(const std::string& path, std::shared_ptr<FakeUsbDevice> fake);
+
+// Milliseconds since `start`.
+double MsSince(HighResClock::time_point start);
+
+// A vendor-specific device with one configuration, one interface and no endpoints, that
+// answers vendor requests according to bRequest:
+//
+//   ECHO  IN returns wLength bytes counting up from wValue; OUT accepts anything.
+//   SLOW  like ECHO, after wIndex ms.
+//   HANG  never answers.
+//   STALL stalls.
+class FakeVendorDevice : public FakeUsbDevice
+{
+public:
+	static const uint8_t ECHO = 1;
+	static const uint8_t SLOW = 2;
+	static const uint8_t HANG = 3;
+	static const uint8_t STALL = 4;
+
+	std::vector<uint8_t> deviceDescriptor() override;
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override;
+	FakeControlReply control(const FakeSetup& setup, const std::vector<uint8_t>& data) override;
+
+	std::string manufacturer() override { return "UsbTool"; }
+	std::string product() override { return "Fake vendor device"; }
+	std::string serial() override { return "0001"; }
+};
+
+// A device in DFU mode that keeps its firmware in memory. It follows the DFU 1.1 state
+// machine closely enough for DfuDevice, and goes to dfuERROR if it is asked for its status
+// before the bwPollTimeout it gave has passed.
+class FakeDfuDevice : public FakeUsbDevice
+{
+public:
+	FakeDfuDevice(uint16_t transferSize, uint32_t pollTimeoutMs);
+
+	std::vector<uint8_t> deviceDescriptor() override;
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override;
+	FakeControlReply control(const FakeSetup& setup, const std::vector<uint8_t>& data) override;
+
+	std::string manufacturer() override { return "UsbTool"; }
+	std::string product() override { return "Fake DFU device"; }
+	std::string serial() override { return "0002"; }
+
+	// The firmware, as last manifested or as given to setFirmware().
+	std::vector<uint8_t> firmware();
+	void setFirmware(std::vector<uint8_t> firmware);
+
+	// The number of DNLOADs with data, and of GETSTATUS requests that came too early.
+	int blocksWritten();
+	int earlyPolls();
+
+private:
+	FakeControlReply status();
+
+	const uint16_t mTransferSize;
+	const uint32_t mPollTimeoutMs;
+
+	std::mutex mMutex;
+	DfuState mState = DfuState::DfuIdle;
+	uint8_t mStatus = 0;
+	HighResClock::time_point mBusyUntil;
+	std::vector<uint8_t> mFirmware;
+	// What has been downloaded since the last manifestation.
+	std::vector<uint8_t> mDownload;
+	int mBlocksWritten = 0;
+	int mEarlyPolls = 0;
+};
+
+// A device that implements DeltaFlashProtocol's default requests over flash held in memory.
+// With an `eraseBlocks` above 1 a write erases the other blocks of its erase unit too and
+// leaves them erased, as flash whose erase unit is bigger than the block size would.
+class FakeDeltaFlashDevice : public FakeUsbDevice
+{
+public:
+	FakeDeltaFlashDevice(std::vector<uint8_t> flash, uint32_t eraseBlocks = 1);
+
+	std::vector<uint8_t> deviceDescriptor() override;
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override;
+	FakeControlReply control(const FakeSetup& setup, const std::vector<uint8_t>& data) override;
+
+	std::string manufacturer() override { return "UsbTool"; }
+	std::string product() override { return "Fake delta flash device"; }
+	std::string serial() override { return "0003"; }
+
+	std::vector<uint8_t> flash();
+	// The number of write requests.
+	int blocksWritten();
+
+private:
+	const DeltaFlashProtocol mProtocol;
+	const uint32_t mEraseBlocks;
+
+	std::mutex mMutex;
+	std::vector<uint8_t> mFlash;
+	int mBlocksWritten = 0;
+};
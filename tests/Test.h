@@ -0,0 +1,69 @@
+#pragma once
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A very small test runner. Tests register themselves with TEST() and are run by
+// TestMain.cpp; a failed CHECK() marks the test failed but carries on, and REQUIRE()
+// stops it.
+
+struct TestCase
+{
+	const char* name;
+	std::function<void()> body;
+};
+
+std::vector<TestCase>& AllTests();
+
+struct TestRegistration
+{
+	TestRegistration(const char* name, std::function<void()> body)
+	{
+		AllTests().push_back(TestCase{name, body});
+	}
+};
+
+// Report a failed check in the current test.
+void TestFailed(const char* file, int line, const std::string& what);
+
+// Thrown by REQUIRE() to end the test.
+struct TestAbort
+{
+};
+
+#define TEST_CONCAT2(a, b) a##b
+#define TEST_CONCAT(a, b) TEST_CONCAT2(a, b)
+
+#define TEST(name)                                                                   \
+	static void name();                                                              \
+	static TestRegistration TEST_CONCAT(registration_, name)(#name, &name);          \
+	static void name()
+
+#define CHECK(cond)                                                                  \
+	do {                                                                             \
+		if (!(cond))                                                                 \
+			TestFailed(__FILE__, __LINE__, #cond);                                   \
+	} while (false)
+
+#define REQUIRE(cond)                                                                \
+	do {                                                                             \
+		if (!(cond))                                                                 \
+		{                                                                            \
+			TestFailed(__FILE__, __LINE__, #cond);                                   \
+			throw TestAbort();                                                       \
+		}                                                                            \
+	} while (false)
+
+// Unwrap an SResult, ending the test with its error if it failed.
+#define REQUIRE_OK(expr)                                                             \
+	([&]() {                                                                         \
+		auto _res = (expr);                                                          \
+		if (!_res)                                                                   \
+		{                                                                            \
+			TestFailed(__FILE__, __LINE__, std::string(#expr) + ": " + _res.unwrap_err()); \
+			throw TestAbort();                                                       \
+		}                                                                            \
+		return _res;                                                                 \
+	}())
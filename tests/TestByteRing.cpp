@@ -0,0 +1,25 @@
+#include "Test.h"
+
+#include "util/ByteRing.h"
+
+TEST(MirroredRingReportsHugePagesUnsupported)
+{
+	LockedMemoryOptions memory;
+	memory.hugePages = true;
+	ByteRing ring(4096, memory);
+	if (!ring.mirrored())
+		return;
+
+	CHECK(ring.memoryDiagnostic().find("huge pages") != std::string::npos);
+
+	// Still usable across the wrap.
+	std::vector<uint8_t> data(3000, 7);
+	std::vector<uint8_t> out(3000);
+	REQUIRE(ring.write(data.data(), data.size()));
+	CHECK(ring.read(out.data(), out.size()) == 3000);
+	REQUIRE(ring.write(data.data(), data.size()));
+	size_t size = 0;
+	const uint8_t* window = ring.readWindow(size);
+	CHECK(size == ring.readable() && size == 3000);
+	CHECK(window[0] == 7 && window[size - 1] == 7);
+}
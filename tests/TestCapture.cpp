@@ -0,0 +1,219 @@
+#include "Test.h"
+
+#include "usb/Capture.h"
+#include "usb/CaptureQuery.h"
+#include "usb/Pcapng.h"
+
+#include <fstream>
+#include <thread>
+#include <stdio.h>
+
+// Captures written with CaptureWriter and read back with CaptureReader, both while they are
+// still being written (so there is no index) and once they are finished, and pcapng traces
+// imported into them.
+
+namespace
+{
+// In the working directory, like the binary's other output.
+const char* CAPTURE_PATH = "TestCapture.capture";
+const char* PCAPNG_PATH = "TestCapture.pcapng";
+
+void RemoveCapture()
+{
+	std::string path = CAPTURE_PATH;
+	remove(path.c_str());
+	remove((path + ".payload").c_str());
+	remove((path + ".index").c_str());
+	remove(PCAPNG_PATH);
+}
+
+UsbMonRecord BulkComplete(uint64_t timestampNs, uint8_t endpoint)
+{
+	UsbMonRecord r;
+	r.id = timestampNs;
+	r.type = UsbMonEventType::Complete;
+	r.transferType = EndpointInfo::Type::Bulk;
+	r.endpoint = endpoint;
+	r.deviceAddress = 4;
+	r.bus = 1;
+	r.timestampNs = timestampNs;
+	r.urbLength = 2;
+	r.data = {static_cast<uint8_t>(timestampNs), static_cast<uint8_t>(timestampNs >> 8)};
+	return r;
+}
+
+UsbMonRecord VendorRequest(uint64_t timestampNs, uint8_t bRequest, uint16_t wValue)
+{
+	UsbMonRecord r;
+	r.id = timestampNs;
+	r.type = UsbMonEventType::Submit;
+	r.transferType = EndpointInfo::Type::Control;
+	r.endpoint = 0x00;
+	r.deviceAddress = 4;
+	r.bus = 1;
+	r.timestampNs = timestampNs;
+	r.status = -115;
+	r.setupFlag = 0;
+	r.setup = {0x40, bRequest, static_cast<uint8_t>(wValue), static_cast<uint8_t>(wValue >> 8), 0, 0, 0, 0};
+	return r;
+}
+
+// Each chunk on its own thread, like the pool would.
+void PostToThread(std::function<void()> job)
+{
+	std::thread(job).detach();
+}
+
+// What findTime() should give, by looking at every record.
+uint64_t FindTimeByScan(const CaptureReader& reader, uint64_t timestampNs)
+{
+	for (uint64_t i = 0; i < reader.size(); ++i)
+		if (reader.record(i).timestampNs >= timestampNs)
+			return i;
+	return reader.size();
+}
+}
+
+TEST(CaptureFindTimeWithAndWithoutIndex)
+{
+	RemoveCapture();
+	auto writer = REQUIRE_OK(CaptureWriter::create(CAPTURE_PATH)).unwrap();
+
+	// More than one time index block, 10 us apart, with a pair from different CPUs swapped
+	// now and then as usbmon can deliver them.
+	const uint64_t count = 10000;
+	const uint64_t start = 1000000;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		uint64_t t = start + i * 10000;
+		if (i % 1000 == 500)
+			t += 15000;
+		else if (i % 1000 == 501)
+			t -= 15000;
+		REQUIRE_OK(writer->append(BulkComplete(t, i % 2 ? 0x81 : 0x02)));
+	}
+	REQUIRE_OK(writer->flush());
+
+	std::vector<uint64_t> times = {0, start, start + 1, start + 5000000, start + 5005000, start + 5010000,
+	                               start + 5015000, start + count * 10000, UINT64_MAX};
+
+	{
+		// Still being written.
+		auto live = REQUIRE_OK(CaptureReader::open(CAPTURE_PATH)).unwrap();
+		REQUIRE(live->size() == count);
+		CHECK(!live->indexWasValid());
+		for (uint64_t t : times)
+			CHECK(live->findTime(t) == FindTimeByScan(*live, t));
+	}
+
+	REQUIRE_OK(writer->finish());
+	{
+		auto finished = REQUIRE_OK(CaptureReader::open(CAPTURE_PATH)).unwrap();
+		REQUIRE(finished->size() == count);
+		CHECK(finished->indexWasValid());
+		for (uint64_t t : times)
+			CHECK(finished->findTime(t) == FindTimeByScan(*finished, t));
+		CHECK(finished->endpoints().size() == 2);
+
+		auto decoded = REQUIRE_OK(finished->decode(7)).unwrap();
+		CHECK(decoded.endpoint == 0x81);
+		CHECK(decoded.data.size() == 2);
+	}
+
+	writer.reset();
+	RemoveCapture();
+}
+
+TEST(CaptureFindTimeInEmptyCapture)
+{
+	RemoveCapture();
+	auto writer = REQUIRE_OK(CaptureWriter::create(CAPTURE_PATH)).unwrap();
+	REQUIRE_OK(writer->flush());
+
+	{
+		auto reader = REQUIRE_OK(CaptureReader::open(CAPTURE_PATH)).unwrap();
+		CHECK(reader->size() == 0);
+		CHECK(reader->findTime(0) == 0);
+		CHECK(reader->findTime(UINT64_MAX) == 0);
+	}
+
+	writer.reset();
+	RemoveCapture();
+}
+
+TEST(PcapngImportKeepsEveryField)
+{
+	RemoveCapture();
+	{
+		auto pcapng = REQUIRE_OK(PcapngWriter::create(PCAPNG_PATH)).unwrap();
+		for (uint64_t i = 0; i < 100; ++i)
+		{
+			// Nanoseconds, which the usbmon header can't hold.
+			uint64_t t = 1700000000000000000ull + i * 1000 + 7;
+			UsbMonRecord r = i % 10 == 3 ? VendorRequest(t, 0x42, static_cast<uint16_t>(i)) : BulkComplete(t, 0x81);
+			REQUIRE_OK(WriteUsbMonRecord(*pcapng, r));
+		}
+		REQUIRE_OK(pcapng->flush());
+	}
+
+	uint64_t imported = REQUIRE_OK(ImportPcapngToCapture(PCAPNG_PATH, CAPTURE_PATH)).unwrap();
+	CHECK(imported == 100);
+
+	auto capture = REQUIRE_OK(CaptureReader::open(CAPTURE_PATH)).unwrap();
+	REQUIRE(capture->size() == 100);
+	CHECK(capture->indexWasValid());
+	CHECK(capture->record(0).timestampNs == 1700000000000000007ull);
+	auto request = REQUIRE_OK(capture->decode(13)).unwrap();
+	CHECK(request.hasSetup());
+	CHECK(request.setup[1] == 0x42 && request.setup[2] == 13);
+	auto bulk = REQUIRE_OK(capture->decode(14)).unwrap();
+	CHECK(bulk.endpoint == 0x81 && bulk.data.size() == 2);
+
+	// The filter's fields now apply to each packet of the trace.
+	CaptureFilter filter;
+	filter.bRequest = 0x42;
+	filter.wValue = 53;
+	std::vector<CaptureMatch> matches;
+	auto query = std::make_shared<CaptureQuery>(PostToThread, 4);
+	query->start(capture, filter, [&](const std::vector<CaptureMatch>& m) { matches.insert(matches.end(), m.begin(), m.end()); },
+	             nullptr);
+	query->wait();
+	REQUIRE(matches.size() == 1);
+	CHECK(matches[0].record == 53);
+
+	capture.reset();
+	RemoveCapture();
+}
+
+TEST(PcapngReaderRejectsBadFiles)
+{
+	RemoveCapture();
+	{
+		std::ofstream out(PCAPNG_PATH, std::ios::binary);
+		out << "This isn't a pcapng file at all";
+	}
+	CHECK(!PcapngReader::open(PCAPNG_PATH));
+
+	{
+		auto pcapng = REQUIRE_OK(PcapngWriter::create(PCAPNG_PATH)).unwrap();
+		REQUIRE_OK(WriteUsbMonRecord(*pcapng, BulkComplete(1000, 0x81)));
+		REQUIRE_OK(pcapng->flush());
+	}
+	{
+		// Cut the packet block short.
+		std::ofstream out(PCAPNG_PATH, std::ios::binary | std::ios::app);
+		const uint32_t block[2] = {6, 64};
+		out.write(reinterpret_cast<const char*>(block), sizeof(block));
+	}
+
+	auto reader = REQUIRE_OK(PcapngReader::open(PCAPNG_PATH)).unwrap();
+	PcapngPacket packet;
+	CHECK(REQUIRE_OK(reader->next(packet)).unwrap());
+	CHECK(packet.linkType == LINKTYPE_USB_LINUX_MMAPPED);
+	CHECK(packet.timestampNs == 1000);
+	CHECK(!reader->next(packet));
+	reader.reset();
+
+	CHECK(!ImportPcapngToCapture(PCAPNG_PATH, CAPTURE_PATH));
+	RemoveCapture();
+}
@@ -0,0 +1,72 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include <fstream>
+
+namespace
+{
+std::vector<uint8_t> MakeImage(size_t size, uint8_t seed)
+{
+	std::vector<uint8_t> image(size);
+	for (size_t i = 0; i < size; ++i)
+		image[i] = static_cast<uint8_t>(i * 13 + seed);
+	return image;
+}
+
+std::shared_ptr<MappedFile> WriteImage(const std::string& path, const std::vector<uint8_t>& image)
+{
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(image.data()), image.size());
+	}
+	return REQUIRE_OK(MappedFile::open(path, MappedFile::Mode::ReadOnly)).unwrap();
+}
+}
+
+TEST(DeltaFlashWritesOnlyChangedBlocks)
+{
+	// Eight 1 KiB blocks, two of which differ.
+	std::vector<uint8_t> image = MakeImage(8 * 1024, 1);
+	std::vector<uint8_t> old = image;
+	old[1 * 1024 + 5] ^= 0xFF;
+	old[6 * 1024] ^= 0xFF;
+
+	auto fake = std::make_shared<FakeDeltaFlashDevice>(old);
+	auto dev = OpenFake("delta/changed", fake);
+	auto file = WriteImage("delta-changed-test.bin", image);
+
+	DeltaFlasher flasher(dev, DeltaFlashProtocol());
+	DeltaFlashProgress progress = REQUIRE_OK(flasher.flash(*file)).unwrap();
+
+	CHECK(fake->flash() == image);
+	CHECK(fake->blocksWritten() == 2);
+	CHECK(progress.blocksWritten == 2);
+	CHECK(progress.blocksSkipped() == 6);
+	CHECK(progress.blocksVerified == 2);
+	CHECK(progress.blocksRehashed == 8);
+
+	file.reset();
+	MappedFile::remove("delta-changed-test.bin");
+}
+
+TEST(DeltaFlashVerifyCatchesDisturbedSkippedBlock)
+{
+	// Writing block 2 also erases block 3, which was skipped because it already matched.
+	// Reading back only the written block would miss that.
+	std::vector<uint8_t> image = MakeImage(4 * 1024, 2);
+	std::vector<uint8_t> old = image;
+	old[2 * 1024] ^= 0xFF;
+
+	auto fake = std::make_shared<FakeDeltaFlashDevice>(old, 2);
+	auto dev = OpenFake("delta/disturbed", fake);
+	auto file = WriteImage("delta-disturbed-test.bin", image);
+
+	DeltaFlasher flasher(dev, DeltaFlashProtocol());
+	CHECK(!flasher.flash(*file, true));
+
+	// Without verifying it can't tell.
+	CHECK(!!flasher.flash(*file, false));
+
+	file.reset();
+	MappedFile::remove("delta-disturbed-test.bin");
+}
@@ -0,0 +1,56 @@
+#include "Test.h"
+
+#include "usb/DescriptorCache.h"
+
+#include <string.h>
+
+namespace
+{
+DescriptorCacheKey KeyFor(uint32_t i)
+{
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), &i, sizeof(i));
+	return key;
+}
+
+uint32_t NumEntries(const MappedFile& file)
+{
+	// FileHeader is an 8 byte magic followed by numBuckets and numEntries.
+	uint32_t numEntries = 0;
+	memcpy(&numEntries, file.data() + 12, sizeof(numEntries));
+	return numEntries;
+}
+}
+
+TEST(ClearingCacheLeavesOtherMappingsAlone)
+{
+	const std::string path = "descriptor-cache-test.bin";
+	MappedFile::remove(path);
+
+	DescriptorCache& cache = DescriptorCache::global();
+	REQUIRE_OK(cache.open(path));
+
+	DeviceDescriptor desc;
+	desc.idVendor = 0x1234;
+	cache.store(KeyFor(0), desc);
+
+	// Another instance with the same file mapped.
+	auto other = REQUIRE_OK(MappedFile::open(path, MappedFile::Mode::ReadOnly)).unwrap();
+	uint64_t otherSize = other->size();
+
+	// The cache is cleared when the table is half full.
+	for (uint32_t i = 1; i <= 2048; ++i)
+		cache.store(KeyFor(i), desc);
+
+	CHECK(!cache.lookup(KeyFor(1)));
+	CHECK(cache.lookup(KeyFor(2048)));
+
+	// The other mapping still has the old file, intact.
+	CHECK(other->size() == otherSize);
+	CHECK(NumEntries(*other) == 2048);
+
+	auto current = REQUIRE_OK(MappedFile::open(path, MappedFile::Mode::ReadOnly)).unwrap();
+	CHECK(NumEntries(*current) == 1);
+
+	MappedFile::remove(path);
+}
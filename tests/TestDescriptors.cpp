@@ -0,0 +1,44 @@
+#include "Test.h"
+
+#include "usb/Descriptors.h"
+
+namespace
+{
+// A configuration with one interface and one bulk endpoint, followed by `companion`.
+std::vector<uint8_t> ConfigWithCompanion(const std::vector<uint8_t>& companion)
+{
+	std::vector<uint8_t> config{
+		9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, 1, 1, 0, 0x80, 50,
+		9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, 0xFF, 0, 0, 0,
+		7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x81, 0x02, 0x00, 0x04, 0,
+	};
+	config.insert(config.end(), companion.begin(), companion.end());
+	config[2] = static_cast<uint8_t>(config.size());
+	return config;
+}
+}
+
+TEST(CompanionDescriptorIsParsed)
+{
+	auto config = REQUIRE_OK(ParseConfigurationDescriptor(ConfigWithCompanion({
+		6, USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE, 15, 0, 0, 0,
+	}))).unwrap();
+
+	REQUIRE(config.interfaces.size() == 1 && config.interfaces[0].endpoints.size() == 1);
+	const EndpointDescriptor& ep = config.interfaces[0].endpoints[0];
+	CHECK(ep.hasCompanion);
+	CHECK(ep.bMaxBurst == 15);
+}
+
+TEST(MalformedCompanionDescriptorIsSkipped)
+{
+	// One byte short.
+	auto config = REQUIRE_OK(ParseConfigurationDescriptor(ConfigWithCompanion({
+		5, USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE, 15, 0, 0,
+	}))).unwrap();
+
+	REQUIRE(config.interfaces.size() == 1 && config.interfaces[0].endpoints.size() == 1);
+	const EndpointDescriptor& ep = config.interfaces[0].endpoints[0];
+	CHECK(ep.wMaxPacketSize == 1024);
+	CHECK(!ep.hasCompanion);
+}
@@ -0,0 +1,27 @@
+#include "Test.h"
+
+#include "usb/DeviceId.h"
+
+TEST(ParentLocationIdWalksUpOneTier)
+{
+	// A device on port 2 of a hub on port 1 of bus 0x14.
+	CHECK(ParentLocationId(0x14120000) == 0x14100000);
+	// A device on a root hub port.
+	CHECK(ParentLocationId(0x14100000) == 0x14000000);
+	// Deep, with a port number above 9.
+	CHECK(ParentLocationId(0x141a3c00) == 0x141a3000);
+	// The root hub has no parent.
+	CHECK(ParentLocationId(0x14000000) == 0x14000000);
+}
+
+TEST(FakeHubIdIsPathPrefix)
+{
+	DeviceId a;
+	a.path = "hub1/port3";
+	DeviceId b;
+	b.path = "hub1/port4";
+	DeviceId c;
+	c.path = "hub2/port1";
+	CHECK(HubIdOf(a) == HubIdOf(b));
+	CHECK(HubIdOf(a) != HubIdOf(c));
+}
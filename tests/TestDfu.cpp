@@ -0,0 +1,101 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include <fstream>
+
+namespace
+{
+std::vector<uint8_t> MakeImage(size_t size)
+{
+	std::vector<uint8_t> image(size);
+	for (size_t i = 0; i < size; ++i)
+		image[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+	return image;
+}
+
+std::shared_ptr<MappedFile> WriteImage(const std::string& path, const std::vector<uint8_t>& image)
+{
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(image.data()), image.size());
+	}
+	return REQUIRE_OK(MappedFile::open(path, MappedFile::Mode::ReadOnly)).unwrap();
+}
+}
+
+TEST(DfuDownloadWritesImage)
+{
+	auto fake = std::make_shared<FakeDfuDevice>(64, 5);
+	auto dev = OpenFake("dfu/download", fake);
+	DfuDevice dfu = REQUIRE_OK(DfuDevice::open(dev)).unwrap();
+	CHECK(dfu.functionalDescriptor().wTransferSize == 64);
+
+	// Not a whole number of blocks.
+	std::vector<uint8_t> image = MakeImage(1000);
+	auto file = WriteImage("dfu-download-test.bin", image);
+
+	std::vector<uint64_t> reported;
+	DfuProgress progress = REQUIRE_OK(dfu.download(*file, [&](const DfuProgress& p) {
+		reported.push_back(p.bytesDone);
+		return true;
+	})).unwrap();
+
+	CHECK(fake->firmware() == image);
+	CHECK(fake->blocksWritten() == 16);
+	CHECK(fake->earlyPolls() == 0);
+	CHECK(progress.bytesDone == 1000);
+	REQUIRE(reported.size() == 16);
+	CHECK(reported.back() == 1000);
+
+	file.reset();
+	MappedFile::remove("dfu-download-test.bin");
+}
+
+TEST(DfuUploadReportsLastBlock)
+{
+	auto fake = std::make_shared<FakeDfuDevice>(64, 5);
+	fake->setFirmware(MakeImage(1000));
+	auto dev = OpenFake("dfu/upload", fake);
+	DfuDevice dfu = REQUIRE_OK(DfuDevice::open(dev)).unwrap();
+
+	std::vector<uint8_t> uploaded;
+	auto sink = [&](const uint8_t* data, size_t size) -> SResult<void> {
+		uploaded.insert(uploaded.end(), data, data + size);
+		return Ok();
+	};
+
+	DfuProgress last;
+	int calls = 0;
+	DfuProgress progress = REQUIRE_OK(dfu.upload(sink, UINT64_MAX, [&](const DfuProgress& p) {
+		last = p;
+		++calls;
+		return true;
+	})).unwrap();
+
+	CHECK(uploaded == fake->firmware());
+	CHECK(progress.bytesTotal == 1000);
+	CHECK(calls == 16);
+	CHECK(last.bytesDone == 1000);
+	CHECK(last.bytesTotal == 1000);
+}
+
+TEST(DfuUploadStopsAtMaxSize)
+{
+	auto fake = std::make_shared<FakeDfuDevice>(64, 5);
+	fake->setFirmware(MakeImage(1000));
+	auto dev = OpenFake("dfu/upload-max", fake);
+	DfuDevice dfu = REQUIRE_OK(DfuDevice::open(dev)).unwrap();
+
+	std::vector<uint8_t> uploaded;
+	auto sink = [&](const uint8_t* data, size_t size) -> SResult<void> {
+		uploaded.insert(uploaded.end(), data, data + size);
+		return Ok();
+	};
+
+	DfuProgress progress = REQUIRE_OK(dfu.upload(sink, 100)).unwrap();
+	CHECK(progress.bytesDone == 100);
+	CHECK(uploaded == MakeImage(100));
+
+	// It was left back in dfuIDLE.
+	CHECK(REQUIRE_OK(dfu.getState()).unwrap() == DfuState::DfuIdle);
+}
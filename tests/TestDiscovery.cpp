@@ -0,0 +1,43 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include "usb/Discovery.h"
+
+TEST(ReadDescriptorsWithoutOpening)
+{
+	AddFakeUsbDevice("discovery/unopened", std::make_shared<FakeVendorDevice>());
+	DeviceId id;
+	id.path = "discovery/unopened";
+
+	DeviceDescriptor desc = REQUIRE_OK(ReadUsbDeviceDescriptors(id)).unwrap();
+	CHECK(desc.idVendor == 0x1234);
+	CHECK(desc.stringsRead);
+	CHECK(desc.sManufacturer == u"UsbTool");
+	CHECK(desc.sSerialNumber == u"0001");
+	REQUIRE(desc.configurations.size() == 1);
+	CHECK(desc.configurations[0].interfaces.size() == 1);
+}
+
+TEST(ReadDescriptorsOfBusyDevice)
+{
+	// Someone else has the device open and its control pipe is stuck.
+	DeviceId id;
+	id.path = "discovery/busy";
+	auto dev = OpenFake(id.path, std::make_shared<FakeVendorDevice>());
+	auto hung = REQUIRE_OK(dev->controlTransferIn(Device::Recipient::Device, Device::Type::Vendor,
+	                                              FakeVendorDevice::HANG, 0, 0, 8, 0)).unwrap();
+
+	auto start = HighResClock::now();
+	DeviceDescriptor desc = REQUIRE_OK(ReadUsbDeviceDescriptors(id)).unwrap();
+	CHECK(MsSince(start) < 100);
+	CHECK(desc.sProduct == u"Fake vendor device");
+
+	REQUIRE_OK(hung.cancel());
+}
+
+TEST(ReadDescriptorsOfMissingDevice)
+{
+	DeviceId id;
+	id.path = "discovery/missing";
+	CHECK(!ReadUsbDeviceDescriptors(id));
+}
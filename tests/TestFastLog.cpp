@@ -0,0 +1,173 @@
+#include "Test.h"
+
+#include "util/FastLog.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+// Collects what the logging thread outputs.
+struct CapturedLog
+{
+	std::mutex mutex;
+	std::vector<std::pair<LogLevel, std::string>> messages;
+
+	LogSink sink()
+	{
+		return [this](LogLevel level, const std::string& message) {
+			std::unique_lock<std::mutex> lock(mutex);
+			messages.emplace_back(level, message);
+		};
+	}
+
+	// The messages starting with `prefix`, in order. Other tests' leftovers are ignored.
+	std::vector<std::pair<LogLevel, std::string>> find(const std::string& prefix)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		std::vector<std::pair<LogLevel, std::string>> found;
+		for (const auto& m : messages)
+			if (m.second.compare(0, prefix.size(), prefix) == 0)
+				found.push_back(m);
+		return found;
+	}
+};
+
+// Each thread has its own ring, so a new one starts empty.
+void OnNewThread(std::function<void()> f)
+{
+	std::thread t(f);
+	t.join();
+}
+}
+
+TEST(NewThreadCanLogWhileSinkIsBlocked)
+{
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool inSink = false;
+	bool release = false;
+
+	StartFastLog([&](LogLevel, const std::string&) {
+		std::unique_lock<std::mutex> lock(mutex);
+		inSink = true;
+		changed.notify_all();
+		changed.wait(lock, [&] { return release; });
+	});
+
+	FLOG_ERROR("Hold up the sink");
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		CHECK(changed.wait_for(lock, std::chrono::seconds(5), [&] { return inSink; }));
+	}
+
+	// Logging for the first time registers the thread's ring, which mustn't wait for the sink.
+	std::atomic_bool logged{false};
+	std::thread other([&] {
+		FLOG_ERROR("From another thread");
+		logged = true;
+	});
+	for (int i = 0; i < 200 && !logged; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	CHECK(logged);
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		release = true;
+		changed.notify_all();
+	}
+	other.join();
+	StopFastLog();
+}
+
+TEST(FastLogFormatsArguments)
+{
+	CapturedLog log;
+	StartFastLog(log.sink());
+
+	OnNewThread([] {
+		int64_t big = -1234567890123LL;
+		std::string str = "abc";
+		const char* nothing = nullptr;
+		FLOG_ERROR("format: {} {} {} {} {} {} {} {} {}", -5, big, 42u, 1.5, true, str, "def", nothing, static_cast<void*>(nullptr));
+		// Placeholders without arguments are left as they are, and extra arguments ignored.
+		FLOG_ERROR("format: missing {} {}", 1);
+		FLOG_ERROR("format: extra {}", 1, 2);
+		// Strings are cut off at 255 bytes.
+		FLOG_ERROR("format: long {}", std::string(300, 'x'));
+	});
+	FlushFastLog();
+
+	auto found = log.find("format: ");
+	REQUIRE(found.size() == 4);
+	CHECK(found[0].second == "format: -5 -1234567890123 42 1.5 true abc def (null) 0x0");
+	CHECK(found[1].second == "format: missing 1 {}");
+	CHECK(found[2].second == "format: extra 1");
+	CHECK(found[3].second == "format: long " + std::string(255, 'x'));
+	StopFastLog();
+}
+
+TEST(FastLogFiltersLevels)
+{
+	CapturedLog log;
+	StartFastLog(log.sink());
+
+	int evaluated = 0;
+	OnNewThread([&] {
+		// Trace is below the minimum level, so it isn't even evaluated.
+		FLOG_TRACE("levels: trace {}", ++evaluated);
+		FLOG_DEBUG("levels: debug");
+		FLOG_INFO("levels: info");
+		FLOG_WARNING("levels: warning");
+		FLOG_ERROR("levels: error");
+	});
+	FlushFastLog();
+
+	CHECK(evaluated == 0);
+	auto found = log.find("levels: ");
+	std::vector<std::pair<LogLevel, std::string>> expected;
+#if FASTLOG_MIN_LEVEL <= 1
+	expected.emplace_back(LogLevel::Debug, "levels: debug");
+#endif
+	expected.emplace_back(LogLevel::Info, "levels: info");
+	expected.emplace_back(LogLevel::Warning, "levels: warning");
+	expected.emplace_back(LogLevel::Error, "levels: error");
+	CHECK(found == expected);
+	StopFastLog();
+}
+
+TEST(FastLogCountsDroppedMessages)
+{
+	// With the logging thread stopped nothing empties the ring, so it fills up.
+	StopFastLog();
+
+	const int MESSAGES = 2000;
+	uint64_t droppedBefore = FastLogDropped();
+	OnNewThread([] {
+		std::string padding(200, '.');
+		for (int i = 0; i < MESSAGES; ++i)
+			FLOG_ERROR("dropped: {} {}", i, padding);
+	});
+	uint64_t dropped = FastLogDropped() - droppedBefore;
+	// Each record is over 200 bytes, so a 64 kB ring can't hold more than about 300.
+	CHECK(dropped >= MESSAGES - 330);
+	CHECK(dropped < MESSAGES);
+
+	// What fitted comes out once the thread starts: the first messages, in order.
+	CapturedLog log;
+	StartFastLog(log.sink());
+	FlushFastLog();
+	auto found = log.find("dropped: ");
+	CHECK(found.size() + dropped == MESSAGES);
+	bool inOrder = true;
+	for (size_t i = 0; i < found.size(); ++i)
+		inOrder = inOrder && found[i].second.compare(0, 10 + std::to_string(i).size(), "dropped: " + std::to_string(i) + " ") == 0;
+	CHECK(inOrder);
+	StopFastLog();
+}
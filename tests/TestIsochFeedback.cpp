@@ -0,0 +1,137 @@
+#include "Test.h"
+
+#include "usb/IsochFeedback.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+// IsochRateController against a simulated Full Speed audio device whose clock drifts away
+// from the host's. The device plays 48 kHz from a buffer that our OUT packets fill, so if the
+// controller gets the rate wrong the buffer runs away from where it started.
+
+namespace
+{
+const double NOMINAL = 48.0;
+const int BYTES_PER_UNIT = 4;
+// Packets are sized a whole transfer at a time, this far ahead of being played.
+const int PACKETS_PER_TRANSFER = 64;
+const int OUT_LEAD = 3 * PACKETS_PER_TRANSFER;
+
+struct SimulatedDevice
+{
+	// Parts per million its clock is fast by, at frame `t` of `frames`. It starts 100 ppm
+	// fast and drifts to 600 ppm, as a crystal warming up might, settling by about a quarter
+	// of the way through.
+	double ppm(int t, int frames) const { return 600.0 - 500.0 * std::exp(-8.0 * t / frames); }
+
+	// Units played (and, for implicit feedback, recorded) in each frame.
+	int units(double rate)
+	{
+		phase += rate;
+		int n = static_cast<int>(std::floor(phase));
+		phase -= n;
+		return n;
+	}
+
+	double phase = 0.0;
+};
+
+struct BufferRange
+{
+	double low = 0.0;
+	double high = 0.0;
+};
+
+// Run for `frames` frames, and return how far the device's buffer strayed from where it
+// started over the second half, once the controller has had time to settle.
+template<typename Feedback>
+BufferRange Simulate(IsochRateController& rate, int frames, Feedback feedback)
+{
+	SimulatedDevice dev;
+	std::map<int, int> queued;
+	double buffer = 0.0;
+	BufferRange range;
+	bool first = true;
+
+	for (int t = 0; t < frames; ++t)
+	{
+		if (t % PACKETS_PER_TRANSFER == 0)
+		{
+			for (int p = 0; p < PACKETS_PER_TRANSFER; ++p)
+				queued[t + OUT_LEAD + p] = rate.nextPacketBytes() / BYTES_PER_UNIT;
+		}
+
+		double deviceRate = NOMINAL * (1.0 + dev.ppm(t, frames) * 1e-6);
+		int played = dev.units(deviceRate);
+		feedback(t, deviceRate, played);
+
+		// Nothing is played until our first packet arrives.
+		if (t < OUT_LEAD)
+			continue;
+		buffer += queued[t] - played;
+		queued.erase(t);
+
+		if (t < frames / 2)
+			continue;
+		if (first)
+			range.low = range.high = buffer;
+		first = false;
+		range.low = std::min(range.low, buffer);
+		range.high = std::max(range.high, buffer);
+	}
+	return range;
+}
+}
+
+TEST(ImplicitFeedbackKeepsDriftingBufferCentred)
+{
+	IsochRateController rate(NOMINAL, BYTES_PER_UNIT, 64 * BYTES_PER_UNIT, false, 8);
+
+	// The IN stream records as much as is played, and we see each transfer's worth once it
+	// has finished.
+	std::vector<IsochFrameResult> in;
+	BufferRange range = Simulate(rate, 300000, [&](int, double, int played) {
+		IsochFrameResult r;
+		r.ok = true;
+		r.length = played * BYTES_PER_UNIT;
+		in.push_back(r);
+		if (in.size() == PACKETS_PER_TRANSFER)
+		{
+			rate.implicitFeedback(in.data(), static_cast<int>(in.size()), BYTES_PER_UNIT);
+			in.clear();
+		}
+	});
+
+	// The buffer is a few units below where it started because it played at 100 ppm fast
+	// before the first feedback, which centering measures from. Without centering the lag
+	// while the clock drifted leaves it 6 units further out.
+	CHECK(std::fabs(rate.stats().bufferError) <= 2.0);
+	CHECK(range.low > -10.0 && range.high < 0.0);
+	CHECK(range.high - range.low <= 4.0);
+	CHECK(rate.stats().rejectedValues == 0);
+}
+
+TEST(ExplicitFeedbackFollowsDriftingClock)
+{
+	IsochRateController rate(NOMINAL, BYTES_PER_UNIT, 64 * BYTES_PER_UNIT, false, 8);
+
+	// The device reports its rate every 16 frames in 10.14, which can't represent it
+	// exactly, so like a real one counting clocks it is out one way or the other and
+	// averages to the true rate.
+	double residual = 0.0;
+	BufferRange range = Simulate(rate, 300000, [&](int t, double deviceRate, int) {
+		if (t % 16 != 0)
+			return;
+		double exact = deviceRate * 16384.0 + residual;
+		uint32_t v = static_cast<uint32_t>(std::lround(exact));
+		residual = exact - v;
+		uint8_t raw[3] = {static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v >> 16)};
+		REQUIRE_OK(rate.explicitFeedback(raw, 3));
+	});
+
+	// Explicit feedback has no centering, so the buffer keeps whatever offset it picked up
+	// while the clock was drifting, but it mustn't keep moving once the clock settles.
+	CHECK(range.high - range.low <= 4.0);
+	CHECK(std::fabs(rate.stats().unitsPerPacket - NOMINAL * 1.0006) < 0.001);
+}
@@ -0,0 +1,205 @@
+#include "Test.h"
+
+#include "usb/IsochJitterBuffer.h"
+
+#include <cmath>
+#include <vector>
+#include <string.h>
+
+// IsochJitterBuffer on its own, with the producer and the stream simulated a frame at a time
+// so the results are exact.
+
+namespace
+{
+const int BYTES_PER_FRAME = 4;
+// pop()s per update(), as for a transfer of 64 frames.
+const int FRAMES_PER_UPDATE = 64;
+
+std::vector<uint8_t> Frame(uint32_t n)
+{
+	std::vector<uint8_t> f(BYTES_PER_FRAME);
+	memcpy(f.data(), &n, BYTES_PER_FRAME);
+	return f;
+}
+
+uint32_t FrameNumber(const uint8_t* data)
+{
+	uint32_t n = 0;
+	memcpy(&n, data, BYTES_PER_FRAME);
+	return n;
+}
+
+bool IsSilent(const uint8_t* data)
+{
+	return FrameNumber(data) == 0;
+}
+
+struct DriftResult
+{
+	// Frames that came out in the wrong order, or weren't the next or the same as the last.
+	int misordered = 0;
+	// Frames the stream skipped or sent twice, going by their numbers.
+	uint64_t skipped = 0;
+	uint64_t repeated = 0;
+	IsochJitterStats stats;
+};
+
+// Run for `frames` bus frames with a producer that is `ppm` faster than the bus. Frames are
+// numbered from 1 so silence can be told apart.
+DriftResult SimulateDrift(IsochJitterBuffer& buffer, double ppm, int frames)
+{
+	DriftResult result;
+	double phase = 0.0;
+	uint32_t produced = 0;
+	uint32_t last = 0;
+	uint8_t out[BYTES_PER_FRAME];
+
+	for (int t = 0; t < frames; ++t)
+	{
+		phase += 1.0 + ppm * 1e-6;
+		for (; phase >= 1.0; phase -= 1.0)
+			buffer.push(Frame(++produced).data());
+
+		if (buffer.pop(out))
+		{
+			uint32_t n = FrameNumber(out);
+			if (last != 0)
+			{
+				if (n == last)
+					++result.repeated;
+				else if (n > last)
+					result.skipped += n - last - 1;
+				else
+					++result.misordered;
+			}
+			last = n;
+		}
+
+		if ((t + 1) % FRAMES_PER_UPDATE == 0)
+			buffer.update();
+	}
+	result.stats = buffer.stats();
+	return result;
+}
+}
+
+TEST(JitterBufferWaitsForTarget)
+{
+	IsochJitterConfig config;
+	config.capacityFrames = 16;
+	config.targetFrames = 4;
+	IsochJitterBuffer buffer(BYTES_PER_FRAME, config);
+
+	uint8_t out[BYTES_PER_FRAME];
+	CHECK(!buffer.pop(out));
+	CHECK(IsSilent(out));
+
+	for (uint32_t n = 1; n <= 3; ++n)
+		REQUIRE(buffer.push(Frame(n).data()));
+	CHECK(!buffer.pop(out));
+	CHECK(IsSilent(out));
+
+	// Once it reaches the target it plays from the first frame.
+	REQUIRE(buffer.push(Frame(4).data()));
+	REQUIRE(buffer.pop(out));
+	CHECK(FrameNumber(out) == 1);
+
+	IsochJitterStats stats = buffer.stats();
+	CHECK(stats.silentFrames == 2);
+	// Not having started isn't running dry.
+	CHECK(stats.underflows == 0);
+	CHECK(stats.targetFrames == 4);
+}
+
+TEST(JitterBufferCountsOverflowsAndUnderflows)
+{
+	IsochJitterConfig config;
+	config.capacityFrames = 8;
+	config.targetFrames = 2;
+	IsochJitterBuffer buffer(BYTES_PER_FRAME, config);
+
+	for (uint32_t n = 1; n <= 8; ++n)
+		REQUIRE(buffer.push(Frame(n).data()));
+	CHECK(!buffer.push(Frame(9).data()));
+	CHECK(!buffer.push(Frame(10).data()));
+	CHECK(buffer.stats().overflows == 2);
+
+	uint8_t out[BYTES_PER_FRAME];
+	for (uint32_t n = 1; n <= 8; ++n)
+	{
+		REQUIRE(buffer.pop(out));
+		CHECK(FrameNumber(out) == n);
+	}
+
+	// It runs dry once, and then stays silent until it is back at the target.
+	CHECK(!buffer.pop(out));
+	CHECK(IsSilent(out));
+	CHECK(!buffer.pop(out));
+	REQUIRE(buffer.push(Frame(11).data()));
+	CHECK(!buffer.pop(out));
+	REQUIRE(buffer.push(Frame(12).data()));
+	REQUIRE(buffer.pop(out));
+	CHECK(FrameNumber(out) == 11);
+
+	IsochJitterStats stats = buffer.stats();
+	CHECK(stats.underflows == 1);
+	CHECK(stats.silentFrames == 3);
+	CHECK(stats.overflows == 2);
+}
+
+TEST(JitterBufferDropsFramesForFastProducer)
+{
+	IsochJitterConfig config;
+	IsochJitterBuffer buffer(BYTES_PER_FRAME, config);
+
+	// 2000 ppm over 200000 frames is 400 extra frames, far more than the hysteresis allows.
+	DriftResult r = SimulateDrift(buffer, 2000.0, 200000);
+
+	CHECK(r.misordered == 0);
+	CHECK(r.stats.overflows == 0);
+	CHECK(r.stats.underflows == 0);
+	CHECK(r.stats.repeatedFrames == 0);
+	CHECK(r.repeated == 0);
+	// Every drop shows up as a gap in the frame numbers, and nothing else does.
+	CHECK(r.skipped == r.stats.droppedFrames);
+	// Whatever wasn't dropped is still in the buffer, which stays near the target.
+	CHECK(std::fabs(400.0 - r.stats.droppedFrames - (r.stats.fillFrames - config.targetFrames)) <= 2.0);
+	CHECK(std::fabs(r.stats.averageFill - config.targetFrames) <= config.hysteresisFrames + 1);
+	CHECK(std::fabs(r.stats.driftPpm - 2000.0) < 100.0);
+}
+
+TEST(JitterBufferRepeatsFramesForSlowProducer)
+{
+	IsochJitterConfig config;
+	IsochJitterBuffer buffer(BYTES_PER_FRAME, config);
+
+	DriftResult r = SimulateDrift(buffer, -2000.0, 200000);
+
+	CHECK(r.misordered == 0);
+	CHECK(r.stats.overflows == 0);
+	CHECK(r.stats.underflows == 0);
+	CHECK(r.stats.droppedFrames == 0);
+	CHECK(r.skipped == 0);
+	CHECK(r.repeated == r.stats.repeatedFrames);
+	CHECK(std::fabs(400.0 - r.stats.repeatedFrames - (config.targetFrames - r.stats.fillFrames)) <= 2.0);
+	CHECK(std::fabs(r.stats.averageFill - config.targetFrames) <= config.hysteresisFrames + 1);
+	CHECK(std::fabs(r.stats.driftPpm + 2000.0) < 100.0);
+}
+
+TEST(JitterBufferOnlyMeasuresDriftWithoutCompensation)
+{
+	IsochJitterConfig config;
+	config.capacityFrames = 1024;
+	config.compensate = false;
+	IsochJitterBuffer buffer(BYTES_PER_FRAME, config);
+
+	// 1000 ppm over 100000 frames lets the fill level rise by 100.
+	DriftResult r = SimulateDrift(buffer, 1000.0, 100000);
+
+	CHECK(r.stats.droppedFrames == 0);
+	CHECK(r.stats.repeatedFrames == 0);
+	CHECK(r.skipped == 0);
+	CHECK(r.repeated == 0);
+	CHECK(std::fabs(r.stats.fillFrames - (config.targetFrames + 100)) <= 2);
+	CHECK(std::fabs(r.stats.driftPpm - 1000.0) < 50.0);
+}
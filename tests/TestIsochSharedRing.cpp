@@ -0,0 +1,177 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include "usb/IsochronousStream.h"
+#include "usb/IsochSharedRing.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+
+// Both ends of an IsochSharedRing in one process, which shares memory the same way two
+// processes would.
+
+namespace
+{
+const int BYTES_PER_FRAME = 8;
+const int SLOTS = 64;
+
+// A High Speed device with an isochronous OUT endpoint 0x01 of 8 bytes every microframe,
+// which keeps every packet that isn't silence.
+class FakeSharedRingDevice : public FakeUsbDevice
+{
+public:
+	std::vector<uint8_t> deviceDescriptor() override
+	{
+		return MakeFakeDeviceDescriptor(0x1234, 0x0008, 0x0100, 1, 2, 3);
+	}
+
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override
+	{
+		return {{
+			// Configuration.
+			9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 25, 0, 1, 1, 0, 0x80, 50,
+			// Interface 0, vendor-specific.
+			9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, 0xFF, 0, 0, 0,
+			// Isochronous OUT, 8 bytes, every microframe.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x01, 0x01, BYTES_PER_FRAME, 0, 1,
+		}};
+	}
+
+	std::string serial() override { return "0008"; }
+
+	void isochOut(uint8_t, uint64_t usbMicroframe, const uint8_t* data, int length) override
+	{
+		if (std::all_of(data, data + length, [](uint8_t b) { return b == 0; }))
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		packets[usbMicroframe] = std::vector<uint8_t>(data, data + length);
+	}
+
+	std::mutex mutex;
+	std::map<uint64_t, std::vector<uint8_t>> packets;
+};
+
+// What the producer writes for a microframe: its number, scrambled so no byte is constant.
+std::vector<uint8_t> ProducedFrame(uint64_t usbMicroframe)
+{
+	uint64_t value = usbMicroframe * 0x9E3779B97F4A7C15ull | 1;
+	std::vector<uint8_t> frame(BYTES_PER_FRAME);
+	memcpy(frame.data(), &value, BYTES_PER_FRAME);
+	return frame;
+}
+}
+
+TEST(SharedRingNameCantBeTakenWhileInUse)
+{
+	auto ring = REQUIRE_OK(IsochSharedRing::create("UsbToolTests-in-use", BYTES_PER_FRAME, SLOTS)).unwrap();
+	CHECK(!IsochSharedRing::create("UsbToolTests-in-use", BYTES_PER_FRAME, SLOTS));
+
+	// Still usable afterwards.
+	auto writer = REQUIRE_OK(IsochSharedRingWriter::open("UsbToolTests-in-use")).unwrap();
+	CHECK(writer->writableFrames() == SLOTS);
+
+	// Free again once the ring has gone.
+	writer.reset();
+	ring.reset();
+	REQUIRE_OK(IsochSharedRing::create("UsbToolTests-in-use", BYTES_PER_FRAME, SLOTS));
+}
+
+TEST(SharedRingWriterIsWokenWhenThereIsRoom)
+{
+	auto ring = REQUIRE_OK(IsochSharedRing::create("UsbToolTests-wake", BYTES_PER_FRAME, SLOTS)).unwrap();
+	auto writer = REQUIRE_OK(IsochSharedRingWriter::open("UsbToolTests-wake")).unwrap();
+
+	for (int i = 0; i < SLOTS; ++i)
+	{
+		uint8_t* frame = writer->frame();
+		REQUIRE(frame != nullptr);
+		memset(frame, i, BYTES_PER_FRAME);
+		writer->commit(i);
+	}
+	CHECK(writer->frame() == nullptr);
+	CHECK(!writer->waitForSpace(20));
+
+	auto start = HighResClock::now();
+	std::thread reader([&] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		uint64_t microframe = 0;
+		const uint8_t* frame = ring->front(microframe);
+		if (frame != nullptr && microframe == 0 && frame[0] == 0)
+			ring->pop();
+		ring->wakeWriter();
+	});
+
+	// Woken well before the timeout.
+	CHECK(writer->waitForSpace(5000));
+	double ms = MsSince(start);
+	CHECK(ms >= 40 && ms < 1000);
+	CHECK(writer->writableFrames() == 1);
+	reader.join();
+}
+
+TEST(SharedRingFeedsStreamExactly)
+{
+	const int RING_SLOTS = 256;
+	// 200 ms of microframes.
+	const int FRAMES = 1600;
+
+	auto fake = std::make_shared<FakeSharedRingDevice>();
+	auto dev = OpenFake("shared-ring/stream", fake);
+	auto ring = REQUIRE_OK(IsochSharedRing::create("UsbToolTests-stream", BYTES_PER_FRAME, RING_SLOTS)).unwrap();
+	auto writer = REQUIRE_OK(IsochSharedRingWriter::open("UsbToolTests-stream")).unwrap();
+
+	std::map<uint64_t, std::vector<uint8_t>> produced;
+	IsochFrameClock clock;
+	{
+		IsochronousStream stream(*dev, 0, 0x01, BYTES_PER_FRAME, ring);
+
+		// The producer's side, as another process would do it: wait for the clock, then keep
+		// the ring full from a little after the first writable microframe.
+		auto start = HighResClock::now();
+		while (!writer->clock().valid && MsSince(start) < 3000)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		REQUIRE(writer->clock().valid);
+
+		uint64_t first = writer->clock().firstWritableMicroframe + 8 * 4;
+		for (uint64_t m = first; m < first + FRAMES; ++m)
+		{
+			REQUIRE(writer->waitForSpace(1000));
+			std::vector<uint8_t> frame = ProducedFrame(m);
+			memcpy(writer->frame(), frame.data(), BYTES_PER_FRAME);
+			writer->commit(m);
+			produced[m] = frame;
+		}
+
+		// Wait for the stream to take the rest, then for the last packets to go out.
+		start = HighResClock::now();
+		while (writer->writableFrames() < RING_SLOTS && MsSince(start) < 3000)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		CHECK(writer->writableFrames() == RING_SLOTS);
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		clock = writer->clock();
+	}
+
+	std::map<uint64_t, std::vector<uint8_t>> received;
+	{
+		std::unique_lock<std::mutex> lock(fake->mutex);
+		received = fake->packets;
+	}
+
+	// Everything the device got is what the producer wrote for that microframe.
+	int mismatched = 0;
+	for (const auto& p : received)
+	{
+		auto it = produced.find(p.first);
+		if (it == produced.end() || it->second != p.second)
+			++mismatched;
+	}
+	CHECK(mismatched == 0);
+	// And everything the producer wrote arrived, bar frames the stream said were too late.
+	CHECK(received.size() + clock.lateFrames == produced.size());
+	// The producer kept well ahead, so there should hardly be any.
+	CHECK(clock.lateFrames * 10 < produced.size());
+}
@@ -0,0 +1,179 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include "usb/IsochStreamGroup.h"
+
+#include <cmath>
+#include <thread>
+
+// IsochStreamGroup over Full Speed fake devices, checking what it reports about each member.
+
+namespace
+{
+// A Full Speed device with an isochronous OUT endpoint 0x01 that takes 64 byte packets every
+// frame, and throws them away.
+class FakeIsochOutDevice : public FakeUsbDevice
+{
+public:
+	std::vector<uint8_t> deviceDescriptor() override
+	{
+		return MakeFakeDeviceDescriptor(0x1234, 0x0004, 0x0100, 1, 2, 3);
+	}
+
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override
+	{
+		return {{
+			// Configuration.
+			9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 25, 0, 1, 1, 0, 0x80, 50,
+			// Interface 0, vendor-specific.
+			9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, 0xFF, 0, 0, 0,
+			// Isochronous OUT, 64 bytes, every frame.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x01, 0x01, 64, 0, 1,
+		}};
+	}
+
+	Device::Speed speed() override { return Device::Speed::Full; }
+	std::string serial() override { return "0004"; }
+};
+
+// A High Speed device with an isochronous OUT endpoint 0x01 that takes 64 byte packets every
+// 1 ms. Its bus clock is `offsetUs` ahead of one that started at `epoch`, so devices made
+// with the same epoch have their frames that far apart.
+class FakeOffsetClockDevice : public FakeUsbDevice
+{
+public:
+	FakeOffsetClockDevice(HighResClock::time_point epoch, int offsetUs) : mEpoch(epoch), mOffsetUs(offsetUs) {}
+
+	std::vector<uint8_t> deviceDescriptor() override
+	{
+		return MakeFakeDeviceDescriptor(0x1234, 0x0009, 0x0100, 1, 2, 3);
+	}
+
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override
+	{
+		return {{
+			// Configuration.
+			9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 25, 0, 1, 1, 0, 0x80, 50,
+			// Interface 0, vendor-specific.
+			9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, 0xFF, 0, 0, 0,
+			// Isochronous OUT, 64 bytes, every 8 microframes.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x01, 0x01, 64, 0, 4,
+		}};
+	}
+
+	std::string serial() override { return "0009"; }
+
+	uint64_t busMicroframe() override
+	{
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(HighResClock::now() - mEpoch);
+		return static_cast<uint64_t>((elapsed.count() + mOffsetUs * 1000LL) / 125000);
+	}
+
+private:
+	HighResClock::time_point mEpoch;
+	int mOffsetUs;
+};
+
+const int BYTES_PER_FRAME = 64;
+
+// Wait for the group to report on every member, and return the latest report.
+IsochGroupSkew WaitForStates(IsochStreamGroup& group, size_t members, int timeoutMs)
+{
+	auto start = HighResClock::now();
+	IsochGroupSkew skew = group.skew();
+	while (MsSince(start) < timeoutMs)
+	{
+		skew = group.skew();
+		bool settled = skew.members.size() == members;
+		for (const IsochMemberSync& m : skew.members)
+			settled = settled && m.state != IsochMemberSync::State::Starting;
+		if (settled)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	return skew;
+}
+
+bool Silence(int, HighResClock::time_point, uint8_t*)
+{
+	return false;
+}
+}
+
+TEST(GroupMembersStartTogether)
+{
+	auto a = OpenFake("group/together-a", std::make_shared<FakeIsochOutDevice>());
+	auto b = OpenFake("group/together-b", std::make_shared<FakeIsochOutDevice>());
+
+	IsochStreamGroup group(Silence);
+	group.addDevice(*a, 0, 0x01, BYTES_PER_FRAME);
+	group.addDevice(*b, 0, 0x01, BYTES_PER_FRAME);
+	group.start();
+
+	IsochGroupSkew skew = WaitForStates(group, 2, 3000);
+	REQUIRE(skew.members.size() == 2);
+	CHECK(skew.members[0].state == IsochMemberSync::State::Synchronised);
+	CHECK(skew.members[1].state == IsochMemberSync::State::Synchronised);
+	group.stop();
+}
+
+TEST(GroupReportsStoppedAndDesynchronisedMembers)
+{
+	auto a = OpenFake("group/stopped-a", std::make_shared<FakeIsochOutDevice>());
+	auto b = OpenFake("group/stopped-b", std::make_shared<FakeIsochOutDevice>());
+
+	// The second stream's endpoint doesn't exist, so it stops before it is ready, and the
+	// first gives up waiting for it.
+	IsochStreamGroup group(Silence);
+	group.addDevice(*a, 0, 0x01, BYTES_PER_FRAME);
+	group.addDevice(*b, 0, 0x02, BYTES_PER_FRAME);
+	group.start();
+
+	IsochGroupSkew skew = WaitForStates(group, 2, 5000);
+	REQUIRE(skew.members.size() == 2);
+	CHECK(skew.members[0].state == IsochMemberSync::State::Desynchronised);
+	CHECK(skew.members[1].state == IsochMemberSync::State::Stopped);
+	// Neither is lined up with anything.
+	CHECK(skew.skewUs == 0.0);
+	group.stop();
+}
+
+TEST(GroupMeasuresAndAlignsOffsetBusClocks)
+{
+	// High Speed counters tell the time to within a microframe, so the clocks' fits are that
+	// good, and the skew (the difference of two) a bit less.
+	const double TOLERANCE_US = 150.0;
+
+	for (int offsetUs : {0, 250, 500})
+	{
+		auto epoch = HighResClock::now();
+		std::string name = "group/offset-" + std::to_string(offsetUs);
+		auto a = OpenFake(name + "-a", std::make_shared<FakeOffsetClockDevice>(epoch, 0));
+		auto b = OpenFake(name + "-b", std::make_shared<FakeOffsetClockDevice>(epoch, offsetUs));
+
+		IsochStreamGroup group(Silence);
+		group.addDevice(*a, 0, 0x01, BYTES_PER_FRAME);
+		group.addDevice(*b, 0, 0x01, BYTES_PER_FRAME);
+		group.start();
+
+		IsochGroupSkew skew = WaitForStates(group, 2, 3000);
+		REQUIRE(skew.members.size() == 2);
+		REQUIRE(skew.members[0].state == IsochMemberSync::State::Synchronised);
+		REQUIRE(skew.members[1].state == IsochMemberSync::State::Synchronised);
+
+		// The first frames are the ones nearest the same instant. B's frame f starts
+		// `offsetUs` before A's, so they are that far apart.
+		double startA = skew.members[0].firstFrame * 1000.0;
+		double startB = skew.members[1].firstFrame * 1000.0 - offsetUs;
+		CHECK(std::fabs(std::fabs(startA - startB) - offsetUs) <= TOLERANCE_US);
+
+		// Let the clocks take a few more samples.
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		skew = group.skew();
+		// The data for an instant goes in the packet whose frame holds it, so each device's
+		// packet starts up to a frame before it, `offsetUs` apart or the rest of a frame.
+		double expected = skew.skewUs < 500.0 ? offsetUs : 1000.0 - offsetUs;
+		CHECK(std::fabs(skew.skewUs - expected) <= TOLERANCE_US);
+		group.stop();
+	}
+}
@@ -0,0 +1,134 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include "usb/IsochronousInStream.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+// IsochronousInStream against a Full Speed fake whose packets vary in length, checking that
+// only the received bytes end up in the ring and that every frame's status is reported.
+
+namespace
+{
+const int BYTES_PER_FRAME = 64;
+
+// A Full Speed device with an isochronous IN endpoint 0x81 of up to 64 bytes every frame.
+// Every third packet is empty, every third is short and the rest are full. Each packet's
+// bytes count up from its sequence number, so misplaced data shows up.
+class FakeIsochInDevice : public FakeUsbDevice
+{
+public:
+	std::vector<uint8_t> deviceDescriptor() override
+	{
+		return MakeFakeDeviceDescriptor(0x1234, 0x0005, 0x0100, 1, 2, 3);
+	}
+
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override
+	{
+		return {{
+			// Configuration.
+			9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 25, 0, 1, 1, 0, 0x80, 50,
+			// Interface 0, vendor-specific.
+			9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, 0xFF, 0, 0, 0,
+			// Isochronous IN, 64 bytes, every frame.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x81, 0x01, 64, 0, 1,
+		}};
+	}
+
+	Device::Speed speed() override { return Device::Speed::Full; }
+	std::string serial() override { return "0005"; }
+
+	int isochIn(uint8_t, uint64_t, uint8_t* data, int maxLength) override
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		int seq = static_cast<int>(lengths.size());
+		int length = std::min(maxLength, seq % 3 == 0 ? 0 : seq % 3 == 1 ? 5 : BYTES_PER_FRAME);
+		for (int i = 0; i < length; ++i)
+		{
+			data[i] = static_cast<uint8_t>(seq + i);
+			sent.push_back(data[i]);
+		}
+		lengths.push_back(length);
+		return length;
+	}
+
+	std::mutex mutex;
+	// Every packet's length, and all their bytes back to back.
+	std::vector<int> lengths;
+	std::vector<uint8_t> sent;
+};
+}
+
+TEST(IsochInCompactsShortAndEmptyPackets)
+{
+	auto fake = std::make_shared<FakeIsochInDevice>();
+	auto dev = OpenFake("isoch-in/compact", fake);
+
+	std::mutex statusMutex;
+	std::vector<IsochFrameResult> statuses;
+	uint64_t expectedIndex = 0;
+	bool indicesInOrder = true;
+	auto frameStatus = [&](uint64_t frameIndex, const IsochFrameResult* frames, int numFrames) {
+		std::unique_lock<std::mutex> lock(statusMutex);
+		indicesInOrder = indicesInOrder && frameIndex == expectedIndex;
+		expectedIndex += numFrames;
+		statuses.insert(statuses.end(), frames, frames + numFrames);
+	};
+
+	auto stream = REQUIRE_OK(IsochronousInStream::start(dev, 0, 0x81, BYTES_PER_FRAME, 64 * 1024, frameStatus)).unwrap();
+
+	auto start = HighResClock::now();
+	while (stream->stats().transfers < 3 && MsSince(start) < 3000)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	REQUIRE(stream->status());
+
+	// The statuses are reported after their data is in the ring, so all of it can be read.
+	std::vector<IsochFrameResult> reported;
+	{
+		std::unique_lock<std::mutex> lock(statusMutex);
+		reported = statuses;
+		CHECK(indicesInOrder);
+	}
+	REQUIRE(reported.size() >= 3 * 64);
+
+	std::vector<int> received;
+	size_t receivedBytes = 0;
+	int empty = 0;
+	for (const IsochFrameResult& r : reported)
+	{
+		// The fake only skips frames that were already late, which the stream avoids by
+		// keeping transfers queued back to back.
+		CHECK(r.ok);
+		if (!r.ok)
+			continue;
+		received.push_back(r.length);
+		receivedBytes += r.length;
+		if (r.length == 0)
+			++empty;
+	}
+
+	std::vector<uint8_t> data(receivedBytes);
+	REQUIRE(stream->read(data.data(), data.size()) == data.size());
+
+	std::vector<int> lengths;
+	std::vector<uint8_t> sent;
+	{
+		std::unique_lock<std::mutex> lock(fake->mutex);
+		lengths = fake->lengths;
+		sent = fake->sent;
+	}
+	// The fake may have sent packets since, so compare what was reported with the start.
+	REQUIRE(lengths.size() >= received.size());
+	CHECK(std::equal(received.begin(), received.end(), lengths.begin()));
+	REQUIRE(sent.size() >= data.size());
+	CHECK(std::equal(data.begin(), data.end(), sent.begin()));
+
+	IsochInStats stats = stream->stats();
+	CHECK(stats.frames >= reported.size());
+	CHECK(stats.emptyFrames >= static_cast<uint64_t>(empty));
+	CHECK(empty > 0);
+	CHECK(stats.failedFrames == 0);
+	CHECK(stats.droppedBytes == 0);
+}
@@ -0,0 +1,323 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+#include "usb/IsochronousInStream.h"
+#include "usb/IsochronousStream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// IsochronousStream against fake devices, checking which bus microframes its packets are
+// sent in, and that a rate controlled stream keeps up with a device whose clocks drift.
+
+namespace
+{
+const int BYTES_PER_FRAME = 8;
+
+// A High Speed device with an isochronous OUT endpoint 0x01 of 8 byte packets, serviced every
+// 2^(bInterval-1) microframes. It remembers the packets that weren't all zero, by microframe.
+class FakeHighSpeedOutDevice : public FakeUsbDevice
+{
+public:
+	explicit FakeHighSpeedOutDevice(uint8_t bInterval) : mInterval(bInterval) {}
+
+	std::vector<uint8_t> deviceDescriptor() override
+	{
+		return MakeFakeDeviceDescriptor(0x1234, 0x0006, 0x0100, 1, 2, 3);
+	}
+
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override
+	{
+		return {{
+			// Configuration.
+			9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 25, 0, 1, 1, 0, 0x80, 50,
+			// Interface 0, vendor-specific.
+			9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, 0xFF, 0, 0, 0,
+			// Isochronous OUT, 8 bytes.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x01, 0x01, BYTES_PER_FRAME, 0, mInterval,
+		}};
+	}
+
+	// Each interval is a different unit, so the descriptor cache doesn't mix them up.
+	std::string serial() override { return "0006-" + std::to_string(mInterval); }
+
+	void isochOut(uint8_t, uint64_t usbMicroframe, const uint8_t* data, int length) override
+	{
+		if (std::all_of(data, data + length, [](uint8_t b) { return b == 0; }))
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		packets[usbMicroframe] = std::vector<uint8_t>(data, data + length);
+	}
+
+	std::mutex mutex;
+	std::map<uint64_t, std::vector<uint8_t>> packets;
+
+private:
+	uint8_t mInterval;
+};
+
+// A Full Speed asynchronous audio device, playing 48 kHz stereo 16 bit from a buffer that
+// isochronous OUT endpoint 0x01 fills, and reporting its rate on explicit feedback endpoint
+// 0x81. Its audio clock starts 100 ppm fast and drifts to 600 ppm, and its bus clock runs
+// 200 ppm slow, so neither matches the host's.
+const int AUDIO_BYTES_PER_UNIT = 4;
+const int AUDIO_MAX_PACKET = 200;
+
+class FakeAsyncAudioDevice : public FakeUsbDevice
+{
+public:
+	std::vector<uint8_t> deviceDescriptor() override
+	{
+		return MakeFakeDeviceDescriptor(0x1234, 0x0007, 0x0100, 1, 2, 3);
+	}
+
+	std::vector<std::vector<uint8_t>> configurationDescriptors() override
+	{
+		return {{
+			// Configuration.
+			9, USB_CONFIGURATION_DESCRIPTOR_TYPE, 32, 0, 1, 1, 0, 0x80, 50,
+			// Interface 0, vendor-specific.
+			9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 2, 0xFF, 0, 0, 0,
+			// Isochronous asynchronous OUT, 200 bytes, every frame.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x01, 0x05, AUDIO_MAX_PACKET, 0, 1,
+			// Isochronous feedback IN, 3 bytes, every frame.
+			7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x81, 0x11, 3, 0, 1,
+		}};
+	}
+
+	Device::Speed speed() override { return Device::Speed::Full; }
+	std::string serial() override { return "0007"; }
+
+	uint64_t busMicroframe() override
+	{
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(HighResClock::now() - mCreated);
+		return static_cast<uint64_t>(elapsed.count() * (1.0 - 200e-6) / 125000);
+	}
+
+	// Sample frames played in bus frame `frame`.
+	static double rate(uint64_t frame)
+	{
+		return 48.0 * (1.0 + 1e-6 * (600.0 - 500.0 * std::exp(-static_cast<double>(frame) / 300.0)));
+	}
+
+	void isochOut(uint8_t, uint64_t usbMicroframe, const uint8_t*, int length) override
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64_t frame = usbMicroframe / 8;
+		// It starts playing with the first packet, and plays every frame after that.
+		if (!started)
+		{
+			started = true;
+			nextFrame = frame;
+		}
+		for (; nextFrame <= frame; ++nextFrame)
+		{
+			phase += rate(nextFrame);
+			double n = std::floor(phase);
+			phase -= n;
+			level -= n;
+		}
+		level += length / AUDIO_BYTES_PER_UNIT;
+		if (frame >= firstChecked)
+		{
+			if (!checking)
+				startLevel = level;
+			checking = true;
+			lowest = std::min(lowest, level);
+			highest = std::max(highest, level);
+		}
+	}
+
+	int isochIn(uint8_t, uint64_t usbMicroframe, uint8_t* data, int maxLength) override
+	{
+		if (maxLength < 3)
+			return 0;
+		uint32_t v = static_cast<uint32_t>(std::lround(rate(usbMicroframe / 8) * 16384.0));
+		data[0] = static_cast<uint8_t>(v);
+		data[1] = static_cast<uint8_t>(v >> 8);
+		data[2] = static_cast<uint8_t>(v >> 16);
+		return 3;
+	}
+
+	std::mutex mutex;
+	bool started = false;
+	uint64_t nextFrame = 0;
+	double phase = 0.0;
+	// Sample frames in the device's buffer, and its range from bus frame firstChecked on.
+	double level = 0.0;
+	uint64_t firstChecked = 0;
+	bool checking = false;
+	double startLevel = 0.0;
+	double lowest = 1e9;
+	double highest = -1e9;
+};
+
+// A packet saying which microframe it was written for. The last byte is never zero, so the
+// fake can tell it from padding.
+std::vector<uint8_t> MicroframePacket(uint64_t usbMicroframe)
+{
+	std::vector<uint8_t> packet(BYTES_PER_FRAME, 0xA5);
+	for (int i = 0; i < 4; ++i)
+		packet[i] = static_cast<uint8_t>(usbMicroframe >> (8 * i));
+	return packet;
+}
+
+uint64_t PacketMicroframe(const std::vector<uint8_t>& packet)
+{
+	uint64_t m = 0;
+	for (int i = 0; i < 4; ++i)
+		m |= static_cast<uint64_t>(packet[i]) << (8 * i);
+	return m;
+}
+
+// Write a packet for the last microframe of every service interval, for 100 ms, and check
+// that each is sent at the start of the interval it was written in and nowhere else.
+void CheckMicroframeAddressing(uint8_t bInterval)
+{
+	uint64_t interval = uint64_t(1) << (bInterval - 1);
+
+	auto fake = std::make_shared<FakeHighSpeedOutDevice>(bInterval);
+	auto dev = OpenFake("stream/interval-" + std::to_string(bInterval), fake);
+
+	int written = 0;
+	{
+		IsochronousStream stream(*dev, 0, 0x01, BYTES_PER_FRAME);
+
+		auto start = HighResClock::now();
+		while (MsSince(start) < 100)
+		{
+			// Far enough ahead that the transfer holding it hasn't been sent yet.
+			uint64_t now = stream.CurrentMicroframeNumber();
+			for (uint64_t m = now + 8 * 2; m < now + 8 * 40; ++m)
+			{
+				if (m % interval != interval - 1)
+					continue;
+				if (stream.WriteFrame(m, MicroframePacket(m).data()))
+					++written;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		// Let the last packets go out.
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+	}
+	REQUIRE(written > 0);
+
+	std::map<uint64_t, std::vector<uint8_t>> packets;
+	{
+		std::unique_lock<std::mutex> lock(fake->mutex);
+		packets = fake->packets;
+	}
+	REQUIRE(packets.size() > 50);
+
+	int misplaced = 0;
+	for (const auto& p : packets)
+	{
+		if (p.first % interval != 0 || PacketMicroframe(p.second) != p.first + interval - 1)
+			++misplaced;
+	}
+	CHECK(misplaced == 0);
+
+	// Every interval in between has its packet. A transfer that the submit thread was too
+	// late with leaves a gap, which a busy test machine can cause now and then.
+	uint64_t first = packets.begin()->first;
+	uint64_t last = packets.rbegin()->first;
+	CHECK(packets.size() * 10 >= ((last - first) / interval + 1) * 9);
+}
+}
+
+TEST(StreamWritesEveryMicroframeAtInterval1)
+{
+	CheckMicroframeAddressing(1);
+}
+
+TEST(StreamWritesEveryOtherMicroframeAtInterval2)
+{
+	CheckMicroframeAddressing(2);
+}
+
+TEST(StreamWritesEveryFourthMicroframeAtInterval3)
+{
+	CheckMicroframeAddressing(3);
+}
+
+TEST(RateControlledStreamFollowsDriftingDevice)
+{
+	auto fake = std::make_shared<FakeAsyncAudioDevice>();
+	auto dev = OpenFake("stream/async-audio", fake);
+
+	// Check the device's buffer once the controller has had the first half second to settle.
+	{
+		std::unique_lock<std::mutex> lock(fake->mutex);
+		fake->firstChecked = dev->getBusFrameNumber() + 500;
+	}
+
+	auto rate = std::make_shared<IsochRateController>(48.0, AUDIO_BYTES_PER_UNIT, AUDIO_MAX_PACKET, false, 8);
+	auto feedback = REQUIRE_OK(IsochronousInStream::start(dev, 0, 0x81, 3, 4096)).unwrap();
+	uint64_t underflowAfterStart = 0;
+	{
+		IsochronousStream stream(*dev, 0, 0x01, AUDIO_MAX_PACKET, rate, 64 * 1024);
+
+		// Keep plenty queued, as a player would, so any underflow is the stream's fault.
+		std::vector<uint8_t> audio(48 * AUDIO_BYTES_PER_UNIT * 10, 0x11);
+		auto start = HighResClock::now();
+		while (MsSince(start) < 1500)
+		{
+			rate->readFeedback(*feedback);
+			while (stream.WritableBytes() >= audio.size())
+				stream.WriteBytes(audio.data(), audio.size());
+			// The stream sends zeros until the first data is queued.
+			if (underflowAfterStart == 0 && MsSince(start) < 50)
+				underflowAfterStart = stream.UnderflowBytes();
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		CHECK(stream.UnderflowBytes() == underflowAfterStart);
+		REQUIRE(stream.IsRunning());
+	}
+	REQUIRE(feedback->status());
+
+	IsochRateStats stats = rate->stats();
+	CHECK(stats.feedbackValues > 500);
+	CHECK(stats.rejectedValues == 0);
+	// 600 ppm fast by now. Each value is only accurate to 1/16384 of a sample frame.
+	CHECK(std::fabs(stats.unitsPerPacket - 48.0 * 1.0006) < 0.002);
+
+	std::unique_lock<std::mutex> lock(fake->mutex);
+	REQUIRE(fake->checking);
+	// Not following the drift would move it about 29 sample frames a second. It should stay
+	// within a few of where it was.
+	CHECK(fake->highest - fake->startLevel < 4.0);
+	CHECK(fake->startLevel - fake->lowest < 4.0);
+}
+
+TEST(StreamReportsThreadPolicyAndSubmitStats)
+{
+	auto dev = OpenFake("stream/submit-stats", std::make_shared<FakeHighSpeedOutDevice>(1));
+
+	IsochronousStream stream(*dev, 0, 0x01, BYTES_PER_FRAME);
+	stream.SetThreadPolicy(ThreadPolicy());
+
+	auto start = HighResClock::now();
+	while (stream.SubmitStats().submissions < 20 && MsSince(start) < 3000)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	double elapsedMs = MsSince(start);
+
+	CHECK(stream.ThreadPolicyStatus());
+
+	IsochSubmitStats stats = stream.SubmitStats();
+	REQUIRE(stats.submissions >= 20);
+	// Each transfer is 8 ms at a packet every microframe, and the first few are queued at
+	// once, so there can't be many more than that.
+	CHECK(stats.submissions <= static_cast<uint64_t>(elapsedMs / 8) + 8);
+	CHECK(stats.minMarginMs <= stats.meanMarginMs);
+	CHECK(stats.meanMarginMs <= stats.maxMarginMs);
+	// Every transfer was submitted before it was due to start, and no more than 16 ms plus
+	// the queue of transfers ahead.
+	CHECK(stats.minMarginMs > 0.0);
+	CHECK(stats.maxMarginMs < 16.0 + 4 * 8);
+	CHECK(stats.jitterMs >= 0.0);
+	CHECK(stats.jitterMs <= stats.maxMarginMs - stats.minMarginMs);
+}
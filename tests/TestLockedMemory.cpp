@@ -0,0 +1,101 @@
+#include "Test.h"
+
+#include "util/LockedMemory.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+// What the OS allows depends on the machine (limits, privileges, reserved huge pages), so
+// these check that whatever LockedMemory reports is consistent with what it gave us.
+
+namespace
+{
+bool IsAligned(const void* p, size_t alignment)
+{
+	return reinterpret_cast<uintptr_t>(p) % alignment == 0;
+}
+
+// The whole block can be written and read back.
+bool Usable(LockedMemory& mem)
+{
+	memset(mem.data(), 0x5A, mem.size());
+	return mem.data()[0] == 0x5A && mem.data()[mem.size() / 2] == 0x5A && mem.data()[mem.size() - 1] == 0x5A;
+}
+}
+
+TEST(LockedMemoryPlainAllocation)
+{
+	auto mem = REQUIRE_OK(LockedMemory::allocate(100000, LockedMemoryOptions())).unwrap();
+
+	REQUIRE(mem->data() != nullptr);
+	CHECK(mem->size() == 100000);
+	CHECK(IsAligned(mem->data(), 4096));
+	// Nothing was asked for, so nothing was refused.
+	CHECK(!mem->locked());
+	CHECK(!mem->hugePages());
+	CHECK(mem->diagnostic().empty());
+	CHECK(Usable(*mem));
+}
+
+TEST(LockedMemoryLockedOrSaysWhyNot)
+{
+	LockedMemoryOptions options;
+	options.lock = true;
+	auto mem = REQUIRE_OK(LockedMemory::allocate(64 * 1024, options)).unwrap();
+
+	REQUIRE(mem->data() != nullptr);
+	CHECK(mem->size() == 64 * 1024);
+	CHECK(!mem->hugePages());
+	// Either it is locked, or it falls back to ordinary memory and says why.
+	CHECK(mem->locked() == mem->diagnostic().empty());
+	CHECK(Usable(*mem));
+}
+
+#if !defined(_WIN32)
+TEST(LockedMemoryReportsMemlockLimit)
+{
+	struct rlimit saved;
+	REQUIRE(getrlimit(RLIMIT_MEMLOCK, &saved) == 0);
+
+	// With no allowance only a privileged process can lock anything.
+	struct rlimit none = saved;
+	none.rlim_cur = 0;
+	REQUIRE(setrlimit(RLIMIT_MEMLOCK, &none) == 0);
+
+	LockedMemoryOptions options;
+	options.lock = true;
+	auto res = LockedMemory::allocate(256 * 1024, options);
+	setrlimit(RLIMIT_MEMLOCK, &saved);
+	auto mem = REQUIRE_OK(res).unwrap();
+
+	CHECK(Usable(*mem));
+	if (mem->locked())
+	{
+		CHECK(mem->diagnostic().empty());
+		return;
+	}
+	CHECK(mem->diagnostic().find("mlock") != std::string::npos);
+	CHECK(mem->diagnostic().find("RLIMIT_MEMLOCK") != std::string::npos);
+}
+#endif
+
+TEST(LockedMemoryHugePagesOrSaysWhyNot)
+{
+	LockedMemoryOptions options;
+	options.hugePages = true;
+	size_t size = LockedMemory::HUGE_PAGE_SIZE + 12345;
+	auto mem = REQUIRE_OK(LockedMemory::allocate(size, options)).unwrap();
+
+	REQUIRE(mem->data() != nullptr);
+	CHECK(mem->size() == size);
+	CHECK(mem->hugePages() == mem->diagnostic().empty());
+	if (mem->hugePages())
+		CHECK(IsAligned(mem->data(), LockedMemory::HUGE_PAGE_SIZE));
+	else
+		CHECK(IsAligned(mem->data(), 4096));
+	CHECK(Usable(*mem));
+}
@@ -0,0 +1,55 @@
+#include "Test.h"
+
+#include <exception>
+
+namespace
+{
+bool currentFailed = false;
+}
+
+std::vector<TestCase>& AllTests()
+{
+	static std::vector<TestCase> tests;
+	return tests;
+}
+
+void TestFailed(const char* file, int line, const std::string& what)
+{
+	std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+	currentFailed = true;
+}
+
+// Run every test, or only those whose names contain the first argument.
+int main(int argc, char* argv[])
+{
+	std::string filter = argc > 1 ? argv[1] : "";
+
+	int run = 0;
+	int failed = 0;
+	for (const TestCase& test : AllTests())
+	{
+		if (std::string(test.name).find(filter) == std::string::npos)
+			continue;
+
+		currentFailed = false;
+		try
+		{
+			test.body();
+		}
+		catch (const TestAbort&)
+		{
+		}
+		catch (const std::exception& e)
+		{
+			TestFailed(test.name, 0, std::string("exception: ") + e.what());
+		}
+
+		++run;
+		if (currentFailed)
+			++failed;
+		std::cout << (currentFailed ? "FAIL " : "ok   ") << test.name << std::endl;
+	}
+
+	std::cout << run - failed << " of " << run << " tests passed" << std::endl;
+	return failed == 0 ? 0 : 1;
+}
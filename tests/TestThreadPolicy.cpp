@@ -0,0 +1,130 @@
+#include "Test.h"
+
+#include "util/ThreadPolicy.h"
+
+#include <functional>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Policies are applied on a thread of their own so the test runner's isn't changed. Whether
+// real-time scheduling is allowed depends on the machine, so those tests check that the
+// policy either took effect or the error says why not.
+
+namespace
+{
+void RunOnThread(std::function<void()> f)
+{
+	std::thread t(f);
+	t.join();
+}
+
+#if defined(__linux__)
+int CurrentScheduling(int& priority)
+{
+	int policy = 0;
+	sched_param param;
+	pthread_getschedparam(pthread_self(), &policy, &param);
+	priority = param.sched_priority;
+	return policy;
+}
+#endif
+}
+
+TEST(ThreadPolicyNormalApplies)
+{
+	SResult<void> res = Ok();
+	RunOnThread([&] { res = ApplyThreadPolicy(ThreadPolicy()); });
+	CHECK(res);
+}
+
+TEST(ThreadPolicyRealTimeAppliesOrSaysWhyNot)
+{
+	ThreadPolicy policy;
+	policy.scheduling = ThreadPolicy::Scheduling::Fifo;
+	policy.priority = 10;
+
+	SResult<void> res = Ok();
+	int scheduling = 0;
+	int priority = 0;
+	RunOnThread([&] {
+		res = ApplyThreadPolicy(policy);
+#if defined(__linux__)
+		scheduling = CurrentScheduling(priority);
+#endif
+	});
+
+	if (!res)
+	{
+		CHECK(!res.unwrap_err().empty());
+#if defined(__linux__)
+		CHECK(res.unwrap_err().find("pthread_setschedparam") != std::string::npos);
+		CHECK(scheduling == SCHED_OTHER);
+#endif
+		return;
+	}
+#if defined(__linux__)
+	CHECK(scheduling == SCHED_FIFO);
+	CHECK(priority == 10);
+#endif
+}
+
+#if defined(__linux__)
+TEST(ThreadPolicySetsAffinity)
+{
+	// Use a CPU we are allowed on, in case the tests run in a restricted cpuset.
+	cpu_set_t allowed;
+	REQUIRE(pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) == 0);
+	int cpu = 0;
+	while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &allowed))
+		++cpu;
+	REQUIRE(cpu < CPU_SETSIZE);
+
+	ThreadPolicy policy;
+	policy.cpus = {cpu};
+
+	SResult<void> res = Ok();
+	cpu_set_t after;
+	CPU_ZERO(&after);
+	RunOnThread([&] {
+		res = ApplyThreadPolicy(policy);
+		pthread_getaffinity_np(pthread_self(), sizeof(after), &after);
+	});
+
+	REQUIRE(res);
+	CHECK(CPU_COUNT(&after) == 1);
+	CHECK(CPU_ISSET(cpu, &after));
+}
+#endif
+
+TEST(ThreadPolicyRequestReportsStatus)
+{
+	ThreadPolicyRequest request;
+	CHECK(!request.status());
+
+	// Nothing happens until the thread applies it.
+	request.set(ThreadPolicy());
+	CHECK(!request.status());
+	RunOnThread([&] { request.applyIfPending(); });
+	CHECK(request.status());
+
+#if defined(__linux__)
+	// No scheduler has priorities this high, whatever privileges we have.
+	ThreadPolicy bad;
+	bad.scheduling = ThreadPolicy::Scheduling::Fifo;
+	bad.priority = 1000;
+	request.set(bad);
+	RunOnThread([&] { request.applyIfPending(); });
+	SResult<void> status = request.status();
+	REQUIRE(!status);
+	CHECK(status.unwrap_err().find("pthread_setschedparam") != std::string::npos);
+
+	// A later policy that works clears the error.
+	request.set(ThreadPolicy());
+	RunOnThread([&] { request.applyIfPending(); });
+	CHECK(request.status());
+#endif
+}
@@ -0,0 +1,111 @@
+#include "Test.h"
+#include "FakeDevices.h"
+
+// Transfer timeouts, cancel() and Device::abortPipe() against a fake device that can be
+// told to hang.
+
+namespace
+{
+const Device::Recipient DEV = Device::Recipient::Device;
+const Device::Type VENDOR = Device::Type::Vendor;
+
+uint64_t ControlErrors(Device& dev, uint8_t endpointAddress, TransferError error)
+{
+	for (const EndpointCounterSnapshot& c : dev.endpointCounters())
+		if (c.endpointAddress == endpointAddress)
+			return c.errors[static_cast<int>(error)];
+	return 0;
+}
+}
+
+TEST(ControlTransfersReturnData)
+{
+	auto dev = OpenFake("transfers/echo", std::make_shared<FakeVendorDevice>());
+
+	auto data = REQUIRE_OK(dev->controlTransferInSync(DEV, VENDOR, FakeVendorDevice::ECHO, 10, 0, 4)).unwrap();
+	REQUIRE(data.size() == 4);
+	CHECK(data[0] == 10 && data[3] == 13);
+
+	REQUIRE_OK(dev->controlTransferOutSync(DEV, VENDOR, FakeVendorDevice::ECHO, 0, 0, {1, 2, 3}));
+
+	auto desc = REQUIRE_OK(dev->descriptorsWithStrings()).unwrap();
+	CHECK(desc.idVendor == 0x1234);
+	CHECK(desc.sProduct == u"Fake vendor device");
+}
+
+TEST(HungSyncTransferTimesOut)
+{
+	auto dev = OpenFake("transfers/hang-sync", std::make_shared<FakeVendorDevice>());
+
+	auto start = HighResClock::now();
+	auto res = dev->controlTransferInSync(DEV, VENDOR, FakeVendorDevice::HANG, 0, 0, 8, 100);
+	double ms = MsSince(start);
+
+	CHECK(!res);
+	CHECK(ms >= 90 && ms < 1000);
+	CHECK(ControlErrors(*dev, 0x80, TransferError::Timeout) == 1);
+
+	// The device is usable again straight afterwards.
+	REQUIRE_OK(dev->controlTransferInSync(DEV, VENDOR, FakeVendorDevice::ECHO, 0, 0, 8, 100));
+}
+
+TEST(SlowTransferFinishesWithinTimeout)
+{
+	auto dev = OpenFake("transfers/slow", std::make_shared<FakeVendorDevice>());
+
+	REQUIRE_OK(dev->controlTransferInSync(DEV, VENDOR, FakeVendorDevice::SLOW, 0, 50, 8, 500));
+	CHECK(!dev->controlTransferInSync(DEV, VENDOR, FakeVendorDevice::SLOW, 0, 500, 8, 50));
+}
+
+TEST(CancelEndsHungTransfer)
+{
+	auto dev = OpenFake("transfers/cancel", std::make_shared<FakeVendorDevice>());
+
+	// No timeout, so only cancel() can end it.
+	auto transfer = REQUIRE_OK(dev->controlTransferIn(DEV, VENDOR, FakeVendorDevice::HANG, 0, 0, 8, 0)).unwrap();
+	CHECK(!transfer.result(false));
+
+	REQUIRE_OK(transfer.cancel());
+	CHECK(!transfer.result(true));
+	CHECK(ControlErrors(*dev, 0x80, TransferError::Cancelled) == 1);
+}
+
+TEST(ResultWithinCountsTimeout)
+{
+	auto dev = OpenFake("transfers/within", std::make_shared<FakeVendorDevice>());
+
+	auto transfer = REQUIRE_OK(dev->controlTransferIn(DEV, VENDOR, FakeVendorDevice::HANG, 0, 0, 8, 0)).unwrap();
+	auto start = HighResClock::now();
+	CHECK(!transfer.resultWithin(50));
+	CHECK(MsSince(start) < 1000);
+	CHECK(ControlErrors(*dev, 0x80, TransferError::Timeout) == 1);
+	CHECK(ControlErrors(*dev, 0x80, TransferError::Cancelled) == 0);
+}
+
+TEST(AbortPipeCancelsQueuedTransfers)
+{
+	auto dev = OpenFake("transfers/abort", std::make_shared<FakeVendorDevice>());
+
+	// The second is queued behind the first, which hangs.
+	auto hung = REQUIRE_OK(dev->controlTransferIn(DEV, VENDOR, FakeVendorDevice::HANG, 0, 0, 8, 0)).unwrap();
+	auto queued = REQUIRE_OK(dev->controlTransferIn(DEV, VENDOR, FakeVendorDevice::ECHO, 0, 0, 8, 0)).unwrap();
+
+	REQUIRE_OK(dev->abortPipe(0, 0x00));
+	CHECK(!hung.result(true));
+	CHECK(!queued.result(true));
+	CHECK(ControlErrors(*dev, 0x80, TransferError::Cancelled) == 2);
+
+	CHECK(!dev->abortPipe(0, 0x81));
+}
+
+TEST(StallIsCountedAsStall)
+{
+	auto dev = OpenFake("transfers/stall", std::make_shared<FakeVendorDevice>());
+
+	CHECK(!dev->controlTransferOutSync(DEV, VENDOR, FakeVendorDevice::STALL, 0, 0, {1}));
+
+	uint64_t stalls = 0;
+	for (const EndpointCounterSnapshot& c : dev->endpointCounters())
+		stalls += c.stalls();
+	CHECK(stalls == 1);
+}
@@ -0,0 +1,204 @@
+#include "Test.h"
+
+#include "usb/UsbMon.h"
+
+#include <string.h>
+
+// usbmon events built by hand, laid out in a ring the way the kernel's mon_bin does it, and
+// decoded with the same functions the sniffer uses.
+
+namespace
+{
+// mon_bin starts every event on a 64 byte boundary.
+const size_t EVENT_ALIGN = 64;
+
+UsbMonRecord ControlSubmit()
+{
+	UsbMonRecord r;
+	r.id = 0xFFFF88800000AA00ull;
+	r.type = UsbMonEventType::Submit;
+	r.transferType = EndpointInfo::Type::Control;
+	r.endpoint = 0x80;
+	r.deviceAddress = 5;
+	r.bus = 3;
+	r.timestampNs = 1700000000123456000ull;
+	r.status = -115;
+	r.urbLength = 18;
+	r.setupFlag = 0;
+	r.dataFlag = '<';
+	r.setup = {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00};
+	return r;
+}
+
+UsbMonRecord IsochComplete()
+{
+	UsbMonRecord r;
+	r.id = 0xFFFF88800000BB00ull;
+	r.type = UsbMonEventType::Complete;
+	r.transferType = EndpointInfo::Type::Isochronous;
+	r.endpoint = 0x81;
+	r.deviceAddress = 7;
+	r.bus = 3;
+	r.timestampNs = 1700000000124000000ull;
+	r.urbLength = 6;
+	r.dataFlag = 0;
+	r.interval = 1;
+	r.startFrame = 1234;
+	r.transferFlags = 0x2;
+	// One error, two packets.
+	r.setup = {1, 0, 0, 0, 2, 0, 0, 0};
+	r.isoDescriptors.resize(2);
+	r.isoDescriptors[0].length = 6;
+	r.isoDescriptors[1].status = -18;
+	r.isoDescriptors[1].offset = 6;
+	r.data = {1, 2, 3, 4, 5, 6};
+	return r;
+}
+
+UsbMonRecord BulkError()
+{
+	UsbMonRecord r;
+	r.id = 0xFFFF88800000CC00ull;
+	r.type = UsbMonEventType::Error;
+	r.transferType = EndpointInfo::Type::Bulk;
+	r.endpoint = 0x02;
+	r.deviceAddress = 7;
+	r.bus = 3;
+	r.timestampNs = 1700000000125000000ull;
+	r.status = -19;
+	return r;
+}
+
+void CheckSame(const UsbMonRecord& a, const UsbMonRecord& b)
+{
+	CHECK(a.id == b.id);
+	CHECK(a.type == b.type);
+	CHECK(a.transferType == b.transferType);
+	CHECK(a.endpoint == b.endpoint);
+	CHECK(a.deviceAddress == b.deviceAddress);
+	CHECK(a.bus == b.bus);
+	CHECK(a.timestampNs == b.timestampNs);
+	CHECK(a.status == b.status);
+	CHECK(a.urbLength == b.urbLength);
+	CHECK(a.setupFlag == b.setupFlag);
+	CHECK(a.dataFlag == b.dataFlag);
+	CHECK(a.setup == b.setup);
+	CHECK(a.interval == b.interval);
+	CHECK(a.startFrame == b.startFrame);
+	CHECK(a.transferFlags == b.transferFlags);
+	REQUIRE(a.isoDescriptors.size() == b.isoDescriptors.size());
+	for (size_t i = 0; i < a.isoDescriptors.size(); ++i)
+	{
+		CHECK(a.isoDescriptors[i].status == b.isoDescriptors[i].status);
+		CHECK(a.isoDescriptors[i].offset == b.isoDescriptors[i].offset);
+		CHECK(a.isoDescriptors[i].length == b.isoDescriptors[i].length);
+	}
+	CHECK(a.data == b.data);
+}
+
+// Append an event to the ring at the next aligned offset, and return that offset.
+uint32_t Place(std::vector<uint8_t>& ring, const std::vector<uint8_t>& event)
+{
+	uint32_t offset = static_cast<uint32_t>(ring.size());
+	ring.insert(ring.end(), event.begin(), event.end());
+	ring.resize((ring.size() + EVENT_ALIGN - 1) / EVENT_ALIGN * EVENT_ALIGN, 0xCC);
+	return offset;
+}
+}
+
+TEST(UsbMonEventRoundTrips)
+{
+	for (const UsbMonRecord& r : {ControlSubmit(), IsochComplete(), BulkError()})
+	{
+		std::vector<uint8_t> raw = EncodeUsbMonEvent(r);
+		REQUIRE(raw.size() == USBMON_HEADER_SIZE + r.capturedLength());
+		UsbMonRecord decoded = REQUIRE_OK(DecodeUsbMonEvent(raw.data(), raw.size())).unwrap();
+		CheckSame(decoded, r);
+		CHECK(EncodeUsbMonEvent(decoded) == raw);
+	}
+
+	UsbMonRecord iso = IsochComplete();
+	CHECK(iso.isoErrorCount() == 1);
+	CHECK(iso.isoPacketCount() == 2);
+}
+
+TEST(UsbMonEventRejectsBadInput)
+{
+	std::vector<uint8_t> raw = EncodeUsbMonEvent(IsochComplete());
+
+	// Cut short, in the header and in the data.
+	CHECK(!DecodeUsbMonEvent(raw.data(), USBMON_HEADER_SIZE - 1));
+	CHECK(!DecodeUsbMonEvent(raw.data(), raw.size() - 1));
+
+	// Unknown event type.
+	std::vector<uint8_t> badType = raw;
+	badType[8] = 'X';
+	CHECK(!DecodeUsbMonEvent(badType.data(), badType.size()));
+
+	// More descriptors than captured bytes.
+	std::vector<uint8_t> badCount = raw;
+	uint32_t ndesc = 100;
+	memcpy(badCount.data() + 60, &ndesc, sizeof(ndesc));
+	CHECK(!DecodeUsbMonEvent(badCount.data(), badCount.size()));
+}
+
+TEST(UsbMonBatchSkipsFillerAndMalformed)
+{
+	std::vector<UsbMonRecord> events{ControlSubmit(), IsochComplete(), BulkError()};
+
+	std::vector<uint8_t> ring;
+	std::vector<uint32_t> offsets;
+	offsets.push_back(Place(ring, EncodeUsbMonEvent(events[0])));
+	offsets.push_back(Place(ring, EncodeUsbMonEvent(events[1])));
+
+	// A filler event, as usbmon writes to pad up to the end of the ring.
+	std::vector<uint8_t> filler(USBMON_HEADER_SIZE, 0);
+	filler[8] = '@';
+	offsets.push_back(Place(ring, filler));
+
+	// An event with an unknown type, then one past the end of the ring.
+	std::vector<uint8_t> garbage(USBMON_HEADER_SIZE, 0);
+	garbage[8] = 'Q';
+	offsets.push_back(Place(ring, garbage));
+	offsets.push_back(static_cast<uint32_t>(ring.size() + EVENT_ALIGN));
+
+	offsets.push_back(Place(ring, EncodeUsbMonEvent(events[2])));
+
+	std::vector<UsbMonRecord> records;
+	UsbMonStats stats;
+	DecodeUsbMonBatch(ring.data(), ring.size(), offsets.data(), offsets.size(), records, stats);
+
+	REQUIRE(records.size() == 3);
+	for (size_t i = 0; i < records.size(); ++i)
+		CheckSame(records[i], events[i]);
+	CHECK(stats.events == 3);
+	CHECK(stats.malformed == 2);
+	CHECK(stats.batches == 1);
+
+	// A second batch adds to the same stats.
+	DecodeUsbMonBatch(ring.data(), ring.size(), offsets.data(), 1, records, stats);
+	CHECK(records.size() == 4);
+	CHECK(stats.events == 4);
+	CHECK(stats.batches == 2);
+}
+
+TEST(UsbMonTotalsCountEvents)
+{
+	UsbMonRecord failed = IsochComplete();
+	failed.status = -71;
+	std::vector<UsbMonRecord> records{ControlSubmit(), IsochComplete(), BulkError(), failed};
+
+	UsbMonTotals totals;
+	AddUsbMonTotals(records, totals);
+	CHECK(totals.submissions == 1);
+	CHECK(totals.completions == 2);
+	// The error event and the failed completion.
+	CHECK(totals.errors == 2);
+	// Only completions count, not the length a submission asked for.
+	CHECK(totals.bytes == 12);
+
+	// Later batches add to them.
+	AddUsbMonTotals({ControlSubmit()}, totals);
+	CHECK(totals.submissions == 2);
+	CHECK(totals.completions == 2);
+}
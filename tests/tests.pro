@@ -0,0 +1,75 @@
+# Tests that run against the fake USB backend in usb/fake, so they need no hardware and
+# build on any platform. Run the binary with no arguments for every test, or with a name
+# fragment to run only the matching ones.
+
+CONFIG += c++14 console
+CONFIG -= qt app_bundle
+
+TARGET = UsbToolTests
+TEMPLATE = app
+
+DEFINES += USBTOOL_FAKE_USB
+
+INCLUDEPATH += .. ../dependencies
+
+unix: LIBS += -pthread
+
+SOURCES += \
+	TestMain.cpp \
+	FakeDevices.cpp \
+	TestTransfers.cpp \
+	TestDiscovery.cpp \
+	TestDescriptorCache.cpp \
+	TestDfu.cpp \
+	TestDeviceId.cpp \
+	TestDeltaFlash.cpp \
+	TestDescriptors.cpp \
+	TestIsochFeedback.cpp \
+	TestByteRing.cpp \
+	TestFastLog.cpp \
+	TestUsbMon.cpp \
+	TestCapture.cpp \
+	TestIsochSharedRing.cpp \
+	TestIsochStreamGroup.cpp \
+	TestIsochronousInStream.cpp \
+	TestIsochronousStream.cpp \
+	TestIsochJitterBuffer.cpp \
+	TestLockedMemory.cpp \
+	TestThreadPolicy.cpp \
+	../util/HighResClock.cpp \
+	../util/MappedFile.cpp \
+	../util/Crc32.cpp \
+	../util/FastLog.cpp \
+	../util/ByteRing.cpp \
+	../util/MirroredMemory.cpp \
+	../util/LockedMemory.cpp \
+	../util/ThreadPolicy.cpp \
+	../util/SharedMemory.cpp \
+	../usb/EndpointInfo.cpp \
+	../usb/EndpointCounters.cpp \
+	../usb/DescriptorCache.cpp \
+	../usb/DeviceId.cpp \
+	../usb/Descriptors.cpp \
+	../usb/Device.cpp \
+	../usb/Dfu.cpp \
+	../usb/DeltaFlash.cpp \
+	../usb/IsochFeedback.cpp \
+	../usb/IsochronousInStream.cpp \
+	../usb/UsbMon.cpp \
+	../usb/Pcapng.cpp \
+	../usb/Capture.cpp \
+	../usb/CaptureQuery.cpp \
+	../usb/IsochSharedRing.cpp \
+	../usb/IsochronousStream.cpp \
+	../usb/IsochJitterBuffer.cpp \
+	../usb/IsochStreamGroup.cpp \
+	../usb/fake/Device_Fake.cpp \
+	../usb/fake/Discovery_Fake.cpp \
+	../usb/fake/FakePipes.cpp
+
+HEADERS += \
+	Test.h \
+	FakeDevices.h \
+	../usb/fake/Device_Fake.h \
+	../usb/fake/FakeUsbDevice.h \
+	../usb/fake/FakePipes.h
@@ -0,0 +1,581 @@
+#include "Capture.h"
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+
+#include "Pcapng.h"
+
+using std::string;
+
+namespace
+{
+// Bump the version if the format changes.
+const char RECORDS_MAGIC[8] = {'U', 'T', 'C', 'A', 'P', 'R', 'C', '1'};
+const char INDEX_MAGIC[8] = {'U', 'T', 'C', 'A', 'P', 'I', 'X', '1'};
+
+struct RecordsHeader
+{
+	char magic[8];
+	uint32_t recordSize;
+	uint32_t reserved;
+	// Updated after every append, so a capture that was never finished can still be read.
+	uint64_t recordCount;
+	uint64_t payloadSize;
+	uint8_t padding[32];
+};
+
+static_assert(sizeof(RecordsHeader) == 64, "RecordsHeader is part of the file format");
+
+// The index file is this, then `timeEntries` timestamps, then `endpointCount`
+// IndexEndpoints, then the record numbers they refer to.
+struct IndexHeader
+{
+	char magic[8];
+	// The records the index was made from. If this doesn't match the record file the index
+	// is ignored.
+	uint64_t recordCount;
+	uint64_t timeInterval;
+	uint64_t timeEntries;
+	uint64_t endpointCount;
+};
+
+struct IndexEndpoint
+{
+	uint32_t key;
+	uint32_t reserved;
+	// In record numbers from the start of the lists.
+	uint64_t first;
+	uint64_t count;
+};
+
+// Room for this many records is allocated at first, and then doubled as needed.
+const uint64_t INITIAL_CAPACITY = 16384;
+
+// One time index entry per this many records.
+const uint64_t TIME_INTERVAL = 4096;
+
+// How far out of order records are expected to be, when searching them without an index.
+const uint64_t REORDER_WINDOW = 256;
+
+string PayloadPath(const string& path)
+{
+	return path + ".payload";
+}
+
+string IndexPath(const string& path)
+{
+	return path + ".index";
+}
+
+RecordsHeader* Header(MappedFile& file)
+{
+	return reinterpret_cast<RecordsHeader*>(file.data());
+}
+
+CaptureRecord* Records(MappedFile& file)
+{
+	return reinterpret_cast<CaptureRecord*>(file.data() + sizeof(RecordsHeader));
+}
+
+uint32_t EndpointKey(const CaptureRecord& record)
+{
+	CaptureEndpoint e;
+	e.bus = record.bus;
+	e.deviceAddress = record.deviceAddress;
+	e.endpoint = record.endpoint;
+	return e.key();
+}
+
+// What an index will hold, from a first pass over the records.
+struct IndexPlan
+{
+	// Entry i is the latest timestamp of records 0 to (i + 1) * TIME_INTERVAL - 1. It is the
+	// latest rather than the last since events from different CPUs can be slightly out of order.
+	std::vector<uint64_t> timeIndex;
+	// How many records each endpoint has.
+	std::map<uint32_t, uint64_t> endpointCounts;
+
+	uint64_t bytes(uint64_t count) const
+	{
+		return sizeof(IndexHeader) + timeIndex.size() * sizeof(uint64_t) +
+		       endpointCounts.size() * sizeof(IndexEndpoint) + count * sizeof(uint64_t);
+	}
+};
+
+IndexPlan PlanIndex(const CaptureRecord* records, uint64_t count)
+{
+	IndexPlan plan;
+	uint64_t latest = 0;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		++plan.endpointCounts[EndpointKey(records[i])];
+		latest = std::max(latest, records[i].timestampNs);
+		if ((i + 1) % TIME_INTERVAL == 0)
+			plan.timeIndex.push_back(latest);
+	}
+	return plan;
+}
+
+// Write the index to `out`, which must be plan.bytes(count) long and 8 byte aligned.
+void WriteIndex(const IndexPlan& plan, const CaptureRecord* records, uint64_t count, uint8_t* out)
+{
+	IndexHeader* header = reinterpret_cast<IndexHeader*>(out);
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->recordCount = count;
+	header->timeInterval = TIME_INTERVAL;
+	header->timeEntries = plan.timeIndex.size();
+	header->endpointCount = plan.endpointCounts.size();
+
+	uint8_t* p = out + sizeof(IndexHeader);
+	memcpy(p, plan.timeIndex.data(), plan.timeIndex.size() * sizeof(uint64_t));
+	p += plan.timeIndex.size() * sizeof(uint64_t);
+
+	// Where the next record of each endpoint goes.
+	std::map<uint32_t, uint64_t> next;
+	IndexEndpoint* endpoints = reinterpret_cast<IndexEndpoint*>(p);
+	uint64_t first = 0;
+	for (const auto& e : plan.endpointCounts)
+	{
+		memset(endpoints, 0, sizeof(*endpoints));
+		endpoints->key = e.first;
+		endpoints->first = first;
+		endpoints->count = e.second;
+		next[e.first] = first;
+		first += e.second;
+		++endpoints;
+	}
+
+	uint64_t* lists = reinterpret_cast<uint64_t*>(endpoints);
+	for (uint64_t i = 0; i < count; ++i)
+		lists[next[EndpointKey(records[i])]++] = i;
+}
+}
+
+CaptureEndpoint CaptureEndpoint::fromKey(uint32_t key)
+{
+	CaptureEndpoint e;
+	e.bus = static_cast<uint16_t>(key >> 16);
+	e.deviceAddress = static_cast<uint8_t>(key >> 8);
+	e.endpoint = static_cast<uint8_t>(key);
+	return e;
+}
+
+SResult<std::shared_ptr<CaptureWriter>> CaptureWriter::create(const string& path)
+{
+	std::shared_ptr<CaptureWriter> w(new CaptureWriter());
+	w->mPath = path;
+
+	// An old index would describe different records.
+	remove(IndexPath(path).c_str());
+
+	w->mPayload.open(PayloadPath(path), std::ios::binary | std::ios::trunc);
+	if (!w->mPayload)
+		return Err("Couldn't open " + PayloadPath(path) + " for writing");
+
+	uint64_t size = sizeof(RecordsHeader) + INITIAL_CAPACITY * sizeof(CaptureRecord);
+	auto fileRes = MappedFile::open(path, MappedFile::Mode::ReadWrite, size);
+	if (!fileRes)
+		return Err(fileRes.unwrap_err());
+	w->mRecords = fileRes.unwrap();
+
+	// An old capture may have been bigger.
+	auto res = w->mRecords->resize(size);
+	if (!res)
+		return Err(res.unwrap_err());
+	w->mCapacity = INITIAL_CAPACITY;
+
+	RecordsHeader* header = Header(*w->mRecords);
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, RECORDS_MAGIC, sizeof(header->magic));
+	header->recordSize = sizeof(CaptureRecord);
+	return Ok(w);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	finish();
+}
+
+SResult<void> CaptureWriter::append(const UsbMonRecord& r)
+{
+	if (mFinished)
+		return Err(string("The capture has been finished"));
+
+	uint64_t n = mCount;
+	if (n == mCapacity)
+	{
+		MSTRY(mRecords->resize(sizeof(RecordsHeader) + mCapacity * 2 * sizeof(CaptureRecord)));
+		mCapacity *= 2;
+	}
+
+	CaptureRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.timestampNs = r.timestampNs;
+	rec.urbId = r.id;
+	rec.payloadOffset = mPayloadSize;
+	rec.payloadLength = r.capturedLength();
+	rec.urbLength = r.urbLength;
+	rec.status = r.status;
+	rec.interval = r.interval;
+	rec.startFrame = r.startFrame;
+	rec.transferFlags = r.transferFlags;
+	rec.bus = r.bus;
+	rec.deviceAddress = r.deviceAddress;
+	rec.endpoint = r.endpoint;
+	rec.type = static_cast<char>(r.type);
+	rec.transferType = static_cast<uint8_t>(r.transferType);
+	rec.setupFlag = r.setupFlag;
+	rec.dataFlag = r.dataFlag;
+	memcpy(rec.setup, r.setup.data(), sizeof(rec.setup));
+	rec.isoDescriptorCount = static_cast<uint16_t>(r.isoDescriptors.size());
+
+	// The payload is laid out as usbmon delivers it: the descriptors, then the data.
+	for (const auto& d : r.isoDescriptors)
+	{
+		uint8_t desc[USBMON_ISO_DESCRIPTOR_SIZE] = {};
+		memcpy(desc, &d.status, 4);
+		memcpy(desc + 4, &d.offset, 4);
+		memcpy(desc + 8, &d.length, 4);
+		mPayload.write(reinterpret_cast<const char*>(desc), sizeof(desc));
+	}
+	mPayload.write(reinterpret_cast<const char*>(r.data.data()), r.data.size());
+	if (!mPayload)
+		return Err("Couldn't write to " + PayloadPath(mPath));
+	mPayloadSize += rec.payloadLength;
+
+	Records(*mRecords)[n] = rec;
+	// Count the record only once it is all there.
+	RecordsHeader* header = Header(*mRecords);
+	header->payloadSize = mPayloadSize;
+	header->recordCount = n + 1;
+	mCount = n + 1;
+	return Ok();
+}
+
+SResult<void> CaptureWriter::flush()
+{
+	// The payload first, so no record refers to data that isn't there.
+	mPayload.flush();
+	if (!mPayload)
+		return Err("Couldn't write to " + PayloadPath(mPath));
+	return mRecords->flush();
+}
+
+SResult<void> CaptureWriter::finish()
+{
+	if (mFinished)
+		return Ok();
+	mFinished = true;
+
+	mPayload.close();
+	if (!mPayload)
+		return Err("Couldn't write to " + PayloadPath(mPath));
+
+	MSTRY(mRecords->resize(sizeof(RecordsHeader) + mCount * sizeof(CaptureRecord)));
+	MSTRY(mRecords->flush());
+
+	const CaptureRecord* records = Records(*mRecords);
+	IndexPlan plan = PlanIndex(records, mCount);
+
+	// Write it under another name and rename it, so a reader never sees half an index.
+	string indexPath = IndexPath(mPath);
+	string tempPath = indexPath + ".tmp";
+	{
+		auto indexRes = MappedFile::open(tempPath, MappedFile::Mode::ReadWrite, plan.bytes(mCount));
+		if (!indexRes)
+			return Err(indexRes.unwrap_err());
+		auto index = indexRes.unwrap();
+		// It may have been left over, and bigger.
+		MSTRY(index->resize(plan.bytes(mCount)));
+		WriteIndex(plan, records, mCount, index->data());
+		MSTRY(index->flush());
+	}
+	remove(indexPath.c_str());
+	if (rename(tempPath.c_str(), indexPath.c_str()) != 0)
+		return Err("Couldn't rename " + tempPath + " to " + indexPath);
+	return Ok();
+}
+
+SResult<std::shared_ptr<CaptureReader>> CaptureReader::open(const string& path)
+{
+	std::shared_ptr<CaptureReader> r(new CaptureReader());
+
+	auto recordsRes = MappedFile::open(path, MappedFile::Mode::ReadOnly);
+	if (!recordsRes)
+		return Err(recordsRes.unwrap_err());
+	r->mRecordsFile = recordsRes.unwrap();
+
+	MappedFile& file = *r->mRecordsFile;
+	if (file.size() < sizeof(RecordsHeader))
+		return Err(path + " is too short to be a capture");
+	const RecordsHeader* header = Header(file);
+	if (memcmp(header->magic, RECORDS_MAGIC, sizeof(header->magic)) != 0)
+		return Err(path + " isn't a capture, or is from an incompatible version");
+	if (header->recordSize != sizeof(CaptureRecord))
+		return Err(path + " has records of the wrong size");
+
+	// The writer may have more room than records, or be part way through growing the file.
+	r->mCount = std::min(header->recordCount, (file.size() - sizeof(RecordsHeader)) / sizeof(CaptureRecord));
+	r->mRecordData = Records(file);
+
+	// Empty files can't be mapped, and then there is nothing to read from them anyway.
+	auto payloadRes = MappedFile::open(PayloadPath(path), MappedFile::Mode::ReadOnly);
+	if (payloadRes)
+		r->mPayloadFile = payloadRes.unwrap();
+
+	r->mIndexWasValid = r->loadIndex(path);
+	return Ok(r);
+}
+
+bool CaptureReader::loadIndex(const string& path)
+{
+	auto indexRes = MappedFile::open(IndexPath(path), MappedFile::Mode::ReadOnly);
+	if (!indexRes)
+		return false;
+	mIndexFile = indexRes.unwrap();
+
+	return useIndex(mIndexFile->data(), mIndexFile->size());
+}
+
+bool CaptureReader::useIndex(const uint8_t* data, uint64_t size)
+{
+	// Check every size before using it, so a corrupt index is only rebuilt.
+	if (size < sizeof(IndexHeader))
+		return false;
+	const IndexHeader* header = reinterpret_cast<const IndexHeader*>(data);
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->recordCount != mCount || header->timeInterval == 0)
+		return false;
+
+	uint64_t offset = sizeof(IndexHeader);
+	if (header->timeEntries > (size - offset) / sizeof(uint64_t))
+		return false;
+	const uint64_t* timeIndex = reinterpret_cast<const uint64_t*>(data + offset);
+	offset += header->timeEntries * sizeof(uint64_t);
+
+	if (header->endpointCount > (size - offset) / sizeof(IndexEndpoint))
+		return false;
+	const IndexEndpoint* endpoints = reinterpret_cast<const IndexEndpoint*>(data + offset);
+	offset += header->endpointCount * sizeof(IndexEndpoint);
+
+	const uint64_t* lists = reinterpret_cast<const uint64_t*>(data + offset);
+	uint64_t listEntries = (size - offset) / sizeof(uint64_t);
+
+	std::vector<EndpointEntry> entries;
+	for (uint64_t i = 0; i < header->endpointCount; ++i)
+	{
+		const IndexEndpoint& e = endpoints[i];
+		if (e.first > listEntries || e.count > listEntries - e.first)
+			return false;
+		if (!entries.empty() && entries.back().key >= e.key)
+			return false;
+		entries.push_back(EndpointEntry{e.key, lists + e.first, e.count});
+	}
+
+	mTimeIndex = timeIndex;
+	mTimeEntries = header->timeEntries;
+	mTimeInterval = header->timeInterval;
+	mEndpoints.swap(entries);
+	return true;
+}
+
+void CaptureReader::rebuildIndex()
+{
+	IndexPlan plan = PlanIndex(mRecordData, mCount);
+	mRebuilt.assign(plan.bytes(mCount) / sizeof(uint64_t), 0);
+	uint8_t* data = reinterpret_cast<uint8_t*>(mRebuilt.data());
+	WriteIndex(plan, mRecordData, mCount, data);
+	useIndex(data, plan.bytes(mCount));
+}
+
+void CaptureReader::ensureIndex() const
+{
+	if (mIndexWasValid)
+		return;
+	// Everything else is const, so this is the only thing that needs to be thread-safe.
+	std::call_once(mRebuildOnce, [this] { const_cast<CaptureReader*>(this)->rebuildIndex(); });
+}
+
+const uint8_t* CaptureReader::payload(uint64_t i, uint32_t& size) const
+{
+	const CaptureRecord& rec = mRecordData[i];
+	size = 0;
+	if (!mPayloadFile || rec.payloadLength == 0)
+		return nullptr;
+	if (rec.payloadOffset > mPayloadFile->size() || rec.payloadLength > mPayloadFile->size() - rec.payloadOffset)
+		return nullptr;
+	size = rec.payloadLength;
+	return mPayloadFile->data() + rec.payloadOffset;
+}
+
+SResult<UsbMonRecord> CaptureReader::decode(uint64_t i) const
+{
+	if (i >= mCount)
+		return Err("Record " + std::to_string(i) + " is past the end of the capture");
+
+	const CaptureRecord& rec = mRecordData[i];
+	UsbMonRecord r;
+	r.id = rec.urbId;
+	r.type = static_cast<UsbMonEventType>(rec.type);
+	r.transferType = static_cast<EndpointInfo::Type>(rec.transferType);
+	r.endpoint = rec.endpoint;
+	r.deviceAddress = rec.deviceAddress;
+	r.bus = rec.bus;
+	r.timestampNs = rec.timestampNs;
+	r.status = rec.status;
+	r.urbLength = rec.urbLength;
+	r.setupFlag = rec.setupFlag;
+	r.dataFlag = rec.dataFlag;
+	memcpy(r.setup.data(), rec.setup, r.setup.size());
+	r.interval = rec.interval;
+	r.startFrame = rec.startFrame;
+	r.transferFlags = rec.transferFlags;
+
+	uint32_t size = 0;
+	const uint8_t* p = payload(i, size);
+	if (size != rec.payloadLength)
+		return Err("Record " + std::to_string(i) + "'s data is missing from the payload file");
+	uint64_t descBytes = uint64_t(rec.isoDescriptorCount) * USBMON_ISO_DESCRIPTOR_SIZE;
+	if (descBytes > size)
+		return Err("Record " + std::to_string(i) + " has more isochronous descriptors than data");
+
+	r.isoDescriptors.resize(rec.isoDescriptorCount);
+	for (auto& d : r.isoDescriptors)
+	{
+		memcpy(&d.status, p, 4);
+		memcpy(&d.offset, p + 4, 4);
+		memcpy(&d.length, p + 8, 4);
+		p += USBMON_ISO_DESCRIPTOR_SIZE;
+	}
+	r.data.assign(p, p + (size - descBytes));
+	return Ok(r);
+}
+
+uint64_t CaptureReader::findTime(uint64_t timestampNs) const
+{
+	// A capture that is still being written has no index, and it is reopened every time it
+	// grows, so rebuilding one here would mean reading every record on each call. Records
+	// are appended in time order (give or take a few from different CPUs), so search them
+	// directly instead; only the pages the search touches are read.
+	if (!mIndexWasValid)
+	{
+		const CaptureRecord* end = mRecordData + mCount;
+		const CaptureRecord* found = std::partition_point(mRecordData, end, [timestampNs](const CaptureRecord& r) {
+			return r.timestampNs < timestampNs;
+		});
+		// An out of order record just before that may reach it too.
+		uint64_t i = static_cast<uint64_t>(found - mRecordData);
+		uint64_t first = i;
+		for (uint64_t j = i > REORDER_WINDOW ? i - REORDER_WINDOW : 0; j < i; ++j)
+		{
+			if (mRecordData[j].timestampNs >= timestampNs)
+			{
+				first = j;
+				break;
+			}
+		}
+		return first;
+	}
+
+	// Find the first block whose latest timestamp reaches it. Everything before that block
+	// is earlier.
+	const uint64_t* entry = std::lower_bound(mTimeIndex, mTimeIndex + mTimeEntries, timestampNs);
+	uint64_t i = static_cast<uint64_t>(entry - mTimeIndex) * mTimeInterval;
+	for (; i < mCount; ++i)
+		if (mRecordData[i].timestampNs >= timestampNs)
+			return i;
+	return mCount;
+}
+
+std::vector<CaptureEndpoint> CaptureReader::endpoints() const
+{
+	ensureIndex();
+
+	std::vector<CaptureEndpoint> result;
+	for (const auto& e : mEndpoints)
+		result.push_back(CaptureEndpoint::fromKey(e.key));
+	return result;
+}
+
+const uint64_t* CaptureReader::endpointRecords(const CaptureEndpoint& endpoint, uint64_t& count) const
+{
+	ensureIndex();
+
+	uint32_t key = endpoint.key();
+	auto it = std::lower_bound(mEndpoints.begin(), mEndpoints.end(), key, [](const EndpointEntry& e, uint32_t k) {
+		return e.key < k;
+	});
+	if (it == mEndpoints.end() || it->key != key)
+	{
+		count = 0;
+		return nullptr;
+	}
+	count = it->count;
+	return it->records;
+}
+
+SResult<uint64_t> ExportCaptureToPcapng(const CaptureReader& capture, const string& path)
+{
+	auto writerRes = PcapngWriter::create(path);
+	if (!writerRes)
+		return Err(writerRes.unwrap_err());
+	auto writer = writerRes.unwrap();
+
+	for (uint64_t i = 0; i < capture.size(); ++i)
+	{
+		auto record = capture.decode(i);
+		if (!record)
+			return Err(record.unwrap_err());
+		auto res = WriteUsbMonRecord(*writer, record.unwrap());
+		if (!res)
+			return Err(res.unwrap_err());
+	}
+
+	auto res = writer->flush();
+	if (!res)
+		return Err(res.unwrap_err());
+	return Ok(capture.size());
+}
+
+SResult<uint64_t> ImportPcapngToCapture(const string& pcapngPath, const string& path)
+{
+	auto readerRes = PcapngReader::open(pcapngPath);
+	if (!readerRes)
+		return Err(readerRes.unwrap_err());
+	auto reader = readerRes.unwrap();
+
+	auto writerRes = CaptureWriter::create(path);
+	if (!writerRes)
+		return Err(writerRes.unwrap_err());
+	auto writer = writerRes.unwrap();
+
+	PcapngPacket packet;
+	for (;;)
+	{
+		auto more = reader->next(packet);
+		if (!more)
+			return Err(more.unwrap_err());
+		if (!more.unwrap())
+			break;
+		if (packet.linkType != LINKTYPE_USB_LINUX_MMAPPED)
+			continue;
+
+		auto record = DecodeUsbMonEvent(packet.data, packet.size);
+		if (!record)
+			return Err("Packet " + std::to_string(reader->packets()) + " of " + pcapngPath + ": " + record.unwrap_err());
+		// The packet's timestamp can be finer than the microseconds in the usbmon header.
+		UsbMonRecord r = record.unwrap();
+		r.timestampNs = packet.timestampNs;
+		auto res = writer->append(r);
+		if (!res)
+			return Err(res.unwrap_err());
+	}
+
+	auto res = writer->finish();
+	if (!res)
+		return Err(res.unwrap_err());
+	return Ok(writer->records());
+}
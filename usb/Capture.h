@@ -0,0 +1,179 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/MappedFile.h"
+#include "UsbMon.h"
+
+// Our own capture format, for traces too big to scan. A capture is three files:
+//
+//   name            A header then fixed-size CaptureRecords, so record N is at a known offset.
+//   name.payload    The captured data of every record, appended in order.
+//   name.index      A sparse time index and the records of each endpoint, written when the
+//                   capture is finished. If it is missing or stale (e.g. the capture is still
+//                   being written, or was cut short by a crash) it is rebuilt in memory the
+//                   first time it is needed.
+//
+// Every file is mapped rather than read, so opening a capture of any size is instant and
+// only the pages that are looked at are read from disk. Like BinaryIO, everything is in the
+// host's byte order.
+//
+// Records keep every field of the usbmon event, so a capture can be converted to pcapng
+// without losing anything.
+
+// The fields are ordered so there is no padding.
+struct CaptureRecord
+{
+	uint64_t timestampNs;
+	uint64_t urbId;
+	// Where this record's isochronous descriptors and data are in the payload file.
+	uint64_t payloadOffset;
+	uint32_t payloadLength;
+	uint32_t urbLength;
+	int32_t status;
+	int32_t interval;
+	int32_t startFrame;
+	uint32_t transferFlags;
+	uint16_t bus;
+	uint8_t deviceAddress;
+	uint8_t endpoint;
+	// UsbMonEventType.
+	char type;
+	// EndpointInfo::Type.
+	uint8_t transferType;
+	char setupFlag;
+	char dataFlag;
+	uint8_t setup[8];
+	uint16_t isoDescriptorCount;
+	uint8_t reserved[6];
+};
+
+static_assert(sizeof(CaptureRecord) == 72, "CaptureRecord is part of the file format");
+
+// Identifies an endpoint of a device for the endpoint index.
+struct CaptureEndpoint
+{
+	uint16_t bus = 0;
+	uint8_t deviceAddress = 0;
+	// Including 0x80 for IN.
+	uint8_t endpoint = 0;
+
+	uint32_t key() const { return (uint32_t(bus) << 16) | (uint32_t(deviceAddress) << 8) | endpoint; }
+	static CaptureEndpoint fromKey(uint32_t key);
+	bool operator<(const CaptureEndpoint& other) const { return key() < other.key(); }
+};
+
+// Appends records to a new capture. Not thread-safe.
+class CaptureWriter
+{
+public:
+	// Create the capture, replacing any that is there.
+	static SResult<std::shared_ptr<CaptureWriter>> create(const std::string& path);
+
+	// Calls finish(), ignoring any error.
+	~CaptureWriter();
+
+	SResult<void> append(const UsbMonRecord& record);
+
+	// Write what has been appended so far to disk, so a reader opening the capture sees it.
+	SResult<void> flush();
+
+	// Trim the record file and write the index. Nothing can be appended afterwards. The
+	// index is built from the mapped records here rather than kept in memory while writing.
+	SResult<void> finish();
+
+	uint64_t records() const { return mCount; }
+
+private:
+	CaptureWriter() = default;
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+	std::string mPath;
+	std::shared_ptr<MappedFile> mRecords;
+	// How many records mRecords has room for.
+	uint64_t mCapacity = 0;
+	std::ofstream mPayload;
+	uint64_t mPayloadSize = 0;
+	uint64_t mCount = 0;
+	bool mFinished = false;
+};
+
+// Reads a capture. Everything is const, so it can be used from several threads at once.
+class CaptureReader
+{
+public:
+	static SResult<std::shared_ptr<CaptureReader>> open(const std::string& path);
+
+	uint64_t size() const { return mCount; }
+
+	// Only call these with i < size().
+	const CaptureRecord& record(uint64_t i) const { return mRecordData[i]; }
+	// The record's isochronous descriptors then its data, or nullptr if they are out of
+	// bounds (or empty).
+	const uint8_t* payload(uint64_t i, uint32_t& size) const;
+	// The whole record as it came from usbmon.
+	SResult<UsbMonRecord> decode(uint64_t i) const;
+
+	// The first record at or after `timestampNs`, or size() if there aren't any. Without a
+	// valid index this is a binary search of the records, so it never rebuilds the index.
+	uint64_t findTime(uint64_t timestampNs) const;
+
+	// Every endpoint in the capture.
+	std::vector<CaptureEndpoint> endpoints() const;
+	// The numbers of an endpoint's records, in order. `count` is set to how many there are.
+	const uint64_t* endpointRecords(const CaptureEndpoint& endpoint, uint64_t& count) const;
+
+	// False if the index file was missing or stale, so it will be rebuilt.
+	bool indexWasValid() const { return mIndexWasValid; }
+
+private:
+	CaptureReader() = default;
+	CaptureReader(const CaptureReader&) = delete;
+	CaptureReader& operator=(const CaptureReader&) = delete;
+
+	// Use the index file if it matches the records, and return false if it doesn't.
+	bool loadIndex(const std::string& path);
+	void rebuildIndex();
+	void ensureIndex() const;
+	// Point at an index in memory, after checking it.
+	bool useIndex(const uint8_t* data, uint64_t size);
+
+	std::shared_ptr<MappedFile> mRecordsFile;
+	std::shared_ptr<MappedFile> mPayloadFile;
+	std::shared_ptr<MappedFile> mIndexFile;
+
+	const CaptureRecord* mRecordData = nullptr;
+	uint64_t mCount = 0;
+
+	// Either into mIndexFile, or into mRebuilt. These are set by open() or ensureIndex().
+	const uint64_t* mTimeIndex = nullptr;
+	uint64_t mTimeEntries = 0;
+	uint64_t mTimeInterval = 1;
+	struct EndpointEntry
+	{
+		uint32_t key;
+		const uint64_t* records;
+		uint64_t count;
+	};
+	// Sorted by key.
+	std::vector<EndpointEntry> mEndpoints;
+	std::vector<uint64_t> mRebuilt;
+	bool mIndexWasValid = false;
+	mutable std::once_flag mRebuildOnce;
+};
+
+// Write every record of a capture to a pcapng file, as usbmon events. Returns how many.
+SResult<uint64_t> ExportCaptureToPcapng(const CaptureReader& capture, const std::string& path);
+
+// Read the usbmon events of a pcapng file (LINKTYPE_USB_LINUX_MMAPPED packets, as written by
+// ExportCaptureToPcapng() or by Wireshark on Linux) into a new capture at `path`, so they can
+// be indexed and searched with CaptureQuery. Packets of other link types are skipped.
+// Returns how many were imported.
+SResult<uint64_t> ImportPcapngToCapture(const std::string& pcapngPath, const std::string& path);
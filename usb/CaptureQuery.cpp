@@ -0,0 +1,296 @@
+#include "CaptureQuery.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+using std::string;
+
+namespace
+{
+// Big enough that posting a chunk costs nothing next to searching it, small enough that
+// matches start arriving straight away.
+const uint64_t RECORDS_PER_CHUNK = 1 << 16;
+const uint64_t BYTES_PER_CHUNK = 8 << 20;
+}
+
+const uint8_t* FindBytes(const uint8_t* data, size_t size, const uint8_t* pattern, size_t patternSize)
+{
+	if (patternSize == 0)
+		return data;
+	if (size < patternSize)
+		return nullptr;
+
+	// The last place the pattern could start.
+	const uint8_t* last = data + size - patternSize;
+	const uint8_t* p = data;
+	while (p <= last)
+	{
+		p = static_cast<const uint8_t*>(memchr(p, pattern[0], last - p + 1));
+		if (p == nullptr)
+			return nullptr;
+		if (memcmp(p + 1, pattern + 1, patternSize - 1) == 0)
+			return p;
+		++p;
+	}
+	return nullptr;
+}
+
+bool CaptureFilter::matches(const CaptureRecord& rec) const
+{
+	if (bus >= 0 && rec.bus != bus)
+		return false;
+	if (deviceAddress >= 0 && rec.deviceAddress != deviceAddress)
+		return false;
+	if (endpointNumber >= 0 && (rec.endpoint & 0x7F) != endpointNumber)
+		return false;
+	if (direction == Direction::In && !(rec.endpoint & 0x80))
+		return false;
+	if (direction == Direction::Out && (rec.endpoint & 0x80))
+		return false;
+	if (transferType >= 0 && rec.transferType != transferType)
+		return false;
+	if (eventType != 0 && rec.type != eventType)
+		return false;
+
+	if (bmRequestType >= 0 || bRequest >= 0 || wValue >= 0 || wIndex >= 0)
+	{
+		// usbmon sets the flag to 0 when there is a setup packet.
+		if (rec.setupFlag != 0)
+			return false;
+		if (bmRequestType >= 0 && rec.setup[0] != bmRequestType)
+			return false;
+		if (bRequest >= 0 && rec.setup[1] != bRequest)
+			return false;
+		if (wValue >= 0 && (rec.setup[2] | (rec.setup[3] << 8)) != wValue)
+			return false;
+		if (wIndex >= 0 && (rec.setup[4] | (rec.setup[5] << 8)) != wIndex)
+			return false;
+	}
+
+	switch (status)
+	{
+	case Status::Any:
+		break;
+	case Status::Ok:
+		if (rec.status != 0)
+			return false;
+		break;
+	case Status::Failed:
+		if (rec.status == 0)
+			return false;
+		break;
+	case Status::Code:
+		if (rec.status != statusCode)
+			return false;
+		break;
+	}
+	return true;
+}
+
+bool CaptureFilter::singleEndpoint(CaptureEndpoint& endpoint) const
+{
+	if (bus < 0 || deviceAddress < 0 || endpointNumber < 0 || direction == Direction::Any)
+		return false;
+	endpoint.bus = bus;
+	endpoint.deviceAddress = deviceAddress;
+	endpoint.endpoint = (endpointNumber & 0x7F) | (direction == Direction::In ? 0x80 : 0);
+	return true;
+}
+
+CaptureQuery::CaptureQuery(PostFunc post, int maxJobs) : post(post), maxJobs(maxJobs < 1 ? 1 : maxJobs)
+{
+}
+
+void CaptureQuery::start(std::shared_ptr<CaptureReader> capture, const CaptureFilter& filter, MatchesFunc m, DoneFunc d)
+{
+	// Either every record, or the list of the endpoint's records from the index.
+	const uint64_t* list = nullptr;
+	uint64_t count = capture->size();
+	CaptureEndpoint endpoint;
+	if (filter.singleEndpoint(endpoint))
+	{
+		list = capture->endpointRecords(endpoint, count);
+		if (list == nullptr)
+			count = 0;
+	}
+
+	ChunkFunc s = [capture, filter, list, count](uint64_t chunk, std::vector<CaptureMatch>& found) {
+		uint64_t first = chunk * RECORDS_PER_CHUNK;
+		uint64_t end = std::min(count, first + RECORDS_PER_CHUNK);
+		for (uint64_t i = first; i < end; ++i)
+		{
+			uint64_t r = list ? list[i] : i;
+			const CaptureRecord& rec = capture->record(r);
+			if (!filter.matches(rec))
+				continue;
+
+			CaptureMatch match;
+			match.record = r;
+			if (!filter.pattern.empty())
+			{
+				uint32_t size = 0;
+				const uint8_t* payload = capture->payload(r, size);
+				uint32_t skip = rec.isoDescriptorCount * static_cast<uint32_t>(USBMON_ISO_DESCRIPTOR_SIZE);
+				if (payload == nullptr || size <= skip)
+					continue;
+				const uint8_t* at = FindBytes(payload + skip, size - skip, filter.pattern.data(), filter.pattern.size());
+				if (at == nullptr)
+					continue;
+				match.offset = at - (payload + skip);
+			}
+			found.push_back(match);
+		}
+	};
+
+	begin((count + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK, s, m, d);
+}
+
+SResult<void> CaptureQuery::startFile(const string& path, const std::vector<uint8_t>& pattern, MatchesFunc m, DoneFunc d)
+{
+	if (pattern.empty())
+		return Err(string("The search pattern is empty"));
+
+	auto fileRes = MappedFile::open(path, MappedFile::Mode::ReadOnly);
+	if (!fileRes)
+		return Err(fileRes.unwrap_err());
+	std::shared_ptr<MappedFile> file = fileRes.unwrap();
+	uint64_t size = file->size();
+
+	ChunkFunc s = [file, pattern, size](uint64_t chunk, std::vector<CaptureMatch>& found) {
+		// Chunks overlap by one byte less than the pattern, so a match across the boundary
+		// is found by the chunk it starts in.
+		uint64_t first = chunk * BYTES_PER_CHUNK;
+		uint64_t startsEnd = std::min(size, first + BYTES_PER_CHUNK);
+		uint64_t end = std::min<uint64_t>(size, startsEnd + pattern.size() - 1);
+
+		const uint8_t* data = file->data();
+		uint64_t at = first;
+		while (at < startsEnd)
+		{
+			const uint8_t* p = FindBytes(data + at, end - at, pattern.data(), pattern.size());
+			if (p == nullptr || uint64_t(p - data) >= startsEnd)
+				break;
+			CaptureMatch match;
+			match.offset = p - data;
+			found.push_back(match);
+			at = match.offset + 1;
+		}
+	};
+
+	begin((size + BYTES_PER_CHUNK - 1) / BYTES_PER_CHUNK, s, m, d);
+	return Ok();
+}
+
+void CaptureQuery::begin(uint64_t chunks, ChunkFunc s, MatchesFunc m, DoneFunc d)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	search = s;
+	matchesFunc = m;
+	doneFunc = d;
+	counts.chunks = chunks;
+	startTime = HighResClock::now();
+
+	startNext();
+	if (chunks == 0)
+		report(lock);
+}
+
+void CaptureQuery::startNext()
+{
+	while (running < maxJobs && nextChunk < counts.chunks)
+	{
+		uint64_t chunk = nextChunk++;
+		++running;
+
+		std::shared_ptr<CaptureQuery> self = shared_from_this();
+		post([self, chunk] { self->runOne(chunk); });
+	}
+}
+
+void CaptureQuery::runOne(uint64_t chunk)
+{
+	bool skip = false;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		skip = counts.cancelled;
+	}
+
+	std::vector<CaptureMatch> found;
+	if (!skip)
+		search(chunk, found);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	--running;
+	++counts.chunksDone;
+	finished[chunk] = std::move(found);
+	startNext();
+	report(lock);
+}
+
+void CaptureQuery::report(std::unique_lock<std::mutex>& lock)
+{
+	// Whoever is already reporting will pick up our chunk before it stops.
+	if (reporting)
+		return;
+	reporting = true;
+
+	for (;;)
+	{
+		std::vector<CaptureMatch> batch;
+		while (!finished.empty() && finished.begin()->first == nextToReport)
+		{
+			std::vector<CaptureMatch>& chunk = finished.begin()->second;
+			batch.insert(batch.end(), chunk.begin(), chunk.end());
+			finished.erase(finished.begin());
+			++nextToReport;
+		}
+		if (batch.empty() || counts.cancelled)
+			break;
+
+		counts.matches += batch.size();
+		lock.unlock();
+		if (matchesFunc)
+			matchesFunc(batch);
+		lock.lock();
+	}
+
+	if (!done && counts.chunksDone == counts.chunks)
+	{
+		done = true;
+		CaptureQueryStats s = statsLocked();
+		lock.unlock();
+		if (doneFunc)
+			doneFunc(s);
+		lock.lock();
+		reporting = false;
+		doneCondition.notify_all();
+		return;
+	}
+	reporting = false;
+}
+
+void CaptureQuery::cancel()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	counts.cancelled = true;
+}
+
+void CaptureQuery::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this] { return done && !reporting; });
+}
+
+CaptureQueryStats CaptureQuery::stats() const
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return statsLocked();
+}
+
+CaptureQueryStats CaptureQuery::statsLocked() const
+{
+	CaptureQueryStats s = counts;
+	s.seconds = std::chrono::duration<double>(HighResClock::now() - startTime).count();
+	return s;
+}
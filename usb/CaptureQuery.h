@@ -0,0 +1,167 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/HighResClock.h"
+#include "util/MappedFile.h"
+#include "Capture.h"
+
+// The first occurrence of `pattern` in `data`, or nullptr. memchr() finds candidates for the
+// first byte (it is vectorised on every platform we build for) and each one is checked with
+// memcmp(). An empty pattern matches at the start.
+const uint8_t* FindBytes(const uint8_t* data, size_t size, const uint8_t* pattern, size_t patternSize);
+
+// Selects capture records. Fields left at their defaults match anything.
+struct CaptureFilter
+{
+	int bus = -1;
+	int deviceAddress = -1;
+	// Without the direction bit.
+	int endpointNumber = -1;
+
+	enum class Direction
+	{
+		Any,
+		In,
+		Out,
+	};
+	Direction direction = Direction::Any;
+
+	// EndpointInfo::Type.
+	int transferType = -1;
+	// A UsbMonEventType, or 0 for any.
+	char eventType = 0;
+
+	// Fields of the setup packet. If any are set, only records with a setup packet (control
+	// submissions) match.
+	int bmRequestType = -1;
+	int bRequest = -1;
+	int wValue = -1;
+	int wIndex = -1;
+
+	enum class Status
+	{
+		Any,
+		Ok,
+		// Anything but 0, including -EINPROGRESS on submissions.
+		Failed,
+		// Exactly `statusCode`.
+		Code,
+	};
+	Status status = Status::Any;
+	int32_t statusCode = 0;
+
+	// Only records whose data contains these bytes. The isochronous descriptors are not searched.
+	std::vector<uint8_t> pattern;
+
+	// Everything but the pattern. Records are fixed-size, so this only reads the record file.
+	bool matches(const CaptureRecord& record) const;
+
+	// The single endpoint this selects, if it selects one, so its index can be used.
+	bool singleEndpoint(CaptureEndpoint& endpoint) const;
+};
+
+struct CaptureMatch
+{
+	// The record number. 0 for a file search.
+	uint64_t record = 0;
+	// Where the pattern starts: in the record's data, or in the file. 0 if there's no pattern.
+	uint64_t offset = 0;
+};
+
+struct CaptureQueryStats
+{
+	uint64_t chunks = 0;
+	uint64_t chunksDone = 0;
+	uint64_t matches = 0;
+	bool cancelled = false;
+	// Since start.
+	double seconds = 0.0;
+
+	double fraction() const { return chunks ? double(chunksDone) / chunks : 1.0; }
+};
+
+// Searches a capture, or any file, in chunks that run in parallel. Matches are reported as
+// each chunk finishes, but always in order, so they can be appended to a list as they come.
+//
+// Like FleetRunner it doesn't own any threads: `post` is given each chunk to run. At most
+// `maxJobs` chunks are queued or running at once, so a query over a huge file doesn't fill
+// the pool's queue.
+//
+// Must be created with std::make_shared, since queued chunks keep a reference to it.
+class CaptureQuery : public std::enable_shared_from_this<CaptureQuery>
+{
+public:
+	typedef std::function<void(std::function<void()> job)> PostFunc;
+	// Called from the job threads with the matches of one or more chunks, one call at a time.
+	typedef std::function<void(const std::vector<CaptureMatch>& matches)> MatchesFunc;
+	// Called once, after the last matches (or after cancel()).
+	typedef std::function<void(const CaptureQueryStats& stats)> DoneFunc;
+
+	CaptureQuery(PostFunc post, int maxJobs);
+
+	// Find the records of `capture` that match `filter`, with the offset of the pattern in
+	// each. If the filter selects a single endpoint, only that endpoint's records are read.
+	// Only call one of the start functions, once.
+	void start(std::shared_ptr<CaptureReader> capture, const CaptureFilter& filter, MatchesFunc matches, DoneFunc done);
+
+	// Find every occurrence of `pattern` in a file of any format, e.g. a pcapng trace. This
+	// only looks at the bytes: pcapng blocks aren't parsed, so a match can be in a block
+	// header, and CaptureFilter's fields can't be used. To filter the packets of a pcapng
+	// trace, import it with ImportPcapngToCapture() and use start().
+	SResult<void> startFile(const std::string& path, const std::vector<uint8_t>& pattern, MatchesFunc matches, DoneFunc done);
+
+	// Skip the chunks that haven't started. Nothing more is reported after done.
+	void cancel();
+
+	// Block until done has been called.
+	void wait();
+
+	CaptureQueryStats stats() const;
+
+private:
+	CaptureQuery(const CaptureQuery&) = delete;
+	CaptureQuery& operator=(const CaptureQuery&) = delete;
+
+	typedef std::function<void(uint64_t chunk, std::vector<CaptureMatch>& matches)> ChunkFunc;
+
+	void begin(uint64_t chunks, ChunkFunc search, MatchesFunc matches, DoneFunc done);
+	// Post chunks until there are maxJobs. `mutex` must be locked.
+	void startNext();
+	void runOne(uint64_t chunk);
+	// Report the finished chunks that are next in order, then done if everything has
+	// finished. `lock` holds `mutex`, and is released while calling back.
+	void report(std::unique_lock<std::mutex>& lock);
+	// `mutex` must be locked.
+	CaptureQueryStats statsLocked() const;
+
+	PostFunc post;
+	int maxJobs;
+
+	ChunkFunc search;
+	MatchesFunc matchesFunc;
+	DoneFunc doneFunc;
+
+	mutable std::mutex mutex;
+	std::condition_variable doneCondition;
+
+	uint64_t nextChunk = 0;
+	int running = 0;
+	// Finished chunks that can't be reported until the ones before them have been.
+	std::map<uint64_t, std::vector<CaptureMatch>> finished;
+	uint64_t nextToReport = 0;
+	// True while a thread is calling matchesFunc, so the calls stay in order.
+	bool reporting = false;
+	bool done = false;
+
+	CaptureQueryStats counts;
+	HighResClock::time_point startTime;
+};
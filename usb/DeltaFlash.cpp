@@ -0,0 +1,201 @@
+#include "DeltaFlash.h"
+
+#include "util/Crc32.h"
+#include "util/HighResClock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+using std::string;
+
+std::vector<uint32_t> HashImageBlocks(const uint8_t* data, uint64_t size, const DeltaFlashProtocol& protocol)
+{
+	uint64_t blockSize = protocol.blockSize;
+	std::vector<uint32_t> hashes;
+	hashes.reserve((size + blockSize - 1) / blockSize);
+
+	std::vector<uint8_t> pad(blockSize, protocol.padding);
+
+	for (uint64_t offset = 0; offset < size; offset += blockSize)
+	{
+		uint64_t n = std::min(blockSize, size - offset);
+		uint32_t crc = Crc32(data + offset, n);
+		if (n < blockSize)
+			crc = Crc32(pad.data(), blockSize - n, crc);
+		hashes.push_back(crc);
+	}
+	return hashes;
+}
+
+size_t FirstDifference(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	// memcmp() is vectorised by every C library we use, so compare in chunks with it and only
+	// look at individual bytes in the chunk that differs.
+	static const size_t CHUNK = 256;
+
+	size_t offset = 0;
+	while (offset < size)
+	{
+		size_t n = std::min(CHUNK, size - offset);
+		if (memcmp(a + offset, b + offset, n) != 0)
+			break;
+		offset += n;
+	}
+
+	while (offset < size && a[offset] == b[offset])
+		++offset;
+	return offset;
+}
+
+DeltaFlasher::DeltaFlasher(std::shared_ptr<Device> device, DeltaFlashProtocol protocol) : device(device), protocol(protocol)
+{
+}
+
+SResult<std::vector<uint32_t>> DeltaFlasher::deviceHashes(uint32_t firstBlock, uint32_t count)
+{
+	std::vector<uint32_t> hashes;
+	hashes.reserve(count);
+
+	uint32_t perRequest = std::max<uint32_t>(1, std::min<uint32_t>(protocol.maxHashesPerRequest, 0xFFFF / 4));
+
+	for (uint32_t block = firstBlock; block < firstBlock + count; )
+	{
+		uint32_t n = std::min(perRequest, firstBlock + count - block);
+
+		std::vector<uint8_t> data = TRY(device->controlTransferInSync(protocol.recipient,
+		                                                              Device::Type::Vendor,
+		                                                              protocol.hashRequest,
+		                                                              block,
+		                                                              protocol.wIndex,
+		                                                              n * 4));
+		if (data.size() != n * 4)
+			return Err("Hash request for block " + std::to_string(block) + " returned " + std::to_string(data.size()) +
+			           " bytes; expected " + std::to_string(n * 4));
+
+		for (uint32_t i = 0; i < n; ++i)
+			hashes.push_back(data[i * 4] | (data[i * 4 + 1] << 8) | (data[i * 4 + 2] << 16) | (static_cast<uint32_t>(data[i * 4 + 3]) << 24));
+
+		block += n;
+	}
+	return Ok(hashes);
+}
+
+SResult<std::vector<uint8_t>> DeltaFlasher::readBlock(uint32_t block)
+{
+	std::vector<uint8_t> data = TRY(device->controlTransferInSync(protocol.recipient,
+	                                                              Device::Type::Vendor,
+	                                                              protocol.readRequest,
+	                                                              block,
+	                                                              protocol.wIndex,
+	                                                              protocol.blockSize));
+	if (data.size() != protocol.blockSize)
+		return Err("Reading block " + std::to_string(block) + " returned " + std::to_string(data.size()) + " bytes");
+	return Ok(data);
+}
+
+SResult<void> DeltaFlasher::writeBlock(uint32_t block, std::vector<uint8_t> data)
+{
+	return device->controlTransferOutSync(protocol.recipient,
+	                                      Device::Type::Vendor,
+	                                      protocol.writeRequest,
+	                                      block,
+	                                      protocol.wIndex,
+	                                      std::move(data),
+	                                      protocol.writeTimeoutMs);
+}
+
+std::vector<uint8_t> DeltaFlasher::imageBlock(const MappedFile& image, uint32_t block) const
+{
+	uint64_t offset = static_cast<uint64_t>(block) * protocol.blockSize;
+	uint64_t n = std::min<uint64_t>(protocol.blockSize, image.size() - offset);
+
+	std::vector<uint8_t> data(protocol.blockSize, protocol.padding);
+	memcpy(data.data(), image.data() + offset, n);
+	return data;
+}
+
+SResult<DeltaFlashProgress> DeltaFlasher::flash(const MappedFile& image, bool verify, DeltaFlashProgressCallback progressCallback)
+{
+	if (!device || !device->isOpen())
+		return Err(string("Device not open"));
+	if (protocol.blockSize == 0)
+		return Err(string("Block size is 0"));
+
+	HighResClock::time_point start = HighResClock::now();
+
+	std::vector<uint32_t> imageHashes = HashImageBlocks(image.data(), image.size(), protocol);
+	// Blocks are addressed by wValue.
+	if (imageHashes.size() > 0x10000)
+		return Err("Image has " + std::to_string(imageHashes.size()) + " blocks; at most 65536 can be addressed");
+
+	DeltaFlashProgress progress;
+	progress.blocksTotal = imageHashes.size();
+
+	auto report = [&]() {
+		progress.seconds = std::chrono::duration<double>(HighResClock::now() - start).count();
+		return !progressCallback || progressCallback(progress);
+	};
+
+	std::vector<uint32_t> written;
+
+	// Fetch the device's hashes a batch at a time so progress starts moving straight away.
+	for (uint32_t first = 0; first < imageHashes.size(); )
+	{
+		uint32_t count = std::min<uint32_t>(std::max<uint16_t>(protocol.maxHashesPerRequest, 1), imageHashes.size() - first);
+		std::vector<uint32_t> hashes = TRY(deviceHashes(first, count));
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t block = first + i;
+			if (hashes[i] != imageHashes[block])
+			{
+				MSTRY(writeBlock(block, imageBlock(image, block)));
+				written.push_back(block);
+				++progress.blocksWritten;
+			}
+			++progress.blocksDone;
+			if (!report())
+				return Err(string("Flashing cancelled"));
+		}
+		first += count;
+	}
+
+	if (!verify)
+		return Ok(progress);
+
+	// Only read back what we wrote; the unchanged blocks are checked by hash below.
+	for (uint32_t block : written)
+	{
+		std::vector<uint8_t> readBack = TRY(readBlock(block));
+		std::vector<uint8_t> expected = imageBlock(image, block);
+
+		size_t diff = FirstDifference(readBack.data(), expected.data(), expected.size());
+		if (diff != expected.size())
+			return Err("Verify failed at offset " + std::to_string(static_cast<uint64_t>(block) * protocol.blockSize + diff));
+
+		++progress.blocksVerified;
+		if (!report())
+			return Err(string("Verify cancelled"));
+	}
+
+	// Check the skipped blocks are still what we compared them with.
+	for (uint32_t first = 0; first < imageHashes.size(); )
+	{
+		uint32_t count = std::min<uint32_t>(std::max<uint16_t>(protocol.maxHashesPerRequest, 1), imageHashes.size() - first);
+		std::vector<uint32_t> hashes = TRY(deviceHashes(first, count));
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (hashes[i] != imageHashes[first + i])
+				return Err("Verify failed: block " + std::to_string(first + i) + " has the wrong hash");
+		}
+
+		progress.blocksRehashed += count;
+		if (!report())
+			return Err(string("Verify cancelled"));
+		first += count;
+	}
+
+	return Ok(progress);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/MappedFile.h"
+#include "Device.h"
+
+// The vendor requests a device has to implement for delta flashing. Flash is treated as an
+// array of `blockSize` byte blocks, addressed by block number in wValue. All the requests are
+// sent to `recipient` with `wIndex` (e.g. Recipient::Interface and the interface number).
+struct DeltaFlashProtocol
+{
+	Device::Recipient recipient = Device::Recipient::Device;
+	uint16_t wIndex = 0;
+
+	// IN. wValue is the first block and wLength / 4 the number of blocks. Returns the
+	// CRC-32 (see Crc32()) of each block, little-endian.
+	uint8_t hashRequest = 0xA0;
+	// IN. wValue is the block. Returns blockSize bytes.
+	uint8_t readRequest = 0xA1;
+	// OUT. wValue is the block, and the data is blockSize bytes. The device erases and
+	// programs the block before completing the status stage.
+	uint8_t writeRequest = 0xA2;
+
+	uint16_t blockSize = 1024;
+	// The most hashes asked for in one request.
+	uint16_t maxHashesPerRequest = 256;
+	// The value of erased flash. The last block of the image is padded with this.
+	uint8_t padding = 0xFF;
+	// Erasing and programming a block can take a while.
+	uint32_t writeTimeoutMs = 10000;
+};
+
+struct DeltaFlashProgress
+{
+	uint32_t blocksTotal = 0;
+	// Blocks that have been compared, whether they needed writing or not.
+	uint32_t blocksDone = 0;
+	uint32_t blocksWritten = 0;
+	// Written blocks that have been read back and compared.
+	uint32_t blocksVerified = 0;
+	// Blocks whose hash has been checked again after writing, including the skipped ones.
+	uint32_t blocksRehashed = 0;
+	// Since flash() started.
+	double seconds = 0.0;
+
+	uint32_t blocksSkipped() const { return blocksDone - blocksWritten; }
+};
+
+// Called after every block. Return false to stop.
+typedef std::function<bool(const DeltaFlashProgress&)> DeltaFlashProgressCallback;
+
+// Hash an image in blocks, padding the last one, the same way the device hashes its flash.
+std::vector<uint32_t> HashImageBlocks(const uint8_t* data, uint64_t size, const DeltaFlashProtocol& protocol);
+
+// Find the first byte that differs between `a` and `b`, or return `size` if they are the same.
+size_t FirstDifference(const uint8_t* a, const uint8_t* b, size_t size);
+
+// Writes firmware to a device that mostly holds the same firmware already. The image is hashed
+// in blocks and compared with the device's own block hashes, and only the blocks that differ
+// are written. Written blocks are then read back and compared with the image.
+//
+// Verifying also asks for every block's hash again, so blocks that were skipped are checked
+// against the image as well. That catches a write that disturbed its neighbours (e.g. flash
+// whose erase unit is bigger than blockSize) for 4 bytes per block rather than a full read.
+// A skipped block is only as certain as CRC-32 though: a corrupt block that happens to have
+// the right hash is missed, with odds of 1 in 2^32 per block.
+//
+// The image is used straight from the mapping; only one block at a time is copied, to pad it
+// and hand it to the control transfer.
+class DeltaFlasher
+{
+public:
+	DeltaFlasher(std::shared_ptr<Device> device, DeltaFlashProtocol protocol);
+
+	// Write the blocks of `image` that differ from the device's. With `verify`, read back the
+	// written blocks and then check every block's hash again.
+	SResult<DeltaFlashProgress> flash(const MappedFile& image, bool verify = true, DeltaFlashProgressCallback progress = DeltaFlashProgressCallback());
+
+	// The individual requests.
+	SResult<std::vector<uint32_t>> deviceHashes(uint32_t firstBlock, uint32_t count);
+	SResult<std::vector<uint8_t>> readBlock(uint32_t block);
+	SResult<void> writeBlock(uint32_t block, std::vector<uint8_t> data);
+
+private:
+	// Copy block `block` of the image, padded to blockSize.
+	std::vector<uint8_t> imageBlock(const MappedFile& image, uint32_t block) const;
+
+	std::shared_ptr<Device> device;
+	DeltaFlashProtocol protocol;
+};
@@ -0,0 +1,257 @@
+#include "DescriptorCache.h"
+
+#include "util/BinaryIO.h"
+
+#include <random>
+#include <string.h>
+
+using std::string;
+
+namespace
+{
+
+// Bump the version if the record format changes.
+const char MAGIC[8] = {'U', 'T', 'D', 'C', 'A', 'C', 'H', '2'};
+
+struct FileHeader
+{
+	char magic[8];
+	uint32_t numBuckets;
+	uint32_t numEntries;
+	// Offset of the end of the last record.
+	uint64_t dataEnd;
+};
+
+struct Bucket
+{
+	// Hash of the key. 0 means the bucket is empty.
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t checksum;
+};
+
+uint64_t Fnv1a(const uint8_t* data, size_t size, uint64_t h = 14695981039346656037ull)
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		h ^= data[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+uint64_t HashKey(const DescriptorCacheKey& key)
+{
+	uint64_t h = Fnv1a(key.deviceDescriptor.data(), key.deviceDescriptor.size());
+	h = Fnv1a(reinterpret_cast<const uint8_t*>(key.serial.data()), key.serial.size(), h);
+	return h == 0 ? 1 : h;
+}
+
+void WriteRecord(ByteWriter& w, const DescriptorCacheKey& key, const DeviceDescriptor& desc)
+{
+	for (uint8_t b : key.deviceDescriptor)
+		w.pod(b);
+	w.str(key.serial);
+
+	std::vector<uint8_t> blob = SerializeDeviceDescriptor(desc);
+	w.buf.insert(w.buf.end(), blob.begin(), blob.end());
+}
+
+bool ReadKey(ByteReader& r, DescriptorCacheKey& key)
+{
+	for (uint8_t& b : key.deviceDescriptor)
+		if (!r.pod(b))
+			return false;
+	return r.str(key.serial);
+}
+
+uint64_t DataStart(uint32_t numBuckets)
+{
+	return sizeof(FileHeader) + numBuckets * sizeof(Bucket);
+}
+
+// Write an empty header and table at the start of `file`.
+void WriteEmptyCache(MappedFile& file, uint32_t numBuckets)
+{
+	memset(file.data(), 0, DataStart(numBuckets));
+
+	FileHeader header;
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.numBuckets = numBuckets;
+	header.numEntries = 0;
+	header.dataEnd = DataStart(numBuckets);
+	memcpy(file.data(), &header, sizeof(header));
+}
+
+}
+
+DescriptorCache& DescriptorCache::global()
+{
+	static DescriptorCache cache;
+	return cache;
+}
+
+SResult<void> DescriptorCache::open(const string& path)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	this->path = path;
+	file = TRY(MappedFile::open(path, MappedFile::Mode::ReadWrite, INITIAL_FILE_SIZE));
+
+	FileHeader header;
+	memcpy(&header, file->data(), sizeof(header));
+
+	bool valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+	             header.numBuckets == NUM_BUCKETS &&
+	             header.dataEnd >= DataStart(NUM_BUCKETS) &&
+	             header.dataEnd <= file->size();
+	if (!valid)
+	{
+		SResult<void> res = clear();
+		if (!res)
+			file.reset();
+		return res;
+	}
+	return Ok();
+}
+
+SResult<void> DescriptorCache::clear()
+{
+	// Another instance may have the file mapped, and shrinking it under them would crash them
+	// when they touched a page past the new end. So the empty cache goes in a new file which
+	// replaces the old one; they carry on with the old one until they next open it.
+	string tempPath = path + "." + std::to_string(std::random_device()()) + ".tmp";
+	{
+		std::shared_ptr<MappedFile> temp = TRY(MappedFile::open(tempPath, MappedFile::Mode::ReadWrite, INITIAL_FILE_SIZE));
+		WriteEmptyCache(*temp, NUM_BUCKETS);
+		// So a crash can't leave a renamed file with an unwritten header.
+		temp->flush();
+	}
+
+	// Windows can't rename over a file that is open, even by us.
+	file.reset();
+	bool renamed = MappedFile::rename(tempPath, path);
+	if (!renamed)
+		MappedFile::remove(tempPath);
+
+	file = TRY(MappedFile::open(path, MappedFile::Mode::ReadWrite, INITIAL_FILE_SIZE));
+
+	// Another instance has it open on Windows. Clearing it in place is safe as long as it
+	// doesn't shrink; they only see cache misses.
+	if (!renamed)
+		WriteEmptyCache(*file, NUM_BUCKETS);
+
+	return Ok();
+}
+
+SResult<DeviceDescriptor> DescriptorCache::lookup(const DescriptorCacheKey& key)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!file)
+		return Err(string("Descriptor cache not open"));
+
+	uint64_t hash = HashKey(key);
+	const Bucket* buckets = reinterpret_cast<const Bucket*>(file->data() + sizeof(FileHeader));
+
+	for (uint32_t probe = 0; probe < NUM_BUCKETS; ++probe)
+	{
+		const Bucket& b = buckets[(hash + probe) % NUM_BUCKETS];
+		if (b.hash == 0)
+			break;
+		if (b.hash != hash)
+			continue;
+
+		if (b.offset < DataStart(NUM_BUCKETS) || b.offset > file->size() || b.length > file->size() - b.offset)
+			continue;
+
+		const uint8_t* record = file->data() + b.offset;
+		if (static_cast<uint32_t>(Fnv1a(record, b.length)) != b.checksum)
+			continue;
+
+		ByteReader r(record, b.length);
+		DescriptorCacheKey storedKey;
+		if (!ReadKey(r, storedKey) || !(storedKey == key))
+			continue;
+
+		SResult<DeviceDescriptor> desc = DeserializeDeviceDescriptor(r.position(), r.remaining());
+		if (!desc)
+			continue;
+		return desc;
+	}
+	return Err(string("Not in descriptor cache"));
+}
+
+void DescriptorCache::store(const DescriptorCacheKey& key, const DeviceDescriptor& desc)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!file)
+		return;
+
+	ByteWriter w;
+	WriteRecord(w, key, desc);
+	const std::vector<uint8_t>& record = w.buf;
+
+	FileHeader header;
+	memcpy(&header, file->data(), sizeof(header));
+
+	if (header.numEntries + 1 > NUM_BUCKETS / 2 || header.dataEnd + record.size() > MAX_FILE_SIZE)
+	{
+		if (!clear())
+		{
+			file.reset();
+			return;
+		}
+		memcpy(&header, file->data(), sizeof(header));
+	}
+
+	// Grow the file by doubling.
+	if (header.dataEnd + record.size() > file->size())
+	{
+		uint64_t newSize = file->size();
+		while (header.dataEnd + record.size() > newSize)
+			newSize *= 2;
+		if (!file->resize(newSize))
+		{
+			file.reset();
+			return;
+		}
+	}
+
+	// Write the record before pointing a bucket at it.
+	memcpy(file->data() + header.dataEnd, record.data(), record.size());
+
+	Bucket newBucket;
+	newBucket.hash = HashKey(key);
+	newBucket.offset = header.dataEnd;
+	newBucket.length = record.size();
+	newBucket.checksum = static_cast<uint32_t>(Fnv1a(record.data(), record.size()));
+
+	Bucket* buckets = reinterpret_cast<Bucket*>(file->data() + sizeof(FileHeader));
+	for (uint32_t probe = 0; probe < NUM_BUCKETS; ++probe)
+	{
+		Bucket& b = buckets[(newBucket.hash + probe) % NUM_BUCKETS];
+		if (b.hash == 0)
+		{
+			b = newBucket;
+			++header.numEntries;
+			break;
+		}
+
+		// Replace an existing entry for the same key. The old record is leaked
+		// until the cache is next cleared.
+		if (b.hash == newBucket.hash && b.offset + b.length <= header.dataEnd)
+		{
+			ByteReader r(file->data() + b.offset, b.length);
+			DescriptorCacheKey storedKey;
+			if (ReadKey(r, storedKey) && storedKey == key)
+			{
+				b = newBucket;
+				break;
+			}
+		}
+	}
+
+	header.dataEnd += record.size();
+	memcpy(file->data(), &header, sizeof(header));
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/MappedFile.h"
+#include "Descriptors.h"
+
+static_assert(sizeof(UsbDeviceDescriptor) == 18, "UsbDeviceDescriptor must match the wire format");
+
+// Identifies a device model and unit for the descriptor cache. The raw device descriptor is
+// also the validation read: if a device's firmware is updated without changing bcdDevice its
+// descriptor almost always changes somewhere, and then the cached entry doesn't match.
+struct DescriptorCacheKey
+{
+	// The 18 byte device descriptor exactly as read from the device. This includes
+	// idVendor, idProduct and bcdDevice.
+	std::array<uint8_t, 18> deviceDescriptor{};
+	// The serial number as reported by the OS without any bus traffic. This is empty if
+	// the device doesn't have one, in which case all units with the same device
+	// descriptor share an entry.
+	std::string serial;
+
+	bool operator==(const DescriptorCacheKey& other) const {
+		return deviceDescriptor == other.deviceDescriptor && serial == other.serial;
+	}
+};
+
+// A persistent cache of the descriptors (and strings) of devices we have seen before, so
+// opening them doesn't have to read every configuration and string descriptor again.
+//
+// The cache is a single memory-mapped file: a header, an open-addressing hash table of
+// fixed-size buckets, and then the records they point to. Records are only ever appended;
+// when the table is half full or the file reaches MAX_FILE_SIZE the whole cache is cleared.
+// Clearing writes a new file and renames it over the old one rather than truncating the old
+// one, since other instances may have it mapped. Each record has a checksum and every offset is bounds-checked, so a corrupt or
+// half-written file (e.g. from two instances writing at once) only causes cache misses.
+class DescriptorCache
+{
+public:
+	// The cache used by OpenUsbDevice(). It does nothing until open() is called.
+	static DescriptorCache& global();
+
+	// Open or create the cache file. If it is invalid it is cleared.
+	SResult<void> open(const std::string& path);
+
+	// Get the cached descriptors for a device, or an error if there aren't any.
+	SResult<DeviceDescriptor> lookup(const DescriptorCacheKey& key);
+
+	// Add or replace the descriptors for a device. Errors are ignored since the
+	// cache is only an optimisation.
+	void store(const DescriptorCacheKey& key, const DeviceDescriptor& desc);
+
+private:
+	DescriptorCache() = default;
+	DescriptorCache(const DescriptorCache&) = delete;
+	DescriptorCache& operator=(const DescriptorCache&) = delete;
+
+	static const uint32_t NUM_BUCKETS = 4096;
+	static const uint64_t INITIAL_FILE_SIZE = 1 << 20;
+	static const uint64_t MAX_FILE_SIZE = 64 << 20;
+
+	// Replace the file with an empty cache. `mutex` must be locked. On success `file` is the
+	// new file.
+	SResult<void> clear();
+
+	std::mutex mutex;
+	std::string path;
+	std::shared_ptr<MappedFile> file;
+};
@@ -1,6 +1,10 @@
 #include "Descriptors.h"
 
 #include "UsbSpecification.h"
+#include "util/BinaryIO.h"
+#include "util/FastLog.h"
+
+#include <string.h>
 
 std::string to_string(const DeviceDescriptor& val)
 {
@@ -65,7 +69,70 @@ std::string to_string(const EndpointDescriptor& val)
 	       "        bEndpointAddress: " + std::to_string(val.bEndpointAddress) + "\n"
 	       "        bmAttributes:     " + std::to_string(val.bmAttributes) + "\n"
 	       "        wMaxPacketSize:   " + std::to_string(val.wMaxPacketSize) + "\n"
-	       "        bInterval:        " + std::to_string(val.bInterval) + "\n";
+	       "        bInterval:        " + std::to_string(val.bInterval) + "\n" +
+	       (val.hasCompanion ?
+	           "        bMaxBurst:        " + std::to_string(val.bMaxBurst) + "\n"
+	           "        bmAttributes (companion): " + std::to_string(val.bmCompanionAttributes) + "\n"
+	           "        wBytesPerInterval: " + std::to_string(val.wBytesPerInterval) + "\n" : std::string());
+}
+
+SResult<DeviceDescriptor> ParseDeviceDescriptor(const std::vector<uint8_t>& data)
+{
+	UsbDeviceDescriptor devDesc;
+	if (data.size() != sizeof(devDesc))
+		return Err("Unexpected device descriptor size: " + std::to_string(data.size()));
+	memcpy(&devDesc, data.data(), sizeof(devDesc));
+	
+	DeviceDescriptor desc;
+	desc.bcdUSB = devDesc.bcdUSB;
+	desc.bDeviceClass = devDesc.bDeviceClass;
+	desc.bDeviceSubClass = devDesc.bDeviceSubClass;
+	desc.bDeviceProtocol = devDesc.bDeviceProtocol;
+	desc.bMaxPacketSize0 = devDesc.bMaxPacketSize0;
+	desc.idVendor = devDesc.idVendor;
+	desc.idProduct = devDesc.idProduct;
+	desc.bcdDevice = devDesc.bcdDevice;
+	desc.iManufacturer = devDesc.iManufacturer;
+	desc.iProduct = devDesc.iProduct;
+	desc.iSerialNumber = devDesc.iSerialNumber;
+	desc.bNumConfigurations = devDesc.bNumConfigurations;
+	return Ok(desc);
+}
+
+void ReadDescriptorStrings(DeviceDescriptor& desc,
+                           const std::function<SResult<std::vector<uint8_t>>(uint8_t index, uint16_t languageId)>& getStringDescriptor)
+{
+	desc.stringsRead = true;
+	
+	// Devices without any strings don't have to support any languages. See the USB 2 spec
+	// section 9.6.7.
+	std::vector<uint8_t> langs = getStringDescriptor(0, 0).unwrap_or_default();
+	if (langs.size() < 4)
+		return;
+	
+	uint16_t lang = langs[2] + (langs[3] << 8);
+	
+	auto read = [&](uint8_t index) {
+		if (index == 0)
+			return std::u16string();
+		std::vector<uint8_t> buffer = getStringDescriptor(index, lang).unwrap_or_default();
+		if (buffer.size() <= 2)
+			return std::u16string();
+		std::u16string s((buffer.size() - 2) / 2, u'\0');
+		memcpy(&s[0], buffer.data() + 2, s.size() * 2);
+		return s;
+	};
+	
+	desc.sManufacturer = read(desc.iManufacturer);
+	desc.sProduct = read(desc.iProduct);
+	desc.sSerialNumber = read(desc.iSerialNumber);
+	
+	for (ConfigurationDescriptor& config : desc.configurations)
+	{
+		config.sConfiguration = read(config.iConfiguration);
+		for (InterfaceDescriptor& iface : config.interfaces)
+			iface.sInterface = read(iface.iInterface);
+	}
 }
 
 SResult<ConfigurationDescriptor> ParseConfigurationDescriptor(const std::vector<uint8_t>& data)
@@ -137,6 +204,31 @@ SResult<ConfigurationDescriptor> ParseConfigurationDescriptor(const std::vector<
 			desc.interfaces.back().endpoints.push_back(ed);
 			break;
 		}
+		case USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE:
+		{
+			// These only add burst information, so a bad one isn't worth losing the whole
+			// configuration over. The endpoint is used as if it had none.
+			UsbSuperSpeedEndpointCompanionDescriptor compDesc;
+			if (len != sizeof(compDesc))
+			{
+				FLOG_WARNING("Ignoring endpoint companion descriptor of unexpected size {}", int(len));
+				break;
+			}
+			memcpy(&compDesc, data.data() + offset, sizeof(compDesc));
+			
+			if (desc.interfaces.empty() || desc.interfaces.back().endpoints.empty())
+			{
+				FLOG_WARNING("Ignoring endpoint companion descriptor before any endpoint");
+				break;
+			}
+			
+			EndpointDescriptor& ed = desc.interfaces.back().endpoints.back();
+			ed.hasCompanion = true;
+			ed.bMaxBurst = compDesc.bMaxBurst;
+			ed.bmCompanionAttributes = compDesc.bmAttributes;
+			ed.wBytesPerInterval = compDesc.wBytesPerInterval;
+			break;
+		}
 		default:
 			// We don't care about others for now.
 			break;
@@ -149,3 +241,143 @@ SResult<ConfigurationDescriptor> ParseConfigurationDescriptor(const std::vector<
 	
 	return Ok(desc);
 }
+
+std::vector<uint8_t> SerializeDeviceDescriptor(const DeviceDescriptor& d)
+{
+	ByteWriter w;
+
+	w.pod(d.bcdUSB);
+	w.pod(d.bDeviceClass);
+	w.pod(d.bDeviceSubClass);
+	w.pod(d.bDeviceProtocol);
+	w.pod(d.bMaxPacketSize0);
+	w.pod(d.idVendor);
+	w.pod(d.idProduct);
+	w.pod(d.bcdDevice);
+	w.pod(d.iManufacturer);
+	w.pod(d.iProduct);
+	w.pod(d.iSerialNumber);
+	w.pod<uint8_t>(d.stringsRead);
+	w.str(d.sManufacturer);
+	w.str(d.sProduct);
+	w.str(d.sSerialNumber);
+	w.pod(d.bNumConfigurations);
+
+	w.pod<uint32_t>(d.configurations.size());
+	for (const ConfigurationDescriptor& c : d.configurations)
+	{
+		w.pod(c.bNumInterfaces);
+		w.pod(c.bConfigurationValue);
+		w.pod(c.iConfiguration);
+		w.str(c.sConfiguration);
+		w.pod(c.bmAttributes);
+		w.pod(c.bMaxPower);
+
+		w.pod<uint32_t>(c.interfaces.size());
+		for (const InterfaceDescriptor& i : c.interfaces)
+		{
+			w.pod(i.bInterfaceNumber);
+			w.pod(i.bAlternateSetting);
+			w.pod(i.bNumEndpoints);
+			w.pod(i.bInterfaceClass);
+			w.pod(i.bInterfaceSubClass);
+			w.pod(i.bInterfaceProtocol);
+			w.pod(i.iInterface);
+			w.str(i.sInterface);
+
+			w.pod<uint32_t>(i.endpoints.size());
+			for (const EndpointDescriptor& e : i.endpoints)
+			{
+				w.pod(e.bEndpointAddress);
+				w.pod(e.bmAttributes);
+				w.pod(e.wMaxPacketSize);
+				w.pod(e.bInterval);
+				w.pod<uint8_t>(e.hasCompanion);
+				w.pod(e.bMaxBurst);
+				w.pod(e.bmCompanionAttributes);
+				w.pod(e.wBytesPerInterval);
+			}
+		}
+	}
+	return w.buf;
+}
+
+SResult<DeviceDescriptor> DeserializeDeviceDescriptor(const uint8_t* data, size_t size)
+{
+	ByteReader r(data, size);
+	DeviceDescriptor d;
+
+	std::string truncated = "Serialized descriptor is truncated";
+
+	uint8_t stringsRead = 0;
+	bool ok = r.pod(d.bcdUSB) &&
+	          r.pod(d.bDeviceClass) &&
+	          r.pod(d.bDeviceSubClass) &&
+	          r.pod(d.bDeviceProtocol) &&
+	          r.pod(d.bMaxPacketSize0) &&
+	          r.pod(d.idVendor) &&
+	          r.pod(d.idProduct) &&
+	          r.pod(d.bcdDevice) &&
+	          r.pod(d.iManufacturer) &&
+	          r.pod(d.iProduct) &&
+	          r.pod(d.iSerialNumber) &&
+	          r.pod(stringsRead) &&
+	          r.str(d.sManufacturer) &&
+	          r.str(d.sProduct) &&
+	          r.str(d.sSerialNumber) &&
+	          r.pod(d.bNumConfigurations);
+	if (!ok)
+		return Err(truncated);
+	d.stringsRead = stringsRead != 0;
+
+	// The counts are checked against the limits in the spec so a corrupt count
+	// can't make us allocate gigabytes.
+	uint32_t numConfigs = 0;
+	if (!r.pod(numConfigs) || numConfigs > 255)
+		return Err(truncated);
+	d.configurations.resize(numConfigs);
+	for (ConfigurationDescriptor& c : d.configurations)
+	{
+		ok = r.pod(c.bNumInterfaces) &&
+		     r.pod(c.bConfigurationValue) &&
+		     r.pod(c.iConfiguration) &&
+		     r.str(c.sConfiguration) &&
+		     r.pod(c.bmAttributes) &&
+		     r.pod(c.bMaxPower);
+		uint32_t numInterfaces = 0;
+		if (!ok || !r.pod(numInterfaces) || numInterfaces > 255 * 256)
+			return Err(truncated);
+		c.interfaces.resize(numInterfaces);
+		for (InterfaceDescriptor& i : c.interfaces)
+		{
+			ok = r.pod(i.bInterfaceNumber) &&
+			     r.pod(i.bAlternateSetting) &&
+			     r.pod(i.bNumEndpoints) &&
+			     r.pod(i.bInterfaceClass) &&
+			     r.pod(i.bInterfaceSubClass) &&
+			     r.pod(i.bInterfaceProtocol) &&
+			     r.pod(i.iInterface) &&
+			     r.str(i.sInterface);
+			uint32_t numEndpoints = 0;
+			if (!ok || !r.pod(numEndpoints) || numEndpoints > 32)
+				return Err(truncated);
+			i.endpoints.resize(numEndpoints);
+			for (EndpointDescriptor& e : i.endpoints)
+			{
+				uint8_t hasCompanion = 0;
+				ok = r.pod(e.bEndpointAddress) &&
+				     r.pod(e.bmAttributes) &&
+				     r.pod(e.wMaxPacketSize) &&
+				     r.pod(e.bInterval) &&
+				     r.pod(hasCompanion) &&
+				     r.pod(e.bMaxBurst) &&
+				     r.pod(e.bmCompanionAttributes) &&
+				     r.pod(e.wBytesPerInterval);
+				if (!ok)
+					return Err(truncated);
+				e.hasCompanion = hasCompanion != 0;
+			}
+		}
+	}
+	return Ok(d);
+}
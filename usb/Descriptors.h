@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -11,8 +12,16 @@ struct EndpointDescriptor
 {
 	uint8_t bEndpointAddress;
 	uint8_t bmAttributes;
+	// Bits 11-12 are the number of additional transactions per microframe for high-speed
+	// isochronous and interrupt endpoints. See EndpointInfo.
 	uint16_t wMaxPacketSize;
 	uint8_t bInterval;
+	
+	// From the SuperSpeed endpoint companion descriptor, if there was one.
+	bool hasCompanion = false;
+	uint8_t bMaxBurst = 0;
+	uint8_t bmCompanionAttributes = 0;
+	uint16_t wBytesPerInterval = 0;
 };
 
 struct InterfaceDescriptor
@@ -25,7 +34,8 @@ struct InterfaceDescriptor
 	uint8_t bInterfaceProtocol;
 	
 	uint8_t iInterface;
-//	std::u16string sInterface;
+	// Only filled in by Device::descriptorsWithStrings().
+	std::u16string sInterface;
 	
 	std::vector<EndpointDescriptor> endpoints;
 };
@@ -38,7 +48,8 @@ struct ConfigurationDescriptor
 	
 	uint8_t iConfiguration;
 	
-//	std::u16string sConfiguration;
+	// Only filled in by Device::descriptorsWithStrings().
+	std::u16string sConfiguration;
 	
 	uint8_t bmAttributes;
 	uint8_t bMaxPower;
@@ -62,9 +73,11 @@ struct DeviceDescriptor
 	uint8_t iProduct;
 	uint8_t iSerialNumber;
 	
-//	std::u16string sManufacturer;
-//	std::u16string sProduct;
-//	std::u16string sSerialNumber;
+	// Only filled in by Device::descriptorsWithStrings(), or if they were in the DescriptorCache.
+	bool stringsRead = false;
+	std::u16string sManufacturer;
+	std::u16string sProduct;
+	std::u16string sSerialNumber;
 	
 	uint8_t bNumConfigurations; // Equal to configurations.size().
 	
@@ -83,9 +96,21 @@ std::string to_string(const EndpointDescriptor& val);
 SResult<DeviceDescriptor> ParseDeviceDescriptor(const std::vector<uint8_t>& data);
 
 // Parse a configuration descriptor. The configuration descriptor is followed by
-// interface, endpoint and class and vendor-defined descriptors.
+// interface, endpoint and class and vendor-defined descriptors. A malformed SuperSpeed
+// endpoint companion descriptor is logged and skipped rather than failing the parse.
 SResult<ConfigurationDescriptor> ParseConfigurationDescriptor(const std::vector<uint8_t>& data);
 
+// Fill in the strings of `desc` and set stringsRead, using `getStringDescriptor` to read
+// the raw string descriptor at an index in a language. Index 0 is the language IDs, and the
+// first language is used. Strings that can't be read are left empty.
+void ReadDescriptorStrings(DeviceDescriptor& desc,
+                           const std::function<SResult<std::vector<uint8_t>>(uint8_t index, uint16_t languageId)>& getStringDescriptor);
+
+// Flatten a descriptor tree, including its strings, into a native-endian binary blob for
+// caching on disk, and read it back. Deserializing never reads past `size`.
+std::vector<uint8_t> SerializeDeviceDescriptor(const DeviceDescriptor& desc);
+SResult<DeviceDescriptor> DeserializeDeviceDescriptor(const uint8_t* data, size_t size);
+
 enum class DescriptorType : uint8_t
 {
 	Device = USB_DEVICE_DESCRIPTOR_TYPE,
@@ -108,7 +108,7 @@ SResult<std::vector<uint16_t>> Device::languageIds()
 	return Ok(ids);
 }
 
-SResult<std::vector<uint8_t>> Device::getDescriptor(DescriptorType type, uint8_t index, uint8_t languageId)
+SResult<std::vector<uint8_t>> Device::getDescriptor(DescriptorType type, uint8_t index, uint16_t languageId)
 {
 	// First get the (length, type) header.
 	std::vector<uint8_t> header = TRY(controlTransferInSync(Recipient::Device,
@@ -143,3 +143,30 @@ SResult<DeviceDescriptor> Device::descriptors()
 	return Ok(data.descriptors);
 }
 
+SResult<DeviceDescriptor> Device::descriptorsWithStrings()
+{
+	DeviceDescriptor desc = TRY(descriptors());
+	
+	// They may have come from the DescriptorCache already.
+	if (desc.stringsRead)
+		return Ok(desc);
+	
+	ReadDescriptorStrings(desc, [this](uint8_t index, uint16_t languageId) {
+		return getDescriptor(DescriptorType::String, index, languageId);
+	});
+	
+	data.descriptors = desc;
+	DescriptorCache::global().store(data.descriptorCacheKey, desc);
+	return Ok(desc);
+}
+
+
+std::vector<EndpointCounterSnapshot> Device::endpointCounters() const
+{
+	return counters->snapshot();
+}
+
+void Device::resetEndpointCounters()
+{
+	counters->reset();
+}
@@ -1,22 +1,26 @@
 #pragma once
 
 #include "util/Result.h"
+#include "util/ThreadPolicy.h"
 #include "DeviceId.h"
 
 #include "EndpointInfo.h"
+#include "EndpointCounters.h"
 #include "Descriptors.h"
 
 #include <string>
 #include <vector>
+#include <memory>
 
 #include <stdint.h>
 
 
-#if defined(_WIN32)
+// USBTOOL_FAKE_USB replaces the platform backend with simulated devices, for the tests.
+#if defined(USBTOOL_FAKE_USB)
+#include "fake/Device_Fake.h"
+#elif defined(_WIN32)
 #include "windows/Device_Win.h"
-#endif
-
-#if defined(__APPLE__)
+#elif defined(__APPLE__)
 #include "mac/Device_Mac.h"
 #endif
 
@@ -50,7 +54,7 @@
 // it is a 'high bandwidth endpoint', and can use multiple transactions per microframe.
 // It must have a bInterval of 1.
 
-#if defined(_WIN32)
+#if defined(_WIN32) && !defined(USBTOOL_FAKE_USB)
 class WinUsbIsochBufferHandle;
 class WinUsbInterfaceHandle;
 class Overlapped;
@@ -131,36 +135,49 @@ public:
 		In = 0x80,
 	};
 	
+	// Control transfers fail with TransferError::Timeout if they haven't completed after
+	// this long, so a hung device can't block the calling thread forever. 0 means no timeout.
+	static const uint32_t DEFAULT_TIMEOUT_MS = 5000;
+	
 	// Synchronous control transfers.
 	SResult<std::vector<uint8_t>> controlTransferInSync(Recipient recipient,
 	                                                    Type type,
 	                                                    uint8_t bRequest,
 	                                                    uint16_t wValue,
 	                                                    uint16_t wIndex,
-	                                                    uint16_t wLength);
+	                                                    uint16_t wLength,
+	                                                    uint32_t timeoutMs = DEFAULT_TIMEOUT_MS);
 	SResult<void> controlTransferOutSync(Recipient recipient,
 	                                     Type type,
 	                                     uint8_t bRequest,
 	                                     uint16_t wValue,
 	                                     uint16_t wIndex,
-	                                     std::vector<uint8_t> dat = std::vector<uint8_t>()); // This could theoretically be *slightly* more efficient with a reference, but I doubt it will ever matter.
+	                                     std::vector<uint8_t> dat = std::vector<uint8_t>(), // This could theoretically be *slightly* more efficient with a reference, but I doubt it will ever matter.
+	                                     uint32_t timeoutMs = DEFAULT_TIMEOUT_MS);
 
-	// Asynchronous control transfers.
+	// Asynchronous control transfers. The timeout is applied by the OS, and the handle
+	// completes with an error if it expires. Handles can also be cancelled early.
 	SResult<UsbTransferHandle> controlTransferIn(Recipient recipient,
 	                                             Type type,
 	                                             uint8_t bRequest,
 	                                             uint16_t wValue,
 	                                             uint16_t wIndex,
-	                                             uint16_t wLength);
+	                                             uint16_t wLength,
+	                                             uint32_t timeoutMs = DEFAULT_TIMEOUT_MS);
 	SResult<UsbTransferHandle> controlTransferOut(Recipient recipient,
 	                                              Type type,
 	                                              uint8_t bRequest,
 	                                              uint16_t wValue,
 	                                              uint16_t wIndex,
-	                                              std::vector<uint8_t> dat = std::vector<uint8_t>());
+	                                              std::vector<uint8_t> dat = std::vector<uint8_t>(),
+	                                              uint32_t timeoutMs = DEFAULT_TIMEOUT_MS);
+	
+	// Abort every transfer outstanding on a pipe. They complete with TransferError::Cancelled.
+	// Endpoint 0 (the default control pipe) belongs to the device so `iface` is ignored for it.
+	SResult<void> abortPipe(int iface, uint8_t endpointAddress);
 	
 	// Convenience function to synchronously get a descriptor. languageId should be 0 for non-string descriptors.
-	SResult<std::vector<uint8_t>> getDescriptor(DescriptorType type, uint8_t index, uint8_t languageId = 0);
+	SResult<std::vector<uint8_t>> getDescriptor(DescriptorType type, uint8_t index, uint16_t languageId = 0);
 	
 	// These functions create a buffer for a single transfer. In fact both operating systems allow using one
 	// buffer for more than one transfer, but they do it differently so it is simpler to restrict it to one buffer
@@ -175,12 +192,19 @@ public:
 	// This in theory lets you read/write to it as a transfer is proceeding, so that you are *just* before the kernel
 	// and can achieve very low latency. However for now I will just use 1-frame transfers.
 	
+	// `numFrames` is the number of entries in the transfer's frame list. For High Speed endpoints
+	// serviced every 1, 2 or 4 microframes there are 8, 4 or 2 entries per 1 ms frame (see
+	// EndpointInfo::packetsPerFrame()), and `numFrames` must be a multiple of that. Otherwise
+	// there is one entry per frame.
+	
 	// Create an isochronous read buffer for IN transfers.
 	// 
 	//   `pipe` is the pipeRef on OSX and the endpoint number on Windows. TODO: Is it??
 	//   `iface` is the interface index (not the bInterfaceValue or whatever). TODO: ...
 	SResult<IsochReadBuffer> createIsochReadBuffer(int iface, uint8_t endpointAddress, int numFrames, int bytesPerFrame);
 	// Create an isochronous write buffer for OUT transfers. `pipe` is the pipeRef on OSX and the endpoint number on Windows.
+	// Every entry sends `bytesPerFrame` unless the buffer's frameLengths are filled in, which
+	// is how asynchronous endpoints are sent a varying number of bytes per packet.
 	SResult<IsochWriteBuffer> createIsochWriteBuffer(int iface, uint8_t endpointAddress, int numFrames, int bytesPerFrame);
 
 	// Submit a transfer ASAP. If continueStream is true, this fails if it can't schedule a transfer for the next frame.
@@ -189,12 +213,35 @@ public:
 	// Submit a transfer to start at a specific frame.
 	SResult<UsbIsochTransferHandle> submitIsoOutTransfer(const IsochWriteBuffer& buffer, uint64_t frame);
 	
+	// Submit an IN transfer ASAP. If continueStream is true, this fails if it can't schedule the
+	// transfer to start straight after the last one submitted on the pipe.
+	SResult<UsbIsochTransferHandle> submitIsoInTransferAsap(const IsochReadBuffer& buffer, bool continueStream);
+	
+	// Submit an IN transfer to start at a specific frame.
+	SResult<UsbIsochTransferHandle> submitIsoInTransfer(const IsochReadBuffer& buffer, uint64_t frame);
+	
 	// Get the current bus frame number. This loops.
 	uint64_t getBusFrameNumber();
 	
-	// Get all of the USB descriptors. This is cached when the device is opened.
+	// Get the current bus microframe number (125 us). For Full and Low Speed devices this is
+	// the frame number times 8.
+	uint64_t getBusMicroframeNumber();
+	
+	// Schedule the thread that asynchronous transfers complete on, e.g. as real-time, so
+	// isochronous completions aren't held up. Windows has no such thread so there this does
+	// nothing.
+	SResult<void> setCallbackThreadPolicy(const ThreadPolicy& policy);
+	
+	// Get all of the USB descriptors. This is cached when the device is opened, and
+	// in the DescriptorCache so devices we have seen before open faster.
 	SResult<DeviceDescriptor> descriptors();
 	
+	// Get descriptors() with the string fields filled in, in the first language the
+	// device supports. This costs a couple of control transfers per string the first
+	// time a device is seen; after that they come from the DescriptorCache.
+	// Strings that can't be read are left empty rather than failing.
+	SResult<DeviceDescriptor> descriptorsWithStrings();
+	
 	// WinUsb only supports the first configuration so this doesn't work. Fortunately few devices are multi-configuration.
 	//   void setConfiguration(int conf);
 	
@@ -205,11 +252,21 @@ public:
 	// Set an interface to an alternate setting. I'm not sure how safe this is with pending isoch transfers.
 	SResult<void> setAlternate(int iface, uint8_t alternate);
 	
+	// Get the traffic counters of every endpoint that has been used since the device was opened.
+	// This is cheap and safe to call from any thread while transfers are running.
+	std::vector<EndpointCounterSnapshot> endpointCounters() const;
+	
+	// Zero the traffic counters.
+	void resetEndpointCounters();
+	
 private:
 	// This class cannot be copied. Put it in a shared_ptr if you want to.
 	Device(const Device&) = delete;
 	Device& operator=(const Device&) = delete;
 	
 	UsbDeviceData data;
+	
+	// Transfer handles keep a reference to this so they can update it when they complete.
+	std::shared_ptr<EndpointCounters> counters = EndpointCounters::create();
 };
 
@@ -1,13 +1,68 @@
 #include "DeviceId.h"
 
 #include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
 
-#if defined(__APPLE__)
+#if defined(_WIN32) && !defined(USBTOOL_FAKE_USB)
+#include "windows/Util_Win.h"
+#endif
+
+uint32_t ParentLocationId(uint32_t locationId)
+{
+	for (int shift = 0; shift < 24; shift += 4)
+	{
+		uint32_t mask = 0xFu << shift;
+		if (locationId & mask)
+			return locationId & ~mask;
+	}
+	return locationId;
+}
+
+#if defined(USBTOOL_FAKE_USB)
+
+std::string DeviceIdToString(const DeviceId& addr)
+{
+	return addr.path;
+}
+
+std::string HubIdOf(const DeviceId& addr)
+{
+	// Fakes are registered with paths like "hub1/port3".
+	size_t slash = addr.path.rfind('/');
+	if (slash == std::string::npos)
+		return std::string();
+	return addr.path.substr(0, slash);
+}
+
+#elif defined(__APPLE__)
 
 std::string DeviceIdToString(const DeviceId& addr)
 {
 	return addr.path;
 }
+
+std::string HubIdOf(const DeviceId& addr)
+{
+	// The path is something like IOService:/.../XHC1@14/.../HubName@14100000/DeviceName@14130000
+	// but with the newer USB stack each hub port has its own node in between, so the parent
+	// in the path is the port, not the hub. The device's node is named after its locationID
+	// though, and that encodes the topology.
+	size_t slash = addr.path.rfind('/');
+	size_t at = addr.path.rfind('@');
+	if (slash == std::string::npos || at == std::string::npos || at < slash)
+		return std::string();
+	
+	const char* start = addr.path.c_str() + at + 1;
+	char* end = nullptr;
+	unsigned long locationId = strtoul(start, &end, 16);
+	if (end == start || *end != '\0')
+		return std::string();
+	
+	char hub[32];
+	snprintf(hub, sizeof(hub), "location:%08x", ParentLocationId(static_cast<uint32_t>(locationId)));
+	return hub;
+}
 #elif defined(_WIN32)
 
 std::string DeviceIdToString(const DeviceId& addr)
@@ -21,4 +76,15 @@ std::string DeviceIdToString(const DeviceId& addr)
 	return s;
 }
 
+std::string HubIdOf(const DeviceId& addr)
+{
+	SResult<HubPort> hubPort = FindHubPort(addr.path);
+	if (!hubPort)
+		return std::string();
+	
+	DeviceId hub;
+	hub.path = hubPort.unwrap().hubPath;
+	return DeviceIdToString(hub);
+}
+
 #endif
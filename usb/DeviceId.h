@@ -1,11 +1,15 @@
 #pragma once
 
 #include <string>
+#include <stdint.h>
 
 // This identifies a USB device on the system with an opaque platform-dependent handle.
 struct DeviceId
 {
-#if defined(__APPLE__)
+#if defined(USBTOOL_FAKE_USB)
+	// Whatever the fake device was registered as with AddFakeUsbDevice().
+	std::string path;
+#elif defined(__APPLE__)
 	// This is an up to 512 byte path. Null terminated.
 	std::string path;
 #elif defined(_WIN32)
@@ -32,3 +36,13 @@ struct DeviceId
 };
 
 std::string DeviceIdToString(const DeviceId& addr);
+
+// Identifies the hub a device is plugged into, so that work can be spread across hubs.
+// On OSX this comes from the device's locationID, and on Windows it is the parent hub's
+// device interface path. If the hub can't be found it is empty, which counts as one hub.
+std::string HubIdOf(const DeviceId& addr);
+
+// The locationID of the hub that the device with OSX locationID `locationId` is plugged
+// into. The top byte is the bus and then each nibble is the port at one tier, so this
+// clears the last non-zero nibble. A root hub's port gives the root hub, 0xBB000000.
+uint32_t ParentLocationId(uint32_t locationId);
@@ -0,0 +1,386 @@
+#include "Dfu.h"
+
+#include "UsbSpecification.h"
+#include "util/EnumCasts.h"
+#include "util/HighResClock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <string.h>
+
+using std::string;
+
+std::string to_string(DfuState state)
+{
+	switch (state)
+	{
+	case DfuState::AppIdle:
+		return "appIDLE";
+	case DfuState::AppDetach:
+		return "appDETACH";
+	case DfuState::DfuIdle:
+		return "dfuIDLE";
+	case DfuState::DfuDnloadSync:
+		return "dfuDNLOAD-SYNC";
+	case DfuState::DfuDnBusy:
+		return "dfuDNBUSY";
+	case DfuState::DfuDnloadIdle:
+		return "dfuDNLOAD-IDLE";
+	case DfuState::DfuManifestSync:
+		return "dfuMANIFEST-SYNC";
+	case DfuState::DfuManifest:
+		return "dfuMANIFEST";
+	case DfuState::DfuManifestWaitReset:
+		return "dfuMANIFEST-WAIT-RESET";
+	case DfuState::DfuUploadIdle:
+		return "dfuUPLOAD-IDLE";
+	case DfuState::DfuError:
+		return "dfuERROR";
+	}
+	return "unknown state " + std::to_string(to_integral(state));
+}
+
+SResult<DfuFunctionalDescriptor> ParseDfuFunctionalDescriptor(const std::vector<uint8_t>& data)
+{
+	bool inDfuInterface = false;
+	uint8_t interfaceNumber = 0;
+
+	for (size_t offset = 0; offset + 2 <= data.size(); )
+	{
+		uint8_t len = data[offset];
+		uint8_t type = data[offset + 1];
+		if (len < 2 || offset + len > data.size())
+			return Err("Invalid descriptor length " + std::to_string(len) + " at offset " + std::to_string(offset));
+
+		if (type == USB_INTERFACE_DESCRIPTOR_TYPE && len >= sizeof(UsbInterfaceDescriptor))
+		{
+			UsbInterfaceDescriptor ifDesc;
+			memcpy(&ifDesc, data.data() + offset, sizeof(ifDesc));
+			inDfuInterface = ifDesc.bInterfaceClass == USB_DFU_INTERFACE_CLASS &&
+			                 ifDesc.bInterfaceSubClass == USB_DFU_INTERFACE_SUBCLASS;
+			interfaceNumber = ifDesc.bInterfaceNumber;
+		}
+		else if (type == USB_DFU_FUNCTIONAL_DESCRIPTOR_TYPE && inDfuInterface && len >= 7)
+		{
+			// Zero bcdDFUVersion first in case this is a 7 byte DFU 1.0 descriptor.
+			UsbDfuFunctionalDescriptor funcDesc;
+			memset(&funcDesc, 0, sizeof(funcDesc));
+			memcpy(&funcDesc, data.data() + offset, std::min<size_t>(len, sizeof(funcDesc)));
+
+			DfuFunctionalDescriptor d;
+			d.interfaceNumber = interfaceNumber;
+			d.canDownload = funcDesc.bmAttributes & 0x01;
+			d.canUpload = funcDesc.bmAttributes & 0x02;
+			d.manifestationTolerant = funcDesc.bmAttributes & 0x04;
+			d.willDetach = funcDesc.bmAttributes & 0x08;
+			d.wDetachTimeOut = funcDesc.wDetachTimeOut;
+			d.wTransferSize = funcDesc.wTransferSize;
+			d.bcdDFUVersion = funcDesc.bcdDFUVersion;
+			return Ok(d);
+		}
+
+		offset += len;
+	}
+	return Err(string("No DFU interface found"));
+}
+
+SResult<DfuDevice> DfuDevice::open(std::shared_ptr<Device> device)
+{
+	if (!device || !device->isOpen())
+		return Err(string("Device not open"));
+
+	// Read the whole of the first configuration descriptor. getDescriptor() only reads
+	// bLength bytes, which for a configuration descriptor is just the header.
+	uint16_t wValue = (to_integral(DescriptorType::Configuration) << 8) | 0;
+
+	std::vector<uint8_t> header = TRY(device->controlTransferInSync(Device::Recipient::Device,
+	                                                                Device::Type::Standard,
+	                                                                USB_GET_DESCRIPTOR_REQUEST,
+	                                                                wValue,
+	                                                                0,
+	                                                                sizeof(UsbConfigurationDescriptor)));
+	if (header.size() != sizeof(UsbConfigurationDescriptor))
+		return Err("Configuration descriptor header too short: " + std::to_string(header.size()) + " bytes");
+
+	UsbConfigurationDescriptor configDesc;
+	memcpy(&configDesc, header.data(), sizeof(configDesc));
+
+	std::vector<uint8_t> config = TRY(device->controlTransferInSync(Device::Recipient::Device,
+	                                                                Device::Type::Standard,
+	                                                                USB_GET_DESCRIPTOR_REQUEST,
+	                                                                wValue,
+	                                                                0,
+	                                                                configDesc.wTotalLength));
+
+	DfuDevice dfu;
+	dfu.device = device;
+	dfu.functional = TRY(ParseDfuFunctionalDescriptor(config));
+
+	if (dfu.functional.wTransferSize == 0)
+		return Err(string("DFU functional descriptor has wTransferSize = 0"));
+
+	return Ok(dfu);
+}
+
+SResult<DfuStatus> DfuDevice::getStatus()
+{
+	std::vector<uint8_t> data = TRY(device->controlTransferInSync(Device::Recipient::Interface,
+	                                                              Device::Type::Class,
+	                                                              USB_DFU_GETSTATUS_REQUEST,
+	                                                              0,
+	                                                              functional.interfaceNumber,
+	                                                              sizeof(UsbDfuStatus)));
+	if (data.size() != sizeof(UsbDfuStatus))
+		return Err("DFU_GETSTATUS returned " + std::to_string(data.size()) + " bytes");
+
+	UsbDfuStatus raw;
+	memcpy(&raw, data.data(), sizeof(raw));
+
+	DfuStatus status;
+	status.bStatus = raw.bStatus;
+	status.bwPollTimeout = raw.bwPollTimeout[0] | (raw.bwPollTimeout[1] << 8) | (raw.bwPollTimeout[2] << 16);
+	status.bState = from_integral<DfuState>(raw.bState);
+	status.iString = raw.iString;
+	return Ok(status);
+}
+
+SResult<DfuState> DfuDevice::getState()
+{
+	std::vector<uint8_t> data = TRY(device->controlTransferInSync(Device::Recipient::Interface,
+	                                                              Device::Type::Class,
+	                                                              USB_DFU_GETSTATE_REQUEST,
+	                                                              0,
+	                                                              functional.interfaceNumber,
+	                                                              1));
+	if (data.size() != 1)
+		return Err("DFU_GETSTATE returned " + std::to_string(data.size()) + " bytes");
+
+	return Ok(from_integral<DfuState>(data[0]));
+}
+
+SResult<void> DfuDevice::clearStatus()
+{
+	return device->controlTransferOutSync(Device::Recipient::Interface,
+	                                      Device::Type::Class,
+	                                      USB_DFU_CLRSTATUS_REQUEST,
+	                                      0,
+	                                      functional.interfaceNumber);
+}
+
+SResult<void> DfuDevice::abort()
+{
+	return device->controlTransferOutSync(Device::Recipient::Interface,
+	                                      Device::Type::Class,
+	                                      USB_DFU_ABORT_REQUEST,
+	                                      0,
+	                                      functional.interfaceNumber);
+}
+
+SResult<void> DfuDevice::resetToIdle()
+{
+	DfuStatus status = TRY(getStatus());
+
+	switch (status.bState)
+	{
+	case DfuState::DfuIdle:
+		return Ok();
+	case DfuState::AppIdle:
+	case DfuState::AppDetach:
+		return Err(string("Device is in run-time mode; it must be detached into DFU mode first"));
+	case DfuState::DfuError:
+		MSTRY(clearStatus());
+		break;
+	default:
+		MSTRY(abort());
+		break;
+	}
+
+	DfuState state = TRY(getState());
+	if (state != DfuState::DfuIdle)
+		return Err("Couldn't return device to dfuIDLE; it is in " + to_string(state));
+	return Ok();
+}
+
+SResult<DfuStatus> DfuDevice::waitWhile(DfuState busy, DfuStatus status)
+{
+	HighResClock::time_point deadline = HighResClock::now() + std::chrono::milliseconds(status.bwPollTimeout);
+
+	while (status.bStatus == 0 && status.bState == busy)
+	{
+		std::this_thread::sleep_until(deadline);
+		status = TRY(getStatus());
+		deadline = HighResClock::now() + std::chrono::milliseconds(status.bwPollTimeout);
+	}
+
+	if (status.bStatus != 0)
+		return Err("DFU error status " + std::to_string(status.bStatus) + " in " + to_string(status.bState));
+	return Ok(status);
+}
+
+SResult<DfuProgress> DfuDevice::download(const MappedFile& image, DfuProgressCallback progressCallback)
+{
+	if (!functional.canDownload)
+		return Err(string("Device doesn't support DFU download"));
+
+	MSTRY(resetToIdle());
+
+	HighResClock::time_point start = HighResClock::now();
+
+	const uint8_t* data = image.data();
+	uint64_t size = image.size();
+	uint64_t blockSize = functional.wTransferSize;
+
+	auto makeBlock = [&](uint64_t offset) {
+		uint64_t n = std::min(blockSize, size - offset);
+		return std::vector<uint8_t>(data + offset, data + offset + n);
+	};
+
+	DfuProgress progress;
+	progress.bytesTotal = size;
+
+	std::vector<uint8_t> block;
+	if (size > 0)
+		block = makeBlock(0);
+
+	uint16_t blockNum = 0;
+	for (uint64_t offset = 0; offset < size; ++blockNum)
+	{
+		uint64_t next = offset + block.size();
+
+		MSTRY(device->controlTransferOutSync(Device::Recipient::Interface,
+		                                     Device::Type::Class,
+		                                     USB_DFU_DNLOAD_REQUEST,
+		                                     blockNum,
+		                                     functional.interfaceNumber,
+		                                     std::move(block)));
+
+		// This moves the device from dfuDNLOAD-SYNC to dfuDNBUSY and tells us how
+		// long it will be busy writing the block.
+		DfuStatus status = TRY(getStatus());
+		HighResClock::time_point deadline = HighResClock::now() + std::chrono::milliseconds(status.bwPollTimeout);
+
+		// Prepare the next block while the device is busy.
+		if (next < size)
+			block = makeBlock(next);
+
+		std::this_thread::sleep_until(deadline);
+		if (status.bState == DfuState::DfuDnBusy || status.bState == DfuState::DfuDnloadSync)
+		{
+			status = TRY(getStatus());
+			status = TRY(waitWhile(DfuState::DfuDnBusy, status));
+		}
+
+		if (status.bStatus != 0 || status.bState != DfuState::DfuDnloadIdle)
+		{
+			abort();
+			return Err("Block " + std::to_string(blockNum) + " failed: status " + std::to_string(status.bStatus) +
+			           " in " + to_string(status.bState));
+		}
+
+		offset = next;
+
+		progress.bytesDone = offset;
+		progress.seconds = std::chrono::duration<double>(HighResClock::now() - start).count();
+		if (progressCallback && !progressCallback(progress))
+		{
+			abort();
+			return Err(string("Download cancelled"));
+		}
+	}
+
+	// A zero length DNLOAD ends the download and starts manifestation.
+	MSTRY(device->controlTransferOutSync(Device::Recipient::Interface,
+	                                     Device::Type::Class,
+	                                     USB_DFU_DNLOAD_REQUEST,
+	                                     blockNum,
+	                                     functional.interfaceNumber));
+
+	SResult<DfuStatus> statusRes = getStatus();
+
+	// Devices that aren't manifestation tolerant may stop responding until they are reset,
+	// so there's nothing more we can check.
+	if (functional.manifestationTolerant)
+	{
+		DfuStatus status = TRY(statusRes);
+		status = TRY(waitWhile(DfuState::DfuManifestSync, status));
+		status = TRY(waitWhile(DfuState::DfuManifest, status));
+		if (status.bState != DfuState::DfuIdle)
+			return Err("Manifestation ended in " + to_string(status.bState));
+	}
+
+	progress.seconds = std::chrono::duration<double>(HighResClock::now() - start).count();
+	return Ok(progress);
+}
+
+SResult<DfuProgress> DfuDevice::upload(const std::string& path, uint64_t maxSize, DfuProgressCallback progressCallback)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return Err("Couldn't open " + path + " for writing");
+
+	auto sink = [&](const uint8_t* data, size_t size) -> SResult<void> {
+		out.write(reinterpret_cast<const char*>(data), size);
+		if (!out)
+			return Err("Couldn't write to " + path);
+		return Ok();
+	};
+
+	return upload(sink, maxSize, progressCallback);
+}
+
+SResult<DfuProgress> DfuDevice::upload(DfuSink sink, uint64_t maxSize, DfuProgressCallback progressCallback)
+{
+	if (!functional.canUpload)
+		return Err(string("Device doesn't support DFU upload"));
+
+	MSTRY(resetToIdle());
+
+	HighResClock::time_point start = HighResClock::now();
+
+	DfuProgress progress;
+
+	for (uint16_t blockNum = 0; progress.bytesDone < maxSize; ++blockNum)
+	{
+		uint64_t wanted = std::min<uint64_t>(functional.wTransferSize, maxSize - progress.bytesDone);
+
+		std::vector<uint8_t> block = TRY(device->controlTransferInSync(Device::Recipient::Interface,
+		                                                               Device::Type::Class,
+		                                                               USB_DFU_UPLOAD_REQUEST,
+		                                                               blockNum,
+		                                                               functional.interfaceNumber,
+		                                                               wanted));
+
+		SResult<void> sinkRes = sink(block.data(), block.size());
+		if (!sinkRes)
+		{
+			abort();
+			return sinkRes;
+		}
+
+		progress.bytesDone += block.size();
+		progress.seconds = std::chrono::duration<double>(HighResClock::now() - start).count();
+
+		// A short block means the end of the firmware, and the device goes back to dfuIDLE.
+		bool last = block.size() < functional.wTransferSize;
+		if (last)
+			progress.bytesTotal = progress.bytesDone;
+
+		if (progressCallback && !progressCallback(progress))
+		{
+			abort();
+			return Err(string("Upload cancelled"));
+		}
+
+		if (last)
+			break;
+	}
+
+	progress.bytesTotal = progress.bytesDone;
+
+	// If we stopped early the device is still in dfuUPLOAD-IDLE.
+	MSTRY(resetToIdle());
+
+	return Ok(progress);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/MappedFile.h"
+#include "Device.h"
+
+// DFU 1.1: 6.1.2, Table A.2-1. The states of the device's DFU state machine.
+enum class DfuState : uint8_t
+{
+	AppIdle = 0,
+	AppDetach = 1,
+	DfuIdle = 2,
+	DfuDnloadSync = 3,
+	DfuDnBusy = 4,
+	DfuDnloadIdle = 5,
+	DfuManifestSync = 6,
+	DfuManifest = 7,
+	DfuManifestWaitReset = 8,
+	DfuUploadIdle = 9,
+	DfuError = 10,
+};
+
+// The parsed DFU functional descriptor, and the interface it belongs to.
+struct DfuFunctionalDescriptor
+{
+	uint8_t interfaceNumber = 0;
+
+	bool canDownload = false;
+	bool canUpload = false;
+	// If this isn't set the device has to be reset after manifestation before it will respond.
+	bool manifestationTolerant = false;
+	bool willDetach = false;
+
+	uint16_t wDetachTimeOut = 0;
+	// The most data the device accepts in one DNLOAD or returns in one UPLOAD.
+	uint16_t wTransferSize = 0;
+	uint16_t bcdDFUVersion = 0;
+};
+
+// The response to DFU_GETSTATUS.
+struct DfuStatus
+{
+	// 0 is OK; anything else is an error code from DFU 1.1 Table 6.1.
+	uint8_t bStatus = 0;
+	// How long the host must wait before the next GETSTATUS.
+	uint32_t bwPollTimeout = 0;
+	DfuState bState = DfuState::AppIdle;
+	uint8_t iString = 0;
+};
+
+std::string to_string(DfuState state);
+
+// Find the DFU interface in a raw configuration descriptor (including everything after it)
+// and parse its functional descriptor. That descriptor isn't kept by ParseConfigurationDescriptor().
+SResult<DfuFunctionalDescriptor> ParseDfuFunctionalDescriptor(const std::vector<uint8_t>& configuration);
+
+struct DfuProgress
+{
+	uint64_t bytesDone = 0;
+	uint64_t bytesTotal = 0;
+	// Since the transfer started.
+	double seconds = 0.0;
+
+	double kilobytesPerSecond() const { return seconds > 0.0 ? bytesDone / 1024.0 / seconds : 0.0; }
+};
+
+// Called after every block. Return false to abort the transfer.
+typedef std::function<bool(const DfuProgress&)> DfuProgressCallback;
+
+// Downloads (host to device) and uploads firmware with the DFU 1.1 protocol. The device
+// must already be in DFU mode (the DFU interface is in dfuIDLE, not appIDLE).
+//
+// Downloads send wTransferSize blocks. After each DNLOAD the device says how long to wait
+// (bwPollTimeout) before asking whether it has finished writing; we prepare the next block
+// while waiting rather than after, so the time spent per block is just the device's.
+class DfuDevice
+{
+public:
+	// Read the configuration descriptor to find the DFU interface.
+	static SResult<DfuDevice> open(std::shared_ptr<Device> device);
+
+	const DfuFunctionalDescriptor& functionalDescriptor() const { return functional; }
+
+	// Write `image` to the device, followed by the zero length DNLOAD that starts manifestation,
+	// and wait for manifestation to finish. Returns the final progress, including the speed.
+	SResult<DfuProgress> download(const MappedFile& image, DfuProgressCallback progress = DfuProgressCallback());
+
+	// Read the firmware from the device into a new file at `path`. `maxSize` stops the upload
+	// early; otherwise it continues until the device sends a short block.
+	SResult<DfuProgress> upload(const std::string& path, uint64_t maxSize = UINT64_MAX, DfuProgressCallback progress = DfuProgressCallback());
+	
+	// The same, but each block is passed to `sink` instead of being written to a file.
+	typedef std::function<SResult<void>(const uint8_t* data, size_t size)> DfuSink;
+	SResult<DfuProgress> upload(DfuSink sink, uint64_t maxSize = UINT64_MAX, DfuProgressCallback progress = DfuProgressCallback());
+
+	// The basic requests.
+	SResult<DfuStatus> getStatus();
+	SResult<DfuState> getState();
+	SResult<void> clearStatus();
+	SResult<void> abort();
+
+	// Get out of dfuERROR or a half-finished transfer back to dfuIDLE.
+	SResult<void> resetToIdle();
+
+private:
+	DfuDevice() = default;
+
+	// Poll GETSTATUS, waiting bwPollTimeout between polls, until the state isn't `busy`.
+	SResult<DfuStatus> waitWhile(DfuState busy, DfuStatus status);
+
+	std::shared_ptr<Device> device;
+	DfuFunctionalDescriptor functional;
+};
@@ -14,3 +14,9 @@ SResult<std::vector<DeviceInfo>> EnumerateAvailableDevices();
 // Open the specific device regardless of vendorId and protocol (but it must still have
 // a DFU interface).
 SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId id);
+
+// Read the descriptors and strings of a device without opening it, so the device isn't seized
+// or configured and a program that already has it open carries on undisturbed. As much as
+// possible comes from the DescriptorCache or from what the OS read when the device was
+// attached, rather than from the bus.
+SResult<DeviceDescriptor> ReadUsbDeviceDescriptors(DeviceId id);
@@ -0,0 +1,108 @@
+#include "EndpointCounters.h"
+
+#include <memory>
+#include <new>
+
+uint64_t EndpointCounterSnapshot::totalErrors() const
+{
+	uint64_t total = 0;
+	for (uint64_t e : errors)
+		total += e;
+	return total;
+}
+
+std::string to_string(const EndpointCounterSnapshot& val)
+{
+	static const char* errorNames[NUM_TRANSFER_ERRORS] = {
+		"stall",
+		"timeout",
+		"cancelled",
+		"overrun",
+		"underrun",
+		"not responding",
+		"transmission",
+		"other",
+	};
+
+	std::string s = "Endpoint " + std::to_string(val.endpointAddress & 0x0F);
+	s += (val.endpointAddress & 0x80) ? " IN" : " OUT";
+	s += ": " + std::to_string(val.transfers) + " transfers, " + std::to_string(val.bytes) + " bytes";
+	s += ", " + std::to_string(val.totalErrors()) + " errors";
+
+	for (int i = 0; i < NUM_TRANSFER_ERRORS; ++i)
+		if (val.errors[i] != 0)
+			s += std::string(" (") + errorNames[i] + ": " + std::to_string(val.errors[i]) + ")";
+
+	if (val.lateIsoFrames != 0)
+		s += ", " + std::to_string(val.lateIsoFrames) + " late frames";
+
+	s += ", " + std::to_string(val.inFlight) + " in flight (max " + std::to_string(val.maxInFlight) + ")";
+	return s;
+}
+
+EndpointCounters::EndpointCounters()
+{
+	size_t size = NUM_SLOTS * sizeof(Slot) + CACHE_LINE_SIZE;
+	storage.reset(new uint8_t[size]);
+
+	void* p = storage.get();
+	std::align(CACHE_LINE_SIZE, NUM_SLOTS * sizeof(Slot), p, size);
+	slots = static_cast<Slot*>(p);
+	// One at a time: placement array new may add a cookie before the first element.
+	for (int i = 0; i < NUM_SLOTS; ++i)
+		new (&slots[i]) Slot();
+}
+
+EndpointCounters::~EndpointCounters()
+{
+	for (int i = 0; i < NUM_SLOTS; ++i)
+		slots[i].~Slot();
+}
+
+std::shared_ptr<EndpointCounters> EndpointCounters::create()
+{
+	return std::make_shared<EndpointCounters>();
+}
+
+std::vector<EndpointCounterSnapshot> EndpointCounters::snapshot() const
+{
+	std::vector<EndpointCounterSnapshot> snap;
+
+	for (int i = 0; i < NUM_SLOTS; ++i)
+	{
+		const Slot& s = slots[i];
+
+		// Skip endpoints that have never been used.
+		if (s.maxInFlight.load(std::memory_order_relaxed) == 0)
+			continue;
+
+		EndpointCounterSnapshot e;
+		e.endpointAddress = slotAddress(i);
+		e.transfers = s.transfers.load(std::memory_order_relaxed);
+		e.bytes = s.bytes.load(std::memory_order_relaxed);
+		for (int j = 0; j < NUM_TRANSFER_ERRORS; ++j)
+			e.errors[j] = s.errors[j].load(std::memory_order_relaxed);
+		e.lateIsoFrames = s.lateIsoFrames.load(std::memory_order_relaxed);
+		e.inFlight = s.inFlight.load(std::memory_order_relaxed);
+		e.maxInFlight = s.maxInFlight.load(std::memory_order_relaxed);
+		snap.push_back(e);
+	}
+	return snap;
+}
+
+void EndpointCounters::reset()
+{
+	for (int i = 0; i < NUM_SLOTS; ++i)
+	{
+		Slot& s = slots[i];
+		s.transfers.store(0, std::memory_order_relaxed);
+		s.bytes.store(0, std::memory_order_relaxed);
+		for (auto& e : s.errors)
+			e.store(0, std::memory_order_relaxed);
+		s.lateIsoFrames.store(0, std::memory_order_relaxed);
+		// Keep maxInFlight non-zero so the endpoint still shows up in snapshots.
+		int64_t depth = s.inFlight.load(std::memory_order_relaxed);
+		if (s.maxInFlight.load(std::memory_order_relaxed) != 0)
+			s.maxInFlight.store(depth > 0 ? depth : 1, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// The kinds of transfer failure that we count separately. The platform code maps its
+// own error codes onto these (see KernReturnToTransferError() and LastErrorToTransferError()).
+enum class TransferError
+{
+	Stall,         // The endpoint returned STALL.
+	Timeout,       // The transfer didn't complete in time.
+	Cancelled,     // The transfer was aborted by us.
+	Overrun,       // The device sent more data than we asked for (babble).
+	Underrun,      // We couldn't supply/consume data fast enough.
+	NotResponding, // The device didn't respond or was disconnected.
+	Transmission,  // A corrupted packet: CRC, bit stuffing, data toggle or PID errors. These
+	               // point at the cable or signal integrity, not the device's firmware.
+	Other,
+};
+
+static const int NUM_TRANSFER_ERRORS = 8;
+
+// A copy of the counters for one endpoint at some point in time.
+struct EndpointCounterSnapshot
+{
+	// bEndpointAddress, including the direction bit. The default control
+	// pipe is 0x00 for OUT requests and 0x80 for IN requests.
+	uint8_t endpointAddress = 0;
+
+	// Transfers that completed successfully.
+	uint64_t transfers = 0;
+	// Bytes moved by those transfers.
+	uint64_t bytes = 0;
+	// Failed transfers, indexed by TransferError.
+	std::array<uint64_t, NUM_TRANSFER_ERRORS> errors{};
+	// Isochronous frames that were scheduled too late to be sent or received.
+	uint64_t lateIsoFrames = 0;
+	// Transfers currently submitted but not completed, and the most there has ever been.
+	int64_t inFlight = 0;
+	int64_t maxInFlight = 0;
+
+	uint64_t stalls() const { return errors[static_cast<int>(TransferError::Stall)]; }
+	uint64_t totalErrors() const;
+};
+
+std::string to_string(const EndpointCounterSnapshot& val);
+
+// Per-endpoint traffic counters for a device. These are updated from transfer completion
+// callbacks, so they are relaxed atomics and each endpoint's counters are on their own cache
+// line. That means updating them costs a handful of uncontended atomic adds, and a thread
+// taking a snapshot never bounces a line that the completion thread is using. The snapshot
+// isn't a consistent view across counters but that doesn't matter for statistics.
+//
+// Transfer handles keep a shared_ptr to this so that it outlives the Device if needed.
+//
+// C++14's operator new only guarantees alignof(std::max_align_t), usually 16, so the slots
+// live in their own buffer which is over-allocated by a cache line and aligned by hand.
+class EndpointCounters
+{
+public:
+	EndpointCounters();
+	~EndpointCounters();
+
+	static std::shared_ptr<EndpointCounters> create();
+
+	// Call when a transfer is submitted. Every call must be followed by exactly one
+	// call to completed() or failed() for the same endpoint.
+	void submitted(uint8_t endpointAddress)
+	{
+		Slot& s = slot(endpointAddress);
+		int64_t depth = s.inFlight.fetch_add(1, std::memory_order_relaxed) + 1;
+		// This isn't exact if two threads submit at once, but it's close enough.
+		if (depth > s.maxInFlight.load(std::memory_order_relaxed))
+			s.maxInFlight.store(depth, std::memory_order_relaxed);
+	}
+
+	void completed(uint8_t endpointAddress, uint64_t bytes)
+	{
+		Slot& s = slot(endpointAddress);
+		s.inFlight.fetch_sub(1, std::memory_order_relaxed);
+		s.transfers.fetch_add(1, std::memory_order_relaxed);
+		s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void failed(uint8_t endpointAddress, TransferError error)
+	{
+		Slot& s = slot(endpointAddress);
+		s.inFlight.fetch_sub(1, std::memory_order_relaxed);
+		s.errors[static_cast<int>(error)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Isochronous transfers complete as a whole but individual frames may be late.
+	void lateIsoFrames(uint8_t endpointAddress, uint64_t frames)
+	{
+		slot(endpointAddress).lateIsoFrames.fetch_add(frames, std::memory_order_relaxed);
+	}
+
+	// Get the counters of all endpoints that have ever been used.
+	std::vector<EndpointCounterSnapshot> snapshot() const;
+
+	// Zero everything except the in-flight depth.
+	void reset();
+
+private:
+	EndpointCounters(const EndpointCounters&) = delete;
+	EndpointCounters& operator=(const EndpointCounters&) = delete;
+
+	// 64 bytes is right for x86 and most ARM chips.
+	static const int CACHE_LINE_SIZE = 64;
+
+	struct alignas(CACHE_LINE_SIZE) Slot
+	{
+		std::atomic<uint64_t> transfers{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> errors[NUM_TRANSFER_ERRORS] = {};
+		std::atomic<uint64_t> lateIsoFrames{0};
+		std::atomic<int64_t> inFlight{0};
+		std::atomic<int64_t> maxInFlight{0};
+	};
+
+	// There are 16 endpoint numbers in each direction. OUT endpoints are 0-15, IN are 16-31.
+	static const int NUM_SLOTS = 32;
+
+	static int slotIndex(uint8_t endpointAddress)
+	{
+		return (endpointAddress & 0x0F) + ((endpointAddress & 0x80) ? 16 : 0);
+	}
+
+	static uint8_t slotAddress(int index)
+	{
+		return index < 16 ? index : (0x80 | (index - 16));
+	}
+
+	Slot& slot(uint8_t endpointAddress)
+	{
+		return slots[slotIndex(endpointAddress)];
+	}
+
+	// Owns the memory; slots points at the first cache line boundary inside it.
+	std::unique_ptr<uint8_t[]> storage;
+	Slot* slots = nullptr;
+};
@@ -34,6 +34,15 @@ std::string to_string(const EndpointInfo &val)
 	}
 	
 	s += " Max Packet Size: " + std::to_string(val.maxPacketSize);
+	if (val.transactionsPerMicroframe > 1)
+		s += " x " + std::to_string(val.transactionsPerMicroframe) + " per microframe";
+	if (val.superSpeed)
+	{
+		s += " Burst: " + std::to_string(val.maxBurst);
+		if (val.mult > 1)
+			s += " x " + std::to_string(val.mult);
+		s += " Bytes Per Interval: " + std::to_string(val.bytesPerInterval);
+	}
 	s += " Interval: " + std::to_string(val.interval);
 	
 	if (val.type == EndpointInfo::Type::Isochronous)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
 
 #include "Descriptors.h"
@@ -13,13 +14,62 @@ struct EndpointInfo
 		ep.direction = (desc.bEndpointAddress & 0x80) == 0 ? Direction::Out : Direction::In;
 		ep.number = desc.bEndpointAddress & 0x0F;
 		ep.type = from_integral<Type>(desc.bmAttributes & 0x03);
-		ep.maxPacketSize = desc.wMaxPacketSize;
+		ep.maxPacketSize = desc.wMaxPacketSize & 0x07FF;
+		// 3 is reserved.
+		ep.transactionsPerMicroframe = std::min(((desc.wMaxPacketSize >> 11) & 0x03) + 1, 3);
 		ep.interval = desc.bInterval;
 		ep.synchronisation = from_integral<Synchronisation>((desc.bmAttributes >> 2) & 0x03);
 		ep.usage = from_integral<Usage>((desc.bmAttributes >> 4) & 0x03);
+		
+		if (desc.hasCompanion)
+		{
+			ep.superSpeed = true;
+			ep.maxBurst = std::min(desc.bMaxBurst + 1, 16);
+			// For isochronous endpoints bits 0-1 are Mult. For bulk they are MaxStreams.
+			if (ep.type == Type::Isochronous)
+				ep.mult = std::min((desc.bmCompanionAttributes & 0x03) + 1, 3);
+			ep.bytesPerInterval = desc.wBytesPerInterval;
+		}
 		return ep;
 	}
 	
+	// bEndpointAddress.
+	uint8_t address() const
+	{
+		return number | (direction == Direction::In ? 0x80 : 0x00);
+	}
+	
+	// How often the endpoint is serviced, in 125 us microframes. `highSpeed` is true for High
+	// Speed and faster devices, where bInterval counts microframes rather than frames.
+	int servicePeriodMicroframes(bool highSpeed) const
+	{
+		int b = std::max(1, std::min(interval, 16));
+		// Full and low speed interrupt endpoints give the period in frames directly.
+		if (!highSpeed && type == Type::Interrupt)
+			return std::max(1, interval) * 8;
+		int period = 1 << (b - 1);
+		return highSpeed ? period : period * 8;
+	}
+	
+	// The number of isochronous frame list entries per 1 ms frame. For a High Speed endpoint
+	// with bInterval 1-3 that's one per service interval (8, 4 or 2), otherwise one.
+	int packetsPerFrame(bool highSpeed) const
+	{
+		return std::max(1, 8 / servicePeriodMicroframes(highSpeed));
+	}
+	
+	// The most data the endpoint can move in one service interval. This is the size to use
+	// for each frame of an isochronous transfer.
+	//
+	// For high-speed endpoints that's up to three packets per microframe. For SuperSpeed ones
+	// it is up to 16 packets per burst, and for isochronous endpoints up to 3 bursts.
+	int maxBytesPerInterval() const
+	{
+		if (superSpeed)
+			return maxPacketSize * maxBurst * mult;
+		return maxPacketSize * transactionsPerMicroframe;
+	}
+	
 	// The direction from the host's perspective. Out is from the host to device.
 	// In is from the device to the host.
 	enum class Direction {
@@ -38,9 +88,23 @@ struct EndpointInfo
 		Interrupt = 3,
 	} type = Type::Control;
 	
-	// Maximum size of a single packet.
+	// Maximum size of a single packet. This is bits 0-10 of wMaxPacketSize.
 	int maxPacketSize = 0;
 	
+	// Bits 11-12 of wMaxPacketSize, plus one. High-speed isochronous and interrupt endpoints
+	// that need more than 1024 bytes per microframe ('high bandwidth' endpoints) can send up
+	// to three packets per microframe. This is 1 for everything else.
+	int transactionsPerMicroframe = 1;
+	
+	// The rest is from the SuperSpeed endpoint companion descriptor.
+	bool superSpeed = false;
+	// Packets per burst (bMaxBurst + 1, 1-16).
+	int maxBurst = 1;
+	// Bursts per service interval for isochronous endpoints (Mult + 1, 1-3).
+	int mult = 1;
+	// The bytes the endpoint actually moves per service interval, for periodic endpoints.
+	int bytesPerInterval = 0;
+	
 	// bInterval is ignored for bulk and control endpoints.
 	//
 	// For low speed endpoints this is 1-255 and specifies the number of frames (ms)
@@ -0,0 +1,175 @@
+#include "IsochFeedback.h"
+#include "IsochronousInStream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+using std::string;
+
+SResult<double> DecodeFeedbackValue(const uint8_t* data, int size, bool highSpeed)
+{
+	if (highSpeed)
+	{
+		if (size < 4)
+			return Err("High Speed feedback values are 4 bytes, got " + std::to_string(size));
+		uint32_t v = data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24);
+		return Ok(v / 65536.0);
+	}
+
+	if (size < 3)
+		return Err("Full Speed feedback values are 3 bytes, got " + std::to_string(size));
+	// 10.14 in the low 24 bits.
+	uint32_t v = data[0] | (data[1] << 8) | (data[2] << 16);
+	return Ok(v / 16384.0);
+}
+
+IsochRateController::IsochRateController(double nominalUnitsPerPacket,
+                                         int bytesPerUnit,
+                                         int maxBytesPerPacket,
+                                         bool highSpeed,
+                                         int microframesPerPacket)
+	: mNominal(nominalUnitsPerPacket),
+	  mBytesPerUnit(std::max(bytesPerUnit, 1)),
+	  mHighSpeed(highSpeed),
+	  mMicroframesPerPacket(std::max(microframesPerPacket, 1)),
+	  mRate(nominalUnitsPerPacket),
+	  mSentHistory(new std::atomic<uint64_t>[SENT_HISTORY])
+{
+	mMaxUnitsPerPacket = maxBytesPerPacket / mBytesPerUnit;
+	for (int i = 0; i < SENT_HISTORY; ++i)
+		mSentHistory[i] = 0;
+}
+
+void IsochRateController::SetRate(double unitsPerPacket)
+{
+	// A device whose clock is this far out is broken, or we have misread the value.
+	if (unitsPerPacket < mNominal * 0.75 || unitsPerPacket > mNominal * 1.25)
+	{
+		++mRejectedValues;
+		return;
+	}
+	mRate = unitsPerPacket;
+	++mFeedbackValues;
+}
+
+SResult<void> IsochRateController::explicitFeedback(const uint8_t* data, int size)
+{
+	auto value = DecodeFeedbackValue(data, size, mHighSpeed);
+	if (!value)
+		return Err(value.unwrap_err());
+	double perFrame = value.unwrap();
+
+	// Full Speed values are per frame, and High Speed ones per microframe.
+	double perPacket = mHighSpeed ? perFrame * mMicroframesPerPacket : perFrame * mMicroframesPerPacket / 8.0;
+
+	// Devices measure their rate over short periods, so the values jitter around the true one
+	// and we size a whole transfer's packets at a time. Using just the latest value would
+	// give the average of whichever values happened to be latest, not the true rate.
+	if (mFeedbackValues > 0)
+		perPacket = mRate + (perPacket - mRate) / EXPLICIT_SMOOTHING;
+	SetRate(perPacket);
+	return Ok();
+}
+
+void IsochRateController::readFeedback(IsochronousInStream& stream)
+{
+	int valueSize = mHighSpeed ? 4 : 3;
+	uint8_t buf[64 * 4];
+
+	for (;;)
+	{
+		size_t n = stream.read(buf, sizeof(buf) / valueSize * valueSize);
+		if (n == 0)
+			return;
+
+		size_t pos = 0;
+		// Finish a value split across reads.
+		while (mPartialSize > 0 && pos < n)
+		{
+			mPartial[mPartialSize++] = buf[pos++];
+			if (mPartialSize == valueSize)
+			{
+				explicitFeedback(mPartial, valueSize);
+				mPartialSize = 0;
+			}
+		}
+		for (; pos + valueSize <= n; pos += valueSize)
+			explicitFeedback(buf + pos, valueSize);
+		for (; pos < n; ++pos)
+			mPartial[mPartialSize++] = buf[pos];
+	}
+}
+
+void IsochRateController::implicitFeedback(const IsochFrameResult* frames, int numFrames, int inBytesPerUnit)
+{
+	if (inBytesPerUnit < 1)
+		return;
+
+	for (int i = 0; i < numFrames; ++i)
+	{
+		if (frames[i].ok)
+		{
+			uint64_t units = frames[i].length / inBytesPerUnit;
+			mWindowUnits += units;
+			++mWindowPackets;
+			mUnitsReceived += units;
+		}
+		else
+		{
+			// The device sent something but we don't know how much. Assume the usual.
+			mUnitsReceived += mRate.load();
+		}
+		++mPacketsReceived;
+
+		if (mWindowPackets < IMPLICIT_WINDOW_PACKETS)
+			continue;
+
+		SetRate(static_cast<double>(mWindowUnits) / mWindowPackets);
+		mWindowUnits = 0;
+		mWindowPackets = 0;
+
+		// Compare with what we had sent after the same number of packets, if we have sized
+		// that many and haven't overwritten it since.
+		uint64_t sent = mPacketsSent;
+		if (mPacketsReceived > sent || sent - mPacketsReceived >= SENT_HISTORY / 2)
+			continue;
+		double backlog = static_cast<double>(mSentHistory[(mPacketsReceived - 1) % SENT_HISTORY]) - mUnitsReceived;
+
+		if (!mHaveTarget)
+		{
+			mTargetBacklog = backlog;
+			mHaveTarget = true;
+		}
+		double error = backlog - mTargetBacklog;
+		mBufferError = error;
+		// Never more than half a unit per packet, so it doesn't sound like a pitch change.
+		mCorrection = std::max(-0.5, std::min(0.5, -error / CENTERING_PACKETS));
+	}
+}
+
+int IsochRateController::nextPacketBytes()
+{
+	mPhase += mRate.load() + mCorrection.load();
+
+	double units = std::floor(mPhase);
+	units = std::max(0.0, std::min(units, static_cast<double>(mMaxUnitsPerPacket)));
+	mPhase -= units;
+
+	mUnitsSent += static_cast<uint64_t>(units);
+	uint64_t packet = mPacketsSent;
+	mSentHistory[packet % SENT_HISTORY] = mUnitsSent;
+	mPacketsSent = packet + 1;
+
+	return static_cast<int>(units) * mBytesPerUnit;
+}
+
+IsochRateStats IsochRateController::stats() const
+{
+	IsochRateStats s;
+	s.unitsPerPacket = mRate;
+	s.feedbackValues = mFeedbackValues;
+	s.rejectedValues = mRejectedValues;
+	s.bufferError = mBufferError;
+	return s;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "IsochFrame.h"
+
+class IsochronousInStream;
+
+// Decode a value from an explicit feedback endpoint into units (e.g. audio sample frames)
+// per frame. Full Speed endpoints send 10.14 fixed point per 1 ms frame in 3 bytes, and High
+// Speed ones 16.16 fixed point per microframe in 4 bytes.
+SResult<double> DecodeFeedbackValue(const uint8_t* data, int size, bool highSpeed);
+
+struct IsochRateStats
+{
+	// The current rate the device is consuming data at.
+	double unitsPerPacket = 0.0;
+	// Feedback values used, and ones thrown away for being too far from the nominal rate.
+	uint64_t feedbackValues = 0;
+	uint64_t rejectedValues = 0;
+	// Implicit feedback only: how far the device's buffer is from where it started, in units.
+	double bufferError = 0.0;
+};
+
+// Works out how many bytes to send in each packet to an asynchronous isochronous OUT
+// endpoint, whose clock isn't locked to the host's. The device tells us how fast it is
+// consuming data, either explicitly with a feedback endpoint, or implicitly by how much it
+// sends on an IN endpoint running from the same clock. The fractional part of the rate is
+// carried over so that on average we send exactly what the device uses and its buffer stays
+// where it started.
+//
+// Feedback is given on one thread (the IN stream's) and packets sized on another (the OUT
+// stream's).
+class IsochRateController
+{
+public:
+	// `nominalUnitsPerPacket` is the rate until feedback arrives, e.g. 48 for 48 kHz audio
+	// with a packet every frame. Each unit is `bytesPerUnit` bytes (e.g. channels * sample
+	// size) and no packet is more than `maxBytesPerPacket`. `microframesPerPacket` is the OUT
+	// endpoint's service interval for High Speed, or 8 for Full Speed.
+	IsochRateController(double nominalUnitsPerPacket, int bytesPerUnit, int maxBytesPerPacket, bool highSpeed, int microframesPerPacket);
+
+	// Explicit feedback: a raw value read from the feedback endpoint.
+	SResult<void> explicitFeedback(const uint8_t* data, int size);
+
+	// Explicit feedback: use every value waiting in a stream reading the feedback endpoint.
+	void readFeedback(IsochronousInStream& stream);
+
+	// Implicit feedback: the frames received on the IN endpoint, whose packets have the same
+	// interval as ours. Suitable for calling from an IsochFrameStatusCallback.
+	void implicitFeedback(const IsochFrameResult* frames, int numFrames, int inBytesPerUnit);
+
+	// The length of the next packet in bytes. Only call this from one thread.
+	int nextPacketBytes();
+
+	int bytesPerUnit() const { return mBytesPerUnit; }
+
+	IsochRateStats stats() const;
+
+private:
+	void SetRate(double unitsPerPacket);
+
+	// Explicit feedback values are smoothed over roughly this many.
+	static const int EXPLICIT_SMOOTHING = 32;
+	// Implicit feedback rate is averaged over this many IN packets.
+	static const int IMPLICIT_WINDOW_PACKETS = 256;
+	// Implicit feedback buffer errors are corrected over roughly this many packets.
+	static const int CENTERING_PACKETS = 1024;
+
+	double mNominal = 0.0;
+	int mBytesPerUnit = 1;
+	int mMaxUnitsPerPacket = 0;
+	bool mHighSpeed = false;
+	int mMicroframesPerPacket = 8;
+
+	std::atomic<double> mRate;
+	std::atomic<uint64_t> mFeedbackValues{0};
+	std::atomic<uint64_t> mRejectedValues{0};
+
+	// Centering with implicit feedback. The device consumes on the OUT endpoint exactly what it
+	// produces on the IN one, so how far its buffer has moved is the difference between the
+	// units we sent in the first n packets and those we received in the first n packets, less
+	// whatever it was when feedback started (the streams didn't start together). Comparing
+	// packet counts rather than running totals means it doesn't matter that the OUT packets
+	// are sized well before they are sent and the IN ones are seen well after.
+	//
+	// The total sent after each packet, indexed by packet number modulo SENT_HISTORY.
+	static const int SENT_HISTORY = 8192;
+	std::unique_ptr<std::atomic<uint64_t>[]> mSentHistory;
+	std::atomic<uint64_t> mPacketsSent{0};
+	// Added to the rate, set by the IN thread once per window.
+	std::atomic<double> mCorrection{0.0};
+	std::atomic<double> mBufferError{0.0};
+
+	// IN thread only.
+	uint64_t mWindowUnits = 0;
+	int mWindowPackets = 0;
+	uint64_t mPacketsReceived = 0;
+	double mUnitsReceived = 0.0;
+	bool mHaveTarget = false;
+	double mTargetBacklog = 0.0;
+	// Part of a value left over from readFeedback().
+	uint8_t mPartial[4];
+	int mPartialSize = 0;
+
+	// OUT thread only. The fraction of a unit owed to the device, and the total sent.
+	double mPhase = 0.0;
+	uint64_t mUnitsSent = 0;
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "EndpointCounters.h"
+
+// The outcome of one entry in the frame list of an isochronous transfer.
+struct IsochFrameResult
+{
+	// The bytes actually transferred. IN frames are often shorter than requested, or empty.
+	int length = 0;
+	bool ok = false;
+	// Why the frame failed, if !ok. TransferError::Underrun means it was scheduled too late.
+	TransferError error = TransferError::Other;
+};
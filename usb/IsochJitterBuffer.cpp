@@ -0,0 +1,142 @@
+#include "IsochJitterBuffer.h"
+
+#include <algorithm>
+#include <string.h>
+
+IsochJitterBuffer::IsochJitterBuffer(int bytesPerFrame, const IsochJitterConfig& config)
+	: mBytesPerFrame(bytesPerFrame),
+	  mConfig(config),
+	  mRing(static_cast<size_t>(std::max(config.capacityFrames, 1)) * bytesPerFrame, config.memory),
+	  mLast(bytesPerFrame, 0),
+	  mScratch(bytesPerFrame, 0),
+	  mHistory(DRIFT_WINDOW)
+{
+	mConfig.capacityFrames = std::max(mConfig.capacityFrames, 1);
+	mConfig.targetFrames = std::max(0, std::min(mConfig.targetFrames, mConfig.capacityFrames));
+}
+
+int IsochJitterBuffer::FillFrames() const
+{
+	return static_cast<int>(mRing.readable() / mBytesPerFrame);
+}
+
+bool IsochJitterBuffer::push(const uint8_t* data)
+{
+	// The ring is rounded up to a power of two, so check the capacity we were asked for.
+	if (FillFrames() >= mConfig.capacityFrames || !mRing.write(data, mBytesPerFrame))
+	{
+		++mOverflows;
+		return false;
+	}
+	return true;
+}
+
+bool IsochJitterBuffer::pop(uint8_t* data)
+{
+	int fill = FillFrames();
+
+	if (!mPrimed)
+	{
+		if (fill < mConfig.targetFrames || fill == 0)
+		{
+			memset(data, 0, mBytesPerFrame);
+			++mSilentFrames;
+			return false;
+		}
+		mPrimed = true;
+	}
+
+	if (mRepeatNext && mHaveLast)
+	{
+		// Send the last frame again and leave the queue alone.
+		mRepeatNext = false;
+		memcpy(data, mLast.data(), mBytesPerFrame);
+		++mRepeatedFrames;
+		--mCorrected;
+		return true;
+	}
+
+	if (mDropNext && fill >= 2)
+	{
+		mDropNext = false;
+		mRing.read(mScratch.data(), mBytesPerFrame);
+		++mDroppedFrames;
+		++mCorrected;
+		--fill;
+	}
+
+	if (fill == 0)
+	{
+		++mUnderflows;
+		++mSilentFrames;
+		mPrimed = false;
+		memset(data, 0, mBytesPerFrame);
+		return false;
+	}
+
+	mRing.read(data, mBytesPerFrame);
+	memcpy(mLast.data(), data, mBytesPerFrame);
+	mHaveLast = true;
+	++mPopped;
+	return true;
+}
+
+void IsochJitterBuffer::update()
+{
+	int fill = FillFrames();
+	mFill = fill;
+
+	// Don't track the fill level while it is refilling; that isn't drift.
+	if (!mPrimed)
+		return;
+
+	if (!mHaveAverage)
+	{
+		mAverageFill = fill;
+		mHaveAverage = true;
+	}
+	else
+	{
+		mAverageFill += (fill - mAverageFill) / FILL_SMOOTHING;
+	}
+	mAverageFillOut = mAverageFill;
+
+	// The producer's excess over the bus is how much the fill level rose, plus whatever we
+	// dropped (less repeated) to stop it, per frame sent.
+	double level = mAverageFill + mCorrected;
+	auto& then = mHistory[mUpdates % DRIFT_WINDOW];
+	if (mUpdates >= DRIFT_WINDOW && mPopped > then.first)
+		mDriftPpm = (level - then.second) / (mPopped - then.first) * 1e6;
+	then = std::make_pair(mPopped, level);
+	++mUpdates;
+
+	if (!mConfig.compensate)
+		return;
+
+	// At most one correction per update, so the average can catch up before the next.
+	if (mAverageFill > mConfig.targetFrames + mConfig.hysteresisFrames)
+	{
+		mDropNext = true;
+		mAverageFill -= 1.0;
+	}
+	else if (mAverageFill < mConfig.targetFrames - mConfig.hysteresisFrames)
+	{
+		mRepeatNext = true;
+		mAverageFill += 1.0;
+	}
+}
+
+IsochJitterStats IsochJitterBuffer::stats() const
+{
+	IsochJitterStats s;
+	s.fillFrames = mFill;
+	s.averageFill = mAverageFillOut;
+	s.targetFrames = mConfig.targetFrames;
+	s.driftPpm = mDriftPpm;
+	s.underflows = mUnderflows;
+	s.silentFrames = mSilentFrames;
+	s.overflows = mOverflows;
+	s.droppedFrames = mDroppedFrames;
+	s.repeatedFrames = mRepeatedFrames;
+	return s;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+#include "util/ByteRing.h"
+
+struct IsochJitterConfig
+{
+	// How many frames can be queued. Frames pushed when it is full are thrown away.
+	int capacityFrames = 256;
+	// The fill level to start at and hold. It should cover the worst delay of the producer.
+	int targetFrames = 64;
+	// Drop or repeat a frame when the average fill level gets this far from the target,
+	// because the producer's clock is faster or slower than the bus's.
+	int hysteresisFrames = 16;
+	// Without this drift is only measured and reported.
+	bool compensate = true;
+	// How to allocate the buffer, e.g. locked so the stream thread never faults on it.
+	LockedMemoryOptions memory;
+};
+
+struct IsochJitterStats
+{
+	int fillFrames = 0;
+	double averageFill = 0.0;
+	int targetFrames = 0;
+	// How much faster the producer is than the bus, in parts per million.
+	double driftPpm = 0.0;
+
+	// Times the buffer ran dry, and frames sent as zeros because of it (including while
+	// refilling to the target afterwards).
+	uint64_t underflows = 0;
+	uint64_t silentFrames = 0;
+	// Frames thrown away because the buffer was full.
+	uint64_t overflows = 0;
+
+	// Frames dropped or repeated to make up for drift.
+	uint64_t droppedFrames = 0;
+	uint64_t repeatedFrames = 0;
+};
+
+// Sits between a producer that makes frames on its own timer and a stream that sends them
+// on the bus clock. The two clocks never quite agree, so the fill level creeps up or down;
+// it is tracked and, if compensate is set, a frame is dropped or repeated before the buffer
+// over- or underflows. That is much less noticeable than a run of zeros.
+//
+// push() is called on the producer's thread and pop() on the stream's.
+class IsochJitterBuffer
+{
+public:
+	IsochJitterBuffer(int bytesPerFrame, const IsochJitterConfig& config);
+
+	// Queue a frame of bytesPerFrame bytes. Returns false if it was thrown away because the
+	// buffer is full.
+	bool push(const uint8_t* data);
+
+	// Get the next frame to send. Returns false, and fills it with zeros, if there wasn't one.
+	bool pop(uint8_t* data);
+
+	// Call once per transfer, after its frames have been popped, to track the fill level and
+	// correct for drift.
+	void update();
+
+	IsochJitterStats stats() const;
+
+private:
+	int FillFrames() const;
+
+	// The average fill level is smoothed over this many updates, and drift is measured over
+	// DRIFT_WINDOW updates.
+	static const int FILL_SMOOTHING = 16;
+	static const int DRIFT_WINDOW = 1024;
+
+	int mBytesPerFrame = 0;
+	IsochJitterConfig mConfig;
+	ByteRing mRing;
+
+	// Stream thread only.
+	std::vector<uint8_t> mLast;
+	std::vector<uint8_t> mScratch;
+	bool mHaveLast = false;
+	// False until the fill level reaches the target, at the start and after running dry.
+	bool mPrimed = false;
+	// Set by update() for the next pop() to act on.
+	bool mDropNext = false;
+	bool mRepeatNext = false;
+	uint64_t mPopped = 0;
+	double mAverageFill = 0.0;
+	bool mHaveAverage = false;
+	// A ring of (frames popped, average fill) for measuring the slope.
+	std::vector<std::pair<uint64_t, double>> mHistory;
+	int mUpdates = 0;
+	// Net frames we have dropped (positive) or repeated (negative), which the fill level
+	// doesn't show.
+	int64_t mCorrected = 0;
+
+	std::atomic<int> mFill{0};
+	std::atomic<double> mAverageFillOut{0.0};
+	std::atomic<double> mDriftPpm{0.0};
+	std::atomic<uint64_t> mUnderflows{0};
+	std::atomic<uint64_t> mSilentFrames{0};
+	std::atomic<uint64_t> mOverflows{0};
+	std::atomic<uint64_t> mDroppedFrames{0};
+	std::atomic<uint64_t> mRepeatedFrames{0};
+};
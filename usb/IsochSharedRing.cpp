@@ -0,0 +1,469 @@
+#include "IsochSharedRing.h"
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+
+namespace
+{
+// The other process may be built by another compiler, so everything in shared memory is
+// fixed-size, at a fixed offset, and lock-free.
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "The shared ring needs lock-free atomics");
+
+const char RING_MAGIC[8] = {'U', 'T', 'I', 'S', 'O', 'R', 'N', 'G'};
+const char CLOCK_MAGIC[8] = {'U', 'T', 'I', 'S', 'O', 'C', 'L', 'K'};
+const uint32_t LAYOUT_VERSION = 1;
+
+const size_t CACHE_LINE_SIZE = 64;
+const uint32_t MAX_SLOTS = 1 << 16;
+
+// The ring starts with this. The write position, then the read position and the number of
+// waiting writers, are each on a cache line of their own after it, then come the slots.
+struct RingHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t bytesPerFrame;
+	uint32_t slots;
+	uint32_t slotSize;
+};
+
+const size_t WRITE_POS_OFFSET = CACHE_LINE_SIZE;
+const size_t READ_POS_OFFSET = 2 * CACHE_LINE_SIZE;
+const size_t WAITERS_OFFSET = READ_POS_OFFSET + 4;
+const size_t SLOTS_OFFSET = 3 * CACHE_LINE_SIZE;
+
+// Each slot is the frame's microframe then the frame, padded to whole cache lines.
+const size_t SLOT_HEADER_SIZE = 16;
+
+// The positions count frames, and wrap. The slot is the position modulo the (power of two)
+// number of slots.
+std::atomic<uint32_t>& Position(const std::shared_ptr<SharedMemory>& ring, size_t offset)
+{
+	return *reinterpret_cast<std::atomic<uint32_t>*>(ring->data() + offset);
+}
+
+uint8_t* Slot(const std::shared_ptr<SharedMemory>& ring, uint32_t position)
+{
+	const RingHeader* header = reinterpret_cast<const RingHeader*>(ring->data());
+	return ring->data() + SLOTS_OFFSET + size_t(position & (header->slots - 1)) * header->slotSize;
+}
+
+// The clock page. The fields in the middle are a seqlock: `sequence` is odd while they are
+// being written.
+struct ClockPage
+{
+	char magic[8];
+	std::atomic<uint32_t> sequence;
+	std::atomic<uint32_t> entriesPerFrame;
+	std::atomic<uint64_t> usbMicroframe;
+	std::atomic<int64_t> sampledNs;
+	std::atomic<uint64_t> firstWritableMicroframe;
+	std::atomic<uint64_t> lateFrames;
+	std::atomic<uint64_t> missedFrames;
+};
+
+const size_t CLOCK_PAGE_SIZE = 4096;
+static_assert(sizeof(ClockPage) <= CLOCK_PAGE_SIZE, "ClockPage must fit in a page");
+
+const ClockPage* Clock(const std::shared_ptr<SharedMemory>& page)
+{
+	return reinterpret_cast<const ClockPage*>(page->data());
+}
+
+IsochFrameClock ReadClock(const ClockPage* page)
+{
+	IsochFrameClock clock;
+	for (;;)
+	{
+		uint32_t before = page->sequence.load(std::memory_order_acquire);
+		if (before & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		clock.entriesPerFrame = page->entriesPerFrame.load(std::memory_order_relaxed);
+		clock.usbMicroframe = page->usbMicroframe.load(std::memory_order_relaxed);
+		int64_t sampledNs = page->sampledNs.load(std::memory_order_relaxed);
+		clock.firstWritableMicroframe = page->firstWritableMicroframe.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (page->sequence.load(std::memory_order_relaxed) != before)
+			continue;
+
+		clock.valid = before != 0;
+		clock.sampled = HighResClock::time_point(
+		    std::chrono::duration_cast<HighResClock::duration>(std::chrono::nanoseconds(sampledNs)));
+		break;
+	}
+	clock.lateFrames = page->lateFrames.load(std::memory_order_relaxed);
+	clock.missedFrames = page->missedFrames.load(std::memory_order_relaxed);
+	return clock;
+}
+
+#if defined(__linux__)
+// Not FUTEX_PRIVATE_FLAG: the waiter is in another process.
+void FutexWait(std::atomic<uint32_t>& word, uint32_t expected, int timeoutMs)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>& word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+#elif defined(_WIN32)
+std::wstring SpaceEventName(const string& name)
+{
+	// Local\ like the shared memory. Names are ASCII identifiers.
+	return L"Local\\" + std::wstring(name.begin(), name.end()) + L"-space";
+}
+#elif defined(__APPLE__)
+// Like the shared memory, the FIFO is only for processes of the same user (it is made with
+// mode 0600). It is in /tmp because $TMPDIR comes from the environment, which a process
+// started another way (e.g. by launchd) may not share, and then the two wouldn't meet.
+string WakePath(const string& name)
+{
+	return "/tmp/" + name + ".usbtool-wake";
+}
+
+string ErrnoError(const string& what)
+{
+	return what + " failed: " + strerror(errno);
+}
+#endif
+}
+
+uint64_t IsochFrameClock::microframeAt(HighResClock::time_point t) const
+{
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t - sampled).count();
+	// A microframe is 125 us.
+	int64_t microframes = ns / 125000;
+	if (microframes < 0 && uint64_t(-microframes) > usbMicroframe)
+		return 0;
+	return usbMicroframe + microframes;
+}
+
+SResult<std::shared_ptr<IsochSharedRing>> IsochSharedRing::create(const string& name, int bytesPerFrame, int slots)
+{
+	if (bytesPerFrame <= 0)
+		return Err(string("Frames must be at least one byte"));
+	if (slots <= 0 || uint32_t(slots) > MAX_SLOTS)
+		return Err("The ring can have at most " + std::to_string(MAX_SLOTS) + " slots");
+
+	uint32_t slotCount = 2;
+	while (slotCount < uint32_t(slots))
+		slotCount *= 2;
+	uint32_t slotSize = (SLOT_HEADER_SIZE + bytesPerFrame + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+	auto ringRes = SharedMemory::create(name, SLOTS_OFFSET + size_t(slotCount) * slotSize);
+	if (!ringRes)
+		return Err(ringRes.unwrap_err());
+	auto clockRes = SharedMemory::create(name + "-clock", CLOCK_PAGE_SIZE);
+	if (!clockRes)
+		return Err(clockRes.unwrap_err());
+
+	std::shared_ptr<IsochSharedRing> ring(new IsochSharedRing());
+	ring->mRing = ringRes.unwrap();
+	ring->mClock = clockRes.unwrap();
+	ring->mBytesPerFrame = bytesPerFrame;
+	ring->mSlots = slotCount;
+
+#if defined(_WIN32)
+	// Auto-reset, so each wakeWriter() wakes one wait.
+	ring->mSpaceEvent = CreateEventW(nullptr, FALSE, FALSE, SpaceEventName(name).c_str());
+	if (ring->mSpaceEvent == nullptr)
+		return Err("CreateEventW failed: error " + std::to_string(GetLastError()));
+#elif defined(__APPLE__)
+	// The name was free, so a FIFO that is there was left by a process that crashed.
+	string wakePath = WakePath(name);
+	unlink(wakePath.c_str());
+	if (mkfifo(wakePath.c_str(), 0600) != 0)
+		return Err(ErrnoError("mkfifo " + wakePath));
+	ring->mWakePath = wakePath;
+#endif
+
+	uint8_t* base = ring->mRing->data();
+	new (base + WRITE_POS_OFFSET) std::atomic<uint32_t>(0);
+	new (base + READ_POS_OFFSET) std::atomic<uint32_t>(0);
+	new (base + WAITERS_OFFSET) std::atomic<uint32_t>(0);
+	RingHeader* header = reinterpret_cast<RingHeader*>(base);
+	header->version = LAYOUT_VERSION;
+	header->bytesPerFrame = bytesPerFrame;
+	header->slots = slotCount;
+	header->slotSize = slotSize;
+
+	ClockPage* clock = new (ring->mClock->data()) ClockPage();
+	memcpy(clock->magic, CLOCK_MAGIC, sizeof(CLOCK_MAGIC));
+
+	// The magic goes last, so a writer that opens the ring early sees it as not ready.
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+	return Ok(ring);
+}
+
+IsochSharedRing::~IsochSharedRing()
+{
+#if defined(_WIN32)
+	if (mSpaceEvent != nullptr)
+		CloseHandle(mSpaceEvent);
+#elif defined(__APPLE__)
+	if (mWakeFd >= 0)
+		close(mWakeFd);
+	if (!mWakePath.empty())
+		unlink(mWakePath.c_str());
+#endif
+}
+
+const uint8_t* IsochSharedRing::front(uint64_t& usbMicroframe) const
+{
+	uint32_t read = Position(mRing, READ_POS_OFFSET).load(std::memory_order_relaxed);
+	uint32_t write = Position(mRing, WRITE_POS_OFFSET).load(std::memory_order_acquire);
+	if (read == write)
+		return nullptr;
+
+	const uint8_t* slot = Slot(mRing, read);
+	memcpy(&usbMicroframe, slot, sizeof(usbMicroframe));
+	return slot + SLOT_HEADER_SIZE;
+}
+
+void IsochSharedRing::pop()
+{
+	std::atomic<uint32_t>& read = Position(mRing, READ_POS_OFFSET);
+	read.store(read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void IsochSharedRing::wakeWriter()
+{
+	// Pairs with the writer counting itself as waiting before it reads the position.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (Position(mRing, WAITERS_OFFSET).load(std::memory_order_relaxed) == 0)
+		return;
+
+#if defined(__linux__)
+	FutexWake(Position(mRing, READ_POS_OFFSET));
+#elif defined(_WIN32)
+	SetEvent(mSpaceEvent);
+#elif defined(__APPLE__)
+	// A writer holds the FIFO open for reading for as long as it has the ring open, so a
+	// waiter that is still counted when there is no reader died while it was waiting. Let
+	// its count go, unless another writer has registered since, so we stop trying.
+	std::atomic<uint32_t>& waiters = Position(mRing, WAITERS_OFFSET);
+	uint32_t counted = waiters.load(std::memory_order_relaxed);
+	if (mWakeFd < 0)
+	{
+		mWakeFd = ::open(mWakePath.c_str(), O_WRONLY | O_NONBLOCK);
+		if (mWakeFd < 0)
+		{
+			if (errno == ENXIO)
+				waiters.compare_exchange_strong(counted, 0, std::memory_order_relaxed);
+			return;
+		}
+		// Otherwise a write after the writer has gone would kill us with SIGPIPE.
+		fcntl(mWakeFd, F_SETNOSIGPIPE, 1);
+	}
+
+	// If the pipe is full the writer has plenty of wakeups waiting already.
+	uint8_t wake = 1;
+	if (write(mWakeFd, &wake, 1) < 0 && errno == EPIPE)
+	{
+		// Open it again for the next writer.
+		close(mWakeFd);
+		mWakeFd = -1;
+		waiters.compare_exchange_strong(counted, 0, std::memory_order_relaxed);
+	}
+#endif
+}
+
+void IsochSharedRing::publishClock(uint64_t usbMicroframe, HighResClock::time_point sampled,
+                                   uint64_t firstWritableMicroframe, int entriesPerFrame)
+{
+	ClockPage* page = reinterpret_cast<ClockPage*>(mClock->data());
+	uint32_t sequence = page->sequence.load(std::memory_order_relaxed);
+	page->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	page->entriesPerFrame.store(entriesPerFrame, std::memory_order_relaxed);
+	page->usbMicroframe.store(usbMicroframe, std::memory_order_relaxed);
+	page->sampledNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(sampled.time_since_epoch()).count(),
+	                      std::memory_order_relaxed);
+	page->firstWritableMicroframe.store(firstWritableMicroframe, std::memory_order_relaxed);
+
+	page->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void IsochSharedRing::addLateFrames(uint64_t count)
+{
+	if (count != 0)
+		reinterpret_cast<ClockPage*>(mClock->data())->lateFrames.fetch_add(count, std::memory_order_relaxed);
+}
+
+void IsochSharedRing::addMissedFrames(uint64_t count)
+{
+	if (count != 0)
+		reinterpret_cast<ClockPage*>(mClock->data())->missedFrames.fetch_add(count, std::memory_order_relaxed);
+}
+
+IsochFrameClock IsochSharedRing::clock() const
+{
+	return ReadClock(Clock(mClock));
+}
+
+SResult<std::shared_ptr<IsochSharedRingWriter>> IsochSharedRingWriter::open(const string& name)
+{
+	auto ringRes = SharedMemory::open(name, SharedMemory::Access::ReadWrite);
+	if (!ringRes)
+		return Err(ringRes.unwrap_err());
+	auto clockRes = SharedMemory::open(name + "-clock", SharedMemory::Access::ReadOnly);
+	if (!clockRes)
+		return Err(clockRes.unwrap_err());
+
+	std::shared_ptr<IsochSharedRingWriter> writer(new IsochSharedRingWriter());
+	writer->mRing = ringRes.unwrap();
+	writer->mClock = clockRes.unwrap();
+
+	if (writer->mRing->size() < SLOTS_OFFSET)
+		return Err("'" + name + "' is too small to be a frame ring");
+	const RingHeader* header = reinterpret_cast<const RingHeader*>(writer->mRing->data());
+	if (memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0)
+		return Err("'" + name + "' is not a frame ring, or isn't ready yet");
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (header->version != LAYOUT_VERSION)
+		return Err("Frame ring '" + name + "' is version " + std::to_string(header->version) +
+		           ", expected " + std::to_string(LAYOUT_VERSION));
+	if (header->slots < 2 || header->slots > MAX_SLOTS || (header->slots & (header->slots - 1)) != 0 ||
+	    header->slotSize < SLOT_HEADER_SIZE + header->bytesPerFrame ||
+	    writer->mRing->size() < SLOTS_OFFSET + size_t(header->slots) * header->slotSize)
+		return Err("Frame ring '" + name + "' has an invalid header");
+
+	if (writer->mClock->size() < sizeof(ClockPage) ||
+	    memcmp(Clock(writer->mClock)->magic, CLOCK_MAGIC, sizeof(CLOCK_MAGIC)) != 0)
+		return Err("'" + name + "-clock' is not a frame clock");
+
+#if defined(_WIN32)
+	writer->mSpaceEvent = OpenEventW(SYNCHRONIZE, FALSE, SpaceEventName(name).c_str());
+	if (writer->mSpaceEvent == nullptr)
+		return Err("OpenEventW failed: error " + std::to_string(GetLastError()));
+#elif defined(__APPLE__)
+	// The read end first: opening the write end without blocking fails until there is one.
+	string wakePath = WakePath(name);
+	writer->mWakeReadFd = ::open(wakePath.c_str(), O_RDONLY | O_NONBLOCK);
+	if (writer->mWakeReadFd < 0)
+		return Err(ErrnoError("open " + wakePath));
+	writer->mWakeWriteFd = ::open(wakePath.c_str(), O_WRONLY | O_NONBLOCK);
+	if (writer->mWakeWriteFd < 0)
+		return Err(ErrnoError("open " + wakePath));
+#endif
+
+	writer->mBytesPerFrame = header->bytesPerFrame;
+	writer->mSlots = header->slots;
+	return Ok(writer);
+}
+
+IsochSharedRingWriter::~IsochSharedRingWriter()
+{
+#if defined(_WIN32)
+	if (mSpaceEvent != nullptr)
+		CloseHandle(mSpaceEvent);
+#elif defined(__APPLE__)
+	if (mWakeReadFd >= 0)
+		close(mWakeReadFd);
+	if (mWakeWriteFd >= 0)
+		close(mWakeWriteFd);
+#endif
+}
+
+uint8_t* IsochSharedRingWriter::frame()
+{
+	if (writableFrames() == 0)
+		return nullptr;
+	return Slot(mRing, Position(mRing, WRITE_POS_OFFSET).load(std::memory_order_relaxed)) + SLOT_HEADER_SIZE;
+}
+
+void IsochSharedRingWriter::commit(uint64_t usbMicroframe)
+{
+	std::atomic<uint32_t>& write = Position(mRing, WRITE_POS_OFFSET);
+	uint32_t position = write.load(std::memory_order_relaxed);
+	memcpy(Slot(mRing, position), &usbMicroframe, sizeof(usbMicroframe));
+	write.store(position + 1, std::memory_order_release);
+}
+
+int IsochSharedRingWriter::writableFrames() const
+{
+	uint32_t write = Position(mRing, WRITE_POS_OFFSET).load(std::memory_order_relaxed);
+	uint32_t read = Position(mRing, READ_POS_OFFSET).load(std::memory_order_acquire);
+	return mSlots - static_cast<int>(write - read);
+}
+
+bool IsochSharedRingWriter::waitForSpace(int timeoutMs)
+{
+	auto deadline = HighResClock::now() + std::chrono::milliseconds(timeoutMs);
+	for (;;)
+	{
+		if (writableFrames() > 0)
+			return true;
+
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - HighResClock::now()).count();
+		if (left <= 0)
+			return false;
+
+#if defined(__linux__) || defined(_WIN32) || defined(__APPLE__)
+		std::atomic<uint32_t>& read = Position(mRing, READ_POS_OFFSET);
+		std::atomic<uint32_t>& waiters = Position(mRing, WAITERS_OFFSET);
+		waiters.fetch_add(1, std::memory_order_seq_cst);
+		uint32_t seen = read.load(std::memory_order_seq_cst);
+		// The reader may have moved on between the check above and registering as a waiter.
+		// A wakeup sent in between isn't lost either: the event stays set, and the byte
+		// stays in the pipe.
+		if (writableFrames() == 0)
+		{
+#if defined(__linux__)
+			FutexWait(read, seen, static_cast<int>(left));
+#elif defined(_WIN32)
+			(void)seen;
+			WaitForSingleObject(mSpaceEvent, static_cast<DWORD>(left));
+#else
+			(void)seen;
+			struct pollfd fd = {mWakeReadFd, POLLIN, 0};
+			if (poll(&fd, 1, static_cast<int>(left)) > 0)
+			{
+				uint8_t drain[64];
+				while (::read(mWakeReadFd, drain, sizeof(drain)) > 0)
+				{
+				}
+			}
+#endif
+		}
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+#else
+		std::this_thread::sleep_for(std::chrono::microseconds(500));
+#endif
+	}
+}
+
+IsochFrameClock IsochSharedRingWriter::clock() const
+{
+	return ReadClock(Clock(mClock));
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/HighResClock.h"
+#include "util/SharedMemory.h"
+
+// Feeds an IsochronousStream from another process. Frames go through a ring in shared memory
+// with one writer (the other process) and one reader (the stream's submit thread). Neither
+// side takes a lock or makes a system call for a frame. The writer fills each frame in place
+// in the shared memory, and the stream copies it straight into the transfer buffer when it
+// is submitted, as WriteFrame() would.
+//
+// Each frame is stamped with the USB microframe it is for. The stream drops frames whose
+// microframe has already been submitted, and sends zeros for microframes it has no frame for.
+//
+// The stream also publishes its bus clock on a second, read-only page, so the writer can see
+// the current microframe and which is the first it can still write, without asking.
+//
+// The stream takes a whole transfer's frames from the ring at once (64 packets: 64 ms at
+// Full Speed, 8 ms for a High Speed endpoint with bInterval 1), about two transfers before
+// they are sent. The clock's firstWritableMicroframe is the first packet of the next transfer
+// it will take. So the writer has to stay at least a transfer ahead of that, and the ring
+// needs at least 64 slots; the stream won't start with fewer.
+//
+// A writer waiting for room is woken by the stream with a futex on Linux, a named event on
+// Windows and a named pipe on macOS, only when it is actually waiting.
+//
+// Only the memory layout is shared. The other process builds this file and
+// util/SharedMemory.cpp and uses IsochSharedRingWriter.
+
+// A snapshot of the stream's bus clock.
+struct IsochFrameClock
+{
+	// False until the stream has started.
+	bool valid = false;
+	// The bus microframe when it was sampled, and the time it was sampled at.
+	uint64_t usbMicroframe = 0;
+	HighResClock::time_point sampled;
+	// Frames for microframes before this are too late; they have been submitted already.
+	uint64_t firstWritableMicroframe = 0;
+	// Packets per 1 ms frame. Writing any microframe in a packet's interval writes that packet.
+	int entriesPerFrame = 1;
+	// Frames dropped because they were too late, and packets sent as zeros.
+	uint64_t lateFrames = 0;
+	uint64_t missedFrames = 0;
+
+	// The bus microframe at `t`, extrapolated from the sample.
+	uint64_t microframeAt(HighResClock::time_point t) const;
+};
+
+// The stream's side. Created by the process that owns the device.
+class IsochSharedRing
+{
+public:
+	// Create a ring called `name` of `slots` frames (rounded up to a power of two) of
+	// `bytesPerFrame` bytes, and its clock page called `name` + "-clock". Fails if a ring of
+	// that name is in use.
+	static SResult<std::shared_ptr<IsochSharedRing>> create(const std::string& name, int bytesPerFrame, int slots);
+	~IsochSharedRing();
+
+	// The oldest frame, in place, or nullptr if there aren't any. Only the stream's submit
+	// thread calls these.
+	const uint8_t* front(uint64_t& usbMicroframe) const;
+	void pop();
+	// Wake the writer if it is waiting for room. Call this after popping a batch.
+	void wakeWriter();
+
+	// Publish the bus clock. Only the stream's submit thread calls this.
+	void publishClock(uint64_t usbMicroframe, HighResClock::time_point sampled,
+	                  uint64_t firstWritableMicroframe, int entriesPerFrame);
+	void addLateFrames(uint64_t count);
+	void addMissedFrames(uint64_t count);
+
+	IsochFrameClock clock() const;
+
+	int bytesPerFrame() const { return mBytesPerFrame; }
+	int slots() const { return mSlots; }
+	const std::string& name() const { return mRing->name(); }
+
+private:
+	IsochSharedRing() = default;
+	IsochSharedRing(const IsochSharedRing&) = delete;
+	IsochSharedRing& operator=(const IsochSharedRing&) = delete;
+
+	std::shared_ptr<SharedMemory> mRing;
+	std::shared_ptr<SharedMemory> mClock;
+	int mBytesPerFrame = 0;
+	int mSlots = 0;
+#if defined(_WIN32)
+	// Set by wakeWriter().
+	void* mSpaceEvent = nullptr;
+#elif defined(__APPLE__)
+	// A FIFO that wakeWriter() writes a byte to. It is opened the first time a writer waits,
+	// since a FIFO can't be opened for writing until it has a reader, and again after the
+	// writer that had it open goes away.
+	std::string mWakePath;
+	int mWakeFd = -1;
+#endif
+};
+
+// The other process's side.
+class IsochSharedRingWriter
+{
+public:
+	// Open a ring made by IsochSharedRing::create(). The clock page is mapped read-only.
+	static SResult<std::shared_ptr<IsochSharedRingWriter>> open(const std::string& name);
+	~IsochSharedRingWriter();
+
+	// Room for the next frame, to fill in place, or nullptr if the ring is full.
+	uint8_t* frame();
+	// Send the frame from frame() for `usbMicroframe`. Frames must be committed in order.
+	void commit(uint64_t usbMicroframe);
+
+	// How many more frames can be committed.
+	int writableFrames() const;
+
+	// Block until there's room for a frame. Returns false after `timeoutMs`.
+	bool waitForSpace(int timeoutMs);
+
+	IsochFrameClock clock() const;
+
+	int bytesPerFrame() const { return mBytesPerFrame; }
+	int slots() const { return mSlots; }
+
+private:
+	IsochSharedRingWriter() = default;
+	IsochSharedRingWriter(const IsochSharedRingWriter&) = delete;
+	IsochSharedRingWriter& operator=(const IsochSharedRingWriter&) = delete;
+
+	std::shared_ptr<SharedMemory> mRing;
+	std::shared_ptr<SharedMemory> mClock;
+	int mBytesPerFrame = 0;
+	int mSlots = 0;
+#if defined(_WIN32)
+	void* mSpaceEvent = nullptr;
+#elif defined(__APPLE__)
+	// Both ends of the stream's FIFO. Holding the write end too means a read never sees
+	// end of file, whether or not the stream has opened it yet.
+	int mWakeReadFd = -1;
+	int mWakeWriteFd = -1;
+#endif
+};
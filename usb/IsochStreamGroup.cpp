@@ -0,0 +1,320 @@
+#include "IsochStreamGroup.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "util/FastLog.h"
+
+IsochBusClock::IsochBusClock(Device& dev) : mDev(dev)
+{
+}
+
+void IsochBusClock::sample()
+{
+	uint64_t bestMicroframe = 0;
+	HighResClock::time_point bestTime;
+	HighResClock::duration bestWidth = HighResClock::duration::max();
+	for (int i = 0; i < READS_PER_SAMPLE; ++i)
+	{
+		HighResClock::time_point before = HighResClock::now();
+		uint64_t microframe = mDev.getBusMicroframeNumber();
+		HighResClock::time_point after = HighResClock::now();
+		if (after - before < bestWidth)
+		{
+			bestWidth = after - before;
+			bestMicroframe = microframe;
+			bestTime = before + (after - before) / 2;
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	if (mCount == 0)
+	{
+		mOriginMicroframe = bestMicroframe;
+		mOriginTime = bestTime;
+	}
+	if (bestMicroframe % 8 != 0)
+		mWholeFrames = false;
+
+	Sample s;
+	s.microframe = static_cast<double>(static_cast<int64_t>(bestMicroframe - mOriginMicroframe));
+	s.ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(bestTime - mOriginTime).count());
+	mSamples.push_back(s);
+	if (mSamples.size() > MAX_SAMPLES)
+		mSamples.pop_front();
+	++mCount;
+
+	fit();
+}
+
+void IsochBusClock::fit()
+{
+	double n = static_cast<double>(mSamples.size());
+	double meanX = 0.0;
+	double meanY = 0.0;
+	for (const Sample& s : mSamples)
+	{
+		meanX += s.microframe;
+		meanY += s.ns;
+	}
+	meanX /= n;
+	meanY /= n;
+
+	mSlope = NS_PER_MICROFRAME;
+	if (mSamples.back().ns - mSamples.front().ns >= MIN_FIT_SPAN_NS)
+	{
+		double sxx = 0.0;
+		double sxy = 0.0;
+		for (const Sample& s : mSamples)
+		{
+			sxx += (s.microframe - meanX) * (s.microframe - meanX);
+			sxy += (s.microframe - meanX) * (s.ns - meanY);
+		}
+		if (sxx > 0.0)
+			mSlope = sxy / sxx;
+	}
+	double intercept = meanY - mSlope * meanX;
+
+	double sumSquares = 0.0;
+	for (const Sample& s : mSamples)
+	{
+		double error = s.ns - (intercept + mSlope * s.microframe);
+		sumSquares += error * error;
+	}
+	mResidualNs = std::sqrt(sumSquares / n);
+
+	// The counter was read at random times during each microframe (or frame, for Full Speed),
+	// so the line is on average half of one after they start.
+	mIntercept = intercept - mSlope * (mWholeFrames ? 4.0 : 0.5);
+}
+
+HighResClock::time_point IsochBusClock::timeOf(uint64_t usbMicroframe) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	double x = static_cast<double>(static_cast<int64_t>(usbMicroframe - mOriginMicroframe));
+	double ns = mIntercept + mSlope * x;
+	return mOriginTime + std::chrono::duration_cast<HighResClock::duration>(std::chrono::nanoseconds(std::llround(ns)));
+}
+
+double IsochBusClock::microframeAt(HighResClock::time_point t) const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(t - mOriginTime).count());
+	return static_cast<double>(mOriginMicroframe) + (ns - mIntercept) / mSlope;
+}
+
+double IsochBusClock::driftPpm() const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return (NS_PER_MICROFRAME / mSlope - 1.0) * 1e6;
+}
+
+double IsochBusClock::residualUs() const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mResidualNs / 1000.0;
+}
+
+uint64_t IsochBusClock::samples() const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	return mCount;
+}
+
+const int IsochStreamGroup::SAMPLE_INTERVAL_MS;
+const int IsochStreamGroup::START_TIMEOUT_MS;
+
+IsochStreamGroup::IsochStreamGroup(IsochGroupPullCallback pull, SkewCallback skewCallback)
+	: mPull(pull), mSkewCallback(skewCallback)
+{
+}
+
+IsochStreamGroup::~IsochStreamGroup()
+{
+	stop();
+}
+
+int IsochStreamGroup::addDevice(Device& dev, int iface, uint8_t pipe, int bytesPerFrame)
+{
+	std::unique_ptr<Member> m(new Member(dev));
+	m->iface = iface;
+	m->pipe = pipe;
+	m->bytesPerFrame = bytesPerFrame;
+	mMembers.push_back(std::move(m));
+	return static_cast<int>(mMembers.size()) - 1;
+}
+
+void IsochStreamGroup::start()
+{
+	if (mStarted)
+		return;
+	mStarted = true;
+
+	// Enough samples to tell Full Speed counters from High Speed ones. The slope stays
+	// nominal until the sampling thread has a second's worth.
+	for (int i = 0; i < 8; ++i)
+	{
+		for (auto& m : mMembers)
+			m->clock.sample();
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+
+	for (size_t i = 0; i < mMembers.size(); ++i)
+	{
+		Member& m = *mMembers[i];
+		int member = static_cast<int>(i);
+		m.stream.reset(new IsochronousStream(m.dev, m.iface, m.pipe, m.bytesPerFrame,
+		    [this, member](uint64_t usbMicroframe, uint8_t* data) {
+			    return mPull(member, mMembers[member]->clock.timeOf(usbMicroframe), data);
+		    },
+		    [this, member](uint64_t earliestFrame) {
+			    return chooseStartFrame(member, earliestFrame);
+		    }));
+	}
+
+	mSampleThread = std::thread([this] {
+		sampleFunc();
+	});
+}
+
+void IsochStreamGroup::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(mQuitMutex);
+		mQuit = true;
+	}
+	mQuitCondition.notify_all();
+	if (mSampleThread.joinable())
+		mSampleThread.join();
+
+	// Don't keep streams waiting for ones that will never be ready.
+	{
+		std::unique_lock<std::mutex> lock(mStartMutex);
+		mStartAbandoned = true;
+	}
+	mStartCondition.notify_all();
+
+	for (auto& m : mMembers)
+		m->stream.reset();
+}
+
+IsochGroupSkew IsochStreamGroup::skew() const
+{
+	std::unique_lock<std::mutex> lock(mSkewMutex);
+	return mSkew;
+}
+
+IsochronousStream& IsochStreamGroup::stream(int member)
+{
+	return *mMembers[member]->stream;
+}
+
+uint64_t IsochStreamGroup::chooseStartFrame(int member, uint64_t earliestFrame)
+{
+	std::unique_lock<std::mutex> lock(mStartMutex);
+	Member& self = *mMembers[member];
+	self.ready = true;
+	self.earliestFrame = earliestFrame;
+	self.firstFrame = earliestFrame;
+	++mReadyMembers;
+
+	if (mReadyMembers == static_cast<int>(mMembers.size()) && !mStartAbandoned)
+	{
+		// The first instant that every stream can make.
+		HighResClock::time_point start = HighResClock::time_point::min();
+		for (auto& m : mMembers)
+			start = std::max(start, m->clock.timeOf(m->earliestFrame * 8));
+
+		// Each stream's frame that starts nearest then. The buses' frames are out of phase,
+		// so the streams start up to half a frame apart.
+		for (auto& m : mMembers)
+		{
+			double frame = std::round(m->clock.microframeAt(start) / 8.0);
+			m->firstFrame = std::max(m->earliestFrame, static_cast<uint64_t>(std::max(frame, 0.0)));
+			m->synchronised = true;
+		}
+		mStartChosen = true;
+		mStartCondition.notify_all();
+	}
+	else if (!mStartCondition.wait_for(lock, std::chrono::milliseconds(START_TIMEOUT_MS),
+	                                   [this] { return mStartChosen || mStartAbandoned; }) ||
+	         !mStartChosen)
+	{
+		// Probably another stream failed to start. Later ones won't wait either.
+		FLOG_WARNING("Stream {} of the group is starting without the others", member);
+		mStartAbandoned = true;
+		return earliestFrame;
+	}
+	return self.firstFrame;
+}
+
+void IsochStreamGroup::sampleFunc()
+{
+	std::unique_lock<std::mutex> lock(mQuitMutex);
+	for (;;)
+	{
+		mQuitCondition.wait_for(lock, std::chrono::milliseconds(SAMPLE_INTERVAL_MS), [this] { return mQuit; });
+		if (mQuit)
+			break;
+		lock.unlock();
+
+		for (auto& m : mMembers)
+			m->clock.sample();
+		updateSkew();
+
+		lock.lock();
+	}
+}
+
+void IsochStreamGroup::updateSkew()
+{
+	IsochGroupSkew s;
+	HighResClock::time_point now = HighResClock::now();
+	double minOffset = std::numeric_limits<double>::max();
+	double maxOffset = std::numeric_limits<double>::lowest();
+
+	for (auto& m : mMembers)
+	{
+		IsochMemberSync sync;
+		{
+			std::unique_lock<std::mutex> lock(mStartMutex);
+			sync.firstFrame = m->firstFrame;
+			if (!m->stream->IsRunning())
+				sync.state = IsochMemberSync::State::Stopped;
+			else if (m->synchronised)
+				sync.state = IsochMemberSync::State::Synchronised;
+			else if (m->ready && mStartAbandoned)
+				sync.state = IsochMemberSync::State::Desynchronised;
+		}
+		sync.driftPpm = m->clock.driftPpm();
+		sync.residualUs = m->clock.residualUs();
+
+		// The packet whose service interval contains `now` carries the data for `now`.
+		int entriesPerFrame = std::max(1, m->stream->EntriesPerFrame());
+		double interval = 8.0 / entriesPerFrame;
+		double packet = std::floor(m->clock.microframeAt(now) / interval) * interval;
+		HighResClock::time_point sent = m->clock.timeOf(static_cast<uint64_t>(std::max(packet, 0.0)));
+		sync.offsetUs = std::chrono::duration_cast<std::chrono::nanoseconds>(sent - now).count() / 1000.0;
+
+		if (sync.state == IsochMemberSync::State::Synchronised)
+		{
+			minOffset = std::min(minOffset, sync.offsetUs);
+			maxOffset = std::max(maxOffset, sync.offsetUs);
+		}
+		s.members.push_back(sync);
+	}
+	if (minOffset <= maxOffset)
+		s.skewUs = maxOffset - minOffset;
+
+	{
+		std::unique_lock<std::mutex> lock(mSkewMutex);
+		s.maxSkewUs = std::max(mSkew.maxSkewUs, s.skewUs);
+		s.updates = mSkew.updates + 1;
+		mSkew = s;
+	}
+
+	if (mSkewCallback)
+		mSkewCallback(s);
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "Device.h"
+#include "IsochronousStream.h"
+#include "util/HighResClock.h"
+
+// Maps a device's bus microframe counter onto HighResClock. The counter is sampled now and
+// then and a line is fitted through the samples; its slope is how far the bus clock drifts
+// from the host's, typically tens of ppm.
+//
+// The counter is read at some point during its microframe (or frame, for Full Speed devices,
+// which only count whole frames), so the fit is moved back by half of one.
+class IsochBusClock
+{
+public:
+	explicit IsochBusClock(Device& dev);
+
+	// Read the counter a few times and keep the read most tightly bracketed by the host clock.
+	void sample();
+
+	// When a microframe starts. Only meaningful after sample() has been called.
+	HighResClock::time_point timeOf(uint64_t usbMicroframe) const;
+	// The (fractional) microframe at a time.
+	double microframeAt(HighResClock::time_point t) const;
+
+	// How much faster the bus clock is than the host's.
+	double driftPpm() const;
+	// The RMS distance of the samples from the line.
+	double residualUs() const;
+	uint64_t samples() const;
+
+private:
+	// Fit the line through mSamples. mMutex must be locked.
+	void fit();
+
+	// The slope is only fitted over at least this long, so it isn't thrown off by a few
+	// samples close together; until then it is nominal.
+	static const int64_t MIN_FIT_SPAN_NS = 1000000000;
+	// About 13 s of samples at the group's rate.
+	static const size_t MAX_SAMPLES = 256;
+	static const int READS_PER_SAMPLE = 5;
+	static const int NS_PER_MICROFRAME = 125000;
+
+	Device& mDev;
+
+	mutable std::mutex mMutex;
+	// Relative to the first sample, so doubles keep their precision.
+	struct Sample
+	{
+		double microframe;
+		double ns;
+	};
+	std::deque<Sample> mSamples;
+	uint64_t mOriginMicroframe = 0;
+	HighResClock::time_point mOriginTime;
+	uint64_t mCount = 0;
+	// Whether every sample was a whole frame, i.e. this is a Full Speed device.
+	bool mWholeFrames = true;
+
+	// ns since mOriginTime = mIntercept + mSlope * (microframe - mOriginMicroframe).
+	double mIntercept = 0.0;
+	double mSlope = NS_PER_MICROFRAME;
+	double mResidualNs = 0.0;
+};
+
+// Fill `data` for the packet that `member` (from addDevice()) sends at host time `when`.
+// Return false if there is nothing to send; the packet is then zeros. Called on the member's
+// stream thread.
+typedef std::function<bool(int member, HighResClock::time_point when, uint8_t* data)> IsochGroupPullCallback;
+
+struct IsochMemberSync
+{
+	enum class State
+	{
+		// Its stream hasn't chosen its first frame yet.
+		Starting,
+		// Started with the others, and still running.
+		Synchronised,
+		// Started on its own after the others didn't turn up in time, so it isn't lined up
+		// with them.
+		Desynchronised,
+		// Its stream has stopped, e.g. after a transfer failed.
+		Stopped,
+	};
+	State state = State::Starting;
+
+	// The first USB frame the member's stream was started at.
+	uint64_t firstFrame = 0;
+	double driftPpm = 0.0;
+	double residualUs = 0.0;
+	// When the member sends the packet for an instant, relative to the instant. Packets are
+	// pulled by time, so this is between minus one packet interval and 0.
+	double offsetUs = 0.0;
+};
+
+struct IsochGroupSkew
+{
+	std::vector<IsochMemberSync> members;
+	// How far apart the members send the packet for the same instant: the spread of the
+	// synchronised members' offsets. The others aren't lined up, so they'd only hide it.
+	double skewUs = 0.0;
+	double maxSkewUs = 0.0;
+	uint64_t updates = 0;
+};
+
+// Streams to several devices in lockstep. Each device's bus clock is mapped onto the host's
+// with an IsochBusClock, and every packet is pulled for the host time it will be sent at, so
+// the devices stay together however their clocks drift. The streams' first transfers are
+// submitted for the same host instant, to within half a frame.
+//
+// The skew between the devices is measured every SAMPLE_INTERVAL_MS, when the clocks are
+// sampled, and passed to the skew callback (on the group's own thread).
+class IsochStreamGroup
+{
+public:
+	typedef std::function<void(const IsochGroupSkew& skew)> SkewCallback;
+
+	explicit IsochStreamGroup(IsochGroupPullCallback pull, SkewCallback skewCallback = nullptr);
+	// Calls stop().
+	~IsochStreamGroup();
+
+	// Add a device before start(). Returns its member number.
+	int addDevice(Device& dev, int iface, uint8_t pipe, int bytesPerFrame);
+
+	// Sample every device's clock and start the streams. Only call this once.
+	void start();
+
+	// Stop the streams and the sampling thread. It's harmless to call this more than once.
+	void stop();
+
+	IsochGroupSkew skew() const;
+
+	// Only valid between start() and stop().
+	IsochronousStream& stream(int member);
+
+private:
+	IsochStreamGroup(const IsochStreamGroup&) = delete;
+	IsochStreamGroup& operator=(const IsochStreamGroup&) = delete;
+
+	// Wait for every stream to be ready to start, then return the first frame for `member`
+	// so that they all start at the same time.
+	uint64_t chooseStartFrame(int member, uint64_t earliestFrame);
+
+	// Sample the clocks and measure the skew every SAMPLE_INTERVAL_MS.
+	void sampleFunc();
+	void updateSkew();
+
+	static const int SAMPLE_INTERVAL_MS = 50;
+	// How long a stream waits for the others before starting on its own.
+	static const int START_TIMEOUT_MS = 1000;
+
+	struct Member
+	{
+		explicit Member(Device& dev) : dev(dev), clock(dev) {}
+
+		Device& dev;
+		int iface = 0;
+		uint8_t pipe = 0;
+		int bytesPerFrame = 0;
+		IsochBusClock clock;
+		std::unique_ptr<IsochronousStream> stream;
+
+		// For chooseStartFrame().
+		bool ready = false;
+		uint64_t earliestFrame = 0;
+		uint64_t firstFrame = 0;
+		// Whether firstFrame was chosen with the others'.
+		bool synchronised = false;
+	};
+
+	IsochGroupPullCallback mPull;
+	SkewCallback mSkewCallback;
+	std::vector<std::unique_ptr<Member>> mMembers;
+
+	std::mutex mStartMutex;
+	std::condition_variable mStartCondition;
+	int mReadyMembers = 0;
+	bool mStartChosen = false;
+	// A stream gave up waiting, or the group was stopped, so the others shouldn't wait.
+	bool mStartAbandoned = false;
+
+	std::thread mSampleThread;
+	std::mutex mQuitMutex;
+	std::condition_variable mQuitCondition;
+	bool mQuit = false;
+	bool mStarted = false;
+
+	mutable std::mutex mSkewMutex;
+	IsochGroupSkew mSkew;
+};
@@ -0,0 +1,243 @@
+#include "IsochronousInStream.h"
+
+#include <algorithm>
+#include <utility>
+
+using std::string;
+
+IsochronousInStream::IsochronousInStream(std::shared_ptr<Device> dev, int iface, uint8_t endpointAddress, int bytesPerFrame, size_t ringBytes,
+                                         const LockedMemoryOptions& memory)
+	: mFrameResults(FRAMES_PER_TRANSFER), mRing(ringBytes, memory), mDev(std::move(dev)), mIface(iface), mEndpointAddress(endpointAddress), mBytesPerFrame(bytesPerFrame)
+{
+}
+
+SResult<std::shared_ptr<IsochronousInStream>> IsochronousInStream::start(std::shared_ptr<Device> dev,
+                                                                         int iface,
+                                                                         uint8_t endpointAddress,
+                                                                         int bytesPerFrame,
+                                                                         size_t ringBytes,
+                                                                         IsochFrameStatusCallback frameStatus,
+                                                                         const LockedMemoryOptions& memory)
+{
+	if ((endpointAddress & 0x80) == 0)
+		return Err("Endpoint " + std::to_string(endpointAddress) + " isn't an IN endpoint");
+	if (bytesPerFrame <= 0)
+		return Err("Invalid bytes per frame: " + std::to_string(bytesPerFrame));
+	if (!dev)
+		return Err(string("No device"));
+
+	std::shared_ptr<IsochronousInStream> stream(new IsochronousInStream(dev, iface, endpointAddress, bytesPerFrame, ringBytes, memory));
+	stream->mFrameStatus = frameStatus;
+
+	// Create the buffers here so errors are reported to the caller.
+	for (TransferInfo& t : stream->mTransfers)
+		t.readBuffer = TRY(dev->createIsochReadBuffer(iface, endpointAddress, FRAMES_PER_TRANSFER, bytesPerFrame));
+
+	IsochronousInStream* s = stream.get();
+	stream->mReceiveThread = std::thread([s] { s->ReceiveFunc(); });
+
+	return Ok(stream);
+}
+
+SResult<std::shared_ptr<IsochronousInStream>> IsochronousInStream::start(std::shared_ptr<Device> dev,
+                                                                         int iface,
+                                                                         const EndpointInfo& endpoint,
+                                                                         size_t ringBytes,
+                                                                         IsochFrameStatusCallback frameStatus,
+                                                                         const LockedMemoryOptions& memory)
+{
+	if (endpoint.type != EndpointInfo::Type::Isochronous)
+		return Err("Endpoint " + std::to_string(endpoint.number) + " isn't isochronous");
+
+	return start(dev, iface, endpoint.address(), endpoint.maxBytesPerInterval(), ringBytes, frameStatus, memory);
+}
+
+IsochronousInStream::~IsochronousInStream()
+{
+	mQuit = true;
+	// Complete the outstanding transfers so the thread wakes up.
+	mDev->abortPipe(mIface, mEndpointAddress);
+	if (mReceiveThread.joinable())
+		mReceiveThread.join();
+}
+
+size_t IsochronousInStream::read(uint8_t* data, size_t size)
+{
+	return mRing.read(data, size);
+}
+
+const uint8_t* IsochronousInStream::peek(size_t& size) const
+{
+	return mRing.readWindow(size);
+}
+
+void IsochronousInStream::consume(size_t size)
+{
+	mRing.consume(size);
+}
+
+size_t IsochronousInStream::available() const
+{
+	return mRing.readable();
+}
+
+IsochInStats IsochronousInStream::stats() const
+{
+	IsochInStats s;
+	s.transfers = mTransfersDone.load(std::memory_order_relaxed);
+	s.failedTransfers = mFailedTransfers.load(std::memory_order_relaxed);
+	s.frames = mFrames.load(std::memory_order_relaxed);
+	s.emptyFrames = mEmptyFrames.load(std::memory_order_relaxed);
+	s.failedFrames = mFailedFrames.load(std::memory_order_relaxed);
+	s.bytes = mBytes.load(std::memory_order_relaxed);
+	s.droppedBytes = mDroppedBytes.load(std::memory_order_relaxed);
+	s.restarts = mRestarts.load(std::memory_order_relaxed);
+	return s;
+}
+
+SResult<void> IsochronousInStream::status() const
+{
+	std::unique_lock<std::mutex> lock(mErrorMutex);
+	if (!mError.empty())
+	{
+		string error = mError;
+		return Err(error);
+	}
+	return Ok();
+}
+
+void IsochronousInStream::Stop(const string& error)
+{
+	std::unique_lock<std::mutex> lock(mErrorMutex);
+	if (mError.empty())
+		mError = error;
+}
+
+void IsochronousInStream::ProcessTransfer(int index)
+{
+	const IsochReadBuffer& buffer = mTransfers[index].readBuffer;
+	const uint8_t* data = buffer.data();
+
+	uint64_t bytes = 0;
+	uint64_t dropped = 0;
+	uint64_t empty = 0;
+	uint64_t failed = 0;
+
+	for (int f = 0; f < FRAMES_PER_TRANSFER; ++f)
+	{
+		IsochFrameResult r = buffer.frameResult(f);
+		r.length = std::min(std::max(r.length, 0), mBytesPerFrame);
+		mFrameResults[f] = r;
+
+		if (!r.ok)
+		{
+			++failed;
+			continue;
+		}
+		if (r.length == 0)
+		{
+			++empty;
+			continue;
+		}
+
+		// Each frame's data starts at a fixed offset, so this is where the packets are
+		// compacted. If the reader is too far behind the packet is dropped whole.
+		if (mRing.write(data + f * mBytesPerFrame, r.length))
+			bytes += r.length;
+		else
+			dropped += r.length;
+	}
+
+	if (mFrameStatus)
+		mFrameStatus(mFrames.load(std::memory_order_relaxed), mFrameResults.data(), FRAMES_PER_TRANSFER);
+
+	mFrames.fetch_add(FRAMES_PER_TRANSFER, std::memory_order_relaxed);
+	mEmptyFrames.fetch_add(empty, std::memory_order_relaxed);
+	mFailedFrames.fetch_add(failed, std::memory_order_relaxed);
+	mBytes.fetch_add(bytes, std::memory_order_relaxed);
+	mDroppedBytes.fetch_add(dropped, std::memory_order_relaxed);
+}
+
+void IsochronousInStream::setThreadPolicy(const ThreadPolicy& policy)
+{
+	mThreadPolicy.set(policy);
+}
+
+SResult<void> IsochronousInStream::threadPolicyStatus() const
+{
+	return mThreadPolicy.status();
+}
+
+void IsochronousInStream::ReceiveFunc()
+{
+	mThreadPolicy.applyIfPending();
+
+	// Queue all the transfers back to back.
+	for (int i = 0; i < NUM_TRANSFERS; ++i)
+	{
+		SResult<UsbIsochTransferHandle> res = mDev->submitIsoInTransferAsap(mTransfers[i].readBuffer, i > 0);
+		if (!res)
+		{
+			Stop("Error submitting isochronous read: " + res.unwrap_err());
+			mQuit = true;
+			break;
+		}
+		mTransfers[i].transferHandle = res.unwrap();
+		mTransfers[i].submitted = true;
+	}
+
+	int consecutiveFailures = 0;
+
+	// The transfers complete in order, so wait for each in turn.
+	for (int i = 0; !mQuit; i = (i + 1) % NUM_TRANSFERS)
+	{
+		mThreadPolicy.applyIfPending();
+
+		TransferInfo& t = mTransfers[i];
+		SResult<int> res = t.transferHandle.result();
+		t.submitted = false;
+
+		if (mQuit)
+			break;
+
+		mTransfersDone.fetch_add(1, std::memory_order_relaxed);
+		if (res)
+		{
+			consecutiveFailures = 0;
+		}
+		else
+		{
+			mFailedTransfers.fetch_add(1, std::memory_order_relaxed);
+			// A whole ring of failures means the device has probably gone.
+			if (++consecutiveFailures >= NUM_TRANSFERS)
+			{
+				Stop("Isochronous reads keep failing: " + res.unwrap_err());
+				break;
+			}
+		}
+
+		ProcessTransfer(i);
+
+		// Continue straight after the last queued transfer. If that's already in the past
+		// we fell behind, so start again as soon as possible and accept the gap.
+		SResult<UsbIsochTransferHandle> sub = mDev->submitIsoInTransferAsap(t.readBuffer, true);
+		if (!sub)
+		{
+			mRestarts.fetch_add(1, std::memory_order_relaxed);
+			sub = mDev->submitIsoInTransferAsap(t.readBuffer, false);
+		}
+		if (!sub)
+		{
+			Stop("Error submitting isochronous read: " + sub.unwrap_err());
+			break;
+		}
+		t.transferHandle = sub.unwrap();
+		t.submitted = true;
+	}
+
+	// Make sure nothing is still using the buffers.
+	mDev->abortPipe(mIface, mEndpointAddress);
+	for (TransferInfo& t : mTransfers)
+		if (t.submitted)
+			t.transferHandle.result();
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <thread>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+#include "Device.h"
+#include "IsochFrame.h"
+#include "util/ByteRing.h"
+#include "util/ThreadPolicy.h"
+
+// Counts for working out how much data was lost, and why.
+struct IsochInStats
+{
+	uint64_t transfers = 0;
+	// Transfers that completed with an error. Their frames are still used if they are OK.
+	uint64_t failedTransfers = 0;
+
+	uint64_t frames = 0;
+	// Frames that were received but had no data. Devices send these when they have nothing new.
+	uint64_t emptyFrames = 0;
+	// Frames that weren't received, e.g. because of a CRC error or because the transfer was
+	// scheduled too late.
+	uint64_t failedFrames = 0;
+
+	// Bytes put in the ring, and bytes thrown away because the reader had fallen behind.
+	uint64_t bytes = 0;
+	uint64_t droppedBytes = 0;
+
+	// Times the stream couldn't continue from where the last transfer ended and had to be
+	// restarted, leaving a gap.
+	uint64_t restarts = 0;
+};
+
+// Called on the stream thread after each transfer with the result of each of its frames.
+// `frameIndex` is the number of frames received before this transfer, including failed ones.
+typedef std::function<void(uint64_t frameIndex, const IsochFrameResult* frames, int numFrames)> IsochFrameStatusCallback;
+
+// Continuously reads an isochronous IN endpoint. Several transfers are kept in flight so
+// the endpoint is serviced every frame. When each one completes the frames' actual lengths
+// are used to copy just the data that was received into a ring, so variable-length packets
+// end up back to back. Nothing is allocated per packet or per transfer.
+class IsochronousInStream
+{
+public:
+	// Create the buffers and start receiving. The stream keeps `dev` open until it is
+	// destroyed. `bytesPerFrame` is the most the endpoint sends per frame list entry. `ringBytes` is how much data can be waiting to be read. `memory`
+	// can ask for the ring to be locked; see ringMemoryDiagnostic() for whether it was.
+	static SResult<std::shared_ptr<IsochronousInStream>> start(std::shared_ptr<Device> dev,
+	                                                           int iface,
+	                                                           uint8_t endpointAddress,
+	                                                           int bytesPerFrame,
+	                                                           size_t ringBytes,
+	                                                           IsochFrameStatusCallback frameStatus = IsochFrameStatusCallback(),
+	                                                           const LockedMemoryOptions& memory = LockedMemoryOptions());
+
+	// The same, with each frame sized for the endpoint's largest service interval, which
+	// includes every transaction of a high-bandwidth or SuperSpeed burst endpoint.
+	static SResult<std::shared_ptr<IsochronousInStream>> start(std::shared_ptr<Device> dev,
+	                                                           int iface,
+	                                                           const EndpointInfo& endpoint,
+	                                                           size_t ringBytes,
+	                                                           IsochFrameStatusCallback frameStatus = IsochFrameStatusCallback(),
+	                                                           const LockedMemoryOptions& memory = LockedMemoryOptions());
+
+	// Stops the stream. Anything not read is lost.
+	~IsochronousInStream();
+
+	// Read received data. Returns the number of bytes copied. Only call this from one thread.
+	size_t read(uint8_t* data, size_t size);
+
+	// The received data in place, as one contiguous block however it sits in the ring.
+	// `size` is set to how much there is. Call consume() once it has been used. Only call
+	// these from the thread that calls read().
+	const uint8_t* peek(size_t& size) const;
+	void consume(size_t size);
+
+	// The number of bytes waiting to be read.
+	size_t available() const;
+
+	IsochInStats stats() const;
+
+	// Why the ring isn't locked when that was asked for, or empty.
+	std::string ringMemoryDiagnostic() const { return mRing.memoryDiagnostic(); }
+
+	// An error if the stream has stopped by itself, e.g. because the device was unplugged.
+	SResult<void> status() const;
+
+	// Schedule the stream's thread, e.g. as real-time. It is applied by the thread itself
+	// before its next transfer; threadPolicyStatus() then says whether it all worked.
+	void setThreadPolicy(const ThreadPolicy& policy);
+	SResult<void> threadPolicyStatus() const;
+
+private:
+	IsochronousInStream(std::shared_ptr<Device> dev, int iface, uint8_t endpointAddress, int bytesPerFrame, size_t ringBytes,
+	                    const LockedMemoryOptions& memory);
+	IsochronousInStream(const IsochronousInStream&) = delete;
+	IsochronousInStream& operator=(const IsochronousInStream&) = delete;
+
+	// Loops, waiting for each transfer in turn, copying its data out and resubmitting it.
+	void ReceiveFunc();
+
+	// Copy the received frames of transfer `index` into the ring.
+	void ProcessTransfer(int index);
+
+	void Stop(const std::string& error);
+
+	struct TransferInfo
+	{
+		IsochReadBuffer readBuffer;
+		UsbIsochTransferHandle transferHandle;
+		bool submitted = false;
+	};
+
+	// Enough that a late wakeup of the stream thread doesn't leave the endpoint unserviced.
+	static const int NUM_TRANSFERS = 4;
+	// Frame list entries per transfer. For high-speed endpoints these are microframes.
+	static const int FRAMES_PER_TRANSFER = 64;
+
+	std::array<TransferInfo, NUM_TRANSFERS> mTransfers;
+	// Reused for every transfer, so the callback gets an array without allocating.
+	std::vector<IsochFrameResult> mFrameResults;
+	IsochFrameStatusCallback mFrameStatus;
+
+	ByteRing mRing;
+
+	// Written by the stream thread, read by anyone.
+	std::atomic<uint64_t> mTransfersDone{0};
+	std::atomic<uint64_t> mFailedTransfers{0};
+	std::atomic<uint64_t> mFrames{0};
+	std::atomic<uint64_t> mEmptyFrames{0};
+	std::atomic<uint64_t> mFailedFrames{0};
+	std::atomic<uint64_t> mBytes{0};
+	std::atomic<uint64_t> mDroppedBytes{0};
+	std::atomic<uint64_t> mRestarts{0};
+
+	mutable std::mutex mErrorMutex;
+	std::string mError;
+
+	ThreadPolicyRequest mThreadPolicy;
+
+	std::thread mReceiveThread;
+	std::atomic_bool mQuit{false};
+
+	std::shared_ptr<Device> mDev;
+	int mIface = 0;
+	uint8_t mEndpointAddress = 0;
+	int mBytesPerFrame = 0;
+};
@@ -1,25 +1,76 @@
 #include "IsochronousStream.h"
 
-#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <string.h>
 
-using std::cerr;
-using std::endl;
-using std::cout;
+#include "util/FastLog.h"
 
 IsochronousStream::IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame)
 	: mDev(dev), mIface(iface), mPipe(pipe), mBytesPerFrame(bytesPerFrame)
+{
+	Start();
+}
+
+IsochronousStream::IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame,
+                                     std::shared_ptr<IsochRateController> rate, size_t ringBytes,
+                                     const LockedMemoryOptions& memory)
+	: mDev(dev), mIface(iface), mPipe(pipe), mBytesPerFrame(bytesPerFrame),
+	  mRate(rate), mRing(new ByteRing(ringBytes, memory))
+{
+	Start();
+}
+
+IsochronousStream::IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame, const IsochJitterConfig& jitter)
+	: mDev(dev), mIface(iface), mPipe(pipe), mBytesPerFrame(bytesPerFrame),
+	  mJitter(new IsochJitterBuffer(bytesPerFrame, jitter))
+{
+	Start();
+}
+
+IsochronousStream::IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame, IsochFramePullCallback pull,
+                                     IsochStartFrameCallback startFrame)
+	: mDev(dev), mIface(iface), mPipe(pipe), mBytesPerFrame(bytesPerFrame), mPull(pull), mStartFrame(startFrame)
+{
+	Start();
+}
+
+IsochronousStream::IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame, std::shared_ptr<IsochSharedRing> shared)
+	: mDev(dev), mIface(iface), mPipe(pipe), mBytesPerFrame(bytesPerFrame), mShared(shared)
+{
+	// Checked here so a stream that can't work never submits anything.
+	if (shared->bytesPerFrame() != bytesPerFrame)
+	{
+		FLOG_ERROR("Shared ring {} has {} byte frames, but the stream has {}", shared->name(), shared->bytesPerFrame(), bytesPerFrame);
+		return;
+	}
+	// Each transfer takes all of its frames at once.
+	if (shared->slots() < FRAMES_PER_TRANSFER)
+	{
+		FLOG_ERROR("Shared ring {} has {} slots, but the stream needs at least {}", shared->name(), shared->slots(), int(FRAMES_PER_TRANSFER));
+		return;
+	}
+	Start();
+}
+
+void IsochronousStream::Start()
 {
 	// Start the submit transfers thread.
+	mSubmitTransfersRunning = true;
 	mSubmitTransfersThread = std::thread([&] {
 		SubmitTransfersFunc();
+		mSubmitTransfersRunning = false;
 	});
 }
 
 IsochronousStream::~IsochronousStream()
 {
-	cout << "Stopping isochronous stream" << endl;
+	FLOG_DEBUG("Stopping isochronous stream");
 	mSubmitTransfersQuit = true;
-	mSubmitTransfersThread.join();
+	// A shared ring stream with a ring that doesn't fit never started.
+	if (mSubmitTransfersThread.joinable())
+		mSubmitTransfersThread.join();
 }
 
 uint64_t IsochronousStream::CurrentFrameNumber() const
@@ -27,101 +78,322 @@ uint64_t IsochronousStream::CurrentFrameNumber() const
 	return mDev.getBusFrameNumber();
 }
 
-bool IsochronousStream::WriteFrame(uint64_t usbFrame, const uint8_t* data)
+uint64_t IsochronousStream::CurrentMicroframeNumber() const
 {
-//	for (int i = 0; i < NUM_TRANSFERS; ++i)
-//	{
-//		uint64_t sf = mTransfers[i].startFrame;
-//		if (sf <= usbFrame && usbFrame < sf + FRAMES_PER_TRANSFER)
-//		{
-//			memcpy(mTransfers[i].writeBuffer.data(), data, mBytesPerFrame);
-//			return true;
-//		}
-//	}
+	return mDev.getBusMicroframeNumber();
+}
+
+bool IsochronousStream::WriteFrame(uint64_t usbMicroframe, const uint8_t* data)
+{
+	int entriesPerFrame = mEntriesPerFrame;
+	uint64_t usbFrame = usbMicroframe / 8;
+	// Which service interval of the frame this microframe is in.
+	int entryInFrame = (usbMicroframe % 8) * entriesPerFrame / 8;
+	uint64_t framesPerTransfer = FRAMES_PER_TRANSFER / entriesPerFrame;
+	
+	for (int i = 0; i < NUM_TRANSFERS; ++i)
+	{
+		TransferInfo& t = mTransfers[i];
+		uint64_t sf = t.startFrame;
+		if (sf == 0 || usbFrame < sf || usbFrame >= sf + framesPerTransfer)
+			continue;
+		
+		// The transfer may have been refilled for later frames since we looked, in which case
+		// the frame has already gone.
+		std::unique_lock<std::mutex> lock(t.writeMutex);
+		if (t.startFrame != sf)
+			return false;
+		uint64_t entry = (usbFrame - sf) * entriesPerFrame + entryInFrame;
+		memcpy(t.writeBuffer.data() + entry * mBytesPerFrame, data, mBytesPerFrame);
+		return true;
+	}
 	return false;
 }
 
+bool IsochronousStream::WriteBytes(const uint8_t* data, size_t size)
+{
+	if (!mRing)
+		return false;
+	return mRing->write(data, size);
+}
+
+size_t IsochronousStream::WritableBytes() const
+{
+	return mRing ? mRing->writable() : 0;
+}
+
+uint8_t* IsochronousStream::WriteWindow(size_t& size)
+{
+	if (!mRing)
+	{
+		size = 0;
+		return nullptr;
+	}
+	return mRing->writeWindow(size);
+}
+
+void IsochronousStream::CommitWrite(size_t size)
+{
+	if (mRing)
+		mRing->commit(size);
+}
+
+uint64_t IsochronousStream::UnderflowBytes() const
+{
+	return mUnderflowBytes;
+}
+
+bool IsochronousStream::QueueFrame(const uint8_t* data)
+{
+	if (!mJitter)
+		return false;
+	return mJitter->push(data);
+}
+
+IsochJitterStats IsochronousStream::JitterStats() const
+{
+	return mJitter ? mJitter->stats() : IsochJitterStats();
+}
+
+void IsochronousStream::SetThreadPolicy(const ThreadPolicy& policy)
+{
+	mThreadPolicy.set(policy);
+}
+
+SResult<void> IsochronousStream::ThreadPolicyStatus() const
+{
+	return mThreadPolicy.status();
+}
+
+IsochSubmitStats IsochronousStream::SubmitStats() const
+{
+	std::unique_lock<std::mutex> lock(mSubmitStatsMutex);
+	IsochSubmitStats s = mSubmitStats;
+	if (s.submissions > 1)
+		s.jitterMs = std::sqrt(mMarginM2 / (s.submissions - 1));
+	return s;
+}
+
+int IsochronousStream::EntriesPerFrame() const
+{
+	return mEntriesPerFrame;
+}
+
+bool IsochronousStream::IsRunning() const
+{
+	return mSubmitTransfersRunning;
+}
+
+void IsochronousStream::FillFromJitterBuffer(IsochWriteBuffer& buffer)
+{
+	for (int e = 0; e < buffer.numFrames; ++e)
+		mJitter->pop(buffer.data() + e * mBytesPerFrame);
+	mJitter->update();
+}
+
+void IsochronousStream::FillFromPull(IsochWriteBuffer& buffer, uint64_t usbFrame)
+{
+	int entriesPerFrame = buffer.entriesPerFrame;
+	for (int e = 0; e < buffer.numFrames; ++e)
+	{
+		uint8_t* data = buffer.data() + e * mBytesPerFrame;
+		uint64_t usbMicroframe = (usbFrame + e / entriesPerFrame) * 8 + (e % entriesPerFrame) * 8 / entriesPerFrame;
+		if (!mPull(usbMicroframe, data))
+			memset(data, 0, mBytesPerFrame);
+	}
+}
+
+void IsochronousStream::FillFromShared(IsochWriteBuffer& buffer, uint64_t usbFrame)
+{
+	int entriesPerFrame = buffer.entriesPerFrame;
+	// A frame stamped with any microframe of an entry's service interval is for that entry.
+	uint64_t interval = 8 / entriesPerFrame;
+	uint64_t late = 0;
+	uint64_t missed = 0;
+	for (int e = 0; e < buffer.numFrames; ++e)
+	{
+		uint8_t* data = buffer.data() + e * mBytesPerFrame;
+		uint64_t usbMicroframe = (usbFrame + e / entriesPerFrame) * 8 + (e % entriesPerFrame) * interval;
+		
+		uint64_t stamp = 0;
+		const uint8_t* frame = mShared->front(stamp);
+		// Frames for packets that have already gone are no use.
+		while (frame != nullptr && stamp < usbMicroframe)
+		{
+			mShared->pop();
+			++late;
+			frame = mShared->front(stamp);
+		}
+		
+		if (frame != nullptr && stamp < usbMicroframe + interval)
+		{
+			memcpy(data, frame, mBytesPerFrame);
+			mShared->pop();
+		}
+		else
+		{
+			memset(data, 0, mBytesPerFrame);
+			++missed;
+		}
+	}
+	mShared->wakeWriter();
+	mShared->addLateFrames(late);
+	mShared->addMissedFrames(missed);
+}
+
+void IsochronousStream::PublishSharedClock(uint64_t nextSubmissionFrame)
+{
+	mShared->publishClock(mDev.getBusMicroframeNumber(), HighResClock::now(), nextSubmissionFrame * 8, mEntriesPerFrame);
+}
+
+void IsochronousStream::FillFromRing(IsochWriteBuffer& buffer)
+{
+	// The data for each entry follows straight on from the last one's.
+	uint8_t* p = buffer.data();
+	for (int e = 0; e < buffer.numFrames; ++e)
+	{
+		// The controller's limit comes from whoever made it, so make sure it fits the buffer.
+		int length = std::min(std::max(mRate->nextPacketBytes(), 0), buffer.bytesPerFrame);
+		size_t got = mRing->read(p, length);
+		if (got < static_cast<size_t>(length))
+		{
+			// Send silence rather than a short packet, which would throw the device's rate out.
+			memset(p + got, 0, length - got);
+			mUnderflowBytes += length - got;
+		}
+		buffer.frameLengths[e] = length;
+		p += length;
+	}
+}
+
 void IsochronousStream::SubmitTransfersFunc()
 {
-//	cout << "Starting iso submission thread" << endl;
-//	// We'll just use one buffer for each transfer and loop them.
-//	for (int i = 0; i < NUM_TRANSFERS; ++i)
-//	{
-//		auto&& res = mDev.createIsochWriteBuffer(mIface, mPipe, FRAMES_PER_TRANSFER, mBytesPerFrame);
-//		if (!res)
-//		{
-//			cerr << "Error creating isoch buffer" << res.unwrap_err() << endl;
-//			return;
-//		}
-//		mTransfers[i].writeBuffer = res.unwrap();
-//		mTransfers[i].startFrame = 0;
-//	}
+	// We'll just use one buffer for each transfer and loop them.
+	for (int i = 0; i < NUM_TRANSFERS; ++i)
+	{
+		auto&& res = mDev.createIsochWriteBuffer(mIface, mPipe, FRAMES_PER_TRANSFER, mBytesPerFrame);
+		if (!res)
+		{
+			FLOG_ERROR("Error creating isoch buffer: {}", res.unwrap_err());
+			return;
+		}
+		mTransfers[i].writeBuffer = res.unwrap();
+		mTransfers[i].startFrame = 0;
+		if (mRate)
+			mTransfers[i].writeBuffer.frameLengths.assign(FRAMES_PER_TRANSFER, 0);
+	}
 	
-//	// TODO: Latency measurement. I need to make this work at all first.
+	mEntriesPerFrame = mTransfers[0].writeBuffer.entriesPerFrame;
+	uint64_t framesPerTransfer = FRAMES_PER_TRANSFER / mEntriesPerFrame;
 	
-//	// 16 ms in the future should be plenty.
-//	uint64_t submissionFrame = mDev.getBusFrameNumber() + 16;
+	mThreadPolicy.applyIfPending();
 	
-//	std::vector<bool> transferSubmitted(NUM_TRANSFERS, false);
+	// 16 ms in the future should be plenty.
+	uint64_t submissionFrame = mDev.getBusFrameNumber() + 16;
+	if (mStartFrame)
+		submissionFrame = std::max(submissionFrame, mStartFrame(submissionFrame));
 	
-//	// Loop until we are told to quit.
-//	for (int i = 0; !mSubmitTransfersQuit; i = (i + 1) % NUM_TRANSFERS)
-//	{
-//		// Wait for the second oldest transfer to finish. We don't want for the oldest one
-//		// because it seems to complete before it has actually finished! I know right wtf!
-//		int w = (i + 1) % NUM_TRANSFERS;
-//		if (transferSubmitted[w])
-//		{
-//			cerr << "Loop: Wait for transfer: " << w << " (" << mTransfers[w].startFrame << "- )" << endl;
-//			// Wait for it to complete.
-//			auto&& res = mTransfers[w].transferHandle.result();
-//			if (!res)
-//			{
-//				cerr << "Error completing transfer " << w << ": " << res.unwrap_err() << endl;
-//				return;
-//			}
-//			cerr << "Loop: Transfer complete: " << w << " (- " << mTransfers[w].startFrame + FRAMES_PER_TRANSFER << ") @ " << mDev.getBusFrameNumber() << endl;
-//		}
-
-//		// Ok let's submit a transfer.
+	if (mShared)
+		PublishSharedClock(submissionFrame);
+	
+	std::vector<bool> transferSubmitted(NUM_TRANSFERS, false);
+	
+	// Loop until we are told to quit.
+	for (int i = 0; !mSubmitTransfersQuit; i = (i + 1) % NUM_TRANSFERS)
+	{
+		mThreadPolicy.applyIfPending();
+		
+		// Wait for the second oldest transfer to finish. We don't wait for the oldest one
+		// because it seems to complete before it has actually finished!
+		int w = (i + 1) % NUM_TRANSFERS;
+		if (transferSubmitted[w])
+		{
+			auto&& res = mTransfers[w].transferHandle.result();
+			if (!res)
+			{
+				FLOG_ERROR("Error completing transfer {}: {}", w, res.unwrap_err());
+				return;
+			}
+		}
+
+		// Only plain streams are written by WriteFrame(); the others are filled now.
+		if (mRate)
+		{
+			FillFromRing(mTransfers[i].writeBuffer);
+		}
+		else if (mJitter)
+		{
+			FillFromJitterBuffer(mTransfers[i].writeBuffer);
+		}
+		else if (mPull)
+		{
+			FillFromPull(mTransfers[i].writeBuffer, submissionFrame);
+		}
+		else if (mShared)
+		{
+			FillFromShared(mTransfers[i].writeBuffer, submissionFrame);
+		}
+		else
+		{
+			// A WriteFrame() that found the old start frame could still be copying, so take
+			// the lock rather than just clearing startFrame; otherwise its frame could end up
+			// in the new transfer at the wrong time.
+			std::unique_lock<std::mutex> lock(mTransfers[i].writeMutex);
+			mTransfers[i].startFrame = 0;
+			
+			// Zero the buffer. This is interpreted by the device as padding/underflow.
+			memset(mTransfers[i].writeBuffer.data(), 0, mTransfers[i].writeBuffer.size());
+			
+			mTransfers[i].startFrame = submissionFrame;
+		}
 		
-//		// Zero the buffer. This is interpretted as the device as padding/underflow.
-//		memset(mTransfers[i].writeBuffer.data(), 0, mTransfers[i].writeBuffer.size());
+		// How long before it starts we managed to submit it.
+		double marginMs = submissionFrame - mDev.getBusMicroframeNumber() / 8.0;
+		{
+			std::unique_lock<std::mutex> lock(mSubmitStatsMutex);
+			IsochSubmitStats& st = mSubmitStats;
+			++st.submissions;
+			if (st.submissions == 1 || marginMs < st.minMarginMs)
+				st.minMarginMs = marginMs;
+			if (st.submissions == 1 || marginMs > st.maxMarginMs)
+				st.maxMarginMs = marginMs;
+			double delta = marginMs - st.meanMarginMs;
+			st.meanMarginMs += delta / st.submissions;
+			mMarginM2 += delta * (marginMs - st.meanMarginMs);
+		}
 		
-//		// Set the start frame.
-//		mTransfers[i].startFrame = submissionFrame;
+		// Submit it at the appropriate place.
+		auto&& res = mDev.submitIsoOutTransfer(mTransfers[i].writeBuffer, submissionFrame);
+		if (!res)
+		{
+			FLOG_ERROR("Error submitting transfer {}: {}", i, res.unwrap_err());
+			return;
+		}
 		
-//		cout << "Loop: Submitting transfer: " << i << " (" << submissionFrame << ")" << endl;
-//		// Submit it at the appropriate place.
-//		auto&& res = mDev.submitIsoOutTransfer(mTransfers[i].writeBuffer, submissionFrame);
-//		if (!res)
-//		{
-//			cerr << "Error submitting transfer " << i << ": " << res.unwrap_err() << endl;
-//			return;
-//		}
+		// Record the new transfer handle.
+		mTransfers[i].transferHandle = res.unwrap();
 		
-//		// Record the new transfer handle.
-//		mTransfers[i].transferHandle = res.unwrap();
+		// This transfer has been submitted.
+		transferSubmitted[i] = true;
 		
-//		// This transfer has been submitted.
-//		transferSubmitted[i] = true;
+		// When to submit the next frame...
+		submissionFrame += framesPerTransfer;
 		
-//		// When to submit the next frame...
-//		submissionFrame += FRAMES_PER_TRANSFER;
-//	}
-//	cout << "Iso submission thread exit..." << endl;
+		if (mShared)
+			PublishSharedClock(submissionFrame);
+	}
 	
-//	// Wait for all the transfers to finish.
-//	for (int i = 0; i < NUM_TRANSFERS; ++i)
-//	{
-//		if (transferSubmitted[i])
-//		{
-//			auto&& res = mTransfers[i].transferHandle.result();
-//			if (!res)
-//			{
-//				cerr << "Error completing transfer " << i << ": " << res.unwrap_err() << endl;
-//				return;
-//			}
-//		}
-//	}
+	// Wait for all the transfers to finish.
+	for (int i = 0; i < NUM_TRANSFERS; ++i)
+	{
+		if (transferSubmitted[i])
+		{
+			auto&& res = mTransfers[i].transferHandle.result();
+			if (!res)
+			{
+				FLOG_ERROR("Error completing transfer {}: {}", i, res.unwrap_err());
+				return;
+			}
+		}
+	}
 }
@@ -3,26 +3,139 @@
 #include <thread>
 #include <array>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdint.h>
 
 #include "Device.h"
+#include "IsochFeedback.h"
+#include "IsochJitterBuffer.h"
+#include "IsochSharedRing.h"
+#include "util/ByteRing.h"
+#include "util/ThreadPolicy.h"
+
+// Called on the stream's thread just before a transfer is submitted, once for each of its
+// packets. Fill `data` with bytesPerFrame bytes for the packet sent at `usbMicroframe`. Return
+// false if there is nothing to send; the packet is then zeros.
+typedef std::function<bool(uint64_t usbMicroframe, uint8_t* data)> IsochFramePullCallback;
+
+// Called on the stream's thread before the first transfer is submitted, with the earliest USB
+// frame it can start at. Returns the frame to start at, which must not be earlier.
+typedef std::function<uint64_t(uint64_t earliestUsbFrame)> IsochStartFrameCallback;
+
+// How far ahead of their first frame transfers were submitted. If the minimum gets near zero
+// the submit thread is being held up and packets are about to be missed.
+struct IsochSubmitStats
+{
+	uint64_t submissions = 0;
+	double minMarginMs = 0.0;
+	double maxMarginMs = 0.0;
+	double meanMarginMs = 0.0;
+	// Mostly how late the submit thread wakes up.
+	double jitterMs = 0.0;
+};
 
 // This class tracks the current haptic frame number, and where to write frames.
 class IsochronousStream
 {
 public:
 	IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame);
+	
+	// A stream to an asynchronous endpoint. Instead of packets being written for particular
+	// frames, data is queued with WriteBytes() and each packet takes however much `rate` says
+	// the device needs, up to `bytesPerFrame`. `ringBytes` is how much can be queued, in
+	// memory allocated according to `memory`.
+	IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame,
+	                  std::shared_ptr<IsochRateController> rate, size_t ringBytes,
+	                  const LockedMemoryOptions& memory = LockedMemoryOptions());
+	
+	// A stream for a producer running on its own timer. Frames are queued in order with
+	// QueueFrame() and sent one per packet, through a jitter buffer that absorbs the producer's
+	// timing and the drift between its clock and the bus's.
+	IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame, const IsochJitterConfig& jitter);
+	
+	// A stream whose packets are asked for just before they are submitted, so they are as
+	// fresh as the stream's latency allows and can't be late. `startFrame` can choose when
+	// the stream starts, e.g. to line it up with streams to other devices.
+	IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame, IsochFramePullCallback pull,
+	                  IsochStartFrameCallback startFrame = nullptr);
+	
+	// A stream fed by another process through `shared` (see IsochSharedRing.h), which must be
+	// for frames of `bytesPerFrame` and have at least 64 slots, a transfer's worth. If it
+	// doesn't, the error is logged and the stream never starts. The stream publishes its bus
+	// clock there too.
+	IsochronousStream(Device& dev, int iface, uint8_t pipe, int bytesPerFrame, std::shared_ptr<IsochSharedRing> shared);
 	virtual ~IsochronousStream();
 	
-	// Get the current USB frame number.
+	// Get the current USB frame number (1 ms).
 	uint64_t CurrentFrameNumber() const;
 	
-	// Write a usbFrame. Returns false if it was way in the past or future.
+	// Get the current USB microframe number (125 us).
+	uint64_t CurrentMicroframeNumber() const;
+	
+	// Write the packet for a USB microframe. Returns false if it was way in the past or future.
 	// Even if it returns true, it may have only just been in the past.
 	// `data` must point to `bytesPerFrame` bytes.
-	bool WriteFrame(uint64_t usbFrame, const uint8_t* data);
+	//
+	// High Speed endpoints with bInterval 1 have a packet every microframe. Others have one
+	// per service interval (2 or 4 microframes, or a whole frame for Full Speed endpoints),
+	// and writing any microframe in the interval writes its packet.
+	//
+	// Always returns false for rate controlled, jitter buffered, pull and shared ring streams.
+	bool WriteFrame(uint64_t usbMicroframe, const uint8_t* data);
+	
+	// Queue data for a rate controlled stream. Returns false, queueing nothing, if there isn't
+	// room for all of it. Data should be whole units (e.g. audio sample frames).
+	bool WriteBytes(const uint8_t* data, size_t size);
+	
+	// How much more can be queued with WriteBytes().
+	size_t WritableBytes() const;
+	
+	// Queue data for a rate controlled stream by writing it in place. `size` is set to how
+	// much room there is, all of it contiguous. Call CommitWrite() with how much was written.
+	uint8_t* WriteWindow(size_t& size);
+	void CommitWrite(size_t size);
+	
+	// Bytes sent as zeros because WriteBytes() hadn't been called soon enough.
+	uint64_t UnderflowBytes() const;
+	
+	// Queue the next frame of a jitter buffered stream. `data` must point to `bytesPerFrame`
+	// bytes. Returns false if the buffer was full and the frame was thrown away.
+	bool QueueFrame(const uint8_t* data);
+	
+	// The fill level, drift and underflow/overflow counts of a jitter buffered stream.
+	IsochJitterStats JitterStats() const;
+	
+	// Schedule the submit thread, e.g. as real-time. It is applied by the thread itself before
+	// its next transfer; ThreadPolicyStatus() then says whether it all worked.
+	void SetThreadPolicy(const ThreadPolicy& policy);
+	SResult<void> ThreadPolicyStatus() const;
+	
+	IsochSubmitStats SubmitStats() const;
+	
+	// Whether the submit thread is still submitting transfers. False once it has stopped
+	// after an error (which it logs), or if the stream never started.
+	bool IsRunning() const;
+	
+	// Packets per 1 ms frame, once the first transfer has been set up: 1 for Full Speed, and
+	// 1, 2, 4 or 8 for High Speed depending on bInterval.
+	int EntriesPerFrame() const;
 private:
 	
+	void Start();
+	
+	// Size the packets of a transfer with the rate controller and pack queued data into them.
+	void FillFromRing(IsochWriteBuffer& buffer);
+	
+	// Fill a transfer starting at `usbFrame` from the jitter buffer or the pull callback.
+	void FillFromJitterBuffer(IsochWriteBuffer& buffer);
+	void FillFromPull(IsochWriteBuffer& buffer, uint64_t usbFrame);
+	void FillFromShared(IsochWriteBuffer& buffer, uint64_t usbFrame);
+	
+	// Tell the shared ring's writer where the bus is and which frames it can still write.
+	void PublishSharedClock(uint64_t nextSubmissionFrame);
+	
 	// This function loops, submitting 64-ms isochronous transfers.
 	void SubmitTransfersFunc();
 	
@@ -31,15 +144,19 @@ private:
 		IsochWriteBuffer writeBuffer;
 		UsbIsochTransferHandle transferHandle;
 		
-		// The first USB frame for this transfer.
-		std::atomic<uint64_t> startFrame;
+		// The first USB frame for this transfer, or 0 while it is being refilled.
+		std::atomic<uint64_t> startFrame{0};
+		// Held by WriteFrame() while it copies into writeBuffer, and by the submit thread
+		// while it refills it, so a frame can't land in the buffer after it has moved on.
+		std::mutex writeMutex;
 	};
 	
 	// Number of in-flight transfers to have. We need at least two. 3 or 4 is probably reasonable
 	// to be safe.
 	static const int NUM_TRANSFERS = 4;
-	// How long should each transfer be. This should be reasonably high so that we aren't submitting
-	// transfers all the time.
+	// How many frame list entries each transfer has. This should be reasonably high so that we
+	// aren't submitting transfers all the time. It is a multiple of 8 so it is a whole number
+	// of frames for every High Speed interval.
 	static const int FRAMES_PER_TRANSFER = 64;
 	
 	// Array of transfers.
@@ -49,9 +166,35 @@ private:
 	std::thread mSubmitTransfersThread;
 	// Bool to indicate that the submit thread should exit.
 	std::atomic_bool mSubmitTransfersQuit{false};
+	// Set when the submit thread starts, and cleared when it returns.
+	std::atomic_bool mSubmitTransfersRunning{false};
 	
 	Device& mDev;
 	int mIface = 0;
 	uint8_t mPipe = 0;
 	int mBytesPerFrame = 0;
+	// Frame list entries per 1 ms frame, from the buffers. Set before any transfer starts.
+	std::atomic<int> mEntriesPerFrame{1};
+	
+	// Only for rate controlled streams.
+	std::shared_ptr<IsochRateController> mRate;
+	std::unique_ptr<ByteRing> mRing;
+	std::atomic<uint64_t> mUnderflowBytes{0};
+	
+	// Only for jitter buffered streams.
+	std::unique_ptr<IsochJitterBuffer> mJitter;
+	
+	// Only for pull streams.
+	IsochFramePullCallback mPull;
+	IsochStartFrameCallback mStartFrame;
+	
+	// Only for shared ring streams.
+	std::shared_ptr<IsochSharedRing> mShared;
+	
+	ThreadPolicyRequest mThreadPolicy;
+	
+	// Running statistics of the submit margin, using Welford's method for the variance.
+	mutable std::mutex mSubmitStatsMutex;
+	IsochSubmitStats mSubmitStats;
+	double mMarginM2 = 0.0;
 };
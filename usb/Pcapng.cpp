@@ -0,0 +1,265 @@
+#include "Pcapng.h"
+
+#include <string.h>
+
+using std::string;
+
+namespace
+{
+// pcapng block types.
+const uint32_t SECTION_HEADER_BLOCK = 0x0A0D0D0A;
+const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+const uint32_t ENHANCED_PACKET_BLOCK = 0x00000006;
+
+const uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+// The magic as it reads from a file in the other byte order.
+const uint32_t SWAPPED_BYTE_ORDER_MAGIC = 0x4D3C2B1A;
+
+// Interface options.
+const uint16_t OPT_ENDOFOPT = 0;
+const uint16_t IF_TSRESOL = 9;
+
+template<typename T>
+void Put(string& s, T v)
+{
+	s.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void Pad(string& s)
+{
+	s.append((4 - s.size() % 4) % 4, '\0');
+}
+
+template<typename T>
+T Get(const uint8_t* p)
+{
+	T v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+}
+
+SResult<std::shared_ptr<PcapngWriter>> PcapngWriter::create(const string& path, uint16_t linkType, uint32_t snapLength)
+{
+	std::shared_ptr<PcapngWriter> w(new PcapngWriter());
+	w->mPath = path;
+	w->mOut.open(path, std::ios::binary | std::ios::trunc);
+	if (!w->mOut)
+		return Err("Couldn't open " + path + " for writing");
+
+	// Everything is written in our byte order; readers use the magic to tell which it is.
+	string shb;
+	Put<uint32_t>(shb, BYTE_ORDER_MAGIC);
+	Put<uint16_t>(shb, 1);
+	Put<uint16_t>(shb, 0);
+	// The section length isn't known in advance.
+	Put<int64_t>(shb, -1);
+	auto res = w->writeBlock(SECTION_HEADER_BLOCK, shb);
+	if (!res)
+		return Err(res.unwrap_err());
+
+	string idb;
+	Put<uint16_t>(idb, linkType);
+	Put<uint16_t>(idb, 0);
+	Put<uint32_t>(idb, snapLength);
+	// Nanosecond timestamps.
+	Put<uint16_t>(idb, IF_TSRESOL);
+	Put<uint16_t>(idb, 1);
+	Put<uint8_t>(idb, 9);
+	Pad(idb);
+	Put<uint16_t>(idb, OPT_ENDOFOPT);
+	Put<uint16_t>(idb, 0);
+	res = w->writeBlock(INTERFACE_DESCRIPTION_BLOCK, idb);
+	if (!res)
+		return Err(res.unwrap_err());
+
+	return Ok(w);
+}
+
+SResult<void> PcapngWriter::write(uint64_t timestampNs, const uint8_t* data, uint32_t size, uint32_t originalLength)
+{
+	string epb;
+	epb.reserve(20 + size + 3);
+	Put<uint32_t>(epb, 0);
+	Put<uint32_t>(epb, static_cast<uint32_t>(timestampNs >> 32));
+	Put<uint32_t>(epb, static_cast<uint32_t>(timestampNs));
+	Put<uint32_t>(epb, size);
+	Put<uint32_t>(epb, originalLength < size ? size : originalLength);
+	epb.append(reinterpret_cast<const char*>(data), size);
+	Pad(epb);
+	MSTRY(writeBlock(ENHANCED_PACKET_BLOCK, epb));
+	++mPackets;
+	return Ok();
+}
+
+SResult<void> PcapngWriter::flush()
+{
+	mOut.flush();
+	if (!mOut)
+		return Err("Couldn't write to " + mPath);
+	return Ok();
+}
+
+SResult<void> PcapngWriter::writeBlock(uint32_t type, const string& body)
+{
+	// The type, the total length at both ends, and the body, which is already padded.
+	uint32_t length = static_cast<uint32_t>(body.size() + 12);
+	string block;
+	block.reserve(length);
+	Put<uint32_t>(block, type);
+	Put<uint32_t>(block, length);
+	block += body;
+	Put<uint32_t>(block, length);
+
+	mOut.write(block.data(), block.size());
+	if (!mOut)
+		return Err("Couldn't write to " + mPath);
+	return Ok();
+}
+
+SResult<std::shared_ptr<PcapngReader>> PcapngReader::open(const string& path)
+{
+	std::shared_ptr<PcapngReader> r(new PcapngReader());
+	r->mPath = path;
+	auto fileRes = MappedFile::open(path, MappedFile::Mode::ReadOnly);
+	if (!fileRes)
+		return Err(fileRes.unwrap_err());
+	r->mFile = fileRes.unwrap();
+
+	const MappedFile& file = *r->mFile;
+	if (file.size() < 12 || Get<uint32_t>(file.data()) != SECTION_HEADER_BLOCK)
+		return Err(path + " isn't a pcapng file");
+	return Ok(r);
+}
+
+SResult<bool> PcapngReader::next(PcapngPacket& packet)
+{
+	const uint8_t* data = mFile->data();
+	uint64_t size = mFile->size();
+
+	while (mOffset < size)
+	{
+		// Check every length before using it, so a truncated or corrupt file is only an error.
+		string where = " at offset " + std::to_string(mOffset) + " of " + mPath;
+		if (size - mOffset < 12)
+			return Err("Truncated block" + where);
+		const uint8_t* block = data + mOffset;
+		uint32_t type = Get<uint32_t>(block);
+		uint32_t length = Get<uint32_t>(block + 4);
+
+		if (type == SECTION_HEADER_BLOCK)
+		{
+			// The byte order magic is needed before the length can be trusted.
+			if (size - mOffset < 16)
+				return Err("Truncated section header" + where);
+			uint32_t magic = Get<uint32_t>(block + 8);
+			if (magic == SWAPPED_BYTE_ORDER_MAGIC)
+				return Err("The section" + where + " was written on a machine of the other byte order");
+			if (magic != BYTE_ORDER_MAGIC)
+				return Err("Bad byte order magic" + where);
+		}
+
+		if (length < 12 || length % 4 != 0 || length > size - mOffset)
+			return Err("Bad block length " + std::to_string(length) + where);
+		if (Get<uint32_t>(block + length - 4) != length)
+			return Err("Block lengths don't match" + where);
+		mOffset += length;
+
+		const uint8_t* body = block + 8;
+		uint32_t bodySize = length - 12;
+		switch (type)
+		{
+		case SECTION_HEADER_BLOCK:
+			mInterfaces.clear();
+			mInSection = true;
+			break;
+
+		case INTERFACE_DESCRIPTION_BLOCK:
+			if (!mInSection)
+				return Err("Interface description before any section header" + where);
+			MSTRY(readInterface(body, bodySize));
+			break;
+
+		case ENHANCED_PACKET_BLOCK:
+		{
+			if (bodySize < 20)
+				return Err("Truncated packet block" + where);
+			uint32_t interfaceId = Get<uint32_t>(body);
+			if (interfaceId >= mInterfaces.size())
+				return Err("Packet for unknown interface " + std::to_string(interfaceId) + where);
+			uint64_t timestamp = (uint64_t(Get<uint32_t>(body + 4)) << 32) | Get<uint32_t>(body + 8);
+			uint32_t captured = Get<uint32_t>(body + 12);
+			if (captured > bodySize - 20)
+				return Err("Packet is longer than its block" + where);
+
+			const Interface& i = mInterfaces[interfaceId];
+			packet.linkType = i.linkType;
+			packet.timestampNs = toNs(i, timestamp);
+			packet.data = body + 20;
+			packet.size = captured;
+			packet.originalLength = Get<uint32_t>(body + 16);
+			++mPackets;
+			return Ok(true);
+		}
+
+		default:
+			break;
+		}
+	}
+	return Ok(false);
+}
+
+SResult<void> PcapngReader::readInterface(const uint8_t* body, uint32_t size)
+{
+	if (size < 8)
+		return Err("Truncated interface description in " + mPath);
+	Interface i;
+	i.linkType = Get<uint16_t>(body);
+
+	// Options are a code, a length, and a value padded to 4 bytes.
+	uint32_t at = 8;
+	while (size - at >= 4)
+	{
+		uint16_t code = Get<uint16_t>(body + at);
+		uint16_t length = Get<uint16_t>(body + at + 2);
+		at += 4;
+		if (code == OPT_ENDOFOPT || length > size - at)
+			break;
+		if (code == IF_TSRESOL && length == 1)
+		{
+			i.binary = (body[at] & 0x80) != 0;
+			i.exponent = body[at] & 0x7F;
+		}
+		at += (length + 3u) & ~3u;
+		if (at > size)
+			break;
+	}
+
+	mInterfaces.push_back(i);
+	return Ok();
+}
+
+uint64_t PcapngReader::toNs(const Interface& i, uint64_t timestamp) const
+{
+	if (i.binary)
+	{
+		if (i.exponent >= 64)
+			return 0;
+		// The whole seconds and the fraction separately, so it can't overflow.
+		uint64_t fraction = timestamp & ((uint64_t(1) << i.exponent) - 1);
+		return (timestamp >> i.exponent) * 1000000000ull +
+		       static_cast<uint64_t>(fraction * 1e9 / double(uint64_t(1) << i.exponent));
+	}
+
+	if (i.exponent <= 9)
+	{
+		for (int e = i.exponent; e < 9; ++e)
+			timestamp *= 10;
+	}
+	else
+	{
+		for (int e = 9; e < i.exponent; ++e)
+			timestamp /= 10;
+	}
+	return timestamp;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "util/MappedFile.h"
+
+// The link type for packets that are a binary usbmon event: its 64 byte header, then any
+// isochronous descriptors, then the captured data. Wireshark decodes these.
+static const uint16_t LINKTYPE_USB_LINUX_MMAPPED = 220;
+
+// Writes a pcapng file with one interface. Timestamps are kept in nanoseconds.
+class PcapngWriter
+{
+public:
+	// Create (or truncate) the file and write its section and interface headers.
+	static SResult<std::shared_ptr<PcapngWriter>> create(const std::string& path,
+	                                                     uint16_t linkType = LINKTYPE_USB_LINUX_MMAPPED,
+	                                                     uint32_t snapLength = 0);
+
+	// Write one packet. `originalLength` is how long it was before it was truncated to
+	// `size`, if it was.
+	SResult<void> write(uint64_t timestampNs, const uint8_t* data, uint32_t size, uint32_t originalLength);
+
+	SResult<void> flush();
+
+	uint64_t packets() const { return mPackets; }
+
+private:
+	PcapngWriter() = default;
+	PcapngWriter(const PcapngWriter&) = delete;
+	PcapngWriter& operator=(const PcapngWriter&) = delete;
+
+	SResult<void> writeBlock(uint32_t type, const std::string& body);
+
+	std::string mPath;
+	std::ofstream mOut;
+	uint64_t mPackets = 0;
+};
+
+// A packet from an Enhanced Packet Block.
+struct PcapngPacket
+{
+	// The link type of the packet's interface.
+	uint16_t linkType = 0;
+	uint64_t timestampNs = 0;
+	// Into the mapped file, so only valid while the reader is.
+	const uint8_t* data = nullptr;
+	uint32_t size = 0;
+	uint32_t originalLength = 0;
+};
+
+// Reads the packets of a pcapng file in order, from a mapping of it. Every section and
+// interface is followed, and timestamps are converted from each interface's resolution.
+// Blocks other than the section, interface and enhanced packet blocks are skipped.
+//
+// Only files in our byte order are read: the packets of a usbmon capture are in the byte
+// order of the machine that took it too, and DecodeUsbMonEvent() doesn't swap them.
+class PcapngReader
+{
+public:
+	static SResult<std::shared_ptr<PcapngReader>> open(const std::string& path);
+
+	// Read the next packet into `packet`. False at the end of the file.
+	SResult<bool> next(PcapngPacket& packet);
+
+	uint64_t packets() const { return mPackets; }
+
+private:
+	PcapngReader() = default;
+	PcapngReader(const PcapngReader&) = delete;
+	PcapngReader& operator=(const PcapngReader&) = delete;
+
+	struct Interface
+	{
+		uint16_t linkType = 0;
+		// Timestamps are in units of 10^-exponent seconds, or 2^-exponent if `binary`.
+		bool binary = false;
+		uint8_t exponent = 6;
+	};
+
+	SResult<void> readInterface(const uint8_t* body, uint32_t size);
+	uint64_t toNs(const Interface& i, uint64_t timestamp) const;
+
+	std::string mPath;
+	std::shared_ptr<MappedFile> mFile;
+	uint64_t mOffset = 0;
+	// Of the current section.
+	std::vector<Interface> mInterfaces;
+	bool mInSection = false;
+	uint64_t mPackets = 0;
+};
@@ -0,0 +1,419 @@
+#include "UsbMon.h"
+
+#include <string.h>
+
+#include "Pcapng.h"
+#include "util/FastLog.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using std::string;
+
+namespace
+{
+// Offsets in the binary header, struct mon_bin_hdr in drivers/usb/mon/mon_bin.c. It is in
+// the host's byte order.
+const size_t OFF_ID = 0;
+const size_t OFF_TYPE = 8;
+const size_t OFF_XFER_TYPE = 9;
+const size_t OFF_EPNUM = 10;
+const size_t OFF_DEVNUM = 11;
+const size_t OFF_BUSNUM = 12;
+const size_t OFF_FLAG_SETUP = 14;
+const size_t OFF_FLAG_DATA = 15;
+const size_t OFF_TS_SEC = 16;
+const size_t OFF_TS_USEC = 24;
+const size_t OFF_STATUS = 28;
+const size_t OFF_LEN_URB = 32;
+const size_t OFF_LEN_CAP = 36;
+const size_t OFF_SETUP = 40;
+const size_t OFF_INTERVAL = 48;
+const size_t OFF_START_FRAME = 52;
+const size_t OFF_XFER_FLAGS = 56;
+const size_t OFF_NDESC = 60;
+
+// usbmon pads the ring with these so an event never wraps around the end.
+const char FILLER_TYPE = '@';
+
+template<typename T>
+T Get(const uint8_t* p, size_t offset)
+{
+	T v;
+	memcpy(&v, p + offset, sizeof(v));
+	return v;
+}
+
+template<typename T>
+void Set(uint8_t* p, size_t offset, T v)
+{
+	memcpy(p + offset, &v, sizeof(v));
+}
+
+// usbmon numbers the transfer types differently to bmAttributes.
+EndpointInfo::Type TransferTypeFromUsbMon(uint8_t t)
+{
+	switch (t)
+	{
+	case 0:
+		return EndpointInfo::Type::Isochronous;
+	case 1:
+		return EndpointInfo::Type::Interrupt;
+	case 2:
+		return EndpointInfo::Type::Control;
+	default:
+		return EndpointInfo::Type::Bulk;
+	}
+}
+
+uint8_t TransferTypeToUsbMon(EndpointInfo::Type t)
+{
+	switch (t)
+	{
+	case EndpointInfo::Type::Isochronous:
+		return 0;
+	case EndpointInfo::Type::Interrupt:
+		return 1;
+	case EndpointInfo::Type::Control:
+		return 2;
+	case EndpointInfo::Type::Bulk:
+		return 3;
+	}
+	return 3;
+}
+}
+
+int32_t UsbMonRecord::isoErrorCount() const
+{
+	return Get<int32_t>(setup.data(), 0);
+}
+
+int32_t UsbMonRecord::isoPacketCount() const
+{
+	return Get<int32_t>(setup.data(), 4);
+}
+
+SResult<UsbMonRecord> DecodeUsbMonEvent(const uint8_t* data, size_t size)
+{
+	if (size < USBMON_HEADER_SIZE)
+		return Err(string("usbmon event is shorter than its header"));
+
+	char type = static_cast<char>(data[OFF_TYPE]);
+	if (type != 'S' && type != 'C' && type != 'E')
+		return Err("Unknown usbmon event type " + std::to_string(int(data[OFF_TYPE])));
+
+	UsbMonRecord r;
+	r.id = Get<uint64_t>(data, OFF_ID);
+	r.type = static_cast<UsbMonEventType>(type);
+	r.transferType = TransferTypeFromUsbMon(data[OFF_XFER_TYPE]);
+	r.endpoint = data[OFF_EPNUM];
+	r.deviceAddress = data[OFF_DEVNUM];
+	r.bus = Get<uint16_t>(data, OFF_BUSNUM);
+	r.setupFlag = static_cast<char>(data[OFF_FLAG_SETUP]);
+	r.dataFlag = static_cast<char>(data[OFF_FLAG_DATA]);
+	int64_t sec = Get<int64_t>(data, OFF_TS_SEC);
+	int32_t usec = Get<int32_t>(data, OFF_TS_USEC);
+	r.timestampNs = static_cast<uint64_t>(sec) * 1000000000ull + static_cast<uint64_t>(usec) * 1000ull;
+	r.status = Get<int32_t>(data, OFF_STATUS);
+	r.urbLength = Get<uint32_t>(data, OFF_LEN_URB);
+	memcpy(r.setup.data(), data + OFF_SETUP, r.setup.size());
+	r.interval = Get<int32_t>(data, OFF_INTERVAL);
+	r.startFrame = Get<int32_t>(data, OFF_START_FRAME);
+	r.transferFlags = Get<uint32_t>(data, OFF_XFER_FLAGS);
+
+	uint32_t captured = Get<uint32_t>(data, OFF_LEN_CAP);
+	uint32_t ndesc = Get<uint32_t>(data, OFF_NDESC);
+	if (captured > size - USBMON_HEADER_SIZE)
+		return Err("usbmon event claims " + std::to_string(captured) + " captured bytes but only " +
+		           std::to_string(size - USBMON_HEADER_SIZE) + " follow it");
+	if (static_cast<uint64_t>(ndesc) * USBMON_ISO_DESCRIPTOR_SIZE > captured)
+		return Err(string("usbmon event has more isochronous descriptors than captured bytes"));
+
+	const uint8_t* p = data + USBMON_HEADER_SIZE;
+	r.isoDescriptors.resize(ndesc);
+	for (auto& d : r.isoDescriptors)
+	{
+		d.status = Get<int32_t>(p, 0);
+		d.offset = Get<uint32_t>(p, 4);
+		d.length = Get<uint32_t>(p, 8);
+		p += USBMON_ISO_DESCRIPTOR_SIZE;
+	}
+	r.data.assign(p, data + USBMON_HEADER_SIZE + captured);
+	return Ok(r);
+}
+
+std::vector<uint8_t> EncodeUsbMonEvent(const UsbMonRecord& r)
+{
+	std::vector<uint8_t> out(USBMON_HEADER_SIZE + r.capturedLength(), 0);
+	uint8_t* data = out.data();
+
+	Set<uint64_t>(data, OFF_ID, r.id);
+	data[OFF_TYPE] = static_cast<uint8_t>(r.type);
+	data[OFF_XFER_TYPE] = TransferTypeToUsbMon(r.transferType);
+	data[OFF_EPNUM] = r.endpoint;
+	data[OFF_DEVNUM] = r.deviceAddress;
+	Set<uint16_t>(data, OFF_BUSNUM, r.bus);
+	data[OFF_FLAG_SETUP] = static_cast<uint8_t>(r.setupFlag);
+	data[OFF_FLAG_DATA] = static_cast<uint8_t>(r.dataFlag);
+	Set<int64_t>(data, OFF_TS_SEC, static_cast<int64_t>(r.timestampNs / 1000000000ull));
+	Set<int32_t>(data, OFF_TS_USEC, static_cast<int32_t>(r.timestampNs % 1000000000ull / 1000));
+	Set<int32_t>(data, OFF_STATUS, r.status);
+	Set<uint32_t>(data, OFF_LEN_URB, r.urbLength);
+	Set<uint32_t>(data, OFF_LEN_CAP, r.capturedLength());
+	memcpy(data + OFF_SETUP, r.setup.data(), r.setup.size());
+	Set<int32_t>(data, OFF_INTERVAL, r.interval);
+	Set<int32_t>(data, OFF_START_FRAME, r.startFrame);
+	Set<uint32_t>(data, OFF_XFER_FLAGS, r.transferFlags);
+	Set<uint32_t>(data, OFF_NDESC, static_cast<uint32_t>(r.isoDescriptors.size()));
+
+	uint8_t* p = data + USBMON_HEADER_SIZE;
+	for (const auto& d : r.isoDescriptors)
+	{
+		Set<int32_t>(p, 0, d.status);
+		Set<uint32_t>(p, 4, d.offset);
+		Set<uint32_t>(p, 8, d.length);
+		p += USBMON_ISO_DESCRIPTOR_SIZE;
+	}
+	if (!r.data.empty())
+		memcpy(p, r.data.data(), r.data.size());
+	return out;
+}
+
+SResult<void> WriteUsbMonRecord(PcapngWriter& writer, const UsbMonRecord& record)
+{
+	std::vector<uint8_t> packet = EncodeUsbMonEvent(record);
+	// As libpcap does: the length had none of the data been cut off.
+	uint32_t original = static_cast<uint32_t>(USBMON_HEADER_SIZE + record.isoDescriptors.size() * USBMON_ISO_DESCRIPTOR_SIZE) +
+	                    record.urbLength;
+	return writer.write(record.timestampNs, packet.data(), static_cast<uint32_t>(packet.size()), original);
+}
+
+void DecodeUsbMonBatch(const uint8_t* ring, size_t ringSize, const uint32_t* offsets, size_t count,
+                       std::vector<UsbMonRecord>& records, UsbMonStats& stats)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t offset = offsets[i];
+		if (offset + USBMON_HEADER_SIZE > ringSize)
+		{
+			++stats.malformed;
+			continue;
+		}
+		if (static_cast<char>(ring[offset + OFF_TYPE]) == FILLER_TYPE)
+			continue;
+
+		auto res = DecodeUsbMonEvent(ring + offset, ringSize - offset);
+		if (!res)
+		{
+			++stats.malformed;
+			continue;
+		}
+		records.push_back(std::move(res.unwrap()));
+		++stats.events;
+	}
+	++stats.batches;
+}
+
+void AddUsbMonTotals(const std::vector<UsbMonRecord>& records, UsbMonTotals& totals)
+{
+	for (const UsbMonRecord& r : records)
+	{
+		switch (r.type)
+		{
+		case UsbMonEventType::Submit:
+			++totals.submissions;
+			break;
+		case UsbMonEventType::Complete:
+			++totals.completions;
+			totals.bytes += r.urbLength;
+			if (r.status != 0)
+				++totals.errors;
+			break;
+		case UsbMonEventType::Error:
+			++totals.errors;
+			break;
+		}
+	}
+}
+
+#if defined(__linux__)
+
+namespace
+{
+// From drivers/usb/mon/mon_bin.c; they aren't in the exported headers.
+struct MonBinStats
+{
+	uint32_t queued;
+	uint32_t dropped;
+};
+
+struct MonBinMfetch
+{
+	uint32_t* offvec;
+	uint32_t nfetch;
+	uint32_t nflush;
+};
+
+const unsigned MON_IOC_MAGIC = 0x92;
+const unsigned long MON_IOCG_STATS = _IOR(MON_IOC_MAGIC, 3, MonBinStats);
+const unsigned long MON_IOCT_RING_SIZE = _IO(MON_IOC_MAGIC, 4);
+const unsigned long MON_IOCQ_RING_SIZE = _IO(MON_IOC_MAGIC, 5);
+const unsigned long MON_IOCX_MFETCH = _IOWR(MON_IOC_MAGIC, 7, MonBinMfetch);
+
+// How long to wait for events before checking whether to stop.
+const int POLL_TIMEOUT_MS = 100;
+
+// Ask the kernel how many events it dropped every this many batches, and when idle.
+const uint64_t STATS_INTERVAL = 64;
+
+string ErrnoError(const string& what)
+{
+	return what + " failed: " + strerror(errno);
+}
+}
+
+SResult<std::shared_ptr<UsbMonSniffer>> UsbMonSniffer::start(int bus, RecordsCallback callback, size_t ringSize)
+{
+	std::shared_ptr<UsbMonSniffer> s(new UsbMonSniffer());
+	s->mCallback = callback;
+
+	string path = "/dev/usbmon" + std::to_string(bus);
+	s->mFd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (s->mFd < 0)
+	{
+		int err = errno;
+		string error = ErrnoError("Opening " + path);
+		if (err == ENOENT)
+			error += " (is the usbmon module loaded? Try modprobe usbmon)";
+		else if (err == EACCES || err == EPERM)
+			error += " (usbmon needs root, or read access to " + path + ")";
+		return Err(error);
+	}
+
+	if (ringSize != 0 && ioctl(s->mFd, MON_IOCT_RING_SIZE, static_cast<unsigned long>(ringSize)) < 0)
+		return Err(ErrnoError("Setting the usbmon ring size"));
+
+	int size = ioctl(s->mFd, MON_IOCQ_RING_SIZE);
+	if (size <= 0)
+		return Err(ErrnoError("Getting the usbmon ring size"));
+	s->mRingSize = static_cast<size_t>(size);
+
+	void* ring = mmap(nullptr, s->mRingSize, PROT_READ, MAP_SHARED, s->mFd, 0);
+	if (ring == MAP_FAILED)
+		return Err(ErrnoError("Mapping the usbmon ring"));
+	s->mRing = static_cast<const uint8_t*>(ring);
+
+	s->mThread = std::thread(&UsbMonSniffer::run, s.get());
+	return Ok(s);
+}
+
+UsbMonSniffer::~UsbMonSniffer()
+{
+	stop();
+	if (mRing != nullptr)
+		munmap(const_cast<uint8_t*>(mRing), mRingSize);
+	if (mFd >= 0)
+		close(mFd);
+}
+
+void UsbMonSniffer::stop()
+{
+	mQuit = true;
+	if (mThread.joinable())
+		mThread.join();
+}
+
+void UsbMonSniffer::run()
+{
+	uint32_t offsets[MAX_BATCH];
+	// Events from the last batch, which the next fetch frees.
+	uint32_t toFlush = 0;
+	std::vector<UsbMonRecord> records;
+	UsbMonStats stats;
+
+	auto pollDropped = [&] {
+		MonBinStats kernel;
+		if (ioctl(mFd, MON_IOCG_STATS, &kernel) == 0)
+			mKernelDropped += kernel.dropped;
+	};
+
+	while (!mQuit)
+	{
+		MonBinMfetch fetch;
+		fetch.offvec = offsets;
+		fetch.nfetch = MAX_BATCH;
+		fetch.nflush = toFlush;
+
+		if (ioctl(mFd, MON_IOCX_MFETCH, &fetch) < 0)
+		{
+			// The flush happens before the wait, so it has been done either way.
+			if (errno == EAGAIN)
+			{
+				toFlush = 0;
+				pollDropped();
+				pollfd pfd;
+				pfd.fd = mFd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				poll(&pfd, 1, POLL_TIMEOUT_MS);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			FLOG_ERROR("Stopping usbmon reader: MON_IOCX_MFETCH failed: {}", strerror(errno));
+			break;
+		}
+
+		// The records are copies, so this batch can be freed by the next fetch.
+		toFlush = fetch.nfetch;
+
+		records.clear();
+		stats = UsbMonStats();
+		DecodeUsbMonBatch(mRing, mRingSize, offsets, fetch.nfetch, records, stats);
+		mEvents += stats.events;
+		mMalformed += stats.malformed;
+		uint64_t batches = ++mBatches;
+		if (batches % STATS_INTERVAL == 0)
+			pollDropped();
+
+		if (!records.empty() && mCallback)
+			mCallback(records);
+	}
+}
+
+#else
+
+SResult<std::shared_ptr<UsbMonSniffer>> UsbMonSniffer::start(int bus, RecordsCallback callback, size_t ringSize)
+{
+	return Err(string("usbmon is only available on Linux"));
+}
+
+UsbMonSniffer::~UsbMonSniffer()
+{
+}
+
+void UsbMonSniffer::stop()
+{
+}
+
+void UsbMonSniffer::run()
+{
+}
+
+#endif
+
+UsbMonStats UsbMonSniffer::stats() const
+{
+	UsbMonStats s;
+	s.events = mEvents;
+	s.kernelDropped = mKernelDropped;
+	s.malformed = mMalformed;
+	s.batches = mBatches;
+	return s;
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "EndpointInfo.h"
+
+class PcapngWriter;
+
+// Linux's usbmon shows every URB on a bus, whichever program sent it. Its binary interface
+// gives each event as a 64 byte header, then for isochronous transfers a 16 byte descriptor
+// per packet, then as much of the data as it captured.
+static const size_t USBMON_HEADER_SIZE = 64;
+static const size_t USBMON_ISO_DESCRIPTOR_SIZE = 16;
+
+enum class UsbMonEventType : char
+{
+	Submit = 'S',
+	Complete = 'C',
+	Error = 'E',
+};
+
+struct UsbMonIsoDescriptor
+{
+	int32_t status = 0;
+	// Where the packet's data is, from the start of the data.
+	uint32_t offset = 0;
+	uint32_t length = 0;
+};
+
+// One decoded usbmon event. Every field of the header is kept, so it can be encoded again
+// exactly.
+struct UsbMonRecord
+{
+	// The URB's kernel address, so a completion can be matched with its submission.
+	uint64_t id = 0;
+	UsbMonEventType type = UsbMonEventType::Submit;
+	EndpointInfo::Type transferType = EndpointInfo::Type::Control;
+	// The endpoint address, including 0x80 for IN.
+	uint8_t endpoint = 0;
+	uint8_t deviceAddress = 0;
+	uint16_t bus = 0;
+	// Wall clock time, to the microsecond.
+	uint64_t timestampNs = 0;
+	// 0, or a negative errno. -EINPROGRESS (-115) on submission.
+	int32_t status = 0;
+	// The length of the URB: requested on submission, transferred on completion.
+	uint32_t urbLength = 0;
+
+	// 0 if `setup` holds a setup packet, otherwise why not ('-' if it isn't a control
+	// submission).
+	char setupFlag = '-';
+	// 0 if the data was captured, otherwise why not ('<' for data still to be received, '>'
+	// for an OUT completion, 'Z' if there is none).
+	char dataFlag = 'Z';
+	// The setup packet for control submissions. For isochronous transfers usbmon puts the
+	// error and descriptor counts here instead; see isoErrorCount() and isoPacketCount().
+	std::array<uint8_t, 8> setup{};
+
+	int32_t interval = 0;
+	int32_t startFrame = 0;
+	// The URB's transfer_flags.
+	uint32_t transferFlags = 0;
+
+	std::vector<UsbMonIsoDescriptor> isoDescriptors;
+	// What usbmon captured of the data. It is truncated for large transfers.
+	std::vector<uint8_t> data;
+
+	bool hasSetup() const { return setupFlag == 0; }
+	bool isIn() const { return (endpoint & 0x80) != 0; }
+	int32_t isoErrorCount() const;
+	int32_t isoPacketCount() const;
+
+	// The header's len_cap: the descriptors and data that follow it.
+	uint32_t capturedLength() const
+	{
+		return static_cast<uint32_t>(isoDescriptors.size() * USBMON_ISO_DESCRIPTOR_SIZE + data.size());
+	}
+};
+
+// Decode the event at the start of `data`. `size` may include whatever follows it.
+SResult<UsbMonRecord> DecodeUsbMonEvent(const uint8_t* data, size_t size);
+
+// The inverse of DecodeUsbMonEvent(), e.g. to write a record to a pcapng file.
+std::vector<uint8_t> EncodeUsbMonEvent(const UsbMonRecord& record);
+
+// Write a record as a LINKTYPE_USB_LINUX_MMAPPED packet.
+SResult<void> WriteUsbMonRecord(PcapngWriter& writer, const UsbMonRecord& record);
+
+struct UsbMonStats
+{
+	uint64_t events = 0;
+	// Events the kernel dropped because our ring was full.
+	uint64_t kernelDropped = 0;
+	// Events we couldn't decode.
+	uint64_t malformed = 0;
+	// Batches fetched, so events / batches is how many each syscall got.
+	uint64_t batches = 0;
+};
+
+// A running summary of the traffic, for showing rather than storing every event.
+struct UsbMonTotals
+{
+	uint64_t submissions = 0;
+	uint64_t completions = 0;
+	// Error events, and completions with a non-zero status.
+	uint64_t errors = 0;
+	// The lengths of the completed URBs.
+	uint64_t bytes = 0;
+};
+
+// Add `records` to `totals`.
+void AddUsbMonTotals(const std::vector<UsbMonRecord>& records, UsbMonTotals& totals);
+
+// Decode the events that MON_IOCX_MFETCH pointed at in a usbmon ring. `offsets` are from the
+// start of `ring`. The filler events usbmon uses to avoid wrapping are skipped.
+void DecodeUsbMonBatch(const uint8_t* ring, size_t ringSize, const uint32_t* offsets, size_t count,
+                       std::vector<UsbMonRecord>& records, UsbMonStats& stats);
+
+// Reads every event on one bus (or all of them) from /dev/usbmonN, which needs root or
+// read access to the device node and the usbmon module loaded. The kernel's ring is mapped
+// into our memory, and each MON_IOCX_MFETCH call frees the last batch and waits for the
+// next, so there is one syscall per batch rather than per event.
+//
+// Only Linux has usbmon; start() fails elsewhere.
+class UsbMonSniffer
+{
+public:
+	// Called on the sniffer's thread with each batch, in order.
+	typedef std::function<void(const std::vector<UsbMonRecord>& records)> RecordsCallback;
+
+	// `bus` is 0 for all buses. `ringSize` is the kernel's ring, or 0 for its default
+	// (300 kB); make it bigger if events are dropped.
+	static SResult<std::shared_ptr<UsbMonSniffer>> start(int bus, RecordsCallback callback, size_t ringSize = 0);
+
+	~UsbMonSniffer();
+
+	// Stop reading. The callback isn't called after this returns.
+	void stop();
+
+	UsbMonStats stats() const;
+
+private:
+	UsbMonSniffer() = default;
+	UsbMonSniffer(const UsbMonSniffer&) = delete;
+	UsbMonSniffer& operator=(const UsbMonSniffer&) = delete;
+
+	void run();
+
+	// The most events to fetch in one call.
+	static const int MAX_BATCH = 256;
+
+	int mFd = -1;
+	const uint8_t* mRing = nullptr;
+	size_t mRingSize = 0;
+	RecordsCallback mCallback;
+
+	std::thread mThread;
+	std::atomic_bool mQuit{false};
+
+	std::atomic<uint64_t> mEvents{0};
+	std::atomic<uint64_t> mKernelDropped{0};
+	std::atomic<uint64_t> mMalformed{0};
+	std::atomic<uint64_t> mBatches{0};
+};
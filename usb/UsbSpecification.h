@@ -14,6 +14,8 @@
 #define USB_DEVICE_QUALIFIER_DESCRIPTOR_TYPE                0x06
 #define USB_OTHER_SPEED_CONFIGURATION_DESCRIPTOR_TYPE       0x07
 #define USB_INTERFACE_POWER_DESCRIPTOR_TYPE                 0x08
+// USB 3.0: 9.4 Standard Device Requests, Table 9-6. Descriptor Types
+#define USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE   0x30
 
 // USB 2.0: 9.6.1 Device, Table 9-8. Standard Device Descriptor
 struct UsbDeviceDescriptor {
@@ -74,6 +76,16 @@ struct UsbEndpointDescriptor {
 	uint8_t   bInterval;
 };
 
+// USB 3.0: 9.6.7 SuperSpeed Endpoint Companion, Table 9-20. It follows each endpoint
+// descriptor of a SuperSpeed device.
+struct UsbSuperSpeedEndpointCompanionDescriptor {
+	uint8_t   bLength;
+	uint8_t   bDescriptorType;
+	uint8_t   bMaxBurst;
+	uint8_t   bmAttributes;
+	uint16_t  wBytesPerInterval;
+};
+
 // USB 2.0:	9.4 Standard Device Requests, Table 9-4. Standard Request Codes
 #define USB_GET_STATUS_REQUEST                 0x00
 #define USB_CLEAR_FEATURE_REQUEST              0x01
@@ -87,4 +99,38 @@ struct UsbEndpointDescriptor {
 #define USB_SET_INTERFACE_REQUEST              0x0B
 #define USB_SYNCH_FRAME_REQUEST                0x0C
 
+// DFU 1.1: 4.1.3 Run-Time DFU Functional Descriptor, Table 4.2. It follows the DFU
+// interface descriptor. DFU 1.0 devices omit bcdDFUVersion, so bLength may be 7.
+struct UsbDfuFunctionalDescriptor {
+	uint8_t   bLength;
+	uint8_t   bDescriptorType;
+	uint8_t   bmAttributes;
+	uint16_t  wDetachTimeOut;
+	uint16_t  wTransferSize;
+	uint16_t  bcdDFUVersion;
+};
+
+#define USB_DFU_FUNCTIONAL_DESCRIPTOR_TYPE     0x21
+
+// DFU 1.1: 4.2.1 The DFU interface class and subclass.
+#define USB_DFU_INTERFACE_CLASS                0xFE
+#define USB_DFU_INTERFACE_SUBCLASS             0x01
+
+// DFU 1.1: 3. Requests, Table 3.2. DFU Class-Specific Request Values
+#define USB_DFU_DETACH_REQUEST                 0x00
+#define USB_DFU_DNLOAD_REQUEST                 0x01
+#define USB_DFU_UPLOAD_REQUEST                 0x02
+#define USB_DFU_GETSTATUS_REQUEST              0x03
+#define USB_DFU_CLRSTATUS_REQUEST              0x04
+#define USB_DFU_GETSTATE_REQUEST               0x05
+#define USB_DFU_ABORT_REQUEST                  0x06
+
+// DFU 1.1: 6.1.2 DFU_GETSTATUS Request. The response is 6 bytes.
+struct UsbDfuStatus {
+	uint8_t   bStatus;
+	uint8_t   bwPollTimeout[3]; // 24 bit little endian.
+	uint8_t   bState;
+	uint8_t   iString;
+};
+
 #pragma pack(pop)
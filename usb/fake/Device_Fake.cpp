@@ -0,0 +1,464 @@
+#if defined(USBTOOL_FAKE_USB)
+
+#include "../Device.h"
+#include "../EndpointInfo.h"
+#include "FakeUsbDevice.h"
+#include "FakePipes.h"
+
+#include "util/EnumCasts.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+using std::string;
+
+// Device fake implementation. The pipes themselves are in FakePipes.cpp.
+
+bool Device::isOpen() const
+{
+	return data.fake != nullptr;
+}
+
+void Device::close()
+{
+	data.fake.reset();
+	data.controlPipe.reset();
+	std::unique_lock<std::mutex> lock(data.isochPipesMutex);
+	data.isochPipes.clear();
+}
+
+SResult<Device::Speed> Device::speed() const
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	return Ok(data.fake->speed());
+}
+
+// Submit a control request on the device's control pipe.
+static SResult<UsbTransferHandle> SubmitControl(UsbDeviceData& data,
+                                                const std::shared_ptr<EndpointCounters>& counters,
+                                                uint8_t bmRequestType,
+                                                uint8_t bRequest,
+                                                uint16_t wValue,
+                                                uint16_t wIndex,
+                                                uint16_t wLength,
+                                                std::vector<uint8_t> dat,
+                                                uint32_t timeoutMs)
+{
+	FakeSetup setup;
+	setup.bmRequestType = bmRequestType;
+	setup.bRequest = bRequest;
+	setup.wValue = wValue;
+	setup.wIndex = wIndex;
+	setup.wLength = wLength;
+
+	UsbTransferHandle transfer;
+	transfer.state = std::make_shared<FakeTransferState>();
+	transfer.state->counters = counters;
+	transfer.state->endpointAddress = bmRequestType & 0x80;
+	transfer.buffer = std::make_shared<std::vector<uint8_t>>(setup.in() ? wLength : 0);
+	transfer.pipe = data.controlPipe;
+
+	counters->submitted(transfer.state->endpointAddress);
+	data.controlPipe->submit(setup, std::move(dat), transfer.buffer, transfer.state, timeoutMs);
+	return Ok(transfer);
+}
+
+SResult<std::vector<uint8_t>> Device::controlTransferInSync(Device::Recipient recipient,
+                                                           Device::Type type,
+                                                           uint8_t bRequest,
+                                                           uint16_t wValue,
+                                                           uint16_t wIndex,
+                                                           uint16_t wLength,
+                                                           uint32_t timeoutMs)
+{
+	UsbTransferHandle transfer = TRY(controlTransferIn(recipient, type, bRequest, wValue, wIndex, wLength, timeoutMs));
+	return transfer.result(true);
+}
+
+SResult<void> Device::controlTransferOutSync(Device::Recipient recipient,
+                                             Device::Type type,
+                                             uint8_t bRequest,
+                                             uint16_t wValue,
+                                             uint16_t wIndex,
+                                             std::vector<uint8_t> dat,
+                                             uint32_t timeoutMs)
+{
+	size_t size = dat.size();
+	UsbTransferHandle transfer = TRY(controlTransferOut(recipient, type, bRequest, wValue, wIndex, std::move(dat), timeoutMs));
+	TRY(transfer.result(true));
+
+	if (static_cast<size_t>(transfer.state->transferred) != size)
+		return Err("Error sending control transfer: Sent " + std::to_string(transfer.state->transferred) + " of " + std::to_string(size) + " bytes");
+	return Ok();
+}
+
+SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient,
+                                                     Device::Type type,
+                                                     uint8_t bRequest,
+                                                     uint16_t wValue,
+                                                     uint16_t wIndex,
+                                                     uint16_t wLength,
+                                                     uint32_t timeoutMs)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+
+	uint8_t bmRequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::In);
+	return SubmitControl(data, counters, bmRequestType, bRequest, wValue, wIndex, wLength, std::vector<uint8_t>(), timeoutMs);
+}
+
+SResult<UsbTransferHandle> Device::controlTransferOut(Device::Recipient recipient,
+                                                      Device::Type type,
+                                                      uint8_t bRequest,
+                                                      uint16_t wValue,
+                                                      uint16_t wIndex,
+                                                      std::vector<uint8_t> dat,
+                                                      uint32_t timeoutMs)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+
+	if (dat.size() > 0xFFFF)
+		return Err(string("Data too long for transfer"));
+
+	uint8_t bmRequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::Out);
+	uint16_t wLength = static_cast<uint16_t>(dat.size());
+	return SubmitControl(data, counters, bmRequestType, bRequest, wValue, wIndex, wLength, std::move(dat), timeoutMs);
+}
+
+SResult<void> Device::abortPipe(int, uint8_t endpointAddress)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+
+	if ((endpointAddress & 0x0F) == 0)
+	{
+		data.controlPipe->abort();
+		return Ok();
+	}
+
+	std::unique_lock<std::mutex> lock(data.isochPipesMutex);
+	for (auto& pipe : data.isochPipes)
+	{
+		if (pipe.first == endpointAddress)
+		{
+			pipe.second->abort();
+			return Ok();
+		}
+	}
+	return Err("Pipe for endpoint address " + std::to_string(endpointAddress) + " not found");
+}
+
+// Find an endpoint in the current alternate setting of the iface'th interface.
+static SResult<EndpointDescriptor> FindEndpoint(const UsbDeviceData& data, int iface, uint8_t endpointAddress)
+{
+	if (data.descriptors.configurations.empty())
+		return Err(string("Device has no configurations"));
+	if (iface < 0 || iface >= static_cast<int>(data.alternates.size()))
+		return Err("Interface " + std::to_string(iface) + " out of range " + std::to_string(data.alternates.size()));
+
+	// Interfaces are numbered in the order they first appear, as on OSX.
+	std::vector<uint8_t> numbers;
+	for (const InterfaceDescriptor& i : data.descriptors.configurations[0].interfaces)
+		if (std::find(numbers.begin(), numbers.end(), i.bInterfaceNumber) == numbers.end())
+			numbers.push_back(i.bInterfaceNumber);
+
+	for (const InterfaceDescriptor& i : data.descriptors.configurations[0].interfaces)
+	{
+		if (i.bInterfaceNumber != numbers[iface] || i.bAlternateSetting != data.alternates[iface])
+			continue;
+		for (const EndpointDescriptor& ep : i.endpoints)
+			if (ep.bEndpointAddress == endpointAddress)
+				return Ok(ep);
+	}
+	return Err("No pipe for endpoint address " + std::to_string(endpointAddress));
+}
+
+static SResult<std::shared_ptr<FakeIsochPipe>> IsochPipeFor(UsbDeviceData& data, uint8_t endpointAddress)
+{
+	std::unique_lock<std::mutex> lock(data.isochPipesMutex);
+	for (auto& pipe : data.isochPipes)
+		if (pipe.first == endpointAddress)
+			return Ok(pipe.second);
+
+	auto pipe = std::make_shared<FakeIsochPipe>(data.fake, endpointAddress);
+	data.isochPipes.push_back(std::make_pair(endpointAddress, pipe));
+	return Ok(pipe);
+}
+
+// The frame list entries per 1 ms frame, checking that `numFrames` is a multiple of it.
+static SResult<int> EntriesPerFrame(UsbDeviceData& data, int iface, uint8_t endpointAddress, int numFrames)
+{
+	EndpointDescriptor desc = TRY(FindEndpoint(data, iface, endpointAddress));
+	EndpointInfo info = EndpointInfo::from(desc);
+	if (info.type != EndpointInfo::Type::Isochronous)
+		return Err("Endpoint " + std::to_string(endpointAddress) + " isn't isochronous");
+
+	Device::Speed speed = data.fake->speed();
+	int entriesPerFrame = info.packetsPerFrame(speed == Device::Speed::High);
+	if (numFrames <= 0 || numFrames % entriesPerFrame != 0)
+		return Err("Isochronous transfers on endpoint " + std::to_string(endpointAddress) + " need a multiple of " +
+		           std::to_string(entriesPerFrame) + " frame list entries");
+	return Ok(entriesPerFrame);
+}
+
+SResult<IsochReadBuffer> Device::createIsochReadBuffer(int iface, uint8_t endpointAddress, int numFrames, int bytesPerFrame)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+
+	IsochReadBuffer buffer;
+	buffer.entriesPerFrame = TRY(EntriesPerFrame(data, iface, endpointAddress, numFrames));
+	buffer.pipe = TRY(IsochPipeFor(data, endpointAddress));
+	buffer.buffer = std::make_shared<std::vector<uint8_t>>(numFrames * bytesPerFrame);
+	buffer.frames = std::make_shared<std::vector<IsochFrameResult>>(numFrames);
+	buffer.endpointAddress = endpointAddress;
+	buffer.numFrames = numFrames;
+	buffer.bytesPerFrame = bytesPerFrame;
+	return Ok(buffer);
+}
+
+SResult<IsochWriteBuffer> Device::createIsochWriteBuffer(int iface, uint8_t endpointAddress, int numFrames, int bytesPerFrame)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+
+	IsochWriteBuffer buffer;
+	buffer.entriesPerFrame = TRY(EntriesPerFrame(data, iface, endpointAddress, numFrames));
+	buffer.pipe = TRY(IsochPipeFor(data, endpointAddress));
+	buffer.buffer = std::make_shared<std::vector<uint8_t>>(numFrames * bytesPerFrame);
+	buffer.frames = std::make_shared<std::vector<IsochFrameResult>>(numFrames);
+	buffer.endpointAddress = endpointAddress;
+	buffer.numFrames = numFrames;
+	buffer.bytesPerFrame = bytesPerFrame;
+	return Ok(buffer);
+}
+
+static SResult<UsbIsochTransferHandle> SubmitIsoch(const std::shared_ptr<EndpointCounters>& counters,
+                                                   const FakeIsochTransfer& t,
+                                                   const std::shared_ptr<FakeIsochPipe>& pipe,
+                                                   bool asap,
+                                                   bool continueStream,
+                                                   uint64_t frame)
+{
+	if (!pipe)
+		return Err(string("Invalid isochronous buffer"));
+
+	UsbIsochTransferHandle transfer;
+	transfer.state = t.state;
+	transfer.pipe = pipe;
+	transfer.state->counters = counters;
+	transfer.state->endpointAddress = t.endpointAddress;
+
+	counters->submitted(t.endpointAddress);
+	SResult<void> res = pipe->submit(t, asap, continueStream, frame);
+	if (!res)
+	{
+		std::unique_lock<std::mutex> lock(t.state->mutex);
+		t.state->complete(false, TransferError::Other, res.unwrap_err(), 0);
+		return Err(res.unwrap_err());
+	}
+	return Ok(transfer);
+}
+
+static FakeIsochTransfer MakeOutTransfer(const IsochWriteBuffer& buffer)
+{
+	FakeIsochTransfer t;
+	t.state = std::make_shared<FakeTransferState>();
+	t.in = false;
+	t.endpointAddress = buffer.endpointAddress;
+	t.buffer = buffer.buffer;
+	t.frames = buffer.frames;
+	t.numFrames = buffer.numFrames;
+	t.bytesPerFrame = buffer.bytesPerFrame;
+	t.entriesPerFrame = buffer.entriesPerFrame;
+	t.frameLengths = buffer.frameLengths;
+	return t;
+}
+
+static FakeIsochTransfer MakeInTransfer(const IsochReadBuffer& buffer)
+{
+	FakeIsochTransfer t;
+	t.state = std::make_shared<FakeTransferState>();
+	t.in = true;
+	t.endpointAddress = buffer.endpointAddress;
+	t.buffer = buffer.buffer;
+	t.frames = buffer.frames;
+	t.numFrames = buffer.numFrames;
+	t.bytesPerFrame = buffer.bytesPerFrame;
+	t.entriesPerFrame = buffer.entriesPerFrame;
+	return t;
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoOutTransferAsap(const IsochWriteBuffer& buffer, bool continueStream)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	return SubmitIsoch(counters, MakeOutTransfer(buffer), buffer.pipe, true, continueStream, 0);
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoOutTransfer(const IsochWriteBuffer& buffer, uint64_t frame)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	return SubmitIsoch(counters, MakeOutTransfer(buffer), buffer.pipe, false, false, frame);
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoInTransferAsap(const IsochReadBuffer& buffer, bool continueStream)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	return SubmitIsoch(counters, MakeInTransfer(buffer), buffer.pipe, true, continueStream, 0);
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoInTransfer(const IsochReadBuffer& buffer, uint64_t frame)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	return SubmitIsoch(counters, MakeInTransfer(buffer), buffer.pipe, false, false, frame);
+}
+
+uint64_t Device::getBusFrameNumber()
+{
+	if (!isOpen())
+		return 0;
+	return data.fake->busMicroframe() / 8;
+}
+
+uint64_t Device::getBusMicroframeNumber()
+{
+	if (!isOpen())
+		return 0;
+
+	Speed speed = data.fake->speed();
+	if (speed == Speed::Low || speed == Speed::Full)
+		return getBusFrameNumber() * 8;
+	return data.fake->busMicroframe();
+}
+
+SResult<void> Device::setCallbackThreadPolicy(const ThreadPolicy&)
+{
+	// Transfers complete on the pipes' own threads, which are only for testing.
+	return Ok();
+}
+
+int Device::numInterfaces()
+{
+	if (!isOpen())
+		return 0;
+	return static_cast<int>(data.alternates.size());
+}
+
+SResult<void> Device::setAlternate(int iface, uint8_t alternate)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	if (iface < 0 || iface >= static_cast<int>(data.alternates.size()))
+		return Err("Interface " + std::to_string(iface) + " out of range " + std::to_string(data.alternates.size()));
+
+	data.alternates[iface] = alternate;
+	return Ok();
+}
+
+SResult<std::vector<uint8_t>> UsbTransferHandle::result(bool block)
+{
+	if (!state)
+		return Err(string("Transfer not started"));
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	if (block)
+		state->condition.wait(lock, [&] { return state->done; });
+
+	if (!state->done)
+		return Err(string("Transfer not finished."));
+	if (!state->ok)
+		return Err("Transfer error: " + state->message);
+
+	// We may have received less data than requested.
+	std::vector<uint8_t> data = *buffer;
+	data.resize(state->transferred);
+	return Ok(data);
+}
+
+SResult<std::vector<uint8_t>> UsbTransferHandle::resultWithin(uint32_t timeoutMs)
+{
+	if (!state)
+		return Err(string("Transfer not started"));
+
+	{
+		std::unique_lock<std::mutex> lock(state->mutex);
+		if (!state->condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return state->done; }))
+		{
+			state->timedOut = true;
+			lock.unlock();
+
+			cancel();
+			result(true);
+			return Err("Transfer timed out after " + std::to_string(timeoutMs) + " ms");
+		}
+	}
+	return result(false);
+}
+
+SResult<void> UsbTransferHandle::cancel()
+{
+	if (!state || !pipe)
+		return Err(string("Transfer not started"));
+	pipe->cancel(state);
+	return Ok();
+}
+
+SResult<int> UsbIsochTransferHandle::result(bool block)
+{
+	if (!state)
+		return Err(string("Transfer not started"));
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	if (block)
+		state->condition.wait(lock, [&] { return state->done; });
+
+	if (!state->done)
+		return Err(string("Transfer not finished."));
+	if (!state->ok)
+		return Err("Isoch transfer error: " + state->message);
+	return Ok(state->transferred);
+}
+
+SResult<int> UsbIsochTransferHandle::resultWithin(uint32_t timeoutMs)
+{
+	if (!state)
+		return Err(string("Transfer not started"));
+
+	{
+		std::unique_lock<std::mutex> lock(state->mutex);
+		if (!state->condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return state->done; }))
+		{
+			state->timedOut = true;
+			lock.unlock();
+
+			cancel();
+			result(true);
+			return Err("Isoch transfer timed out after " + std::to_string(timeoutMs) + " ms");
+		}
+	}
+	return result(false);
+}
+
+SResult<void> UsbIsochTransferHandle::cancel()
+{
+	if (!state || !pipe)
+		return Err(string("Transfer not started"));
+	pipe->abort();
+	return Ok();
+}
+
+IsochFrameResult IsochReadBuffer::frameResult(int frame) const
+{
+	if (!frames || frame < 0 || frame >= numFrames)
+		return IsochFrameResult();
+	return (*frames)[frame];
+}
+
+#endif
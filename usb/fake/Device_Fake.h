@@ -0,0 +1,150 @@
+#pragma once
+
+#if defined(USBTOOL_FAKE_USB)
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../DeviceId.h"
+#include "../Descriptors.h"
+#include "../DescriptorCache.h"
+#include "../EndpointCounters.h"
+#include "../IsochFrame.h"
+
+// The in-process backend used by the tests. Devices are simulated by FakeUsbDevice objects
+// (see FakeUsbDevice.h) instead of being real hardware, so the code above Device can be run
+// anywhere, including against devices that hang, stall or drift.
+
+class FakeUsbDevice;
+class FakeControlPipe;
+class FakeIsochPipe;
+
+// The state of one transfer, shared by its handle and the pipe that completes it.
+struct FakeTransferState
+{
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	bool done = false;
+	// Whether it completed successfully, and if not why.
+	bool ok = false;
+	TransferError error = TransferError::Other;
+	std::string message;
+	int transferred = 0;
+	// Set by cancel() and abortPipe(); the pipe completes it with TransferError::Cancelled.
+	bool cancelled = false;
+	// Set if resultWithin() cancelled the transfer, so it is counted as a timeout.
+	bool timedOut = false;
+
+	std::shared_ptr<EndpointCounters> counters;
+	uint8_t endpointAddress = 0;
+
+	// Complete the transfer and update the counters. `mutex` must be locked.
+	void complete(bool success, TransferError err, const std::string& msg, int bytes);
+};
+
+class IsochReadBuffer
+{
+public:
+	const uint8_t* data() const { return buffer ? buffer->data() : nullptr; }
+	int size() const { return bytesPerFrame * numFrames; }
+
+	// After the transfer has completed, the result of frame `frame`. Its data is at
+	// data() + frame * bytesPerFrame.
+	IsochFrameResult frameResult(int frame) const;
+
+// private:
+	std::shared_ptr<std::vector<uint8_t>> buffer;
+	std::shared_ptr<std::vector<IsochFrameResult>> frames;
+	std::shared_ptr<FakeIsochPipe> pipe;
+	uint8_t endpointAddress = 0;
+	int numFrames = 0;
+	int bytesPerFrame = 0;
+	int entriesPerFrame = 1;
+};
+
+class IsochWriteBuffer
+{
+public:
+	uint8_t* data() { return buffer ? buffer->data() : nullptr; }
+	int size() { return bytesPerFrame * numFrames; }
+
+// private:
+	std::shared_ptr<std::vector<uint8_t>> buffer;
+	std::shared_ptr<std::vector<IsochFrameResult>> frames;
+	std::shared_ptr<FakeIsochPipe> pipe;
+	uint8_t endpointAddress = 0;
+	int numFrames = 0;
+	int bytesPerFrame = 0;
+	int entriesPerFrame = 1;
+	// If not empty, the length of each frame list entry, at most bytesPerFrame. Their data is
+	// then packed back to back rather than bytesPerFrame apart. Empty means all bytesPerFrame.
+	std::vector<int> frameLengths;
+};
+
+// Handle to an asynchronous normal pipe operation.
+class UsbTransferHandle
+{
+	friend class Device;
+public:
+	SResult<std::vector<uint8_t>> result(bool block = true);
+
+	// Wait at most `timeoutMs` for the result. If the transfer still hasn't finished
+	// it is cancelled and this returns an error.
+	SResult<std::vector<uint8_t>> resultWithin(uint32_t timeoutMs);
+
+	// Cancel the transfer if it hasn't finished.
+	SResult<void> cancel();
+
+// private:
+	std::shared_ptr<FakeTransferState> state;
+	std::shared_ptr<std::vector<uint8_t>> buffer;
+	std::shared_ptr<FakeControlPipe> pipe;
+};
+
+class UsbIsochTransferHandle
+{
+	friend class Device;
+public:
+	// Returns bytes transferred on success (the sum of the frame list's actual counts).
+	SResult<int> result(bool block = true);
+
+	// Wait at most `timeoutMs` for the result. If the transfer still hasn't finished
+	// it is cancelled and this returns an error.
+	SResult<int> resultWithin(uint32_t timeoutMs);
+
+	// Cancel the transfer if it hasn't finished. Like AbortPipe() this cancels the later
+	// transfers queued on the pipe too.
+	SResult<void> cancel();
+
+// private:
+	std::shared_ptr<FakeTransferState> state;
+	std::shared_ptr<FakeIsochPipe> pipe;
+};
+
+struct UsbDeviceData
+{
+	// The device address.
+	DeviceId address;
+
+	// What is being simulated, and the threads that simulate its pipes. The pipes are shared
+	// with transfer handles so they outlive the Device while transfers are running.
+	std::shared_ptr<FakeUsbDevice> fake;
+	std::shared_ptr<FakeControlPipe> controlPipe;
+	// Isochronous pipes by endpoint address, created when a buffer is first made for them.
+	std::mutex isochPipesMutex;
+	std::vector<std::pair<uint8_t, std::shared_ptr<FakeIsochPipe>>> isochPipes;
+
+	// Cached.
+	DeviceDescriptor descriptors;
+
+	// Where `descriptors` is stored in the DescriptorCache.
+	DescriptorCacheKey descriptorCacheKey;
+
+	// The configuration's current alternate settings, by interface index.
+	std::vector<uint8_t> alternates;
+};
+
+#endif
@@ -0,0 +1,266 @@
+#if defined(USBTOOL_FAKE_USB)
+
+#include "../Discovery.h"
+#include "FakeUsbDevice.h"
+#include "FakePipes.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string.h>
+
+using std::string;
+
+namespace
+{
+std::mutex registryMutex;
+std::map<string, std::shared_ptr<FakeUsbDevice>> registry;
+
+std::shared_ptr<FakeUsbDevice> FindFake(const string& path)
+{
+	std::unique_lock<std::mutex> lock(registryMutex);
+	auto it = registry.find(path);
+	return it == registry.end() ? nullptr : it->second;
+}
+}
+
+FakeControlReply FakeControlReply::ok(std::vector<uint8_t> data, uint32_t delayMs)
+{
+	FakeControlReply r;
+	r.data = std::move(data);
+	r.delayMs = delayMs;
+	return r;
+}
+
+FakeControlReply FakeControlReply::stall()
+{
+	FakeControlReply r;
+	r.outcome = Outcome::Stall;
+	return r;
+}
+
+FakeControlReply FakeControlReply::hang()
+{
+	FakeControlReply r;
+	r.outcome = Outcome::Hang;
+	return r;
+}
+
+FakeUsbDevice::FakeUsbDevice() : mCreated(HighResClock::now())
+{
+}
+
+std::vector<uint8_t> FakeUsbDevice::stringDescriptor(uint8_t index, uint16_t)
+{
+	if (index == 0)
+		return std::vector<uint8_t>{4, USB_STRING_DESCRIPTOR_TYPE, 0x09, 0x04};
+
+	// The device descriptor's string indices.
+	std::vector<uint8_t> dev = deviceDescriptor();
+	if (dev.size() < sizeof(UsbDeviceDescriptor))
+		return std::vector<uint8_t>();
+	UsbDeviceDescriptor d;
+	memcpy(&d, dev.data(), sizeof(d));
+	if (index == d.iManufacturer)
+		return MakeFakeStringDescriptor(manufacturer());
+	if (index == d.iProduct)
+		return MakeFakeStringDescriptor(product());
+	if (index == d.iSerialNumber)
+		return MakeFakeStringDescriptor(serial());
+	return std::vector<uint8_t>();
+}
+
+FakeControlReply FakeUsbDevice::control(const FakeSetup&, const std::vector<uint8_t>&)
+{
+	return FakeControlReply::stall();
+}
+
+uint64_t FakeUsbDevice::busMicroframe()
+{
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(HighResClock::now() - mCreated);
+	return static_cast<uint64_t>(elapsed.count() / 125000);
+}
+
+void AddFakeUsbDevice(const string& path, std::shared_ptr<FakeUsbDevice> device)
+{
+	std::unique_lock<std::mutex> lock(registryMutex);
+	registry[path] = device;
+}
+
+void RemoveFakeUsbDevice(const string& path)
+{
+	std::unique_lock<std::mutex> lock(registryMutex);
+	registry.erase(path);
+}
+
+std::vector<uint8_t> MakeFakeDeviceDescriptor(uint16_t idVendor, uint16_t idProduct, uint16_t bcdDevice,
+                                              uint8_t iManufacturer, uint8_t iProduct, uint8_t iSerialNumber)
+{
+	UsbDeviceDescriptor d;
+	memset(&d, 0, sizeof(d));
+	d.bLength = sizeof(d);
+	d.bDescriptorType = USB_DEVICE_DESCRIPTOR_TYPE;
+	d.bcdUSB = 0x0200;
+	d.bMaxPacketSize0 = 64;
+	d.idVendor = idVendor;
+	d.idProduct = idProduct;
+	d.bcdDevice = bcdDevice;
+	d.iManufacturer = iManufacturer;
+	d.iProduct = iProduct;
+	d.iSerialNumber = iSerialNumber;
+	d.bNumConfigurations = 1;
+
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(&d);
+	return std::vector<uint8_t>(p, p + sizeof(d));
+}
+
+std::vector<uint8_t> MakeFakeStringDescriptor(const string& ascii)
+{
+	std::vector<uint8_t> s{static_cast<uint8_t>(2 + ascii.size() * 2), USB_STRING_DESCRIPTOR_TYPE};
+	for (char c : ascii)
+	{
+		s.push_back(static_cast<uint8_t>(c));
+		s.push_back(0);
+	}
+	return s;
+}
+
+SResult<std::vector<DeviceInfo>> EnumerateAvailableDevices()
+{
+	std::vector<std::pair<string, std::shared_ptr<FakeUsbDevice>>> fakes;
+	{
+		std::unique_lock<std::mutex> lock(registryMutex);
+		fakes.assign(registry.begin(), registry.end());
+	}
+
+	std::vector<DeviceInfo> devices;
+	for (auto& fake : fakes)
+	{
+		std::vector<uint8_t> raw = fake.second->deviceDescriptor();
+		if (raw.size() < sizeof(UsbDeviceDescriptor))
+			continue;
+		UsbDeviceDescriptor d;
+		memcpy(&d, raw.data(), sizeof(d));
+
+		// The OS reports these without any bus traffic.
+		DeviceInfo info;
+		info.id.path = fake.first;
+		info.manufacturer = fake.second->manufacturer();
+		info.product = fake.second->product();
+		info.serial = fake.second->serial();
+		info.vendorId = d.idVendor;
+		info.productId = d.idProduct;
+		devices.push_back(info);
+	}
+	return Ok(devices);
+}
+
+// Read the descriptors over the control pipe, as WinUsb_GetDescriptor() does.
+static SResult<DeviceDescriptor> ReadDescriptors(Device& dev, const DescriptorCacheKey& key)
+{
+	SResult<DeviceDescriptor> cached = DescriptorCache::global().lookup(key);
+	if (cached)
+		return cached;
+
+	std::vector<uint8_t> raw(key.deviceDescriptor.begin(), key.deviceDescriptor.end());
+	DeviceDescriptor desc = TRY(ParseDeviceDescriptor(raw));
+
+	for (int index = 0; index < desc.bNumConfigurations; ++index)
+	{
+		std::vector<uint8_t> header = TRY(dev.controlTransferInSync(Device::Recipient::Device,
+		                                                            Device::Type::Standard,
+		                                                            USB_GET_DESCRIPTOR_REQUEST,
+		                                                            (USB_CONFIGURATION_DESCRIPTOR_TYPE << 8) | index,
+		                                                            0,
+		                                                            sizeof(UsbConfigurationDescriptor)));
+		if (header.size() != sizeof(UsbConfigurationDescriptor))
+			return Err("Configuration descriptor " + std::to_string(index) + " is too short");
+
+		UsbConfigurationDescriptor config;
+		memcpy(&config, header.data(), sizeof(config));
+
+		std::vector<uint8_t> buffer = TRY(dev.controlTransferInSync(Device::Recipient::Device,
+		                                                            Device::Type::Standard,
+		                                                            USB_GET_DESCRIPTOR_REQUEST,
+		                                                            (USB_CONFIGURATION_DESCRIPTOR_TYPE << 8) | index,
+		                                                            0,
+		                                                            config.wTotalLength));
+		desc.configurations.push_back(TRY(ParseConfigurationDescriptor(buffer)));
+	}
+
+	DescriptorCache::global().store(key, desc);
+	return Ok(desc);
+}
+
+SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId id)
+{
+	std::shared_ptr<FakeUsbDevice> fake = FindFake(id.path);
+	if (!fake)
+		return Err("No fake device at " + id.path);
+
+	std::shared_ptr<Device> newDev = std::make_shared<Device>();
+	newDev->data.address = id;
+	newDev->data.fake = fake;
+	newDev->data.controlPipe = std::make_shared<FakeControlPipe>(fake);
+
+	std::vector<uint8_t> raw = TRY(newDev->getDescriptor(DescriptorType::Device, 0));
+	if (raw.size() != sizeof(UsbDeviceDescriptor))
+		return Err("Device descriptor is " + std::to_string(raw.size()) + " bytes");
+
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), raw.data(), raw.size());
+	key.serial = fake->serial();
+	newDev->data.descriptorCacheKey = key;
+	newDev->data.descriptors = TRY(ReadDescriptors(*newDev, key));
+
+	// Every interface starts in alternate setting 0.
+	if (!newDev->data.descriptors.configurations.empty())
+		newDev->data.alternates.assign(newDev->data.descriptors.configurations[0].bNumInterfaces, 0);
+
+	return Ok(newDev);
+}
+
+SResult<DeviceDescriptor> ReadUsbDeviceDescriptors(DeviceId id)
+{
+	std::shared_ptr<FakeUsbDevice> fake = FindFake(id.path);
+	if (!fake)
+		return Err("No fake device at " + id.path);
+
+	// The fake's descriptors stand in for the ones the OS read when the device was attached,
+	// so none of this goes through a control pipe.
+	std::vector<uint8_t> raw = fake->deviceDescriptor();
+	if (raw.size() != sizeof(UsbDeviceDescriptor))
+		return Err("Device descriptor is " + std::to_string(raw.size()) + " bytes");
+
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), raw.data(), raw.size());
+	key.serial = fake->serial();
+
+	SResult<DeviceDescriptor> cached = DescriptorCache::global().lookup(key);
+	if (cached && cached.unwrap().stringsRead)
+		return cached;
+
+	DeviceDescriptor desc;
+	if (cached)
+	{
+		desc = cached.unwrap();
+	}
+	else
+	{
+		desc = TRY(ParseDeviceDescriptor(raw));
+		for (const std::vector<uint8_t>& config : fake->configurationDescriptors())
+			desc.configurations.push_back(TRY(ParseConfigurationDescriptor(config)));
+	}
+
+	ReadDescriptorStrings(desc, [&](uint8_t index, uint16_t languageId) -> SResult<std::vector<uint8_t>> {
+		std::vector<uint8_t> s = fake->stringDescriptor(index, languageId);
+		if (s.empty())
+			return Err("No string descriptor " + std::to_string(index));
+		return Ok(s);
+	});
+
+	DescriptorCache::global().store(key, desc);
+	return Ok(desc);
+}
+
+#endif
@@ -0,0 +1,348 @@
+#if defined(USBTOOL_FAKE_USB)
+
+#include "FakePipes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+#include "../UsbSpecification.h"
+
+using std::string;
+
+void FakeTransferState::complete(bool success, TransferError err, const string& msg, int bytes)
+{
+	if (done)
+		return;
+	done = true;
+	ok = success;
+	error = err;
+	message = msg;
+	transferred = bytes;
+
+	if (counters)
+	{
+		if (success)
+			counters->completed(endpointAddress, bytes);
+		else if (timedOut)
+			counters->failed(endpointAddress, TransferError::Timeout);
+		else
+			counters->failed(endpointAddress, err);
+	}
+	condition.notify_all();
+}
+
+FakeControlPipe::FakeControlPipe(std::shared_ptr<FakeUsbDevice> fake) : mFake(fake)
+{
+	mThread = std::thread([this] { run(); });
+}
+
+FakeControlPipe::~FakeControlPipe()
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mQuit = true;
+		++mCancelGeneration;
+	}
+	mCondition.notify_all();
+	mThread.join();
+
+	// Nothing will answer these now.
+	for (Request& r : mQueue)
+	{
+		std::unique_lock<std::mutex> lock(r.state->mutex);
+		r.state->complete(false, TransferError::Cancelled, "Pipe closed", 0);
+	}
+}
+
+void FakeControlPipe::submit(const FakeSetup& setup, std::vector<uint8_t> data, std::shared_ptr<std::vector<uint8_t>> buffer,
+                             std::shared_ptr<FakeTransferState> state, uint32_t timeoutMs)
+{
+	Request r;
+	r.setup = setup;
+	r.data = std::move(data);
+	r.buffer = buffer;
+	r.state = state;
+	r.timeoutMs = timeoutMs;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mQueue.push_back(std::move(r));
+	}
+	mCondition.notify_all();
+}
+
+void FakeControlPipe::cancel(const std::shared_ptr<FakeTransferState>& state)
+{
+	{
+		std::unique_lock<std::mutex> stateLock(state->mutex);
+		state->cancelled = true;
+	}
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		++mCancelGeneration;
+	}
+	mCondition.notify_all();
+}
+
+void FakeControlPipe::abort()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (Request& r : mQueue)
+	{
+		std::unique_lock<std::mutex> stateLock(r.state->mutex);
+		r.state->cancelled = true;
+	}
+	if (mCurrent)
+	{
+		std::unique_lock<std::mutex> stateLock(mCurrent->mutex);
+		mCurrent->cancelled = true;
+	}
+	++mCancelGeneration;
+	mCondition.notify_all();
+}
+
+FakeControlReply FakeControlPipe::reply(const FakeSetup& setup, const std::vector<uint8_t>& data)
+{
+	if (setup.bmRequestType == 0x80 && setup.bRequest == USB_GET_DESCRIPTOR_REQUEST)
+	{
+		uint8_t type = setup.wValue >> 8;
+		uint8_t index = setup.wValue & 0xFF;
+		if (type == USB_DEVICE_DESCRIPTOR_TYPE)
+			return FakeControlReply::ok(mFake->deviceDescriptor());
+		if (type == USB_CONFIGURATION_DESCRIPTOR_TYPE)
+		{
+			std::vector<std::vector<uint8_t>> configs = mFake->configurationDescriptors();
+			if (index >= configs.size())
+				return FakeControlReply::stall();
+			return FakeControlReply::ok(configs[index]);
+		}
+		if (type == USB_STRING_DESCRIPTOR_TYPE)
+		{
+			std::vector<uint8_t> s = mFake->stringDescriptor(index, setup.wIndex);
+			if (s.empty())
+				return FakeControlReply::stall();
+			return FakeControlReply::ok(s);
+		}
+	}
+	return mFake->control(setup, data);
+}
+
+void FakeControlPipe::run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mCondition.wait(lock, [this] { return mQuit || !mQueue.empty(); });
+		if (mQuit)
+			return;
+
+		Request r = mQueue.front();
+		mQueue.pop_front();
+		mCurrent = r.state;
+		auto submitted = std::chrono::steady_clock::now();
+		auto deadline = submitted + std::chrono::milliseconds(r.timeoutMs);
+
+		lock.unlock();
+		FakeControlReply reply;
+		bool cancelled = false;
+		{
+			std::unique_lock<std::mutex> stateLock(r.state->mutex);
+			cancelled = r.state->cancelled;
+		}
+		if (!cancelled)
+			reply = this->reply(r.setup, r.data);
+		lock.lock();
+
+		// Wait for the reply's delay, or forever if it hangs, unless it times out or is
+		// cancelled first.
+		bool hang = reply.outcome == FakeControlReply::Outcome::Hang;
+		auto due = submitted + std::chrono::milliseconds(reply.delayMs);
+		bool timedOut = false;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> stateLock(r.state->mutex);
+				cancelled = r.state->cancelled;
+			}
+			if (cancelled || mQuit)
+				break;
+
+			auto now = std::chrono::steady_clock::now();
+			if (r.timeoutMs != 0 && now >= deadline)
+			{
+				timedOut = true;
+				break;
+			}
+			if (!hang && now >= due)
+				break;
+
+			auto wake = hang ? deadline : std::min(due, r.timeoutMs != 0 ? deadline : due);
+			uint64_t generation = mCancelGeneration;
+			if (hang && r.timeoutMs == 0)
+				mCondition.wait(lock, [&] { return mQuit || mCancelGeneration != generation; });
+			else
+				mCondition.wait_until(lock, wake, [&] { return mQuit || mCancelGeneration != generation; });
+		}
+		mCurrent.reset();
+		lock.unlock();
+
+		{
+			std::unique_lock<std::mutex> stateLock(r.state->mutex);
+			if (cancelled || mQuit)
+			{
+				r.state->complete(false, TransferError::Cancelled, "Transfer aborted", 0);
+			}
+			else if (timedOut)
+			{
+				r.state->timedOut = true;
+				r.state->complete(false, TransferError::Timeout, "Transfer timed out after " + std::to_string(r.timeoutMs) + " ms", 0);
+			}
+			else if (reply.outcome == FakeControlReply::Outcome::Stall)
+			{
+				r.state->complete(false, TransferError::Stall, "Pipe stalled", 0);
+			}
+			else if (r.setup.in())
+			{
+				size_t n = std::min<size_t>(reply.data.size(), r.buffer->size());
+				if (n != 0)
+					memcpy(r.buffer->data(), reply.data.data(), n);
+				r.state->complete(true, TransferError::Other, string(), static_cast<int>(n));
+			}
+			else
+			{
+				r.state->complete(true, TransferError::Other, string(), static_cast<int>(r.data.size()));
+			}
+		}
+		lock.lock();
+	}
+}
+
+const int FakeIsochPipe::POLL_US;
+
+FakeIsochPipe::FakeIsochPipe(std::shared_ptr<FakeUsbDevice> fake, uint8_t endpointAddress)
+	: mFake(fake), mEndpointAddress(endpointAddress)
+{
+	mThread = std::thread([this] { run(); });
+}
+
+FakeIsochPipe::~FakeIsochPipe()
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mCondition.notify_all();
+	mThread.join();
+	abort();
+}
+
+SResult<void> FakeIsochPipe::submit(FakeIsochTransfer transfer, bool asap, bool continueStream, uint64_t frame)
+{
+	uint64_t now = mFake->busMicroframe();
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	uint64_t first = frame * 8;
+	if (asap)
+	{
+		if (mHaveNext && mNextMicroframe >= now)
+			first = mNextMicroframe;
+		else if (continueStream && mHaveNext)
+			return Err(string("Isochronous stream was interrupted"));
+		else
+			first = (now / 8 + 2) * 8;
+	}
+
+	transfer.firstMicroframe = first;
+	transfer.submittedMicroframe = now;
+	mNextMicroframe = first + static_cast<uint64_t>(transfer.numFrames / transfer.entriesPerFrame) * 8;
+	mHaveNext = true;
+	mQueue.push_back(std::move(transfer));
+	mCondition.notify_all();
+	return Ok();
+}
+
+void FakeIsochPipe::abort()
+{
+	std::deque<FakeIsochTransfer> aborted;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		aborted.swap(mQueue);
+		mHaveNext = false;
+	}
+	for (FakeIsochTransfer& t : aborted)
+	{
+		std::unique_lock<std::mutex> stateLock(t.state->mutex);
+		t.state->complete(false, TransferError::Cancelled, "Transfer aborted", 0);
+	}
+}
+
+void FakeIsochPipe::finish(FakeIsochTransfer& t)
+{
+	int interval = 8 / t.entriesPerFrame;
+	bool variable = !t.in && !t.frameLengths.empty();
+	int offset = 0;
+	int transferred = 0;
+	int late = 0;
+	for (int e = 0; e < t.numFrames; ++e)
+	{
+		uint64_t microframe = t.firstMicroframe + static_cast<uint64_t>(e) * interval;
+		int length = variable ? t.frameLengths[e] : t.bytesPerFrame;
+		uint8_t* data = t.buffer->data() + (variable ? offset : e * t.bytesPerFrame);
+		offset += length;
+
+		IsochFrameResult& result = (*t.frames)[e];
+		result = IsochFrameResult();
+		if (microframe < t.submittedMicroframe)
+		{
+			result.error = TransferError::Underrun;
+			++late;
+			continue;
+		}
+
+		if (t.in)
+			result.length = std::max(0, std::min(t.bytesPerFrame, mFake->isochIn(t.endpointAddress, microframe, data, t.bytesPerFrame)));
+		else
+		{
+			mFake->isochOut(t.endpointAddress, microframe, data, length);
+			result.length = length;
+		}
+		result.ok = true;
+		transferred += result.length;
+	}
+
+	std::unique_lock<std::mutex> stateLock(t.state->mutex);
+	if (late != 0 && t.state->counters)
+		t.state->counters->lateIsoFrames(t.endpointAddress, late);
+	t.state->complete(true, TransferError::Other, string(), transferred);
+}
+
+void FakeIsochPipe::run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mCondition.wait_for(lock, std::chrono::microseconds(POLL_US), [this] { return mQuit; });
+		if (mQuit)
+			return;
+		if (mQueue.empty())
+			continue;
+
+		const FakeIsochTransfer& front = mQueue.front();
+		std::shared_ptr<FakeTransferState> state = front.state;
+		uint64_t end = front.firstMicroframe + static_cast<uint64_t>(front.numFrames / front.entriesPerFrame) * 8;
+		lock.unlock();
+		bool due = mFake->busMicroframe() >= end;
+		lock.lock();
+		// It may have been aborted meanwhile.
+		if (!due || mQueue.empty() || mQueue.front().state != state)
+			continue;
+
+		FakeIsochTransfer t = std::move(mQueue.front());
+		mQueue.pop_front();
+		lock.unlock();
+		finish(t);
+		lock.lock();
+	}
+}
+
+#endif
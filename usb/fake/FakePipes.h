@@ -0,0 +1,124 @@
+#pragma once
+
+#if defined(USBTOOL_FAKE_USB)
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "util/Result.h"
+#include "Device_Fake.h"
+#include "FakeUsbDevice.h"
+
+// The default control pipe of a fake device. Requests are answered one at a time on the
+// pipe's own thread, as the device would, so a request that hangs holds up the ones behind it
+// until it times out or is cancelled.
+class FakeControlPipe
+{
+public:
+	explicit FakeControlPipe(std::shared_ptr<FakeUsbDevice> fake);
+	// Cancels everything and joins the thread.
+	~FakeControlPipe();
+
+	// Queue a request. IN data is written to `buffer`. A `timeoutMs` of 0 means none.
+	void submit(const FakeSetup& setup, std::vector<uint8_t> data, std::shared_ptr<std::vector<uint8_t>> buffer,
+	            std::shared_ptr<FakeTransferState> state, uint32_t timeoutMs);
+
+	// Cancel one request, or every request on the pipe.
+	void cancel(const std::shared_ptr<FakeTransferState>& state);
+	void abort();
+
+private:
+	FakeControlPipe(const FakeControlPipe&) = delete;
+	FakeControlPipe& operator=(const FakeControlPipe&) = delete;
+
+	void run();
+	// Answer standard GET_DESCRIPTOR requests from the fake's descriptors.
+	FakeControlReply reply(const FakeSetup& setup, const std::vector<uint8_t>& data);
+
+	struct Request
+	{
+		FakeSetup setup;
+		std::vector<uint8_t> data;
+		std::shared_ptr<std::vector<uint8_t>> buffer;
+		std::shared_ptr<FakeTransferState> state;
+		uint32_t timeoutMs = 0;
+	};
+
+	std::shared_ptr<FakeUsbDevice> mFake;
+
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque<Request> mQueue;
+	// The request being answered.
+	std::shared_ptr<FakeTransferState> mCurrent;
+	// Bumped by cancel() and abort() so the request being answered notices.
+	uint64_t mCancelGeneration = 0;
+	bool mQuit = false;
+	std::thread mThread;
+};
+
+// An isochronous transfer as the pipe sees it.
+struct FakeIsochTransfer
+{
+	std::shared_ptr<FakeTransferState> state;
+	bool in = false;
+	uint8_t endpointAddress = 0;
+	std::shared_ptr<std::vector<uint8_t>> buffer;
+	std::shared_ptr<std::vector<IsochFrameResult>> frames;
+	int numFrames = 0;
+	int bytesPerFrame = 0;
+	int entriesPerFrame = 1;
+	std::vector<int> frameLengths;
+
+	// Set by submit().
+	uint64_t firstMicroframe = 0;
+	// Packets due before this had already gone when the transfer was submitted.
+	uint64_t submittedMicroframe = 0;
+};
+
+// An isochronous pipe of a fake device. Each transfer completes once the device's bus clock
+// has passed its last packet, and then every packet is handed to (or taken from) the fake.
+// Packets whose microframe had already passed when the transfer was submitted are late, and
+// fail with TransferError::Underrun as they do on OSX.
+class FakeIsochPipe
+{
+public:
+	FakeIsochPipe(std::shared_ptr<FakeUsbDevice> fake, uint8_t endpointAddress);
+	~FakeIsochPipe();
+
+	// Queue a transfer to start at USB frame `frame`, or straight after the last one if
+	// `asap`. With `continueStream` that fails if the last one has already finished.
+	SResult<void> submit(FakeIsochTransfer transfer, bool asap, bool continueStream, uint64_t frame);
+
+	// Cancel every transfer queued on the pipe.
+	void abort();
+
+private:
+	FakeIsochPipe(const FakeIsochPipe&) = delete;
+	FakeIsochPipe& operator=(const FakeIsochPipe&) = delete;
+
+	void run();
+	void finish(FakeIsochTransfer& t);
+
+	// How often the pipe's thread looks at the bus clock.
+	static const int POLL_US = 250;
+
+	std::shared_ptr<FakeUsbDevice> mFake;
+	uint8_t mEndpointAddress = 0;
+
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque<FakeIsochTransfer> mQueue;
+	// The microframe after the last one queued, for asap submissions.
+	uint64_t mNextMicroframe = 0;
+	bool mHaveNext = false;
+	bool mQuit = false;
+	std::thread mThread;
+};
+
+#endif
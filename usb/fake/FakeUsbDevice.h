@@ -0,0 +1,96 @@
+#pragma once
+
+#if defined(USBTOOL_FAKE_USB)
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "../Device.h"
+#include "util/HighResClock.h"
+
+// A control request as the fake device sees it.
+struct FakeSetup
+{
+	uint8_t bmRequestType = 0;
+	uint8_t bRequest = 0;
+	uint16_t wValue = 0;
+	uint16_t wIndex = 0;
+	uint16_t wLength = 0;
+
+	bool in() const { return (bmRequestType & 0x80) != 0; }
+};
+
+// What a fake device does with a control request.
+struct FakeControlReply
+{
+	enum class Outcome
+	{
+		// Complete after `delayMs`, returning `data` (truncated to wLength) for IN requests.
+		Ok,
+		// Complete after `delayMs` with a STALL handshake.
+		Stall,
+		// Never answer. The transfer only ends when it times out or is cancelled.
+		Hang,
+	};
+
+	Outcome outcome = Outcome::Ok;
+	std::vector<uint8_t> data;
+	uint32_t delayMs = 0;
+
+	static FakeControlReply ok(std::vector<uint8_t> data = std::vector<uint8_t>(), uint32_t delayMs = 0);
+	static FakeControlReply stall();
+	static FakeControlReply hang();
+};
+
+// A device simulated in this process. Subclass it, register it with AddFakeUsbDevice(),
+// and it is found by EnumerateAvailableDevices() and opened by OpenUsbDevice() like a real
+// one. The methods are called from the device's pipe threads, one control request at a
+// time, so they only need a lock for state that the test itself also touches.
+class FakeUsbDevice
+{
+public:
+	FakeUsbDevice();
+	virtual ~FakeUsbDevice() = default;
+
+	// The raw device descriptor and each raw configuration descriptor (with everything
+	// after it). GET_DESCRIPTOR requests for them are answered before control() is asked.
+	virtual std::vector<uint8_t> deviceDescriptor() = 0;
+	virtual std::vector<std::vector<uint8_t>> configurationDescriptors() = 0;
+	// String descriptors by index. Index 0 is the language ID list. Empty means STALL.
+	virtual std::vector<uint8_t> stringDescriptor(uint8_t index, uint16_t languageId);
+
+	virtual Device::Speed speed() { return Device::Speed::High; }
+	virtual std::string manufacturer() { return std::string(); }
+	virtual std::string product() { return std::string(); }
+	virtual std::string serial() { return std::string(); }
+
+	// Every other control request. `data` is what was sent with OUT requests.
+	virtual FakeControlReply control(const FakeSetup& setup, const std::vector<uint8_t>& data);
+
+	// The current bus microframe. By default the bus clock runs exactly at the host's rate;
+	// override this to make it drift.
+	virtual uint64_t busMicroframe();
+
+	// An isochronous OUT packet arrives in `usbMicroframe`.
+	virtual void isochOut(uint8_t /*endpointAddress*/, uint64_t /*usbMicroframe*/, const uint8_t* /*data*/, int /*length*/) {}
+	// The device sends an isochronous IN packet in `usbMicroframe`. Fill `data` and return the
+	// length, at most `maxLength`.
+	virtual int isochIn(uint8_t /*endpointAddress*/, uint64_t /*usbMicroframe*/, uint8_t* /*data*/, int /*maxLength*/) { return 0; }
+
+protected:
+	HighResClock::time_point mCreated;
+};
+
+// Make a fake device visible at `path` (its DeviceId), replacing any already there.
+void AddFakeUsbDevice(const std::string& path, std::shared_ptr<FakeUsbDevice> device);
+// Unplug it. Devices that are open stay open.
+void RemoveFakeUsbDevice(const std::string& path);
+
+// Build descriptors for fakes.
+std::vector<uint8_t> MakeFakeDeviceDescriptor(uint16_t idVendor, uint16_t idProduct, uint16_t bcdDevice = 0x0100,
+                                              uint8_t iManufacturer = 0, uint8_t iProduct = 0, uint8_t iSerialNumber = 0);
+std::vector<uint8_t> MakeFakeStringDescriptor(const std::string& ascii);
+
+#endif
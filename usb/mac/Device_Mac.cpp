@@ -6,18 +6,25 @@
 
 #include "util/scope_exit.h"
 #include "util/EnumCasts.h"
+#include "util/FastLog.h"
 
 #include "Util_Mac.h"
 #include "TypeWrappers_Mac.h"
 
 #include <string>
 #include <thread>
+#include <chrono>
 #include <iostream>
+#include <string.h>
 
 using std::string;
 using std::cerr;
 using std::endl;
 
+// How long to wait for an aborted transfer's completion callback. The abort normally completes
+// it straight away, so this only matters if the device or driver is wedged.
+static const int ABORT_TIMEOUT_MS = 1000;
+
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/IOCFPlugIn.h>
@@ -76,7 +83,8 @@ SResult<std::vector<uint8_t>> Device::controlTransferInSync(Device::Recipient re
                                                                uint8_t bRequest,
                                                                uint16_t wValue,
                                                                uint16_t wIndex,
-                                                               uint16_t wLength)
+                                                               uint16_t wLength,
+                                                               uint32_t timeoutMs)
 {
 	if (!isOpen())
 		return Err(string("Device not open"));
@@ -85,7 +93,7 @@ SResult<std::vector<uint8_t>> Device::controlTransferInSync(Device::Recipient re
 
 	std::vector<uint8_t> buffer(wLength);
 
-	IOUSBDevRequest request;
+	IOUSBDevRequestTO request;
 	request.bmRequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::In);
 	request.bRequest = bRequest;
 	request.wValue = wValue;
@@ -93,10 +101,19 @@ SResult<std::vector<uint8_t>> Device::controlTransferInSync(Device::Recipient re
 	request.wLength = wLength;
 	request.pData = buffer.data();
 	request.wLenDone = 0;
+	request.noDataTimeout = timeoutMs;
+	request.completionTimeout = timeoutMs;
+
+	counters->submitted(to_integral(Direction::In));
 
-	kern_return_t kr = (*dev)->DeviceRequest(dev, &request);
+	kern_return_t kr = (*dev)->DeviceRequestTO(dev, &request);
 	if (kr != kIOReturnSuccess)
+	{
+		counters->failed(to_integral(Direction::In), KernReturnToTransferError(kr));
 		return Err("Error sending control transfer: " + KernReturnToString(kr));
+	}
+
+	counters->completed(to_integral(Direction::In), request.wLenDone);
 
 	// We may received less data than requested.
 	if (buffer.size() > request.wLenDone)
@@ -105,7 +122,7 @@ SResult<std::vector<uint8_t>> Device::controlTransferInSync(Device::Recipient re
 	return Ok(buffer);
 }
 
-SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat)
+SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat, uint32_t timeoutMs)
 {
 	if (!isOpen())
 		return Err(string("Device not open"));
@@ -115,7 +132,7 @@ SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device
 
 	auto dev = data.device->device();
 
-	IOUSBDevRequest request;
+	IOUSBDevRequestTO request;
 	request.bmRequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::Out);
 	request.bRequest = bRequest;
 	request.wValue = wValue;
@@ -123,10 +140,19 @@ SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device
 	request.wLength = dat.size();
 	request.pData = dat.data();
 	request.wLenDone = 0;
+	request.noDataTimeout = timeoutMs;
+	request.completionTimeout = timeoutMs;
+
+	counters->submitted(to_integral(Direction::Out));
 
-	kern_return_t kr = (*dev)->DeviceRequest(dev, &request);
+	kern_return_t kr = (*dev)->DeviceRequestTO(dev, &request);
 	if (kr != kIOReturnSuccess)
+	{
+		counters->failed(to_integral(Direction::Out), KernReturnToTransferError(kr));
 		return Err("Error sending control transfer: " + KernReturnToString(kr));
+	}
+
+	counters->completed(to_integral(Direction::Out), request.wLenDone);
 
 	// We should always have sent exactly the amount we tried to.
 	if (request.wLenDone != dat.size())
@@ -135,7 +161,7 @@ SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device
 	return Ok();
 }
 
-SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint32_t timeoutMs)
 {
 	if (!isOpen())
 		return Err(string("Device not open"));
@@ -144,7 +170,7 @@ SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient
 
 	auto buffer = std::make_shared<std::vector<uint8_t>>(wLength);
 
-	IOUSBDevRequest request;
+	IOUSBDevRequestTO request;
 	request.bmRequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::In);
 	request.bRequest = bRequest;
 	request.wValue = wValue;
@@ -152,26 +178,33 @@ SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient
 	request.wLength = wLength;
 	request.pData = buffer->data();
 	request.wLenDone = 0;
+	request.noDataTimeout = timeoutMs;
+	request.completionTimeout = timeoutMs;
 	
 	UsbTransferHandle transferHandle;
 	transferHandle.data->device = data.device;
 	transferHandle.data->buffer = buffer;
+	transferHandle.data->counters = counters;
+	transferHandle.data->endpointAddress = to_integral(Direction::In);
 	
 	// Allocate a new copy of the transferHandle data. This keeps the device, and buffers
 	// open until the transfer is completed.
 	auto* userData = new std::shared_ptr<UsbTransferHandle::Data>(transferHandle.data);
 	
-	kern_return_t kr = (*dev)->DeviceRequestAsync(dev, &request, &UsbTransferHandle::callback, userData);
+	counters->submitted(to_integral(Direction::In));
+	
+	kern_return_t kr = (*dev)->DeviceRequestAsyncTO(dev, &request, &UsbTransferHandle::callback, userData);
 	if (kr != kIOReturnSuccess)
 	{
 		delete userData;
+		counters->failed(to_integral(Direction::In), KernReturnToTransferError(kr));
 		return Err("Error sending control transfer: " + KernReturnToString(kr));
 	}
 	
 	return Ok(transferHandle);
 }
 
-SResult<UsbTransferHandle> Device::controlTransferOut(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat)
+SResult<UsbTransferHandle> Device::controlTransferOut(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat, uint32_t timeoutMs)
 {
 	return Err(string("Unimplemented"));
 }
@@ -184,6 +217,15 @@ SResult<IsochReadBuffer> Device::createIsochReadBuffer(int iface, uint8_t endpoi
 	if (iface < 0 || iface >= data.interfaces.size())
 		return Err("Interface " + std::to_string(iface) + " out of range " + std::to_string(data.interfaces.size()));
 
+	auto pipe = data.interfaces[iface]->pipes.find(endpointAddress);
+	if (pipe == data.interfaces[iface]->pipes.end())
+		return Err("No pipe for endpoint address " + std::to_string(endpointAddress));
+	
+	int entriesPerFrame = pipe->second.entriesPerFrame;
+	if (numFrames <= 0 || numFrames % entriesPerFrame != 0)
+		return Err("Isochronous transfers on endpoint " + std::to_string(endpointAddress) + " need a multiple of " +
+		           std::to_string(entriesPerFrame) + " frame list entries");
+
 	// The interface interface.
 	IOUSBInterfaceInterface700** ifacep = data.interfaces[iface]->iface();
 
@@ -209,6 +251,7 @@ SResult<IsochReadBuffer> Device::createIsochReadBuffer(int iface, uint8_t endpoi
 	buffer.endpointAddress = endpointAddress;
 	buffer.numFrames = numFrames;
 	buffer.bytesPerFrame = bytesPerFrame;
+	buffer.entriesPerFrame = entriesPerFrame;
 	
 	return Ok(buffer);
 }
@@ -221,6 +264,15 @@ SResult<IsochWriteBuffer> Device::createIsochWriteBuffer(int iface, uint8_t endp
 	if (iface < 0 || iface >= data.interfaces.size())
 		return Err("Interface " + std::to_string(iface) + " out of range " + std::to_string(data.interfaces.size()));
 
+	auto pipe = data.interfaces[iface]->pipes.find(endpointAddress);
+	if (pipe == data.interfaces[iface]->pipes.end())
+		return Err("No pipe for endpoint address " + std::to_string(endpointAddress));
+	
+	int entriesPerFrame = pipe->second.entriesPerFrame;
+	if (numFrames <= 0 || numFrames % entriesPerFrame != 0)
+		return Err("Isochronous transfers on endpoint " + std::to_string(endpointAddress) + " need a multiple of " +
+		           std::to_string(entriesPerFrame) + " frame list entries");
+
 	// The interface interface.
 	IOUSBInterfaceInterface700** ifacep = data.interfaces[iface]->iface();
 
@@ -231,13 +283,13 @@ SResult<IsochWriteBuffer> Device::createIsochWriteBuffer(int iface, uint8_t endp
 	if (kr != kIOReturnSuccess)
 		return Err("Error creating isochronous write buffer: " + KernReturnToString(kr));
 	
-	std::cout << "Created low latency write buffer: " << static_cast<void*>(writeBuffer) << std::endl;
+	FLOG_DEBUG("Created low latency write buffer: {}", static_cast<void*>(writeBuffer));
 
 	kr = (*ifacep)->LowLatencyCreateBuffer(ifacep, reinterpret_cast<void**>(&frameBuffer), numFrames * sizeof(IOUSBLowLatencyIsocFrame), kUSBLowLatencyFrameListBuffer);
 	if (kr != kIOReturnSuccess)
 		return Err("Error creating isochronous frame list buffer: " + KernReturnToString(kr));
 
-	std::cout << "Created low latency frame buffer: " << static_cast<void*>(frameBuffer) << std::endl;
+	FLOG_DEBUG("Created low latency frame buffer: {}", static_cast<void*>(frameBuffer));
 
 	if (writeBuffer == nullptr || frameBuffer == nullptr)
 		return Err(string("Null pointer creating isochronous buffer."));
@@ -250,10 +302,33 @@ SResult<IsochWriteBuffer> Device::createIsochWriteBuffer(int iface, uint8_t endp
 	buffer.endpointAddress = endpointAddress;
 	buffer.numFrames = numFrames;
 	buffer.bytesPerFrame = bytesPerFrame;
+	buffer.entriesPerFrame = entriesPerFrame;
 	
 	return Ok(buffer);
 }
 
+// Fill in the frame list of a write, using the buffer's frame lengths if it has them, and
+// return it for LowLatencyWriteIsochPipeAsync().
+static SResult<IOUSBLowLatencyIsocFrame*> FillWriteFrameList(const IsochWriteBuffer& buffer)
+{
+	bool variable = !buffer.frameLengths.empty();
+	if (variable && buffer.frameLengths.size() != static_cast<size_t>(buffer.numFrames))
+		return Err("Isochronous write has " + std::to_string(buffer.frameLengths.size()) + " frame lengths for " +
+		           std::to_string(buffer.numFrames) + " frames");
+
+	IOUSBLowLatencyIsocFrame* frames = reinterpret_cast<IOUSBLowLatencyIsocFrame*>(buffer.frameBuffer->buffer());
+	for (int i = 0; i < buffer.numFrames; ++i)
+	{
+		int length = variable ? buffer.frameLengths[i] : buffer.bytesPerFrame;
+		if (length < 0 || length > buffer.bytesPerFrame)
+			return Err("Isochronous write frame " + std::to_string(i) + " has length " + std::to_string(length));
+		frames[i].frReqCount = length;
+		frames[i].frActCount = 0;
+		frames[i].frStatus = kIOReturnError;
+	}
+	return Ok(frames);
+}
+
 SResult<UsbIsochTransferHandle> Device::submitIsoOutTransferAsap(const IsochWriteBuffer& buffer, bool continueStream)
 {
 	if (!isOpen())
@@ -277,13 +352,7 @@ SResult<UsbIsochTransferHandle> Device::submitIsoOutTransferAsap(const IsochWrit
 	UInt64 frame = continueStream ? pipeData.nextFrame : currentFrame + 1;
 	
 	// Fill in the frame list.
-	IOUSBLowLatencyIsocFrame* frames = reinterpret_cast<IOUSBLowLatencyIsocFrame*>(buffer.frameBuffer->buffer());
-	for (int i = 0; i < buffer.numFrames; ++i)
-	{
-		frames[i].frReqCount = buffer.bytesPerFrame;
-		frames[i].frActCount = 0;
-		frames[i].frStatus = kIOReturnError;
-	}
+	IOUSBLowLatencyIsocFrame* frames = TRY(FillWriteFrameList(buffer));
 
 	// Create a new transfer handle.
 	UsbIsochTransferHandle transferHandle;
@@ -291,16 +360,23 @@ SResult<UsbIsochTransferHandle> Device::submitIsoOutTransferAsap(const IsochWrit
 	transferHandle.data->iface = buffer.interface;
 	transferHandle.data->readOrWriteBuffer = buffer.writeBuffer;
 	transferHandle.data->frameBuffer = buffer.frameBuffer;
+	transferHandle.data->numFrames = buffer.numFrames;
+	transferHandle.data->pipeRef = pipeData.pipeRef;
+	transferHandle.data->counters = counters;
+	transferHandle.data->endpointAddress = buffer.endpointAddress;
 	
 	// Allocate a new copy of the transferHandle data. This keeps the device, and buffers
 	// open until the transfer is completed.
 	auto* userData = new std::shared_ptr<UsbIsochTransferHandle::Data>(transferHandle.data);
 	
+	counters->submitted(buffer.endpointAddress);
+	
 	for (int i = 0;; ++i)
 	{
 		if (i > 32 || (continueStream && i > 0))
 		{
 			delete userData;
+			counters->failed(buffer.endpointAddress, TransferError::Underrun);
 			return Err(string("Couldn't schedule isochronous transfer."));
 		}
 		
@@ -324,11 +400,12 @@ SResult<UsbIsochTransferHandle> Device::submitIsoOutTransferAsap(const IsochWrit
 		else
 		{
 			delete userData;
+			counters->failed(buffer.endpointAddress, KernReturnToTransferError(kr));
 			return Err("Error submitting isoch transfer: " + KernReturnToString(kr));
 		}
 	}
 	
-	pipeData.nextFrame = frame + buffer.numFrames;
+	pipeData.nextFrame = frame + buffer.numFrames / buffer.entriesPerFrame;
 
 	return Ok(transferHandle);
 }
@@ -354,13 +431,7 @@ SResult<UsbIsochTransferHandle> Device::submitIsoOutTransfer(const IsochWriteBuf
 		return Err("Error getting bus frame number: " + KernReturnToString(kr));
 	
 	// Fill in the frame list.
-	IOUSBLowLatencyIsocFrame* frames = reinterpret_cast<IOUSBLowLatencyIsocFrame*>(buffer.frameBuffer->buffer());
-	for (int i = 0; i < buffer.numFrames; ++i)
-	{
-		frames[i].frReqCount = buffer.bytesPerFrame;
-		frames[i].frActCount = 0;
-		frames[i].frStatus = kIOReturnError;
-	}
+	IOUSBLowLatencyIsocFrame* frames = TRY(FillWriteFrameList(buffer));
 
 	// Create a new transfer handle.
 	UsbIsochTransferHandle transferHandle;
@@ -368,12 +439,18 @@ SResult<UsbIsochTransferHandle> Device::submitIsoOutTransfer(const IsochWriteBuf
 	transferHandle.data->iface = buffer.interface;
 	transferHandle.data->readOrWriteBuffer = buffer.writeBuffer;
 	transferHandle.data->frameBuffer = buffer.frameBuffer;
+	transferHandle.data->numFrames = buffer.numFrames;
+	transferHandle.data->pipeRef = pipeData.pipeRef;
+	transferHandle.data->counters = counters;
+	transferHandle.data->endpointAddress = buffer.endpointAddress;
 	
 	// Allocate a new copy of the transferHandle data. This keeps the device, and buffers
 	// open until the transfer is completed.
 	auto* userData = new std::shared_ptr<UsbIsochTransferHandle::Data>(transferHandle.data);
 	
-	std::cout << "Submitting transfer for frame " << frame << " current frame: " << getBusFrameNumber() << " at time (nanos): " << mach_absolute_time() << std::endl;
+	counters->submitted(buffer.endpointAddress);
+	
+	FLOG_TRACE("Submitting transfer for frame {} current frame: {}", frame, getBusFrameNumber());
 	
 	kr = (*iface)->LowLatencyWriteIsochPipeAsync(iface,
 												 pipeData.pipeRef,
@@ -387,14 +464,113 @@ SResult<UsbIsochTransferHandle> Device::submitIsoOutTransfer(const IsochWriteBuf
 	if (kr != kIOReturnSuccess)
 	{
 		delete userData;
+		counters->failed(buffer.endpointAddress, KernReturnToTransferError(kr));
 		return Err("Error submitting isoch transfer: " + KernReturnToString(kr));
 	}
 
-	pipeData.nextFrame = frame + buffer.numFrames;
+	pipeData.nextFrame = frame + buffer.numFrames / buffer.entriesPerFrame;
+
+	return Ok(transferHandle);
+}
+
+// Submit an isochronous read. If `asap` the transfer starts at the pipe's next frame when
+// `continueStream`, or the next frame that is still in the future otherwise. If not, it starts at `frame`.
+static SResult<UsbIsochTransferHandle> SubmitIsochRead(const UsbDeviceData& data,
+                                                       const std::shared_ptr<EndpointCounters>& counters,
+                                                       const IsochReadBuffer& buffer,
+                                                       bool asap,
+                                                       bool continueStream,
+                                                       uint64_t frame)
+{
+	// Check we have the pipe info.
+	if (buffer.interface->pipes.count(buffer.endpointAddress) != 1)
+		return Err("Internal error: pipe for endpoint address " + std::to_string(buffer.endpointAddress) + " not found");
+	
+	auto& pipeData = buffer.interface->pipes.at(buffer.endpointAddress);
+
+	IOUSBInterfaceInterface700** iface = buffer.interface->iface();
+	
+	if (asap)
+	{
+		UInt64 currentFrame = 0;
+		AbsoluteTime atTime;
+		kern_return_t kr = (*iface)->GetBusFrameNumber(iface, &currentFrame, &atTime);
+		if (kr != kIOReturnSuccess)
+			return Err("Error getting bus frame number: " + KernReturnToString(kr));
+		frame = continueStream ? pipeData.nextFrame : currentFrame + 1;
+	}
+	
+	// Fill in the frame list. The callback reads the actual counts back from it.
+	IOUSBLowLatencyIsocFrame* frames = reinterpret_cast<IOUSBLowLatencyIsocFrame*>(buffer.frameBuffer->buffer());
+	for (int i = 0; i < buffer.numFrames; ++i)
+	{
+		frames[i].frReqCount = buffer.bytesPerFrame;
+		frames[i].frActCount = 0;
+		frames[i].frStatus = kIOReturnError;
+	}
+
+	UsbIsochTransferHandle transferHandle;
+	transferHandle.data->device = data.device;
+	transferHandle.data->iface = buffer.interface;
+	transferHandle.data->readOrWriteBuffer = buffer.readBuffer;
+	transferHandle.data->frameBuffer = buffer.frameBuffer;
+	transferHandle.data->numFrames = buffer.numFrames;
+	transferHandle.data->pipeRef = pipeData.pipeRef;
+	transferHandle.data->counters = counters;
+	transferHandle.data->endpointAddress = buffer.endpointAddress;
+	
+	// Keeps the device and buffers open until the transfer is completed. Deleted by the callback.
+	auto* userData = new std::shared_ptr<UsbIsochTransferHandle::Data>(transferHandle.data);
+	
+	counters->submitted(buffer.endpointAddress);
+	
+	for (int i = 0;; ++i)
+	{
+		kern_return_t kr = (*iface)->LowLatencyReadIsochPipeAsync(iface,
+		                                                          pipeData.pipeRef,
+		                                                          buffer.readBuffer->buffer(),
+		                                                          frame,
+		                                                          buffer.numFrames,
+		                                                          0, // Only update the frame list at the end of the transfer.
+		                                                          frames,
+		                                                          &UsbIsochTransferHandle::callback,
+		                                                          userData);
+		if (kr == kIOReturnSuccess)
+			break;
+		
+		// When starting a new stream, keep trying later frames until we are in the future.
+		if (kr == kIOReturnIsoTooOld && asap && !continueStream && i < 32)
+		{
+			++frame;
+			continue;
+		}
+		
+		delete userData;
+		counters->failed(buffer.endpointAddress, KernReturnToTransferError(kr));
+		return Err("Error submitting isoch read: " + KernReturnToString(kr));
+	}
+	
+	pipeData.nextFrame = frame + buffer.numFrames / buffer.entriesPerFrame;
 
 	return Ok(transferHandle);
 }
 
+SResult<UsbIsochTransferHandle> Device::submitIsoInTransferAsap(const IsochReadBuffer& buffer, bool continueStream)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	
+	return SubmitIsochRead(data, counters, buffer, true, continueStream, 0);
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoInTransfer(const IsochReadBuffer& buffer, uint64_t frame)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	
+	return SubmitIsochRead(data, counters, buffer, false, false, frame);
+}
+
 uint64_t Device::getBusFrameNumber()
 {
 	if (!isOpen())
@@ -423,6 +599,44 @@ uint64_t Device::getBusFrameNumber()
 	return frame;
 }
 
+SResult<void> Device::setCallbackThreadPolicy(const ThreadPolicy& policy)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	
+	return data.runLoop.applyThreadPolicy(policy);
+}
+
+uint64_t Device::getBusMicroframeNumber()
+{
+	if (!isOpen())
+		return 0;
+	
+	IOUSBDeviceInterface650** dev = data.device->device();
+	
+	UInt8 speed = 0;
+	if ((*dev)->GetDeviceSpeed(dev, &speed) != kIOReturnSuccess || speed == kUSBDeviceSpeedLow || speed == kUSBDeviceSpeedFull)
+		return getBusFrameNumber() * 8;
+	
+	UInt64 microframe;
+	uint64_t atTime;
+	
+	kern_return_t kr = (*dev)->GetBusMicroFrameNumber(dev, &microframe, reinterpret_cast<AbsoluteTime*>(&atTime));
+	if (kr != kIOReturnSuccess)
+		return 0;
+	
+	// Adjust by the time since it was read, as getBusFrameNumber() does.
+	uint64_t now = mach_absolute_time();
+	
+	static mach_timebase_info_data_t timebase = {0, 0};
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	
+	uint64_t elapsedNano = (now - atTime) * timebase.numer / timebase.denom;
+	
+	return microframe + elapsedNano / 125000;
+}
+
 int Device::numInterfaces()
 {
 	if (!isOpen())
@@ -450,6 +664,38 @@ SResult<void> Device::setAlternate(int iface, uint8_t alternate)
 	return Ok();
 }
 
+SResult<void> Device::abortPipe(int iface, uint8_t endpointAddress)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	
+	// The default control pipe.
+	if ((endpointAddress & 0x0F) == 0)
+	{
+		IOUSBDeviceInterface650** dev = data.device->device();
+		kern_return_t kr = (*dev)->USBDeviceAbortPipeZero(dev);
+		if (kr != kIOReturnSuccess)
+			return Err("Error aborting control pipe: " + KernReturnToString(kr));
+		return Ok();
+	}
+
+	if (iface < 0 || iface >= data.interfaces.size())
+		return Err("Interface " + std::to_string(iface) + " out of range " + std::to_string(data.interfaces.size()));
+	
+	auto& interface = data.interfaces[iface];
+	
+	if (interface->pipes.count(endpointAddress) != 1)
+		return Err("Pipe for endpoint address " + std::to_string(endpointAddress) + " not found");
+	
+	IOUSBInterfaceInterface700** ifacep = interface->iface();
+	
+	kern_return_t kr = (*ifacep)->AbortPipe(ifacep, interface->pipes.at(endpointAddress).pipeRef);
+	if (kr != kIOReturnSuccess)
+		return Err("Error aborting pipe: " + KernReturnToString(kr));
+	
+	return Ok();
+}
+
 SResult<std::vector<uint8_t>> UsbTransferHandle::result(bool block)
 {
 	std::unique_lock<std::mutex> lock(data->mutex);
@@ -467,6 +713,51 @@ SResult<std::vector<uint8_t>> UsbTransferHandle::result(bool block)
 	return Ok(*data->buffer);
 }
 
+SResult<std::vector<uint8_t>> UsbTransferHandle::resultWithin(uint32_t timeoutMs)
+{
+	{
+		std::unique_lock<std::mutex> lock(data->mutex);
+		
+		if (!data->condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return data->done; }))
+		{
+			data->timedOut = true;
+			lock.unlock();
+			
+			SResult<void> cancelRes = cancel();
+			if (!cancelRes)
+				return Err("Transfer timed out after " + std::to_string(timeoutMs) + " ms and couldn't be aborted: " + cancelRes.unwrap_err());
+			
+			// Wait for the abort to complete the transfer so the buffer is no longer in use,
+			// but don't hang the caller if the completion never comes.
+			lock.lock();
+			if (!data->condition.wait_for(lock, std::chrono::milliseconds(ABORT_TIMEOUT_MS), [&] { return data->done; }))
+				return Err("Transfer timed out after " + std::to_string(timeoutMs) + " ms and hasn't finished aborting");
+			return Err("Transfer timed out after " + std::to_string(timeoutMs) + " ms");
+		}
+	}
+	
+	return result(false);
+}
+
+SResult<void> UsbTransferHandle::cancel()
+{
+	{
+		std::unique_lock<std::mutex> lock(data->mutex);
+		if (data->done)
+			return Ok();
+	}
+	
+	if (!data->device)
+		return Err(string("Transfer not started"));
+	
+	IOUSBDeviceInterface650** dev = data->device->device();
+	kern_return_t kr = (*dev)->USBDeviceAbortPipeZero(dev);
+	if (kr != kIOReturnSuccess)
+		return Err("Error aborting control pipe: " + KernReturnToString(kr));
+	
+	return Ok();
+}
+
 void UsbTransferHandle::callback(void* refcon, IOReturn result, void* arg0)
 {
 	if (refcon == nullptr)
@@ -481,9 +772,20 @@ void UsbTransferHandle::callback(void* refcon, IOReturn result, void* arg0)
 	std::unique_lock<std::mutex> lock((*dataPtrPtr)->mutex);
 
 	(*dataPtrPtr)->result = result;
-//	data->transferred = ??? TODO: Get this from arg0
+	// For DeviceRequestAsync arg0 is the number of bytes transferred.
+	(*dataPtrPtr)->transferred = static_cast<int>(reinterpret_cast<uintptr_t>(arg0));
 	(*dataPtrPtr)->done = true;
 	
+	if ((*dataPtrPtr)->counters)
+	{
+		if (result == kIOReturnSuccess)
+			(*dataPtrPtr)->counters->completed((*dataPtrPtr)->endpointAddress, (*dataPtrPtr)->transferred);
+		else if ((*dataPtrPtr)->timedOut)
+			(*dataPtrPtr)->counters->failed((*dataPtrPtr)->endpointAddress, TransferError::Timeout);
+		else
+			(*dataPtrPtr)->counters->failed((*dataPtrPtr)->endpointAddress, KernReturnToTransferError(result));
+	}
+	
 	(*dataPtrPtr)->condition.notify_one();
 	
 	// We don't need the temporary shared_ptr to the TransferHandle::Data any more - the transfer is done.
@@ -508,6 +810,51 @@ SResult<int> UsbIsochTransferHandle::result(bool block)
 	return Ok(data->transferred);
 }
 
+SResult<int> UsbIsochTransferHandle::resultWithin(uint32_t timeoutMs)
+{
+	{
+		std::unique_lock<std::mutex> lock(data->mutex);
+		
+		if (!data->condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return data->done; }))
+		{
+			data->timedOut = true;
+			lock.unlock();
+			
+			SResult<void> cancelRes = cancel();
+			if (!cancelRes)
+				return Err("Isoch transfer timed out after " + std::to_string(timeoutMs) + " ms and couldn't be aborted: " + cancelRes.unwrap_err());
+			
+			// Wait for the abort to complete the transfer so the buffers are no longer in use,
+			// but don't hang the caller if the completion never comes.
+			lock.lock();
+			if (!data->condition.wait_for(lock, std::chrono::milliseconds(ABORT_TIMEOUT_MS), [&] { return data->done; }))
+				return Err("Isoch transfer timed out after " + std::to_string(timeoutMs) + " ms and hasn't finished aborting");
+			return Err("Isoch transfer timed out after " + std::to_string(timeoutMs) + " ms");
+		}
+	}
+	
+	return result(false);
+}
+
+SResult<void> UsbIsochTransferHandle::cancel()
+{
+	{
+		std::unique_lock<std::mutex> lock(data->mutex);
+		if (data->done)
+			return Ok();
+	}
+	
+	if (!data->iface)
+		return Err(string("Transfer not started"));
+	
+	IOUSBInterfaceInterface700** ifacep = data->iface->iface();
+	kern_return_t kr = (*ifacep)->AbortPipe(ifacep, data->pipeRef);
+	if (kr != kIOReturnSuccess)
+		return Err("Error aborting isoch pipe: " + KernReturnToString(kr));
+	
+	return Ok();
+}
+
 void UsbIsochTransferHandle::callback(void* refcon, IOReturn result, void* arg0)
 {
 	// arg0 is a pointer to the framelist and can be used to identify the particular request apparently.
@@ -519,7 +866,7 @@ void UsbIsochTransferHandle::callback(void* refcon, IOReturn result, void* arg0)
 		return;
 	}
 	
-	std::cout << "Transfer finished at time (nanos): " << mach_absolute_time() << std::endl;
+	FLOG_TRACE("Isochronous transfer finished");
 	
 	
 	std::shared_ptr<UsbIsochTransferHandle::Data>* dataPtrPtr = static_cast<std::shared_ptr<UsbIsochTransferHandle::Data>*>(refcon);
@@ -527,9 +874,35 @@ void UsbIsochTransferHandle::callback(void* refcon, IOReturn result, void* arg0)
 	std::unique_lock<std::mutex> lock((*dataPtrPtr)->mutex);
 
 	(*dataPtrPtr)->result = result;
-//	data->transferred = ??? TODO: Get this from the frame list (arg0).
+	
+	// Add up the bytes actually sent, and count frames that were too late to be sent.
+	int transferred = 0;
+	int lateFrames = 0;
+	if ((*dataPtrPtr)->frameBuffer)
+	{
+		const IOUSBLowLatencyIsocFrame* frames = reinterpret_cast<const IOUSBLowLatencyIsocFrame*>((*dataPtrPtr)->frameBuffer->buffer());
+		for (int i = 0; i < (*dataPtrPtr)->numFrames; ++i)
+		{
+			transferred += frames[i].frActCount;
+			if (frames[i].frStatus == kIOReturnIsoTooOld)
+				++lateFrames;
+		}
+	}
+	(*dataPtrPtr)->transferred = transferred;
 	(*dataPtrPtr)->done = true;
 	
+	if ((*dataPtrPtr)->counters)
+	{
+		if (lateFrames != 0)
+			(*dataPtrPtr)->counters->lateIsoFrames((*dataPtrPtr)->endpointAddress, lateFrames);
+		if (result == kIOReturnSuccess)
+			(*dataPtrPtr)->counters->completed((*dataPtrPtr)->endpointAddress, transferred);
+		else if ((*dataPtrPtr)->timedOut)
+			(*dataPtrPtr)->counters->failed((*dataPtrPtr)->endpointAddress, TransferError::Timeout);
+		else
+			(*dataPtrPtr)->counters->failed((*dataPtrPtr)->endpointAddress, KernReturnToTransferError(result));
+	}
+	
 	(*dataPtrPtr)->condition.notify_one();
 	
 	// We don't need the shared_ptr to the TransferHandle::Data any more - the transfer is done.
@@ -546,6 +919,32 @@ int IsochReadBuffer::size() const
 	return bytesPerFrame * numFrames;
 }
 
+IsochFrameResult IsochReadBuffer::frameResult(int frame) const
+{
+	IsochFrameResult result;
+	if (!frameBuffer || frame < 0 || frame >= numFrames)
+		return result;
+	
+	const IOUSBLowLatencyIsocFrame& f = reinterpret_cast<const IOUSBLowLatencyIsocFrame*>(frameBuffer->buffer())[frame];
+	result.length = f.frActCount;
+	
+	switch (f.frStatus)
+	{
+	case kIOReturnSuccess:
+	// A short packet, which is normal for IN endpoints.
+	case kIOReturnUnderrun:
+		result.ok = true;
+		break;
+	case kIOReturnIsoTooOld:
+		result.error = TransferError::Underrun;
+		break;
+	default:
+		result.error = KernReturnToTransferError(f.frStatus);
+		break;
+	}
+	return result;
+}
+
 uint8_t* IsochWriteBuffer::data()
 {
 	return writeBuffer ? writeBuffer->buffer() : nullptr;
@@ -566,7 +965,7 @@ SResult<void> InterfaceWithMetadata::refreshPipes()
 	if (kr != kIOReturnSuccess)
 		return Err("Couldn't get USB interface endpoint count: " + KernReturnToString(kr));
 
-	cerr << "Interface has " << int(interfaceNumEndpoints) << " endpoints" << endl;
+	FLOG_DEBUG("Interface has {} endpoints", int(interfaceNumEndpoints));
 	
 	pipes.clear();
 	
@@ -597,7 +996,29 @@ SResult<void> InterfaceWithMetadata::refreshPipes()
 			pipeAddress |= 1 << kUSBRqDirnShift;
 		
 		pipes[pipeAddress].pipeRef = pipeRef;
-		cerr << "Interface pipe address " << int(pipeAddress) << " -> pipe ref " << int(pipeRef) << endl;
+		pipes[pipeAddress].entriesPerFrame = 1;
+		
+		// GetPipeProperties() converts the interval to milliseconds, so get the raw bInterval
+		// to find out how many times a High Speed endpoint is serviced per frame.
+		if (highSpeed && transferType == kUSBIsoc)
+		{
+			IOUSBEndpointProperties props;
+			memset(&props, 0, sizeof(props));
+			props.bVersion = kUSBEndpointPropertiesVersion3;
+			
+			kr = (*iface())->GetPipePropertiesV2(iface(), pipeRef, &props);
+			if (kr != kIOReturnSuccess)
+				return Err("Couldn't get USB pipe properties: " + KernReturnToString(kr));
+			
+			EndpointDescriptor desc;
+			desc.bEndpointAddress = pipeAddress;
+			desc.bmAttributes = props.bTransferType;
+			desc.wMaxPacketSize = props.wMaxPacketSize;
+			desc.bInterval = props.bInterval;
+			pipes[pipeAddress].entriesPerFrame = EndpointInfo::from(desc).packetsPerFrame(true);
+		}
+		
+		FLOG_DEBUG("Interface pipe address {} -> pipe ref {}", int(pipeAddress), int(pipeRef));
 	}
 	
 	return Ok();
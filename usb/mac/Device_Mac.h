@@ -10,6 +10,9 @@
 
 #include "../DeviceId.h"
 #include "../Descriptors.h"
+#include "../DescriptorCache.h"
+#include "../EndpointCounters.h"
+#include "../IsochFrame.h"
 
 #include "TypeWrappers_Mac.h"
 #include "RunLoop.h"
@@ -37,10 +40,16 @@ public:
 		// Pipes are unidirectional so we don't need separate in/out variables.
 		// This is only used for isochronous pipes.
 		uint64_t nextFrame = 0;
+		// Isochronous frame list entries per 1 ms frame. High Speed endpoints serviced every
+		// 1, 2 or 4 microframes have an entry per service interval, so 8, 4 or 2.
+		int entriesPerFrame = 1;
 	};
 	
 	// Map from endpoint address (number & direction) to data.
 	std::map<uint8_t, PipeData> pipes;
+	
+	// Set before refreshPipes() is called. High Speed endpoints measure bInterval in microframes.
+	bool highSpeed = false;
 };
 
 // These are buffers for one transfer, since that means we can do it in the same way on OSX and Windows.
@@ -51,13 +60,19 @@ public:
 	const uint8_t* data() const;
 	int size() const;
 	
+	// After the transfer has completed, the result of frame `frame`. Its data is at
+	// data() + frame * bytesPerFrame.
+	IsochFrameResult frameResult(int frame) const;
+	
 // private:
 	std::shared_ptr<LowLatencyBuffer> readBuffer;
 	std::shared_ptr<LowLatencyBuffer> frameBuffer;
 	std::shared_ptr<InterfaceWithMetadata> interface;
 	uint8_t endpointAddress;
+	// Frame list entries, and how many of them there are per 1 ms frame.
 	int numFrames;
 	int bytesPerFrame;
+	int entriesPerFrame = 1;
 };
 
 class IsochWriteBuffer
@@ -71,8 +86,13 @@ public:
 	std::shared_ptr<LowLatencyBuffer> frameBuffer;
 	std::shared_ptr<InterfaceWithMetadata> interface;
 	uint8_t endpointAddress;
+	// Frame list entries, and how many of them there are per 1 ms frame.
 	int numFrames;
 	int bytesPerFrame;
+	int entriesPerFrame = 1;
+	// If not empty, the length of each frame list entry, at most bytesPerFrame. Their data is
+	// then packed back to back rather than bytesPerFrame apart. Empty means all bytesPerFrame.
+	std::vector<int> frameLengths;
 };
 
 // Handle to an asynchronous normal pipe operation.
@@ -81,6 +101,15 @@ class UsbTransferHandle
 	friend class Device;
 public:
 	SResult<std::vector<uint8_t>> result(bool block = true);
+	
+	// Wait at most `timeoutMs` for the result. If the transfer still hasn't finished
+	// it is cancelled and this returns an error.
+	SResult<std::vector<uint8_t>> resultWithin(uint32_t timeoutMs);
+	
+	// Cancel the transfer if it hasn't finished. OSX can only abort all the requests
+	// on the default control pipe, so this cancels any other outstanding control
+	// transfers to the device too.
+	SResult<void> cancel();
 
 private:
 	static void callback(void* refcon, IOReturn result, void* arg0);
@@ -98,6 +127,8 @@ private:
 		bool done = false;
 		IOReturn result = kIOReturnInternalError;
 		int transferred = 0;
+		// Set if resultWithin() cancelled the transfer, so it is counted as a timeout.
+		bool timedOut = false;
 		
 		// We need to keep a reference to the interface and device so that it isn't destroyed before
 		// the transfer is complete.
@@ -106,6 +137,10 @@ private:
 		
 		// And the buffer.
 		std::shared_ptr<std::vector<uint8_t>> buffer;
+		
+		// Updated when the transfer completes.
+		std::shared_ptr<EndpointCounters> counters;
+		uint8_t endpointAddress = 0;
 	private:
 		Data(const Data&) = delete;
 		Data& operator=(const Data&) = delete;
@@ -120,8 +155,19 @@ class UsbIsochTransferHandle
 {
 	friend class Device;
 public:
-	// Returns bytes transferred on success, except it always is 0.
+	// Returns bytes transferred on success (the sum of the frame list's actual counts).
 	SResult<int> result(bool block = true);
+	
+	// Wait at most `timeoutMs` for the result. If the transfer still hasn't finished
+	// it is cancelled and this returns an error.
+	SResult<int> resultWithin(uint32_t timeoutMs);
+	
+	// Cancel the transfer if it hasn't finished. This aborts the whole pipe, so later
+	// transfers that were queued behind it are cancelled too.
+	//
+	// It is safe to destroy the handle while the transfer is running; the buffers are kept
+	// alive until it completes.
+	SResult<void> cancel();
 
 private:
 	static void callback(void* refcon, IOReturn result, void* arg0);
@@ -139,14 +185,23 @@ private:
 		bool done = false;
 		IOReturn result = kIOReturnInternalError;
 		int transferred = 0;
+		// Set if resultWithin() cancelled the transfer, so it is counted as a timeout.
+		bool timedOut = false;
 		
 		// We need to keep a reference to the interface and device so that it isn't destroyed before
 		// the transfer is complete.
 		std::shared_ptr<DeviceInterface> device;
 		std::shared_ptr<InterfaceWithMetadata> iface;
+		// The pipe the transfer is on, for cancelling it.
+		uint8_t pipeRef = 0;
 		// And either the read/write and frame buffers.
 		std::shared_ptr<LowLatencyBuffer> readOrWriteBuffer;
 		std::shared_ptr<LowLatencyBuffer> frameBuffer;
+		int numFrames = 0;
+		
+		// Updated when the transfer completes.
+		std::shared_ptr<EndpointCounters> counters;
+		uint8_t endpointAddress = 0;
 	private:
 		Data(const Data&) = delete;
 		Data& operator=(const Data&) = delete;
@@ -174,6 +229,9 @@ struct UsbDeviceData
 	// Cached.
 	DeviceDescriptor descriptors;
 	
+	// Where `descriptors` is stored in the DescriptorCache.
+	DescriptorCacheKey descriptorCacheKey;
+	
 	// The run loop thread. This is the thread that async callbacks are run from.
 	RunLoop runLoop;
 };
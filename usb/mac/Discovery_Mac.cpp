@@ -6,6 +6,7 @@
 
 #include "util/scope_exit.h"
 #include "util/EnumCasts.h"
+#include "util/FastLog.h"
 
 #include "Util_Mac.h"
 #include "TypeWrappers_Mac.h"
@@ -13,6 +14,7 @@
 #include <string>
 #include <thread>
 #include <iostream>
+#include <string.h>
 
 using std::string;
 using std::cerr;
@@ -37,7 +39,7 @@ SResult<std::vector<uint8_t>> ControlTransferInSync(IOUSBDeviceInterface650** de
 {
 	std::vector<uint8_t> buffer(wLength);
 	
-	IOUSBDevRequest request;
+	IOUSBDevRequestTO request;
 	request.bmRequestType = to_integral(recipient) | to_integral(type) | to_integral(Device::Direction::In);
 	request.bRequest = bRequest;
 	request.wValue = wValue;
@@ -45,8 +47,11 @@ SResult<std::vector<uint8_t>> ControlTransferInSync(IOUSBDeviceInterface650** de
 	request.wLength = wLength;
 	request.pData = buffer.data();
 	request.wLenDone = 0;
+	// Don't let one broken device hang enumeration.
+	request.noDataTimeout = Device::DEFAULT_TIMEOUT_MS;
+	request.completionTimeout = Device::DEFAULT_TIMEOUT_MS;
 	
-	kern_return_t kr = (*dev)->DeviceRequest(dev, &request);
+	kern_return_t kr = (*dev)->DeviceRequestTO(dev, &request);
 	if (kr != kIOReturnSuccess)
 		return Err("Error sending control transfer: " + KernReturnToString(kr));
 	
@@ -57,7 +62,7 @@ SResult<std::vector<uint8_t>> ControlTransferInSync(IOUSBDeviceInterface650** de
 	return Ok(buffer);
 }
 
-SResult<std::vector<uint8_t>> GetDescriptor(IOUSBDeviceInterface650** dev, DescriptorType type, uint8_t index, uint8_t languageId)
+SResult<std::vector<uint8_t>> GetDescriptor(IOUSBDeviceInterface650** dev, DescriptorType type, uint8_t index, uint16_t languageId)
 {
 	// First get the (length, type) header.
 	std::vector<uint8_t> header = TRY(ControlTransferInSync(dev,
@@ -302,12 +307,113 @@ kern_return_t ConfigureDevice(IOUSBDeviceInterface650** dev)
 	return kIOReturnSuccess;
 }
 
-SResult<DeviceDescriptor> ReadDescriptors(IOUSBDeviceInterface650** dev)
+// Get the serial number that IOKit read when the device was attached. This doesn't
+// touch the bus. Returns an empty string if the device doesn't have one.
+string GetSerialNumberProperty(io_service_t usbDevice)
 {
-	DeviceDescriptor desc;
+	CFTypeRef prop = IORegistryEntryCreateCFProperty(usbDevice, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
+	if (prop == nullptr)
+		return string();
+	
+	auto ae = make_scope_exit([&] { CFRelease(prop); });
+	
+	if (CFGetTypeID(prop) != CFStringGetTypeID())
+		return string();
+	
+	char buffer[256];
+	if (!CFStringGetCString(static_cast<CFStringRef>(prop), buffer, sizeof(buffer), kCFStringEncodingUTF8))
+		return string();
 	
+	return buffer;
+}
+
+// Get a number property that IOKit set when the device was attached.
+int GetNumberProperty(io_service_t usbDevice, CFStringRef key, int defaultValue)
+{
+	CFTypeRef prop = IORegistryEntryCreateCFProperty(usbDevice, key, kCFAllocatorDefault, 0);
+	if (prop == nullptr)
+		return defaultValue;
+	
+	auto ae = make_scope_exit([&] { CFRelease(prop); });
+	
+	int value = defaultValue;
+	if (CFGetTypeID(prop) != CFNumberGetTypeID() ||
+	    !CFNumberGetValue(static_cast<CFNumberRef>(prop), kCFNumberIntType, &value))
+		return defaultValue;
+	
+	return value;
+}
+
+// Make the DescriptorCache key from the copy of the device descriptor that IOKit read when
+// the device was attached. This doesn't touch the bus, and the device needn't be open.
+SResult<DescriptorCacheKey> MakeCachedDescriptorCacheKey(io_service_t usbDevice, IOUSBDeviceInterface650** dev, const string& serial)
+{
+	// UsbDeviceDescriptor is packed, so these can't be read straight into it.
+	UInt8 deviceClass = 0, deviceSubClass = 0, deviceProtocol = 0, numConfigurations = 0;
+	UInt8 iManufacturer = 0, iProduct = 0, iSerialNumber = 0;
+	UInt16 vendor = 0, product = 0, release = 0;
+	
+	kern_return_t kr = kIOReturnSuccess;
+	auto check = [&](kern_return_t r) { if (kr == kIOReturnSuccess) kr = r; };
+	check((*dev)->GetDeviceClass(dev, &deviceClass));
+	check((*dev)->GetDeviceSubClass(dev, &deviceSubClass));
+	check((*dev)->GetDeviceProtocol(dev, &deviceProtocol));
+	check((*dev)->GetDeviceVendor(dev, &vendor));
+	check((*dev)->GetDeviceProduct(dev, &product));
+	check((*dev)->GetDeviceReleaseNumber(dev, &release));
+	check((*dev)->USBGetManufacturerStringIndex(dev, &iManufacturer));
+	check((*dev)->USBGetProductStringIndex(dev, &iProduct));
+	check((*dev)->USBGetSerialNumberStringIndex(dev, &iSerialNumber));
+	check((*dev)->GetNumberOfConfigurations(dev, &numConfigurations));
+	if (kr != kIOReturnSuccess)
+		return Err("Couldn't get cached device descriptor: " + KernReturnToString(kr));
+	
+	UsbDeviceDescriptor devDesc;
+	devDesc.bLength = sizeof(devDesc);
+	devDesc.bDescriptorType = USB_DEVICE_DESCRIPTOR_TYPE;
+	// There aren't getters for these two, but they are in the registry.
+	devDesc.bcdUSB = GetNumberProperty(usbDevice, CFSTR("bcdUSB"), 0x0200);
+	devDesc.bMaxPacketSize0 = GetNumberProperty(usbDevice, CFSTR("bMaxPacketSize0"), 64);
+	devDesc.bDeviceClass = deviceClass;
+	devDesc.bDeviceSubClass = deviceSubClass;
+	devDesc.bDeviceProtocol = deviceProtocol;
+	devDesc.idVendor = vendor;
+	devDesc.idProduct = product;
+	devDesc.bcdDevice = release;
+	devDesc.iManufacturer = iManufacturer;
+	devDesc.iProduct = iProduct;
+	devDesc.iSerialNumber = iSerialNumber;
+	devDesc.bNumConfigurations = numConfigurations;
+	
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), &devDesc, sizeof(devDesc));
+	key.serial = serial;
+	return Ok(key);
+}
+
+// Read the device descriptor and make the DescriptorCache key from it.
+SResult<DescriptorCacheKey> MakeDescriptorCacheKey(IOUSBDeviceInterface650** dev, const string& serial)
+{
 	UsbDeviceDescriptor devDesc = TRY(GetDeviceDescriptor(dev));
 	
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), &devDesc, sizeof(devDesc));
+	key.serial = serial;
+	return Ok(key);
+}
+
+SResult<DeviceDescriptor> ReadDescriptors(IOUSBDeviceInterface650** dev, const DescriptorCacheKey& key)
+{
+	// If we've seen this device before we don't need to read anything else.
+	SResult<DeviceDescriptor> cached = DescriptorCache::global().lookup(key);
+	if (cached)
+		return cached;
+	
+	DeviceDescriptor desc;
+	
+	UsbDeviceDescriptor devDesc;
+	memcpy(&devDesc, key.deviceDescriptor.data(), sizeof(devDesc));
+	
 	desc.bcdUSB = devDesc.bcdUSB;
 	desc.bDeviceClass = devDesc.bDeviceClass;
 	desc.bDeviceSubClass = devDesc.bDeviceSubClass;
@@ -336,6 +442,8 @@ SResult<DeviceDescriptor> ReadDescriptors(IOUSBDeviceInterface650** dev)
 		
 		desc.configurations.push_back(TRY(ParseConfigurationDescriptor(buffer)));
 	}
+	
+	DescriptorCache::global().store(key, desc);
 	return Ok(desc);
 }
 
@@ -426,6 +534,10 @@ SResult<std::vector<std::shared_ptr<InterfaceWithMetadata>>> OpenInterfaces(IOUS
 		
 		std::shared_ptr<InterfaceWithMetadata> iface = std::make_shared<InterfaceWithMetadata>(interface);
 		
+		UInt8 speed = kUSBDeviceSpeedFull;
+		(*dev)->GetDeviceSpeed(dev, &speed);
+		iface->highSpeed = speed != kUSBDeviceSpeedLow && speed != kUSBDeviceSpeedFull;
+		
 		TRY(iface->refreshPipes());
 		
 		interfaces.push_back(iface);
@@ -434,10 +546,12 @@ SResult<std::vector<std::shared_ptr<InterfaceWithMetadata>>> OpenInterfaces(IOUS
 }
 
 
-SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId address)
+// Find the IOKit service for the device at `path` in the IO registry. Release it with
+// IOObjectRelease().
+SResult<io_service_t> FindUsbService(const string& path)
 {
 	// Ok as far as I can tell the only way to do this is to iterate through all the devices and find
-	// the one with a matching address.path ourselves.
+	// the one with a matching path ourselves.
 	
 	CFMutableDictionaryRef matchingDict = IOServiceMatching(kIOUSBDeviceClassName);
 	if (matchingDict == nullptr)
@@ -447,6 +561,8 @@ SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId address)
 	kern_return_t kr = IOServiceGetMatchingServices(kIOMasterPortDefault, matchingDict, &deviceIterator);
 	if (kr != kIOReturnSuccess)
 		return Err("Couldn’t enumerate USB devices: " + std::to_string(kr));
+	
+	auto ae = make_scope_exit([&] { IOObjectRelease(deviceIterator); });
 
 	while (io_service_t usbDevice = IOIteratorNext(deviceIterator))
 	{
@@ -456,103 +572,145 @@ SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId address)
 		if (kr != kIOReturnSuccess)
 		{
 			cerr << "IORegistryEntryGetPath failed: " << KernReturnToString(kr) << endl;
+			IOObjectRelease(usbDevice);
 			continue;
 		}
 
 		// Check it matches.
-		if (std::string(pathName) != address.path)
-			continue;
-
-		// Yeay this is the device!!
-
-		IOCFPlugInInterface** plugInInterface = nullptr;
-		SInt32 score = 0;
+		if (std::string(pathName) == path)
+			return Ok(usbDevice);
+		
+		IOObjectRelease(usbDevice);
+	}
 
-		kr = IOCreatePlugInInterfaceForService(usbDevice,
-		                                       kIOUSBDeviceUserClientTypeID,
-		                                       kIOCFPlugInInterfaceID,
-		                                       &plugInInterface,
-		                                       &score);
+	return Err(string("Device not found"));
+}
 
-		if (kr != kIOReturnSuccess || plugInInterface == nullptr)
-			return Err("Couldn't create USB plugin: " + KernReturnToString(kr));
+// Create a device interface for a device's service. Nothing is sent to the device, and it
+// isn't opened. Release it with (*dev)->Release(dev).
+SResult<IOUSBDeviceInterface650**> CreateDeviceInterface(io_service_t usbDevice)
+{
+	IOCFPlugInInterface** plugInInterface = nullptr;
+	SInt32 score = 0;
+
+	kern_return_t kr = IOCreatePlugInInterfaceForService(usbDevice,
+	                                                     kIOUSBDeviceUserClientTypeID,
+	                                                     kIOCFPlugInInterfaceID,
+	                                                     &plugInInterface,
+	                                                     &score);
+
+	if (kr != kIOReturnSuccess || plugInInterface == nullptr)
+		return Err("Couldn't create USB plugin: " + KernReturnToString(kr));
+
+	IOUSBDeviceInterface650** dev = nullptr;
+	HRESULT result = (*plugInInterface)->QueryInterface(plugInInterface,
+	                                                    CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID650),
+	                                                    (LPVOID*)&dev);
+	(*plugInInterface)->Release(plugInInterface);
+
+	if (result != S_OK || dev == nullptr)
+		return Err("Couldn’t create a device interface: " + std::to_string(result));
+	
+	return Ok(dev);
+}
 
-		kr = IOObjectRelease(usbDevice);
-		if (kr != kIOReturnSuccess)
-			return Err("Couldn't release USB plugin " + KernReturnToString(kr));
+SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId address)
+{
+	io_service_t usbDevice = TRY(FindUsbService(address.path));
+	auto ae = make_scope_exit([&] { IOObjectRelease(usbDevice); });
 
-		IOUSBDeviceInterface650** dev = nullptr;
-		HRESULT result = (*plugInInterface)->QueryInterface(plugInInterface,
-		                                                    CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID650),
-		                                                    (LPVOID*)&dev);
-		(*plugInInterface)->Release(plugInInterface);
+	string serial = GetSerialNumberProperty(usbDevice);
 
-		if (result != S_OK || dev == nullptr)
-		{
-			return Err("Couldn’t create a device interface: " + std::to_string(result));
-		}
+	IOUSBDeviceInterface650** dev = TRY(CreateDeviceInterface(usbDevice));
 
-		// Open the device. TODO: Seize vs not-seize?
-		kr = (*dev)->USBDeviceOpenSeize(dev);
-		if (kr != kIOReturnSuccess || plugInInterface == nullptr)
-		{
-			(*dev)->Release(dev);
-			return Err("Couldn't open device: " + KernReturnToString(kr));
-		}
+	// Open the device. TODO: Seize vs not-seize?
+	kern_return_t kr = (*dev)->USBDeviceOpenSeize(dev);
+	if (kr != kIOReturnSuccess)
+	{
+		(*dev)->Release(dev);
+		return Err("Couldn't open device: " + KernReturnToString(kr));
+	}
 
-		// Configure the device. This is necessary in almost all cases.
-		// See https://developer.apple.com/library/content/documentation/DeviceDrivers/Conceptual/USBBook/DeviceInterfaces/USBDevInterfaces.html#//apple_ref/doc/uid/TP40002645-TPXREF101
-		// Just above Listing 2-5.
-		kr = ConfigureDevice(dev);
-		if (kr != kIOReturnSuccess)
-		{
-			(*dev)->USBDeviceClose(dev);
-			(*dev)->Release(dev);
-			return Err("Couldn't configure device: " + KernReturnToString(kr));
-		}
-		
-		std::shared_ptr<Device> newDev = std::make_shared<Device>();
-		
-		// After this line the device will be closed properly on return.
-		newDev->data.device = std::make_shared<DeviceInterface>(dev);
-		
-		newDev->data.address = address;
+	// Configure the device. This is necessary in almost all cases.
+	// See https://developer.apple.com/library/content/documentation/DeviceDrivers/Conceptual/USBBook/DeviceInterfaces/USBDevInterfaces.html#//apple_ref/doc/uid/TP40002645-TPXREF101
+	// Just above Listing 2-5.
+	kr = ConfigureDevice(dev);
+	if (kr != kIOReturnSuccess)
+	{
+		(*dev)->USBDeviceClose(dev);
+		(*dev)->Release(dev);
+		return Err("Couldn't configure device: " + KernReturnToString(kr));
+	}
+	
+	std::shared_ptr<Device> newDev = std::make_shared<Device>();
+	
+	// After this line the device will be closed properly on return.
+	newDev->data.device = std::make_shared<DeviceInterface>(dev);
+	
+	newDev->data.address = address;
 
-		// Open all the interfaces. If this fails now, the device should be closed cleanly.
-		newDev->data.interfaces = TRY(OpenInterfaces(dev));
-		
-		// Read the device descriptors.
-		newDev->data.descriptors = TRY(ReadDescriptors(dev));
+	// Open all the interfaces. If this fails now, the device should be closed cleanly.
+	newDev->data.interfaces = TRY(OpenInterfaces(dev));
+	
+	// Read the device descriptors.
+	newDev->data.descriptorCacheKey = TRY(MakeDescriptorCacheKey(dev, serial));
+	newDev->data.descriptors = TRY(ReadDescriptors(dev, newDev->data.descriptorCacheKey));
+	
+	// Add an async event source for the device. This is used for control transfers
+	// and probably also things like device disconnection. Who knows really.
+	CFRunLoopSourceRef runLoopSource;
+	kr = (*dev)->CreateDeviceAsyncEventSource(dev, &runLoopSource);
+	if (kr != kIOReturnSuccess)
+		return Err("Couldn't create device async event source: " + KernReturnToString(kr));
+	
+	CFRunLoopAddSource(newDev->data.runLoop.loop(), runLoopSource, kCFRunLoopCommonModes);
+	
+	// We have to add each interface's async event source to the run loop.
+	for (auto& it : newDev->data.interfaces)
+	{
+		// Add the interfaces as async sources.
+		IOUSBInterfaceInterface700** iface = it->iface();
 		
-		// Add an async event source for the device. This is used for control transfers
-		// and probably also things like device disconnection. Who knows really.
 		CFRunLoopSourceRef runLoopSource;
-		kr = (*dev)->CreateDeviceAsyncEventSource(dev, &runLoopSource);
+		kr = (*iface)->CreateInterfaceAsyncEventSource(iface, &runLoopSource);
 		if (kr != kIOReturnSuccess)
-			return Err("Couldn't create device async event source: " + KernReturnToString(kr));
+			return Err("Couldn't create interface async event source: " + KernReturnToString(kr));
 		
+		FLOG_DEBUG("Adding event loop source");
 		CFRunLoopAddSource(newDev->data.runLoop.loop(), runLoopSource, kCFRunLoopCommonModes);
-		
-		// We have to add each interface's async event source to the run loop.
-		for (auto& it : newDev->data.interfaces)
-		{
-			// Add the interfaces as async sources.
-			IOUSBInterfaceInterface700** iface = it->iface();
-			
-			CFRunLoopSourceRef runLoopSource;
-			kr = (*iface)->CreateInterfaceAsyncEventSource(iface, &runLoopSource);
-			if (kr != kIOReturnSuccess)
-				return Err("Couldn't create interface async event source: " + KernReturnToString(kr));
-			
-			cerr << "Adding event loop source" << endl;
-			CFRunLoopAddSource(newDev->data.runLoop.loop(), runLoopSource, kCFRunLoopCommonModes);
-		}
-		
-		cerr << "Success" << endl;
-		return Ok(newDev);
 	}
+	
+	FLOG_DEBUG("Opened USB device {}", address.path);
+	return Ok(newDev);
+}
 
-	return Err(string("Device not found"));
+SResult<DeviceDescriptor> ReadUsbDeviceDescriptors(DeviceId address)
+{
+	io_service_t usbDevice = TRY(FindUsbService(address.path));
+	auto ae = make_scope_exit([&] { IOObjectRelease(usbDevice); });
+
+	string serial = GetSerialNumberProperty(usbDevice);
+
+	// The device interface is never opened, so whoever has the device open keeps it, and it
+	// isn't configured.
+	IOUSBDeviceInterface650** dev = TRY(CreateDeviceInterface(usbDevice));
+	auto ae2 = make_scope_exit([&] { (*dev)->Release(dev); });
+
+	DescriptorCacheKey key = TRY(MakeCachedDescriptorCacheKey(usbDevice, dev, serial));
+	
+	// GetConfigurationDescriptorPtr() returns IOKit's copies.
+	DeviceDescriptor desc = TRY(ReadDescriptors(dev, key));
+	if (desc.stringsRead)
+		return Ok(desc);
+	
+	// IOKit only keeps the device's strings, so these are read from the device. Requests on
+	// the default pipe don't need it to be open; enumeration does the same.
+	ReadDescriptorStrings(desc, [&](uint8_t index, uint16_t languageId) {
+		return GetDescriptor(dev, DescriptorType::String, index, languageId);
+	});
+	
+	DescriptorCache::global().store(key, desc);
+	return Ok(desc);
 }
 
 #endif
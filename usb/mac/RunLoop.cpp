@@ -35,6 +35,63 @@ CFRunLoopRef RunLoop::loop() const
 	return runLoop;
 }
 
+namespace
+{
+struct PolicyRequest
+{
+	ThreadPolicy policy;
+	SResult<void> result = Ok();
+	bool done = false;
+	std::mutex mutex;
+	std::condition_variable doneWait;
+};
+
+void ApplyPolicyCallback(CFRunLoopTimerRef, void* info)
+{
+	PolicyRequest* request = static_cast<PolicyRequest*>(info);
+	SResult<void> result = ApplyThreadPolicy(request->policy);
+	
+	std::unique_lock<std::mutex> lock(request->mutex);
+	request->result = result;
+	request->done = true;
+	request->doneWait.notify_one();
+}
+}
+
+SResult<void> RunLoop::applyThreadPolicy(const ThreadPolicy& policy)
+{
+	CFRunLoopRef rl = loop();
+	if (rl == nullptr)
+		return Err(std::string("Run loop isn't running"));
+	
+	// From a transfer callback the timer would never fire, since we'd be blocking the loop
+	// that has to run it.
+	if (std::this_thread::get_id() == thread.get_id())
+		return ApplyThreadPolicy(policy);
+	
+	PolicyRequest request;
+	request.policy = policy;
+	
+	// Policies can only be applied by the thread itself, so run a one-shot timer on it.
+	CFRunLoopTimerContext context;
+	std::memset(&context, 0, sizeof(context));
+	context.info = &request;
+	CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent(), 0, 0, 0,
+	                                               &ApplyPolicyCallback, &context);
+	CFRunLoopAddTimer(rl, timer, kCFRunLoopCommonModes);
+	CFRunLoopWakeUp(rl);
+	
+	{
+		std::unique_lock<std::mutex> lock(request.mutex);
+		while (!request.done)
+			request.doneWait.wait(lock);
+	}
+	
+	CFRunLoopTimerInvalidate(timer);
+	CFRelease(timer);
+	return request.result;
+}
+
 void RunLoop::run()
 {
 	// Lock the mutex.
@@ -8,6 +8,8 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 
+#include "../../util/ThreadPolicy.h"
+
 // For asynchronous events on OSX, you have to manually create
 // a thread and call their run loop function. Then other threads can add
 // event sources to it.
@@ -21,6 +23,11 @@ public:
 	// (although currently in that case RunLoop() will freeze forever).
 	CFRunLoopRef loop() const;
 	
+	// Apply a scheduling policy to the run loop thread, which is where transfer callbacks run.
+	// Blocks until it has been applied. Can be called on the run loop thread too, e.g. from
+	// a callback, in which case it is applied straight away.
+	SResult<void> applyThreadPolicy(const ThreadPolicy& policy);
+	
 private:
 	RunLoop(const RunLoop&) = delete;
 	RunLoop& operator=(const RunLoop&) = delete;
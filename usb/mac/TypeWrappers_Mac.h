@@ -3,6 +3,8 @@
 #include <memory>
 #include <IOKit/usb/IOUSBLib.h>
 
+#include "util/FastLog.h"
+
 // Wrappers for some OSX types that close their resources when they go out of scope.
 // These classes cannot be copied so they generally have to be encapsulated in a shared_ptr.
 
@@ -74,7 +76,7 @@ public:
 	{
 		if (mBuffer != nullptr && mIface)
 		{
-			std::cout << "Destroying low latency buffer: " << static_cast<void*>(mBuffer) << std::endl;
+			FLOG_DEBUG("Destroying low latency buffer: {}", static_cast<void*>(mBuffer));
 			(*mIface->iface())->LowLatencyDestroyBuffer(mIface->iface(), mBuffer);
 		}
 	}
@@ -308,4 +308,37 @@ std::string KernReturnToString(kern_return_t kr)
 	return r;
 }
 
+TransferError KernReturnToTransferError(kern_return_t kr)
+{
+	switch (kr)
+	{
+	case kIOUSBPipeStalled:
+		return TransferError::Stall;
+	case kIOUSBWrongPIDErr:
+	case kIOUSBPIDCheckErr:
+	case kIOUSBDataToggleErr:
+	case kIOUSBBitstufErr:
+	case kIOUSBCRCErr:
+		return TransferError::Transmission;
+	case kIOReturnTimeout:
+	case kIOUSBTransactionTimeout:
+		return TransferError::Timeout;
+	case kIOReturnAborted:
+		return TransferError::Cancelled;
+	case kIOReturnOverrun:
+	case kIOUSBBufferOverrunErr:
+		return TransferError::Overrun;
+	case kIOReturnUnderrun:
+	case kIOUSBBufferUnderrunErr:
+		return TransferError::Underrun;
+	case kIOReturnNotResponding:
+	case kIOReturnNoDevice:
+	case kIOReturnNotAttached:
+	case kIOReturnOffline:
+		return TransferError::NotResponding;
+	default:
+		return TransferError::Other;
+	}
+}
+
 #endif
@@ -6,8 +6,13 @@
 
 #include <mach/mach.h>
 
+#include "../EndpointCounters.h"
+
 // Convert a kern_return_t error to a string. Only some errors are recognised
 // - generic ones, and some IOKit errors.
 std::string KernReturnToString(kern_return_t kr);
 
+// Classify a failed transfer's kern_return_t for the endpoint counters.
+TransferError KernReturnToTransferError(kern_return_t kr);
+
 #endif
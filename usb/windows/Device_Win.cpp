@@ -21,6 +21,40 @@ using std::string;
 #include <SetupAPI.h>
 #include <Usbiodef.h>
 
+// WinUsb only has per-pipe timeouts, so set the default control pipe's timeout before each
+// transfer if it is different from last time. The caller serialises transfers to a device
+// (UsbThread runs each device on its own strand) so this doesn't race.
+static SResult<void> SetControlTimeout(UsbDeviceData& data, uint32_t timeoutMs)
+{
+	if (data.controlTimeoutMs == timeoutMs)
+		return Ok();
+	
+	ULONG timeout = timeoutMs;
+	BOOL result = WinUsb_SetPipePolicy(data.winUsbInterfaceHandle->handle, 0, PIPE_TRANSFER_TIMEOUT, sizeof(timeout), &timeout);
+	if (result == FALSE)
+		return Err("WinUsb_SetPipePolicy: " + GetLastErrorAsString());
+	
+	data.controlTimeoutMs = timeoutMs;
+	return Ok();
+}
+
+// Create the OVERLAPPED for an asynchronous transfer. The kernel keeps a pointer to it until the
+// transfer is finished, so if the last handle to it is dropped while the transfer is running
+// we cancel the transfer and wait for it to finish before freeing it.
+static std::shared_ptr<Overlapped> MakeTransferOverlapped(std::shared_ptr<WindowsHandle> deviceHandle,
+                                                          std::shared_ptr<WinUsbInterfaceHandle> interfaceHandle)
+{
+	return std::shared_ptr<Overlapped>(new Overlapped, [deviceHandle, interfaceHandle](Overlapped* o) {
+		if (o->overlapped.hEvent != nullptr && !HasOverlappedIoCompleted(&o->overlapped))
+		{
+			CancelIoEx(deviceHandle->handle, &o->overlapped);
+			DWORD numBytes = 0;
+			WinUsb_GetOverlappedResult(interfaceHandle->handle, &o->overlapped, &numBytes, TRUE);
+		}
+		delete o;
+	});
+}
+
 // Return true if this is associated with a device (instead of default-constructed or closed).
 bool Device::isOpen() const
 {
@@ -59,47 +93,67 @@ SResult<Device::Speed> Device::speed() const
 	return Err("Unknown device speed: " + std::to_string(deviceSpeed));
 }
 
-SResult<std::vector<uint8_t> > Device::controlTransferInSync(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+SResult<std::vector<uint8_t> > Device::controlTransferInSync(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint32_t timeoutMs)
 {
 	if (!isOpen())
 		return Err(string("Device not open"));
 	
+	MSTRY(SetControlTimeout(data, timeoutMs));
+	
 	std::vector<uint8_t> buffer(wLength);
 	
 	WINUSB_SETUP_PACKET setup;
-	setup.RequestType = to_integral(Recipient::Device) | to_integral(type) | to_integral(Direction::In);
+	setup.RequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::In);
 	setup.Request = bRequest;
 	setup.Value = wValue;
 	setup.Index = wIndex;
-	setup.Length = 0;
+	setup.Length = wLength;
+	
+	counters->submitted(to_integral(Direction::In));
 	
 	ULONG transferred = 0;
 	BOOL result = WinUsb_ControlTransfer(data.winUsbInterfaceHandle->handle, setup, buffer.data(), buffer.size(), &transferred, nullptr);
 	if (result == FALSE)
-		return Err("WinUsb_ControlTransfer: " + GetLastErrorAsString());
+	{
+		DWORD lastError = GetLastError();
+		counters->failed(to_integral(Direction::In), LastErrorToTransferError(lastError));
+		return Err("WinUsb_ControlTransfer: " + LastErrorAsString(lastError));
+	}
 	
-	if (transferred != buffer.size())
-		return Err("WinUsb_ControlTransfer: Transferred " + std::to_string(transferred) + " Expected: " + std::to_string(buffer.size()));
+	counters->completed(to_integral(Direction::In), transferred);
+	
+	// The device may send less than was asked for.
+	buffer.resize(transferred);
 	
 	return Ok(buffer);
 }
 
-SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat)
+SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat, uint32_t timeoutMs)
 {
 	if (!isOpen())
 		return Err(string("Device not open"));
 	
+	MSTRY(SetControlTimeout(data, timeoutMs));
+	
 	WINUSB_SETUP_PACKET setup;
-	setup.RequestType = to_integral(Recipient::Device) | to_integral(type) | to_integral(Direction::Out);
+	setup.RequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::Out);
 	setup.Request = bRequest;
 	setup.Value = wValue;
 	setup.Index = wIndex;
 	setup.Length = dat.size();
 	
+	counters->submitted(to_integral(Direction::Out));
+	
 	ULONG transferred = 0;
 	BOOL result = WinUsb_ControlTransfer(data.winUsbInterfaceHandle->handle, setup, const_cast<uint8_t*>(dat.data()), dat.size(), &transferred, nullptr);
 	if (result == FALSE)
-		return Err("WinUsb_ControlTransfer: " + GetLastErrorAsString());
+	{
+		DWORD lastError = GetLastError();
+		counters->failed(to_integral(Direction::Out), LastErrorToTransferError(lastError));
+		return Err("WinUsb_ControlTransfer: " + LastErrorAsString(lastError));
+	}
+	
+	counters->completed(to_integral(Direction::Out), transferred);
 	
 	if (transferred != dat.size())
 		return Err("WinUsb_ControlTransfer: Transferred " + std::to_string(transferred) + " Expected: " + std::to_string(dat.size()));
@@ -107,15 +161,18 @@ SResult<void> Device::controlTransferOutSync(Device::Recipient recipient, Device
 	return Ok();
 }
 
-SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint32_t timeoutMs)
 {
 	if (!isOpen())
 		return Err(string("Device not open"));
 	
+	MSTRY(SetControlTimeout(data, timeoutMs));
+	
 	// OVERLAPPED must be at a fixed memory address!
 	UsbTransferHandle transfer;
 	transfer.interfaceHandle = data.winUsbInterfaceHandle;
-	transfer.overlapped.reset(new Overlapped);
+	transfer.deviceHandle = data.deviceHandle;
+	transfer.overlapped = MakeTransferOverlapped(data.deviceHandle, data.winUsbInterfaceHandle);
 	
 	transfer.overlapped->overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
 
@@ -126,12 +183,16 @@ SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient
 	
 	transfer.transferred.reset(new uint32_t(0));
 	
+	transfer.counters = counters;
+	transfer.counted = std::make_shared<std::atomic_bool>(false);
+	transfer.endpointAddress = to_integral(Direction::In);
+	
 	WINUSB_SETUP_PACKET setup;
-	setup.RequestType = to_integral(Recipient::Device) | to_integral(type) | to_integral(Direction::In);
+	setup.RequestType = to_integral(recipient) | to_integral(type) | to_integral(Direction::In);
 	setup.Request = bRequest;
 	setup.Value = wValue;
 	setup.Index = wIndex;
-	setup.Length = 0;
+	setup.Length = wLength;
 
 	BOOL result = WinUsb_ControlTransfer(data.winUsbInterfaceHandle->handle,
 	                                     setup,
@@ -142,13 +203,19 @@ SResult<UsbTransferHandle> Device::controlTransferIn(Device::Recipient recipient
 
 	DWORD lastError = GetLastError();
 	
+	counters->submitted(transfer.endpointAddress);
+	
 	if (result == FALSE && lastError != ERROR_IO_PENDING)
+	{
+		transfer.counted->store(true);
+		counters->failed(transfer.endpointAddress, LastErrorToTransferError(lastError));
 		return Err("WinUsb_ControlTransfer: " + LastErrorAsString(lastError));
+	}
 	
 	return Ok(transfer);
 }
 
-SResult<UsbTransferHandle> Device::controlTransferOut(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat)
+SResult<UsbTransferHandle> Device::controlTransferOut(Device::Recipient recipient, Device::Type type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::vector<uint8_t> dat, uint32_t timeoutMs)
 {
 	return Err(string("Not implemented"));
 }
@@ -196,16 +263,67 @@ SResult<std::vector<uint8_t>> UsbTransferHandle::result(bool block)
 	            block
 	            );
 	
+	DWORD lastError = result == FALSE ? GetLastError() : ERROR_SUCCESS;
+	
+	// Count the transfer the first time we see that it has finished.
+	if (counters && counted && lastError != ERROR_IO_INCOMPLETE && !counted->exchange(true))
+	{
+		if (result == FALSE)
+			counters->failed(endpointAddress, LastErrorToTransferError(lastError));
+		else
+			counters->completed(endpointAddress, numBytes);
+	}
+	
 	if (result == FALSE)
-		return Err("WinUsb_GetOverlappedResult: " + GetLastErrorAsString());
+		return Err("WinUsb_GetOverlappedResult: " + LastErrorAsString(lastError));
+	
+	// The device may send less than was asked for, as in controlTransferInSync().
+	if (endpointAddress & 0x80)
+	{
+		if (numBytes > buffer->size())
+			return Err("WinUsb_GetOverlappedResult: Received " + std::to_string(numBytes) + " bytes, expected at most " + std::to_string(buffer->size()));
+		return Ok(std::vector<uint8_t>(buffer->begin(), buffer->begin() + numBytes));
+	}
 	
 	if (numBytes != buffer->size())
-		return Err("WinUsb_GetOverlappedResult: Received " + std::to_string(numBytes) + " bytes, expected " + std::to_string(buffer->size()));
+		return Err("WinUsb_GetOverlappedResult: Sent " + std::to_string(numBytes) + " bytes, expected " + std::to_string(buffer->size()));
 	
 	return Ok(*buffer);
 }
 
 
+SResult<std::vector<uint8_t>> UsbTransferHandle::resultWithin(uint32_t timeoutMs)
+{
+	if (!interfaceHandle || !overlapped || !transferred || !buffer)
+		return Err(string("Transfer not started"));
+	
+	if (WaitForSingleObject(overlapped->overlapped.hEvent, timeoutMs) == WAIT_TIMEOUT)
+	{
+		cancel();
+		// Wait for the cancellation to finish.
+		result(true);
+		return Err("Transfer timed out after " + std::to_string(timeoutMs) + " ms");
+	}
+	
+	return result(false);
+}
+
+SResult<void> UsbTransferHandle::cancel()
+{
+	if (!deviceHandle || !overlapped)
+		return Err(string("Transfer not started"));
+	
+	if (CancelIoEx(deviceHandle->handle, &overlapped->overlapped) == FALSE)
+	{
+		DWORD lastError = GetLastError();
+		// It already finished.
+		if (lastError == ERROR_NOT_FOUND)
+			return Ok();
+		return Err("CancelIoEx: " + LastErrorAsString(lastError));
+	}
+	return Ok();
+}
+
 SResult<int> UsbIsochTransferHandle::result(bool block)
 {
 	if (!interfaceHandle || !overlapped)
@@ -225,6 +343,64 @@ SResult<int> UsbIsochTransferHandle::result(bool block)
 	return Ok(static_cast<int>(numBytes));
 }
 
+SResult<int> UsbIsochTransferHandle::resultWithin(uint32_t timeoutMs)
+{
+	if (!interfaceHandle || !overlapped)
+		return Err(string("Transfer not started"));
+	
+	if (WaitForSingleObject(overlapped->overlapped.hEvent, timeoutMs) == WAIT_TIMEOUT)
+	{
+		cancel();
+		// Wait for the cancellation to finish.
+		result(true);
+		return Err("Isoch transfer timed out after " + std::to_string(timeoutMs) + " ms");
+	}
+	
+	return result(false);
+}
+
+SResult<void> UsbIsochTransferHandle::cancel()
+{
+	if (!deviceHandle || !overlapped)
+		return Err(string("Transfer not started"));
+	
+	if (CancelIoEx(deviceHandle->handle, &overlapped->overlapped) == FALSE)
+	{
+		DWORD lastError = GetLastError();
+		if (lastError == ERROR_NOT_FOUND)
+			return Ok();
+		return Err("CancelIoEx: " + LastErrorAsString(lastError));
+	}
+	return Ok();
+}
+
+SResult<void> Device::abortPipe(int iface, uint8_t endpointAddress)
+{
+	if (!isOpen())
+		return Err(string("Device not open"));
+	
+	// WinUsb_AbortPipe() doesn't accept the default control pipe, so cancel all the
+	// I/O on the device handle instead. This also cancels pending bulk/interrupt
+	// transfers, but there's no finer-grained way to do it.
+	if ((endpointAddress & 0x0F) == 0)
+	{
+		if (CancelIoEx(data.deviceHandle->handle, nullptr) == FALSE && GetLastError() != ERROR_NOT_FOUND)
+			return Err("CancelIoEx: " + GetLastErrorAsString());
+		return Ok();
+	}
+	
+	if (iface < 0 || iface >= data.winUsbAssocInterfaceHandles.size() + 1)
+		return Err("Interface out of range: " + std::to_string(iface));
+	
+	std::shared_ptr<WinUsbInterfaceHandle>& interfaceHandle = iface == 0 ? data.winUsbInterfaceHandle : data.winUsbAssocInterfaceHandles[iface - 1];
+	
+	BOOL result = WinUsb_AbortPipe(interfaceHandle->handle, endpointAddress);
+	if (result == FALSE)
+		return Err("WinUsb_AbortPipe: " + GetLastErrorAsString());
+	
+	return Ok();
+}
+
 //SResult<UsbIsochTransferHandle> Device::submitIsoOutTransferAsap(const UsbIsochBufferHandle& bufferHandle,
 //                                                                       int offset,
 //                                                                       int size,
@@ -303,9 +479,35 @@ SResult<void> Device::setAlternate(int iface, uint8_t alternate)
 	return Ok();
 }
 
+SResult<IsochReadBuffer> Device::createIsochReadBuffer(int iface, uint8_t endpointAddress, int numFrames, int bytesPerFrame)
+{
+	return Err(string("Unimplemented"));
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoInTransferAsap(const IsochReadBuffer& buffer, bool continueStream)
+{
+	return Err(string("Unimplemented"));
+}
+
+SResult<UsbIsochTransferHandle> Device::submitIsoInTransfer(const IsochReadBuffer& buffer, uint64_t frame)
+{
+	return Err(string("Unimplemented"));
+}
+
 uint64_t Device::getBusFrameNumber()
 {
 	return 0;
 }
 
+uint64_t Device::getBusMicroframeNumber()
+{
+	return 0;
+}
+
+SResult<void> Device::setCallbackThreadPolicy(const ThreadPolicy& policy)
+{
+	// Overlapped I/O completes on whichever thread waits for it, so there's nothing to do.
+	return Ok();
+}
+
 #endif
@@ -2,7 +2,13 @@
 
 #if defined(_WIN32)
 
+#include <atomic>
+#include <memory>
+
 #include "TypeWrappers_Win.h"
+#include "../EndpointCounters.h"
+#include "../IsochFrame.h"
+#include "../DescriptorCache.h"
 
 class UsbIsochBufferHandle
 {
@@ -15,11 +21,18 @@ public:
 // Handle to an asynchronous normal pipe operation.
 class UsbTransferHandle
 {
-	friend class UsbDevice;
+	friend class Device;
 public:
 	
 	// Returns bytes transferred on success, except it always is 0.
 	SResult<std::vector<uint8_t>> result(bool block = true);
+	
+	// Wait at most `timeoutMs` for the result. If the transfer still hasn't finished
+	// it is cancelled and this returns an error.
+	SResult<std::vector<uint8_t>> resultWithin(uint32_t timeoutMs);
+	
+	// Cancel the transfer if it hasn't finished.
+	SResult<void> cancel();
 
 //private:
 	// These must always stay at fixed addresses.
@@ -28,32 +41,67 @@ public:
 	// the whole class in one.
 	std::shared_ptr<std::vector<uint8_t>> buffer;
 	std::shared_ptr<uint32_t> transferred;
+	// If the last reference to this is dropped while the transfer is running it is cancelled
+	// and waited for. See MakeTransferOverlapped().
 	std::shared_ptr<Overlapped> overlapped;
 	std::shared_ptr<WinUsbInterfaceHandle> interfaceHandle;
+	// CancelIoEx() needs the file handle.
+	std::shared_ptr<WindowsHandle> deviceHandle;
+	
+	// The counters are updated the first time result() sees the transfer finish.
+	std::shared_ptr<EndpointCounters> counters;
+	std::shared_ptr<std::atomic_bool> counted;
+	uint8_t endpointAddress = 0;
 };
 
 class UsbIsochTransferHandle
 {
-	friend class UsbDevice;
+	friend class Device;
 public:
 	
 	// Returns bytes transferred on success, except it always is 0.
 	SResult<int> result(bool block = true);
+	
+	// Wait at most `timeoutMs` for the result. If the transfer still hasn't finished
+	// it is cancelled and this returns an error.
+	SResult<int> resultWithin(uint32_t timeoutMs);
+	
+	// Cancel the transfer if it hasn't finished.
+	SResult<void> cancel();
 
 private:
 	// TODO: This should keep a reference to the isoch buffer too.
-	// TODO: This should probably block for the transfer to complete (if it hasn't) in the 
-	// descructor. Otherwise what happens if you destroy it while the transfer is running?
+	//
+	// Destroying the last copy of the handle while the transfer is running cancels it and
+	// blocks until the kernel has finished with the OVERLAPPED. See MakeTransferOverlapped().
 	std::shared_ptr<Overlapped> overlapped;
 	std::shared_ptr<WinUsbInterfaceHandle> interfaceHandle;
+	std::shared_ptr<WindowsHandle> deviceHandle;
 };
 
+// Isochronous transfers aren't implemented with WinUsb yet.
 class IsochReadBuffer
 {
+public:
+	const uint8_t* data() const { return nullptr; }
+	int size() const { return 0; }
+	IsochFrameResult frameResult(int frame) const { return IsochFrameResult(); }
+	
+	int numFrames = 0;
+	int bytesPerFrame = 0;
+	int entriesPerFrame = 1;
 };
 
 class IsochWriteBuffer
 {
+public:
+	uint8_t* data() { return nullptr; }
+	int size() { return 0; }
+	
+	int numFrames = 0;
+	int bytesPerFrame = 0;
+	int entriesPerFrame = 1;
+	std::vector<int> frameLengths;
 };
 
 struct UsbDeviceData
@@ -74,8 +122,15 @@ struct UsbDeviceData
 	// Cached.
 	DeviceDescriptor descriptors;
 	
+	// Where `descriptors` is stored in the DescriptorCache.
+	DescriptorCacheKey descriptorCacheKey;
+	
 	// The device address.
 	DeviceId address;
+	
+	// WinUsb timeouts are per-pipe, so this is the timeout currently set on the
+	// default control pipe. It is only changed when a transfer asks for a different one.
+	uint32_t controlTimeoutMs = 0;
 };
 
 #endif
@@ -4,6 +4,7 @@
 #include <regex>
 #include <codecvt>
 #include <string>
+#include <string.h>
 
 using std::string;
 
@@ -20,6 +21,7 @@ using std::string;
 #include <windows.h>
 #include <SetupAPI.h>
 #include <Usbiodef.h>
+#include <usbioctl.h>
 
 // These are slightly annoying duplicates that are needed for getting the product & vendor name during enumeration.
 SResult<std::vector<uint8_t>> ControlTransferInSync(WINUSB_INTERFACE_HANDLE handle,
@@ -37,7 +39,7 @@ SResult<std::vector<uint8_t>> ControlTransferInSync(WINUSB_INTERFACE_HANDLE hand
 	setup.Request = bRequest;
 	setup.Value = wValue;
 	setup.Index = wIndex;
-	setup.Length = 0;
+	setup.Length = wLength;
 	
 	ULONG transferred = 0;
 	BOOL result = WinUsb_ControlTransfer(handle, setup, buffer.data(), buffer.size(), &transferred, nullptr);
@@ -50,7 +52,7 @@ SResult<std::vector<uint8_t>> ControlTransferInSync(WINUSB_INTERFACE_HANDLE hand
 	return Ok(buffer);
 }
 
-SResult<std::vector<uint8_t>> GetDescriptor(WINUSB_INTERFACE_HANDLE handle, DescriptorType type, uint8_t index, uint8_t languageId)
+SResult<std::vector<uint8_t>> GetDescriptor(WINUSB_INTERFACE_HANDLE handle, DescriptorType type, uint8_t index, uint16_t languageId)
 {
 	// First get the (length, type) header.
 	std::vector<uint8_t> header = TRY(ControlTransferInSync(handle,
@@ -225,10 +227,33 @@ SResult<std::vector<DeviceInfo>> EnumerateAvailableDevices()
 	return Ok(devInfos);
 }
 
-SResult<DeviceDescriptor> ReadDescriptors(WINUSB_INTERFACE_HANDLE interfaceHandle)
+// Get the serial number from a device path like \\?\usb#vid_2ac7&pid_fffe#abcd123456789#{...}.
+// If the device has no serial number Windows makes up an instance ID containing '&'s
+// instead, in which case this returns an empty string.
+string SerialFromPath(const std::wstring& wpath)
 {
-	DeviceDescriptor desc;
+	string path = std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(wpath);
+	
+	size_t start = path.find('#');
+	if (start == string::npos)
+		return string();
+	start = path.find('#', start + 1);
+	if (start == string::npos)
+		return string();
+	++start;
+	size_t end = path.find('#', start);
+	if (end == string::npos)
+		return string();
 	
+	string serial = path.substr(start, end - start);
+	if (serial.find('&') != string::npos)
+		return string();
+	return serial;
+}
+
+// Read the device descriptor and make the DescriptorCache key from it.
+SResult<DescriptorCacheKey> MakeDescriptorCacheKey(WINUSB_INTERFACE_HANDLE interfaceHandle, const string& serial)
+{
 	ULONG transferred = 0;
 	UsbDeviceDescriptor deviceDescriptor;
 	
@@ -245,6 +270,27 @@ SResult<DeviceDescriptor> ReadDescriptors(WINUSB_INTERFACE_HANDLE interfaceHandl
 	if (bResult == FALSE || transferred != sizeof(UsbDeviceDescriptor))
 		return Err("WinUsb_GetDescriptor: " + GetLastErrorAsString());
 	
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), &deviceDescriptor, sizeof(deviceDescriptor));
+	key.serial = serial;
+	return Ok(key);
+}
+
+SResult<DeviceDescriptor> ReadDescriptors(WINUSB_INTERFACE_HANDLE interfaceHandle, const DescriptorCacheKey& key)
+{
+	// If we've seen this device before we don't need to read anything else.
+	SResult<DeviceDescriptor> cached = DescriptorCache::global().lookup(key);
+	if (cached)
+		return cached;
+	
+	DeviceDescriptor desc;
+	
+	ULONG transferred = 0;
+	BOOL bResult = FALSE;
+	
+	UsbDeviceDescriptor deviceDescriptor;
+	memcpy(&deviceDescriptor, key.deviceDescriptor.data(), sizeof(deviceDescriptor));
+	
 	desc.bcdUSB = deviceDescriptor.bcdUSB;
 	desc.bDeviceClass = deviceDescriptor.bDeviceClass;
 	desc.bDeviceSubClass = deviceDescriptor.bDeviceSubClass;
@@ -292,6 +338,7 @@ SResult<DeviceDescriptor> ReadDescriptors(WINUSB_INTERFACE_HANDLE interfaceHandl
 		desc.configurations.push_back(TRY(ParseConfigurationDescriptor(buffer)));
 	}
 	
+	DescriptorCache::global().store(key, desc);
 	return Ok(desc);
 }
 
@@ -342,10 +389,133 @@ SResult<std::shared_ptr<Device>> OpenUsbDevice(DeviceId id)
 		newDev->data.winUsbAssocInterfaceHandles.emplace_back(new WinUsbInterfaceHandle(iface));
 	}
 	
-	newDev->data.descriptors = TRY(ReadDescriptors(newDev->data.winUsbInterfaceHandle->handle));
+	newDev->data.address = id;
+	
+	// Set a timeout on the default control pipe so a broken device can't hang us forever.
+	ULONG timeout = Device::DEFAULT_TIMEOUT_MS;
+	bResult = WinUsb_SetPipePolicy(newDev->data.winUsbInterfaceHandle->handle, 0, PIPE_TRANSFER_TIMEOUT, sizeof(timeout), &timeout);
+	if (bResult == FALSE)
+		return Err("WinUsb_SetPipePolicy: " + GetLastErrorAsString());
+	
+	newDev->data.controlTimeoutMs = timeout;
+	
+	newDev->data.descriptorCacheKey = TRY(MakeDescriptorCacheKey(newDev->data.winUsbInterfaceHandle->handle, SerialFromPath(id.path)));
+	newDev->data.descriptors = TRY(ReadDescriptors(newDev->data.winUsbInterfaceHandle->handle, newDev->data.descriptorCacheKey));
 
 	return Ok(newDev);
 }
 
+// Read a descriptor through the hub the device is plugged into. The hub driver sends the
+// request on the device's default pipe, so the device doesn't have to be opened.
+SResult<std::vector<uint8_t>> GetDescriptorFromHub(HANDLE hub, uint32_t port, uint8_t type, uint8_t index, uint16_t languageId, uint16_t length)
+{
+	std::vector<uint8_t> buffer(sizeof(USB_DESCRIPTOR_REQUEST) + length);
+	
+	USB_DESCRIPTOR_REQUEST* request = reinterpret_cast<USB_DESCRIPTOR_REQUEST*>(buffer.data());
+	request->ConnectionIndex = port;
+	request->SetupPacket.bmRequest = to_integral(Device::Recipient::Device) | to_integral(Device::Type::Standard) | to_integral(Device::Direction::In);
+	request->SetupPacket.bRequest = USB_GET_DESCRIPTOR_REQUEST;
+	request->SetupPacket.wValue = (type << 8) | index;
+	request->SetupPacket.wIndex = languageId;
+	request->SetupPacket.wLength = length;
+	
+	DWORD returned = 0;
+	BOOL bResult = DeviceIoControl(hub,
+	                               IOCTL_USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION,
+	                               buffer.data(),
+	                               buffer.size(),
+	                               buffer.data(),
+	                               buffer.size(),
+	                               &returned,
+	                               nullptr);
+	if (bResult == FALSE)
+		return Err("IOCTL_USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION: " + GetLastErrorAsString());
+	
+	if (returned < sizeof(USB_DESCRIPTOR_REQUEST))
+		return Err("IOCTL_USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION: Returned " + std::to_string(returned) + " bytes");
+	
+	return Ok(std::vector<uint8_t>(buffer.begin() + sizeof(USB_DESCRIPTOR_REQUEST), buffer.begin() + returned));
+}
+
+SResult<DeviceDescriptor> ReadUsbDeviceDescriptors(DeviceId id)
+{
+	HubPort hubPort = TRY(FindHubPort(id.path));
+	
+	// Hubs can be opened by any number of programs at once.
+	HANDLE hubHandle = CreateFileW(hubPort.hubPath.c_str(),
+		GENERIC_WRITE,
+		FILE_SHARE_WRITE,
+		nullptr,
+		OPEN_EXISTING,
+		0,
+		nullptr);
+	
+	if (hubHandle == INVALID_HANDLE_VALUE)
+		return Err("CreateFileW: Invalid hub handle: " + GetLastErrorAsString());
+	
+	WindowsHandle hub(hubHandle);
+	
+	// The hub driver keeps the device descriptor it read when the device was attached.
+	USB_NODE_CONNECTION_INFORMATION_EX connection;
+	memset(&connection, 0, sizeof(connection));
+	connection.ConnectionIndex = hubPort.port;
+	
+	DWORD returned = 0;
+	BOOL bResult = DeviceIoControl(hub.handle,
+	                               IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+	                               &connection,
+	                               sizeof(connection),
+	                               &connection,
+	                               sizeof(connection),
+	                               &returned,
+	                               nullptr);
+	if (bResult == FALSE)
+		return Err("IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX: " + GetLastErrorAsString());
+	
+	static_assert(sizeof(connection.DeviceDescriptor) == sizeof(UsbDeviceDescriptor), "Unexpected USB_DEVICE_DESCRIPTOR size");
+	
+	DescriptorCacheKey key;
+	memcpy(key.deviceDescriptor.data(), &connection.DeviceDescriptor, sizeof(UsbDeviceDescriptor));
+	key.serial = SerialFromPath(id.path);
+	
+	SResult<DeviceDescriptor> cached = DescriptorCache::global().lookup(key);
+	if (cached && cached.unwrap().stringsRead)
+		return cached;
+	
+	DeviceDescriptor desc;
+	if (cached)
+	{
+		desc = cached.unwrap();
+	}
+	else
+	{
+		std::vector<uint8_t> raw(key.deviceDescriptor.begin(), key.deviceDescriptor.end());
+		desc = TRY(ParseDeviceDescriptor(raw));
+		
+		for (int index = 0; index < desc.bNumConfigurations; ++index)
+		{
+			// Read the configuration descriptor to get its total length, then the whole thing.
+			std::vector<uint8_t> header = TRY(GetDescriptorFromHub(hub.handle, hubPort.port, USB_CONFIGURATION_DESCRIPTOR_TYPE, index, 0,
+			                                                       sizeof(UsbConfigurationDescriptor)));
+			if (header.size() != sizeof(UsbConfigurationDescriptor))
+				return Err("Configuration descriptor " + std::to_string(index) + " is too short");
+			
+			UsbConfigurationDescriptor configDescriptor;
+			memcpy(&configDescriptor, header.data(), sizeof(configDescriptor));
+			
+			std::vector<uint8_t> buffer = TRY(GetDescriptorFromHub(hub.handle, hubPort.port, USB_CONFIGURATION_DESCRIPTOR_TYPE, index, 0,
+			                                                       configDescriptor.wTotalLength));
+			desc.configurations.push_back(TRY(ParseConfigurationDescriptor(buffer)));
+		}
+	}
+	
+	ReadDescriptorStrings(desc, [&](uint8_t index, uint16_t languageId) {
+		return GetDescriptorFromHub(hub.handle, hubPort.port, USB_STRING_DESCRIPTOR_TYPE, index, languageId, 255);
+	});
+	
+	DescriptorCache::global().store(key, desc);
+	return Ok(desc);
+}
+
 
 #endif
@@ -2,7 +2,14 @@
 
 #if defined(_WIN32)
 
+#include "util/scope_exit.h"
+
+#include <vector>
+
 #include <windows.h>
+#include <SetupAPI.h>
+#include <cfgmgr32.h>
+#include <Usbiodef.h>
 
 std::string GetLastErrorAsString()
 {
@@ -32,4 +39,93 @@ std::string LastErrorAsString(uint32_t error)
 	return message;
 }
 
+TransferError LastErrorToTransferError(uint32_t error)
+{
+	switch (error)
+	{
+	// WinUsb reports a stalled pipe as a generic failure.
+	case ERROR_GEN_FAILURE:
+		return TransferError::Stall;
+	case ERROR_SEM_TIMEOUT:
+	case WAIT_TIMEOUT:
+		return TransferError::Timeout;
+	case ERROR_OPERATION_ABORTED:
+	case ERROR_CANCELLED:
+		return TransferError::Cancelled;
+	case ERROR_MORE_DATA:
+		return TransferError::Overrun;
+	case ERROR_BAD_COMMAND:
+	case ERROR_DEVICE_NOT_CONNECTED:
+	case ERROR_NO_SUCH_DEVICE:
+		return TransferError::NotResponding;
+	default:
+		return TransferError::Other;
+	}
+}
+
+SResult<HubPort> FindHubPort(const std::wstring& devicePath)
+{
+	HDEVINFO deviceInfoSet = SetupDiCreateDeviceInfoList(nullptr, nullptr);
+	if (deviceInfoSet == INVALID_HANDLE_VALUE)
+		return Err("SetupDiCreateDeviceInfoList: " + GetLastErrorAsString());
+	
+	auto se = make_scope_exit([&] { SetupDiDestroyDeviceInfoList(deviceInfoSet); });
+	
+	SP_DEVICE_INTERFACE_DATA interfaceData;
+	interfaceData.cbSize = sizeof(interfaceData);
+	if (SetupDiOpenDeviceInterfaceW(deviceInfoSet, devicePath.c_str(), 0, &interfaceData) == FALSE)
+		return Err("SetupDiOpenDeviceInterfaceW: " + GetLastErrorAsString());
+	
+	// This fails for lack of a detail buffer, but still fills in the device info.
+	SP_DEVINFO_DATA devInfo;
+	devInfo.cbSize = sizeof(devInfo);
+	if (SetupDiGetDeviceInterfaceDetailW(deviceInfoSet, &interfaceData, nullptr, 0, nullptr, &devInfo) == FALSE &&
+	    GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+		return Err("SetupDiGetDeviceInterfaceDetailW: " + GetLastErrorAsString());
+	
+	// For a USB device the address is its port number on the hub.
+	HubPort hubPort;
+	DWORD address = 0;
+	if (SetupDiGetDeviceRegistryPropertyW(deviceInfoSet, &devInfo, SPDRP_ADDRESS, nullptr,
+	                                      reinterpret_cast<PBYTE>(&address), sizeof(address), nullptr) == FALSE)
+		return Err("SetupDiGetDeviceRegistryPropertyW: " + GetLastErrorAsString());
+	hubPort.port = address;
+	
+	DEVINST parent = 0;
+	CONFIGRET cr = CM_Get_Parent(&parent, devInfo.DevInst, 0);
+	if (cr != CR_SUCCESS)
+		return Err("CM_Get_Parent: " + std::to_string(cr));
+	
+	WCHAR parentId[MAX_DEVICE_ID_LEN];
+	cr = CM_Get_Device_IDW(parent, parentId, MAX_DEVICE_ID_LEN, 0);
+	if (cr != CR_SUCCESS)
+		return Err("CM_Get_Device_IDW: " + std::to_string(cr));
+	
+	// The parent's hub interface.
+	HDEVINFO hubInfoSet = SetupDiGetClassDevsW(&GUID_DEVINTERFACE_USB_HUB, parentId, nullptr, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+	if (hubInfoSet == INVALID_HANDLE_VALUE)
+		return Err("SetupDiGetClassDevsW: " + GetLastErrorAsString());
+	
+	auto se2 = make_scope_exit([&] { SetupDiDestroyDeviceInfoList(hubInfoSet); });
+	
+	SP_DEVICE_INTERFACE_DATA hubInterfaceData;
+	hubInterfaceData.cbSize = sizeof(hubInterfaceData);
+	if (SetupDiEnumDeviceInterfaces(hubInfoSet, nullptr, &GUID_DEVINTERFACE_USB_HUB, 0, &hubInterfaceData) == FALSE)
+		return Err("SetupDiEnumDeviceInterfaces: " + GetLastErrorAsString());
+	
+	DWORD requiredLength = 0;
+	if (SetupDiGetDeviceInterfaceDetailW(hubInfoSet, &hubInterfaceData, nullptr, 0, &requiredLength, nullptr) == FALSE &&
+	    GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+		return Err("SetupDiGetDeviceInterfaceDetailW: " + GetLastErrorAsString());
+	
+	std::vector<uint8_t> detailBuffer(requiredLength);
+	auto detailData = reinterpret_cast<PSP_DEVICE_INTERFACE_DETAIL_DATA_W>(detailBuffer.data());
+	detailData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+	if (SetupDiGetDeviceInterfaceDetailW(hubInfoSet, &hubInterfaceData, detailData, requiredLength, nullptr, nullptr) == FALSE)
+		return Err("SetupDiGetDeviceInterfaceDetailW: " + GetLastErrorAsString());
+	
+	hubPort.hubPath = detailData->DevicePath;
+	return Ok(hubPort);
+}
+
 #endif
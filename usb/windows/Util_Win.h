@@ -5,10 +5,29 @@
 #include <string>
 #include <cstdint>
 
+#include "util/Result.h"
+#include "../EndpointCounters.h"
+
 // Get the last error and return it as a string.
 std::string GetLastErrorAsString();
 
 // Get the string for a given return from GetLastError();
 std::string LastErrorAsString(uint32_t error);
 
+// Classify a failed transfer's GetLastError() code for the endpoint counters.
+TransferError LastErrorToTransferError(uint32_t error);
+
+// The hub port a device is plugged into.
+struct HubPort
+{
+	// The hub's device interface path, for CreateFileW().
+	std::wstring hubPath;
+	// 1-based, as IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX wants it.
+	uint32_t port = 0;
+};
+
+// Find the hub port of the device with the given interface path. This only asks SetupAPI
+// and the configuration manager, so nothing is sent to the device.
+SResult<HubPort> FindHubPort(const std::wstring& devicePath);
+
 #endif
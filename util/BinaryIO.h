@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+
+// Little helpers to flatten structs into a byte buffer and read them back. Everything is
+// native endian, so this is only for files that never leave the machine, like caches.
+
+class ByteWriter
+{
+public:
+	template<typename T>
+	void pod(T v)
+	{
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(&v);
+		buf.insert(buf.end(), p, p + sizeof(v));
+	}
+
+	// Strings are written as a uint32_t length followed by the characters.
+	template<typename C>
+	void str(const std::basic_string<C>& s)
+	{
+		pod<uint32_t>(s.size());
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(s.data());
+		buf.insert(buf.end(), p, p + s.size() * sizeof(C));
+	}
+
+	std::vector<uint8_t> buf;
+};
+
+// All the functions return false if there isn't enough data left, so a truncated
+// or corrupt buffer can't cause out of bounds reads.
+class ByteReader
+{
+public:
+	ByteReader(const uint8_t* data, size_t size) : p(data), end(data + size) {}
+
+	template<typename T>
+	bool pod(T& v)
+	{
+		if (remaining() < sizeof(v))
+			return false;
+		memcpy(&v, p, sizeof(v));
+		p += sizeof(v);
+		return true;
+	}
+
+	template<typename C>
+	bool str(std::basic_string<C>& s)
+	{
+		uint32_t n = 0;
+		if (!pod(n) || remaining() / sizeof(C) < n)
+			return false;
+		s.resize(n);
+		if (n != 0)
+			memcpy(&s[0], p, n * sizeof(C));
+		p += n * sizeof(C);
+		return true;
+	}
+
+	size_t remaining() const { return end - p; }
+	const uint8_t* position() const { return p; }
+
+private:
+	const uint8_t* p;
+	const uint8_t* end;
+};
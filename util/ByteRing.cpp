@@ -0,0 +1,158 @@
+#include "ByteRing.h"
+
+#include <algorithm>
+#include <string.h>
+
+ByteRing::ByteRing(size_t capacity, const LockedMemoryOptions& memory)
+{
+	// A power of two at least a page is a whole number of pages, since pages are too.
+	size_t size = 1;
+	while (size < capacity || size < MirroredMemory::granularity())
+		size <<= 1;
+
+	auto mirrored = MirroredMemory::create(size);
+	if (mirrored && mirrored.unwrap()->size() == size)
+	{
+		mirror = mirrored.unwrap();
+		base = mirror->data();
+
+		// Both views have their own page table entries, so lock and touch both.
+		if (memory.lock)
+		{
+			auto locked = LockMemoryRange(base, size * 2);
+			mLocked = !!locked;
+			if (!locked)
+				mDiagnostic = locked.unwrap_err();
+		}
+		if (memory.prefault)
+			PrefaultMemoryRange(base, size * 2);
+		
+		// The two views come from a shared mapping, which can't be made of huge pages without
+		// reserving them up front (hugetlbfs), so we don't try.
+		if (memory.hugePages)
+		{
+			if (!mDiagnostic.empty())
+				mDiagnostic += "; ";
+			mDiagnostic += "huge pages aren't supported for mirrored rings";
+		}
+	}
+	else
+	{
+		auto locked = LockedMemory::allocate(size, memory);
+		if (locked)
+		{
+			fallback = locked.unwrap();
+			base = fallback->data();
+			mLocked = fallback->locked();
+			mDiagnostic = fallback->diagnostic();
+		}
+		else
+		{
+			lastResort.resize(size);
+			base = lastResort.data();
+			mDiagnostic = locked.unwrap_err();
+		}
+	}
+	mCapacity = size;
+	mask = size - 1;
+}
+
+ByteRing::~ByteRing()
+{
+	if (mirror && mLocked)
+		UnlockMemoryRange(base, mCapacity * 2);
+}
+
+bool ByteRing::write(const uint8_t* data, size_t size)
+{
+	uint64_t w = writePos.load(std::memory_order_relaxed);
+	uint64_t r = readPos.load(std::memory_order_acquire);
+
+	if (size > mCapacity - (w - r))
+		return false;
+
+	size_t offset = w & mask;
+	if (mirror)
+	{
+		memcpy(base + offset, data, size);
+	}
+	else
+	{
+		// Copy in at most two pieces, either side of the end of the buffer.
+		size_t first = std::min(size, mCapacity - offset);
+		memcpy(base + offset, data, first);
+		memcpy(base, data + first, size - first);
+	}
+
+	writePos.store(w + size, std::memory_order_release);
+	return true;
+}
+
+size_t ByteRing::read(uint8_t* data, size_t size)
+{
+	uint64_t r = readPos.load(std::memory_order_relaxed);
+	uint64_t w = writePos.load(std::memory_order_acquire);
+
+	size = std::min<uint64_t>(size, w - r);
+
+	size_t offset = r & mask;
+	if (mirror)
+	{
+		memcpy(data, base + offset, size);
+	}
+	else
+	{
+		size_t first = std::min(size, mCapacity - offset);
+		memcpy(data, base + offset, first);
+		memcpy(data + first, base, size - first);
+	}
+
+	readPos.store(r + size, std::memory_order_release);
+	return size;
+}
+
+const uint8_t* ByteRing::readWindow(size_t& size) const
+{
+	uint64_t r = readPos.load(std::memory_order_relaxed);
+	uint64_t w = writePos.load(std::memory_order_acquire);
+
+	size_t offset = r & mask;
+	size = w - r;
+	if (!mirror)
+		size = std::min(size, mCapacity - offset);
+	return base + offset;
+}
+
+void ByteRing::consume(size_t size)
+{
+	uint64_t r = readPos.load(std::memory_order_relaxed);
+	readPos.store(r + size, std::memory_order_release);
+}
+
+uint8_t* ByteRing::writeWindow(size_t& size)
+{
+	uint64_t w = writePos.load(std::memory_order_relaxed);
+	uint64_t r = readPos.load(std::memory_order_acquire);
+
+	size_t offset = w & mask;
+	size = mCapacity - (w - r);
+	if (!mirror)
+		size = std::min(size, mCapacity - offset);
+	return base + offset;
+}
+
+void ByteRing::commit(size_t size)
+{
+	uint64_t w = writePos.load(std::memory_order_relaxed);
+	writePos.store(w + size, std::memory_order_release);
+}
+
+size_t ByteRing::readable() const
+{
+	return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_acquire);
+}
+
+size_t ByteRing::writable() const
+{
+	return mCapacity - readable();
+}
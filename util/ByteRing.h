@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MirroredMemory.h"
+#include "LockedMemory.h"
+
+// A ring buffer of bytes for one writing thread and one reading thread. Neither side takes
+// a lock; they only share the read and write positions, which are on separate cache lines.
+//
+// Writes are all or nothing, so a packet is never split by the ring filling up.
+//
+// The ring is normally in MirroredMemory, so the readable and writable bytes are always
+// contiguous and can be used in place with readWindow() and writeWindow(). If the OS won't
+// give us a mirrored mapping it falls back to ordinary memory, and the windows stop at the
+// end of the buffer.
+class ByteRing
+{
+public:
+	// The capacity is rounded up to a power of two, and a whole number of pages. `memory` can
+	// ask for the ring to be locked so a stream never page faults on it. Huge pages are only
+	// used if a mirrored mapping can't be made; otherwise memoryDiagnostic() says they weren't.
+	explicit ByteRing(size_t capacity, const LockedMemoryOptions& memory = LockedMemoryOptions());
+	~ByteRing();
+
+	// Append `size` bytes. If there isn't room for all of them nothing is written and this
+	// returns false. Only call this from the writing thread.
+	bool write(const uint8_t* data, size_t size);
+
+	// Copy out up to `size` bytes and return how many there were. Only call this from the
+	// reading thread.
+	size_t read(uint8_t* data, size_t size);
+
+	// The readable bytes, without copying them. `size` is set to how many there are. Call
+	// consume() once they have been used. Only call these from the reading thread.
+	const uint8_t* readWindow(size_t& size) const;
+	void consume(size_t size);
+
+	// Space to write into in place. `size` is set to how much there is. Call commit() with
+	// how much was written. Only call these from the writing thread.
+	uint8_t* writeWindow(size_t& size);
+	void commit(size_t size);
+
+	// These are only exact when called from the thread that would be affected.
+	size_t readable() const;
+	size_t writable() const;
+
+	size_t capacity() const { return mCapacity; }
+
+	// False if this fell back to ordinary memory.
+	bool mirrored() const { return mirror != nullptr; }
+
+	// Whether the memory is locked, and if it was meant to be, why not.
+	bool locked() const { return mLocked; }
+	const std::string& memoryDiagnostic() const { return mDiagnostic; }
+
+private:
+	ByteRing(const ByteRing&) = delete;
+	ByteRing& operator=(const ByteRing&) = delete;
+
+	static const int CACHE_LINE_SIZE = 64;
+
+	// One of these holds the data.
+	std::shared_ptr<MirroredMemory> mirror;
+	std::shared_ptr<LockedMemory> fallback;
+	std::vector<uint8_t> lastResort;
+	bool mLocked = false;
+	std::string mDiagnostic;
+	uint8_t* base = nullptr;
+	size_t mCapacity = 0;
+	size_t mask = 0;
+
+	// Total bytes ever written and read. These never wrap in practice. They are padded
+	// apart rather than using alignas() so the ring can be allocated with plain new.
+	char padding0[CACHE_LINE_SIZE];
+	std::atomic<uint64_t> writePos{0};
+	char padding1[CACHE_LINE_SIZE];
+	std::atomic<uint64_t> readPos{0};
+	char padding2[CACHE_LINE_SIZE];
+};
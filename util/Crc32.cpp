@@ -0,0 +1,56 @@
+#include "Crc32.h"
+
+#include <string.h>
+
+namespace
+{
+
+struct Crc32Tables
+{
+	uint32_t t[8][256];
+
+	Crc32Tables()
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			t[0][i] = c;
+		}
+		// t[k][i] is the CRC of byte i followed by k zero bytes.
+		for (uint32_t i = 0; i < 256; ++i)
+			for (int k = 1; k < 8; ++k)
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+	}
+};
+
+const Crc32Tables& Tables()
+{
+	static const Crc32Tables tables;
+	return tables;
+}
+
+} // anonymous namespace
+
+uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc)
+{
+	const auto& t = Tables().t;
+	crc = ~crc;
+
+	while (size >= 8)
+	{
+		// Assemble the words byte by byte so this doesn't depend on endianness or alignment.
+		uint32_t lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24));
+		uint32_t hi = data[4] | (data[5] << 8) | (data[6] << 16) | (static_cast<uint32_t>(data[7]) << 24);
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		data += 8;
+		size -= 8;
+	}
+
+	while (size-- > 0)
+		crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The CRC-32 used by zlib, Ethernet, etc. (reflected polynomial 0xEDB88320). This is what most
+// microcontroller CRC peripherals and bootloaders compute, which is why we use it for block
+// hashes rather than something stronger. It processes 8 bytes per step (slicing-by-8) so
+// hashing a multi-megabyte image takes a few milliseconds.
+//
+// To hash data in pieces pass the previous result as `crc`.
+uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
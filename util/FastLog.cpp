@@ -0,0 +1,367 @@
+#include "FastLog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+#include "ByteRing.h"
+#include "HighResClock.h"
+
+using std::string;
+
+namespace
+{
+// Each thread's ring. At a few dozen bytes per record this holds well over a thousand.
+const size_t RING_SIZE = 64 * 1024;
+
+// How often the logging thread empties the rings.
+const std::chrono::milliseconds DRAIN_INTERVAL(10);
+
+struct ThreadRing
+{
+	ThreadRing() : ring(RING_SIZE) {}
+
+	ByteRing ring;
+	// Set when the thread exits. The ring is kept until it has been emptied.
+	std::atomic_bool exited{false};
+};
+
+struct Logger
+{
+	// Only held to add, copy or remove rings, so a thread logging for the first time never
+	// waits for the sink.
+	std::mutex ringsMutex;
+	std::vector<std::shared_ptr<ThreadRing>> rings;
+
+	// Not held while the rings are read or the sink is called.
+	std::mutex mutex;
+
+	std::atomic<uint64_t> dropped{0};
+
+	// Everything below is protected by `mutex`.
+	LogSink sink;
+	std::thread thread;
+	bool running = false;
+	bool stopping = false;
+	// Incremented by FlushFastLog(), and copied to `drained` once a drain after it finishes.
+	uint64_t flushRequests = 0;
+	uint64_t drained = 0;
+	std::condition_variable wake;
+	std::condition_variable flushed;
+};
+
+// Never destroyed, so threads that log during exit still have somewhere to put it.
+Logger& TheLogger()
+{
+	static Logger* logger = new Logger();
+	return *logger;
+}
+
+struct ThreadHandle
+{
+	ThreadHandle()
+		: ring(std::make_shared<ThreadRing>())
+	{
+		Logger& logger = TheLogger();
+		std::unique_lock<std::mutex> lock(logger.ringsMutex);
+		logger.rings.push_back(ring);
+	}
+
+	~ThreadHandle()
+	{
+		ring->exited = true;
+	}
+
+	std::shared_ptr<ThreadRing> ring;
+};
+
+ThreadRing& CurrentRing()
+{
+	thread_local ThreadHandle handle;
+	return *handle.ring;
+}
+
+const char* LevelName(LogLevel level)
+{
+	switch (level)
+	{
+	case LogLevel::Trace:
+		return "Trace";
+	case LogLevel::Debug:
+		return "Debug";
+	case LogLevel::Info:
+		return "Info";
+	case LogLevel::Warning:
+		return "Warning";
+	case LogLevel::Error:
+		return "Error";
+	}
+	return "?";
+}
+
+void DefaultSink(LogLevel level, const string& message)
+{
+	std::cerr << LevelName(level) << ": " << message << std::endl;
+}
+
+// Append the next argument, and return how many bytes it took, or 0 if it is malformed.
+size_t FormatArg(const uint8_t* data, size_t size, string& out)
+{
+	if (size < 1)
+		return 0;
+	auto type = static_cast<fastlog::ArgType>(data[0]);
+	++data;
+	--size;
+
+	char buf[64];
+	switch (type)
+	{
+	case fastlog::ArgType::Int:
+	{
+		if (size < sizeof(int64_t))
+			return 0;
+		int64_t v;
+		memcpy(&v, data, sizeof(v));
+		out += std::to_string(v);
+		return 1 + sizeof(v);
+	}
+	case fastlog::ArgType::UInt:
+	{
+		if (size < sizeof(uint64_t))
+			return 0;
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		out += std::to_string(v);
+		return 1 + sizeof(v);
+	}
+	case fastlog::ArgType::Double:
+	{
+		if (size < sizeof(double))
+			return 0;
+		double v;
+		memcpy(&v, data, sizeof(v));
+		snprintf(buf, sizeof(buf), "%g", v);
+		out += buf;
+		return 1 + sizeof(v);
+	}
+	case fastlog::ArgType::Bool:
+		if (size < 1)
+			return 0;
+		out += data[0] ? "true" : "false";
+		return 2;
+	case fastlog::ArgType::Pointer:
+	{
+		if (size < sizeof(uint64_t))
+			return 0;
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(v));
+		out += buf;
+		return 1 + sizeof(v);
+	}
+	case fastlog::ArgType::String:
+	{
+		if (size < 1 || size < 1u + data[0])
+			return 0;
+		out.append(reinterpret_cast<const char*>(data + 1), data[0]);
+		return 2 + data[0];
+	}
+	}
+	return 0;
+}
+
+string FormatRecord(const LogSite* site, const uint8_t* args, size_t size)
+{
+	string out;
+	const char* f = site->format;
+	while (*f != '\0')
+	{
+		if (f[0] == '{' && f[1] == '}')
+		{
+			size_t used = FormatArg(args, size, out);
+			if (used == 0)
+				out += "{}";
+			args += used;
+			size -= used;
+			f += 2;
+		}
+		else
+		{
+			out += *f++;
+		}
+	}
+	return out;
+}
+
+struct Message
+{
+	uint64_t time;
+	LogLevel level;
+	string text;
+};
+
+// Read every complete record from the rings, in timestamp order. Only the logging thread
+// calls this.
+std::vector<Message> Drain(Logger& logger)
+{
+	std::vector<std::shared_ptr<ThreadRing>> rings;
+	{
+		std::unique_lock<std::mutex> lock(logger.ringsMutex);
+		rings = logger.rings;
+	}
+
+	std::vector<Message> messages;
+	std::vector<uint8_t> record;
+	std::vector<std::shared_ptr<ThreadRing>> finished;
+
+	for (const std::shared_ptr<ThreadRing>& ring : rings)
+	{
+		ThreadRing& tr = *ring;
+		// Check this first, so anything the thread wrote before exiting is read below.
+		bool exited = tr.exited.load(std::memory_order_acquire);
+
+		// Records are written whole, so if the size is there the rest is too.
+		uint32_t size;
+		while (tr.ring.read(reinterpret_cast<uint8_t*>(&size), sizeof(size)) == sizeof(size))
+		{
+			record.resize(size - sizeof(size));
+			tr.ring.read(record.data(), record.size());
+
+			const LogSite* site;
+			uint64_t time;
+			memcpy(&site, record.data(), sizeof(site));
+			memcpy(&time, record.data() + sizeof(site), sizeof(time));
+
+			size_t offset = sizeof(site) + sizeof(time);
+			Message m;
+			m.time = time;
+			m.level = site->level;
+			m.text = FormatRecord(site, record.data() + offset, record.size() - offset);
+			messages.push_back(std::move(m));
+		}
+
+		if (exited)
+			finished.push_back(ring);
+	}
+
+	if (!finished.empty())
+	{
+		std::unique_lock<std::mutex> lock(logger.ringsMutex);
+		logger.rings.erase(std::remove_if(logger.rings.begin(), logger.rings.end(), [&](const std::shared_ptr<ThreadRing>& r) {
+			return std::find(finished.begin(), finished.end(), r) != finished.end();
+		}), logger.rings.end());
+	}
+
+	// Interleave the threads. Each ring is already in order, so this is stable within one.
+	std::stable_sort(messages.begin(), messages.end(), [](const Message& a, const Message& b) {
+		return a.time < b.time;
+	});
+	return messages;
+}
+
+void Run(Logger& logger)
+{
+	std::unique_lock<std::mutex> lock(logger.mutex);
+	while (true)
+	{
+		// Only what was asked for before the drain started is sure to be covered by it.
+		uint64_t requests = logger.flushRequests;
+		bool stopping = logger.stopping;
+		// The sink is only replaced while the thread isn't running.
+		LogSink& sink = logger.sink;
+
+		// A slow sink mustn't hold up StopFastLog() and FlushFastLog() callers any more
+		// than it has to, so output without the lock.
+		lock.unlock();
+		for (const Message& m : Drain(logger))
+			sink(m.level, m.text);
+		lock.lock();
+
+		logger.drained = requests;
+		logger.flushed.notify_all();
+
+		if (stopping)
+			break;
+		logger.wake.wait_for(lock, DRAIN_INTERVAL, [&] {
+			return logger.stopping || logger.flushRequests != logger.drained;
+		});
+	}
+}
+}
+
+namespace fastlog
+{
+// A record is [uint32 size][LogSite*][uint64 time in ns][arguments], where the size includes
+// itself. It is filled in by commit().
+Encoder::Encoder(const LogSite* site)
+{
+	uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(HighResClock::now().time_since_epoch()).count();
+	mSize = sizeof(uint32_t);
+	memcpy(mBuffer + mSize, &site, sizeof(site));
+	mSize += sizeof(site);
+	memcpy(mBuffer + mSize, &time, sizeof(time));
+	mSize += sizeof(time);
+}
+
+void Encoder::commit()
+{
+	uint32_t size = static_cast<uint32_t>(mSize);
+	memcpy(mBuffer, &size, sizeof(size));
+	if (!CurrentRing().ring.write(mBuffer, mSize))
+		TheLogger().dropped.fetch_add(1, std::memory_order_relaxed);
+}
+}
+
+void StartFastLog(LogSink sink)
+{
+	Logger& logger = TheLogger();
+	std::unique_lock<std::mutex> lock(logger.mutex);
+	if (logger.running)
+		return;
+	logger.sink = sink ? sink : LogSink(DefaultSink);
+	logger.stopping = false;
+	logger.running = true;
+	logger.thread = std::thread(Run, std::ref(logger));
+}
+
+void StopFastLog()
+{
+	Logger& logger = TheLogger();
+	{
+		std::unique_lock<std::mutex> lock(logger.mutex);
+		if (!logger.running)
+			return;
+		logger.stopping = true;
+		logger.wake.notify_all();
+	}
+	logger.thread.join();
+
+	std::unique_lock<std::mutex> lock(logger.mutex);
+	logger.running = false;
+	logger.flushed.notify_all();
+}
+
+void FlushFastLog()
+{
+	Logger& logger = TheLogger();
+	std::unique_lock<std::mutex> lock(logger.mutex);
+	if (!logger.running)
+		return;
+	uint64_t request = ++logger.flushRequests;
+	logger.wake.notify_all();
+	logger.flushed.wait(lock, [&] {
+		return !logger.running || logger.drained >= request;
+	});
+}
+
+uint64_t FastLogDropped()
+{
+	return TheLogger().dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// A logger for code that can't afford to block, such as isochronous submission and transfer
+// callbacks. Logging a message just copies a pointer to its call site, a timestamp and the
+// raw arguments into a ring owned by the calling thread. A background thread formats and
+// prints them later.
+//
+//   FLOG_DEBUG("Submitting transfer for frame {} ({} frames)", frame, numFrames);
+//
+// Each {} is replaced by the next argument. Arguments can be integers, floating point,
+// bools, pointers, C strings and std::strings. Strings are copied (up to 255 bytes) since
+// they may be gone by the time the message is formatted.
+//
+// Levels below FASTLOG_MIN_LEVEL are removed by the preprocessor, so their arguments aren't
+// even evaluated.
+
+enum class LogLevel
+{
+	Trace = 0,
+	Debug = 1,
+	Info = 2,
+	Warning = 3,
+	Error = 4,
+};
+
+#ifndef FASTLOG_MIN_LEVEL
+#ifdef NDEBUG
+#define FASTLOG_MIN_LEVEL 2
+#else
+#define FASTLOG_MIN_LEVEL 1
+#endif
+#endif
+
+// Where a message is logged from. Records refer to these by address, so they must be static.
+struct LogSite
+{
+	LogLevel level;
+	const char* file;
+	int line;
+	const char* format;
+};
+
+// Receives each formatted message, in timestamp order, on the logging thread.
+typedef std::function<void(LogLevel level, const std::string& message)> LogSink;
+
+// Start the thread that formats records, sending them to `sink` (stderr by default). Until
+// this is called records wait in their threads' rings, and are dropped once they are full.
+void StartFastLog(LogSink sink = LogSink());
+
+// Output everything logged so far and stop the thread.
+void StopFastLog();
+
+// Wait until everything logged before this call has been output.
+void FlushFastLog();
+
+// Messages dropped because a thread's ring was full.
+uint64_t FastLogDropped();
+
+namespace fastlog
+{
+// The largest record. Longer ones have their last arguments cut off.
+static const size_t MAX_RECORD = 1024;
+static const size_t MAX_STRING = 255;
+
+enum class ArgType : uint8_t
+{
+	Int,
+	UInt,
+	Double,
+	Bool,
+	Pointer,
+	String,
+};
+
+class Encoder
+{
+public:
+	Encoder(const LogSite* site);
+
+	void put(ArgType type, const void* data, size_t size)
+	{
+		if (mSize + 1 + size > MAX_RECORD)
+			return;
+		mBuffer[mSize++] = static_cast<uint8_t>(type);
+		memcpy(mBuffer + mSize, data, size);
+		mSize += size;
+	}
+
+	void putString(const char* s, size_t length)
+	{
+		if (length > MAX_STRING)
+			length = MAX_STRING;
+		if (mSize + 2 + length > MAX_RECORD)
+			return;
+		mBuffer[mSize++] = static_cast<uint8_t>(ArgType::String);
+		mBuffer[mSize++] = static_cast<uint8_t>(length);
+		memcpy(mBuffer + mSize, s, length);
+		mSize += length;
+	}
+
+	// Copy the record into the calling thread's ring.
+	void commit();
+
+private:
+	uint8_t mBuffer[MAX_RECORD];
+	size_t mSize = 0;
+};
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type Encode(Encoder& e, T v)
+{
+	int64_t x = v;
+	e.put(ArgType::Int, &x, sizeof(x));
+}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value && !std::is_same<T, bool>::value>::type Encode(Encoder& e, T v)
+{
+	uint64_t x = v;
+	e.put(ArgType::UInt, &x, sizeof(x));
+}
+
+template<typename T>
+typename std::enable_if<std::is_enum<T>::value>::type Encode(Encoder& e, T v)
+{
+	int64_t x = static_cast<int64_t>(v);
+	e.put(ArgType::Int, &x, sizeof(x));
+}
+
+inline void Encode(Encoder& e, bool v)
+{
+	uint8_t x = v;
+	e.put(ArgType::Bool, &x, sizeof(x));
+}
+
+inline void Encode(Encoder& e, double v)
+{
+	e.put(ArgType::Double, &v, sizeof(v));
+}
+
+inline void Encode(Encoder& e, float v)
+{
+	Encode(e, static_cast<double>(v));
+}
+
+inline void Encode(Encoder& e, const char* s)
+{
+	if (s == nullptr)
+		s = "(null)";
+	e.putString(s, strlen(s));
+}
+
+inline void Encode(Encoder& e, char* s)
+{
+	Encode(e, static_cast<const char*>(s));
+}
+
+inline void Encode(Encoder& e, const std::string& s)
+{
+	e.putString(s.data(), s.size());
+}
+
+template<typename T>
+void Encode(Encoder& e, T* p)
+{
+	uint64_t x = reinterpret_cast<uintptr_t>(p);
+	e.put(ArgType::Pointer, &x, sizeof(x));
+}
+
+inline void EncodeAll(Encoder&)
+{
+}
+
+template<typename T, typename... Rest>
+void EncodeAll(Encoder& e, const T& first, const Rest&... rest)
+{
+	Encode(e, first);
+	EncodeAll(e, rest...);
+}
+
+template<typename... Args>
+void Log(const LogSite* site, const Args&... args)
+{
+	Encoder e(site);
+	EncodeAll(e, args...);
+	e.commit();
+}
+}
+
+#define FLOG_AT(lvl, format, ...)                                                  \
+	do {                                                                           \
+		static const LogSite flogSite_ = { lvl, __FILE__, __LINE__, format };      \
+		::fastlog::Log(&flogSite_, ##__VA_ARGS__);                                 \
+	} while (0)
+
+#if FASTLOG_MIN_LEVEL <= 0
+#define FLOG_TRACE(format, ...) FLOG_AT(LogLevel::Trace, format, ##__VA_ARGS__)
+#else
+#define FLOG_TRACE(format, ...) do {} while (0)
+#endif
+
+#if FASTLOG_MIN_LEVEL <= 1
+#define FLOG_DEBUG(format, ...) FLOG_AT(LogLevel::Debug, format, ##__VA_ARGS__)
+#else
+#define FLOG_DEBUG(format, ...) do {} while (0)
+#endif
+
+#if FASTLOG_MIN_LEVEL <= 2
+#define FLOG_INFO(format, ...) FLOG_AT(LogLevel::Info, format, ##__VA_ARGS__)
+#else
+#define FLOG_INFO(format, ...) do {} while (0)
+#endif
+
+#if FASTLOG_MIN_LEVEL <= 3
+#define FLOG_WARNING(format, ...) FLOG_AT(LogLevel::Warning, format, ##__VA_ARGS__)
+#else
+#define FLOG_WARNING(format, ...) do {} while (0)
+#endif
+
+#define FLOG_ERROR(format, ...) FLOG_AT(LogLevel::Error, format, ##__VA_ARGS__)
@@ -0,0 +1,278 @@
+#include "LockedMemory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#if defined(__APPLE__)
+#include <mach/vm_statistics.h>
+#endif
+#endif
+
+using std::string;
+
+namespace
+{
+size_t PageSize()
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+void AddDiagnostic(string& diagnostic, const string& s)
+{
+	if (!diagnostic.empty())
+		diagnostic += "; ";
+	diagnostic += s;
+}
+}
+
+void PrefaultMemoryRange(void* data, size_t size)
+{
+	volatile uint8_t* p = static_cast<volatile uint8_t*>(data);
+	size_t page = PageSize();
+	// Write rather than read, so copy-on-write zero pages are replaced by real ones.
+	for (size_t i = 0; i < size; i += page)
+		p[i] = p[i];
+}
+
+#if defined(_WIN32)
+
+namespace
+{
+string LastError(const string& what)
+{
+	return what + " failed: error " + std::to_string(GetLastError());
+}
+
+// Large pages need SeLockMemoryPrivilege to be held and enabled.
+bool EnableLockMemoryPrivilege()
+{
+	HANDLE token = nullptr;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool ok = LookupPrivilegeValueW(nullptr, L"SeLockMemoryPrivilege", &tp.Privileges[0].Luid) &&
+	          AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr) &&
+	          GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return ok;
+}
+}
+
+SResult<void> LockMemoryRange(void* data, size_t size)
+{
+	if (VirtualLock(data, size))
+		return Ok();
+
+	// The working set limits how much can be locked. Grow it by what we need and try again.
+	SIZE_T minWs = 0, maxWs = 0;
+	HANDLE process = GetCurrentProcess();
+	if (GetProcessWorkingSetSize(process, &minWs, &maxWs) &&
+	    SetProcessWorkingSetSize(process, minWs + size, maxWs + size) &&
+	    VirtualLock(data, size))
+		return Ok();
+
+	return Err(LastError("VirtualLock"));
+}
+
+void UnlockMemoryRange(void* data, size_t size)
+{
+	VirtualUnlock(data, size);
+}
+
+SResult<std::shared_ptr<LockedMemory>> LockedMemory::allocate(size_t size, const LockedMemoryOptions& options)
+{
+	std::shared_ptr<LockedMemory> mem(new LockedMemory());
+	mem->mSize = size;
+
+	if (options.hugePages)
+	{
+		SIZE_T large = GetLargePageMinimum();
+		if (large == 0)
+		{
+			AddDiagnostic(mem->mDiagnostic, "large pages aren't supported");
+		}
+		else if (!EnableLockMemoryPrivilege())
+		{
+			AddDiagnostic(mem->mDiagnostic, "large pages need SeLockMemoryPrivilege (\"Lock pages in memory\")");
+		}
+		else
+		{
+			size_t mapped = (size + large - 1) / large * large;
+			void* p = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p != nullptr)
+			{
+				// Large pages are always locked.
+				mem->mData = static_cast<uint8_t*>(p);
+				mem->mMappedSize = mapped;
+				mem->mHugePages = true;
+				mem->mLocked = true;
+				return Ok(mem);
+			}
+			AddDiagnostic(mem->mDiagnostic, LastError("VirtualAlloc(MEM_LARGE_PAGES)"));
+		}
+	}
+
+	size_t page = PageSize();
+	size_t mapped = (size + page - 1) / page * page;
+	void* p = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (p == nullptr)
+		return Err(LastError("VirtualAlloc"));
+	mem->mData = static_cast<uint8_t*>(p);
+	mem->mMappedSize = mapped;
+
+	if (options.lock)
+	{
+		auto locked = LockMemoryRange(mem->mData, mapped);
+		if (locked)
+			mem->mLocked = true;
+		else
+			AddDiagnostic(mem->mDiagnostic, locked.unwrap_err());
+	}
+
+	if (options.prefault)
+		PrefaultMemoryRange(mem->mData, mapped);
+
+	return Ok(mem);
+}
+
+LockedMemory::~LockedMemory()
+{
+	if (mData == nullptr)
+		return;
+	if (mLocked && !mHugePages)
+		VirtualUnlock(mData, mMappedSize);
+	VirtualFree(mData, 0, MEM_RELEASE);
+}
+
+#else
+
+namespace
+{
+string ErrnoError(const string& what)
+{
+	return what + " failed: " + strerror(errno);
+}
+}
+
+SResult<void> LockMemoryRange(void* data, size_t size)
+{
+	if (mlock(data, size) == 0)
+		return Ok();
+
+	int err = errno;
+	string error = ErrnoError("mlock");
+	// The usual reason is that the limit is tiny (often 64 kB), so say what it is.
+	struct rlimit limit;
+	if ((err == ENOMEM || err == EPERM || err == EAGAIN) && getrlimit(RLIMIT_MEMLOCK, &limit) == 0)
+	{
+		if (limit.rlim_cur == RLIM_INFINITY)
+			error += " (RLIMIT_MEMLOCK is unlimited)";
+		else
+			error += " (RLIMIT_MEMLOCK is " + std::to_string(limit.rlim_cur / 1024) + " kB and " +
+			         std::to_string(size / 1024) + " kB were needed; raise it with ulimit -l or limits.conf)";
+	}
+	return Err(error);
+}
+
+void UnlockMemoryRange(void* data, size_t size)
+{
+	munlock(data, size);
+}
+
+SResult<std::shared_ptr<LockedMemory>> LockedMemory::allocate(size_t size, const LockedMemoryOptions& options)
+{
+	std::shared_ptr<LockedMemory> mem(new LockedMemory());
+	mem->mSize = size;
+
+	if (options.hugePages)
+	{
+		size_t mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+		void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		string what = "mmap(MAP_HUGETLB)";
+#elif defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+		void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+		string what = "mmap(VM_FLAGS_SUPERPAGE_SIZE_2MB)";
+#else
+		void* p = MAP_FAILED;
+		errno = ENOTSUP;
+		string what = "Huge pages";
+#endif
+		if (p != MAP_FAILED)
+		{
+			mem->mData = static_cast<uint8_t*>(p);
+			mem->mMappedSize = mapped;
+			mem->mHugePages = true;
+		}
+		else
+		{
+			AddDiagnostic(mem->mDiagnostic, ErrnoError(what));
+		}
+	}
+
+	if (mem->mData == nullptr)
+	{
+		// If huge pages were asked for, at least align to them so transparent huge pages can
+		// be used where the kernel has them.
+		size_t align = options.hugePages ? HUGE_PAGE_SIZE : PageSize();
+		size_t mapped = (size + align - 1) / align * align;
+		void* p = mmap(nullptr, mapped + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (p == MAP_FAILED)
+			return Err(ErrnoError("mmap"));
+
+		// Trim the excess so the start is aligned.
+		uintptr_t start = reinterpret_cast<uintptr_t>(p);
+		uintptr_t aligned = (start + align - 1) / align * align;
+		if (aligned > start)
+			munmap(p, aligned - start);
+		uintptr_t end = start + mapped + align;
+		if (end > aligned + mapped)
+			munmap(reinterpret_cast<void*>(aligned + mapped), end - (aligned + mapped));
+
+		mem->mData = reinterpret_cast<uint8_t*>(aligned);
+		mem->mMappedSize = mapped;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		if (options.hugePages)
+			madvise(mem->mData, mapped, MADV_HUGEPAGE);
+#endif
+	}
+
+	if (options.lock)
+	{
+		auto locked = LockMemoryRange(mem->mData, mem->mMappedSize);
+		if (locked)
+			mem->mLocked = true;
+		else
+			AddDiagnostic(mem->mDiagnostic, locked.unwrap_err());
+	}
+
+	if (options.prefault)
+		PrefaultMemoryRange(mem->mData, mem->mMappedSize);
+
+	return Ok(mem);
+}
+
+LockedMemory::~LockedMemory()
+{
+	if (mData == nullptr)
+		return;
+	if (mLocked)
+		munlock(mData, mMappedSize);
+	munmap(mData, mMappedSize);
+}
+
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Result.h"
+
+// How memory for transfer buffers and stream rings should be allocated. Each option is a
+// request: if the OS won't allow it the memory is still allocated, and the reason is given
+// by diagnostic().
+struct LockedMemoryOptions
+{
+	// Pin the memory so it is never paged out. Limited by RLIMIT_MEMLOCK on POSIX and the
+	// working set size on Windows.
+	bool lock = false;
+	// Use 2 MB pages to save TLB misses. Linux needs pages reserved in
+	// /proc/sys/vm/nr_hugepages (otherwise transparent huge pages are asked for), Windows
+	// needs SeLockMemoryPrivilege, and macOS only has them on Intel.
+	bool hugePages = false;
+	// Touch every page now so the first use doesn't fault.
+	bool prefault = true;
+};
+
+// A block of memory from mmap() or VirtualAlloc() that may be locked and use huge pages.
+class LockedMemory
+{
+public:
+	// Only fails if no memory could be allocated at all.
+	static SResult<std::shared_ptr<LockedMemory>> allocate(size_t size, const LockedMemoryOptions& options);
+
+	~LockedMemory();
+
+	uint8_t* data() { return mData; }
+	const uint8_t* data() const { return mData; }
+	// What was asked for, although more may have been mapped.
+	size_t size() const { return mSize; }
+
+	bool locked() const { return mLocked; }
+	bool hugePages() const { return mHugePages; }
+
+	// Why an option couldn't be honoured, or empty if they all were.
+	const std::string& diagnostic() const { return mDiagnostic; }
+
+	static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+private:
+	LockedMemory() = default;
+	LockedMemory(const LockedMemory&) = delete;
+	LockedMemory& operator=(const LockedMemory&) = delete;
+
+	uint8_t* mData = nullptr;
+	size_t mSize = 0;
+	size_t mMappedSize = 0;
+	bool mLocked = false;
+	bool mHugePages = false;
+	std::string mDiagnostic;
+};
+
+// Lock a range of existing memory, for memory that has to come from somewhere else (e.g.
+// MirroredMemory). Returns why not on failure.
+SResult<void> LockMemoryRange(void* data, size_t size);
+void UnlockMemoryRange(void* data, size_t size);
+
+// Touch every page of a range so it is mapped in.
+void PrefaultMemoryRange(void* data, size_t size);
@@ -0,0 +1,236 @@
+#include "MappedFile.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#endif
+
+using std::string;
+
+#if defined(_WIN32)
+
+namespace
+{
+string LastError(const string& what)
+{
+	return what + " failed: error " + std::to_string(GetLastError());
+}
+
+std::wstring Widen(const string& s)
+{
+	int n = MultiByteToWideChar(CP_UTF8, 0, s.data(), s.size(), nullptr, 0);
+	std::wstring w(n, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, s.data(), s.size(), &w[0], n);
+	return w;
+}
+}
+
+SResult<std::shared_ptr<MappedFile>> MappedFile::open(const string& path, Mode mode, uint64_t minSize)
+{
+	std::shared_ptr<MappedFile> file(new MappedFile());
+	file->mMode = mode;
+
+	bool rw = mode == Mode::ReadWrite;
+	HANDLE h = CreateFileW(Widen(path).c_str(),
+	                       rw ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+	                       FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                       nullptr,
+	                       rw ? OPEN_ALWAYS : OPEN_EXISTING,
+	                       FILE_ATTRIBUTE_NORMAL,
+	                       nullptr);
+	if (h == INVALID_HANDLE_VALUE)
+		return Err(LastError("CreateFileW(" + path + ")"));
+	file->mFile = h;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(h, &size))
+		return Err(LastError("GetFileSizeEx"));
+	file->mSize = size.QuadPart;
+
+	if (rw && file->mSize < minSize)
+	{
+		MSTRY(file->resize(minSize));
+		return Ok(file);
+	}
+
+	MSTRY(file->map());
+	return Ok(file);
+}
+
+SResult<void> MappedFile::rename(const string& from, const string& to)
+{
+	if (!MoveFileExW(Widen(from).c_str(), Widen(to).c_str(), MOVEFILE_REPLACE_EXISTING))
+		return Err(LastError("MoveFileExW(" + from + ", " + to + ")"));
+	return Ok();
+}
+
+SResult<void> MappedFile::remove(const string& path)
+{
+	if (!DeleteFileW(Widen(path).c_str()))
+		return Err(LastError("DeleteFileW(" + path + ")"));
+	return Ok();
+}
+
+MappedFile::~MappedFile()
+{
+	unmap();
+	if (mFile != nullptr)
+		CloseHandle(mFile);
+}
+
+SResult<void> MappedFile::map()
+{
+	if (mSize == 0)
+		return Err(string("Can't map an empty file"));
+
+	bool rw = mMode == Mode::ReadWrite;
+	mMapping = CreateFileMappingW(mFile, nullptr, rw ? PAGE_READWRITE : PAGE_READONLY,
+	                              mSize >> 32, mSize & 0xFFFFFFFF, nullptr);
+	if (mMapping == nullptr)
+		return Err(LastError("CreateFileMappingW"));
+
+	mData = static_cast<uint8_t*>(MapViewOfFile(mMapping, rw ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, mSize));
+	if (mData == nullptr)
+		return Err(LastError("MapViewOfFile"));
+	return Ok();
+}
+
+void MappedFile::unmap()
+{
+	if (mData != nullptr)
+		UnmapViewOfFile(mData);
+	mData = nullptr;
+	if (mMapping != nullptr)
+		CloseHandle(mMapping);
+	mMapping = nullptr;
+}
+
+SResult<void> MappedFile::resize(uint64_t newSize)
+{
+	if (mMode != Mode::ReadWrite)
+		return Err(string("Can't resize a read-only mapping"));
+
+	unmap();
+
+	LARGE_INTEGER pos;
+	pos.QuadPart = newSize;
+	if (!SetFilePointerEx(mFile, pos, nullptr, FILE_BEGIN) || !SetEndOfFile(mFile))
+		return Err(LastError("SetEndOfFile"));
+
+	mSize = newSize;
+	return map();
+}
+
+SResult<void> MappedFile::flush()
+{
+	if (mData != nullptr && !FlushViewOfFile(mData, 0))
+		return Err(LastError("FlushViewOfFile"));
+	return Ok();
+}
+
+#else
+
+namespace
+{
+string ErrnoError(const string& what)
+{
+	return what + " failed: " + strerror(errno);
+}
+}
+
+SResult<std::shared_ptr<MappedFile>> MappedFile::open(const string& path, Mode mode, uint64_t minSize)
+{
+	std::shared_ptr<MappedFile> file(new MappedFile());
+	file->mMode = mode;
+
+	bool rw = mode == Mode::ReadWrite;
+	file->mFd = ::open(path.c_str(), rw ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	if (file->mFd < 0)
+		return Err(ErrnoError("open(" + path + ")"));
+
+	struct stat st;
+	if (fstat(file->mFd, &st) != 0)
+		return Err(ErrnoError("fstat"));
+	file->mSize = st.st_size;
+
+	if (rw && file->mSize < minSize)
+	{
+		MSTRY(file->resize(minSize));
+		return Ok(file);
+	}
+
+	MSTRY(file->map());
+	return Ok(file);
+}
+
+SResult<void> MappedFile::rename(const string& from, const string& to)
+{
+	if (::rename(from.c_str(), to.c_str()) != 0)
+		return Err(ErrnoError("rename(" + from + ", " + to + ")"));
+	return Ok();
+}
+
+SResult<void> MappedFile::remove(const string& path)
+{
+	if (unlink(path.c_str()) != 0)
+		return Err(ErrnoError("unlink(" + path + ")"));
+	return Ok();
+}
+
+MappedFile::~MappedFile()
+{
+	unmap();
+	if (mFd >= 0)
+		close(mFd);
+}
+
+SResult<void> MappedFile::map()
+{
+	if (mSize == 0)
+		return Err(string("Can't map an empty file"));
+
+	bool rw = mMode == Mode::ReadWrite;
+	void* p = mmap(nullptr, mSize, rw ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, mFd, 0);
+	if (p == MAP_FAILED)
+		return Err(ErrnoError("mmap"));
+
+	mData = static_cast<uint8_t*>(p);
+	return Ok();
+}
+
+void MappedFile::unmap()
+{
+	if (mData != nullptr)
+		munmap(mData, mSize);
+	mData = nullptr;
+}
+
+SResult<void> MappedFile::resize(uint64_t newSize)
+{
+	if (mMode != Mode::ReadWrite)
+		return Err(string("Can't resize a read-only mapping"));
+
+	unmap();
+
+	if (ftruncate(mFd, newSize) != 0)
+		return Err(ErrnoError("ftruncate"));
+
+	mSize = newSize;
+	return map();
+}
+
+SResult<void> MappedFile::flush()
+{
+	if (mData != nullptr && msync(mData, mSize, MS_SYNC) != 0)
+		return Err(ErrnoError("msync"));
+	return Ok();
+}
+
+#endif
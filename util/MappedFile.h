@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+#include "Result.h"
+
+// A file mapped into memory with mmap() or MapViewOfFile(). Changes made to a
+// read-write mapping are written back to the file by the OS.
+class MappedFile
+{
+public:
+	enum class Mode
+	{
+		ReadOnly,
+		// The file is created if it doesn't exist.
+		ReadWrite,
+	};
+
+	// Map a file. In ReadWrite mode the file is extended to at least `minSize` bytes (new
+	// bytes are zero). Empty read-only files can't be mapped so they are an error.
+	static SResult<std::shared_ptr<MappedFile>> open(const std::string& path, Mode mode, uint64_t minSize = 0);
+
+	// Rename `from` to `to`, atomically replacing `to` if it exists. Anyone who has the old
+	// `to` mapped keeps it. On Windows this fails if `to` is open anywhere.
+	static SResult<void> rename(const std::string& from, const std::string& to);
+
+	// Delete a file. A mapping of it stays valid.
+	static SResult<void> remove(const std::string& path);
+
+	~MappedFile();
+
+	uint8_t* data() { return mData; }
+	const uint8_t* data() const { return mData; }
+	uint64_t size() const { return mSize; }
+
+	// Grow or shrink the file and remap it. This invalidates pointers from data().
+	// Only allowed in ReadWrite mode.
+	SResult<void> resize(uint64_t newSize);
+
+	// Ask the OS to write dirty pages to disk now.
+	SResult<void> flush();
+
+private:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	SResult<void> map();
+	void unmap();
+
+	Mode mMode = Mode::ReadOnly;
+	uint8_t* mData = nullptr;
+	uint64_t mSize = 0;
+
+#if defined(_WIN32)
+	void* mFile = nullptr;
+	void* mMapping = nullptr;
+#else
+	int mFd = -1;
+#endif
+};
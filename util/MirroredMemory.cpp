@@ -0,0 +1,176 @@
+#include "MirroredMemory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+using std::string;
+
+#if defined(_WIN32)
+
+namespace
+{
+string LastError(const string& what)
+{
+	return what + " failed: error " + std::to_string(GetLastError());
+}
+}
+
+size_t MirroredMemory::granularity()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+}
+
+SResult<std::shared_ptr<MirroredMemory>> MirroredMemory::create(size_t minSize)
+{
+	size_t g = granularity();
+	size_t size = ((minSize == 0 ? 1 : minSize) + g - 1) / g * g;
+
+	std::shared_ptr<MirroredMemory> mem(new MirroredMemory());
+	mem->mSize = size;
+
+	uint64_t size64 = size;
+	mem->mMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+	                                   size64 >> 32, size64 & 0xFFFFFFFF, nullptr);
+	if (mem->mMapping == nullptr)
+		return Err(LastError("CreateFileMappingW"));
+
+	// There's no way to reserve address space and then map into it without VirtualAlloc2(),
+	// which needs Windows 10. Instead find a free range, release it and map both views into
+	// it, retrying if another thread took it in the meantime.
+	for (int attempt = 0; attempt < 16; ++attempt)
+	{
+		void* base = VirtualAlloc(nullptr, size * 2, MEM_RESERVE, PAGE_NOACCESS);
+		if (base == nullptr)
+			return Err(LastError("VirtualAlloc"));
+		VirtualFree(base, 0, MEM_RELEASE);
+
+		uint8_t* lower = static_cast<uint8_t*>(base);
+		void* first = MapViewOfFileEx(mem->mMapping, FILE_MAP_WRITE, 0, 0, size, lower);
+		if (first == nullptr)
+			continue;
+		void* second = MapViewOfFileEx(mem->mMapping, FILE_MAP_WRITE, 0, 0, size, lower + size);
+		if (second == nullptr)
+		{
+			UnmapViewOfFile(first);
+			continue;
+		}
+		mem->mData = lower;
+		return Ok(mem);
+	}
+	return Err(string("Couldn't find address space for a mirrored mapping"));
+}
+
+MirroredMemory::~MirroredMemory()
+{
+	if (mData != nullptr)
+	{
+		UnmapViewOfFile(mData);
+		UnmapViewOfFile(mData + mSize);
+	}
+	if (mMapping != nullptr)
+		CloseHandle(mMapping);
+}
+
+#else
+
+namespace
+{
+string ErrnoError(const string& what)
+{
+	return what + " failed: " + strerror(errno);
+}
+
+// An anonymous file to map. It is never linked into the filesystem (or is unlinked straight
+// away), so it goes when the mappings do.
+int AnonymousFile(string& error)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+	int fd = static_cast<int>(syscall(SYS_memfd_create, "UsbTool ring", 0));
+	if (fd >= 0)
+		return fd;
+#endif
+	static std::atomic<int> counter{0};
+	string name = "/usbtool-ring-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+	int fd2 = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd2 < 0)
+	{
+		error = ErrnoError("shm_open");
+		return -1;
+	}
+	shm_unlink(name.c_str());
+	return fd2;
+}
+}
+
+size_t MirroredMemory::granularity()
+{
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+SResult<std::shared_ptr<MirroredMemory>> MirroredMemory::create(size_t minSize)
+{
+	size_t g = granularity();
+	size_t size = ((minSize == 0 ? 1 : minSize) + g - 1) / g * g;
+
+	string error;
+	int fd = AnonymousFile(error);
+	if (fd < 0)
+		return Err(error);
+
+	if (ftruncate(fd, size) != 0)
+	{
+		error = ErrnoError("ftruncate");
+		close(fd);
+		return Err(error);
+	}
+
+	// Reserve twice the space, then map the file over each half.
+	void* base = mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		error = ErrnoError("mmap");
+		close(fd);
+		return Err(error);
+	}
+
+	uint8_t* lower = static_cast<uint8_t*>(base);
+	void* first = mmap(lower, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	void* second = first == MAP_FAILED ? MAP_FAILED :
+	               mmap(lower + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (second == MAP_FAILED)
+		error = ErrnoError("mmap");
+	// The mappings keep the memory alive.
+	close(fd);
+
+	if (second == MAP_FAILED)
+	{
+		munmap(base, size * 2);
+		return Err(error);
+	}
+
+	std::shared_ptr<MirroredMemory> mem(new MirroredMemory());
+	mem->mData = lower;
+	mem->mSize = size;
+	return Ok(mem);
+}
+
+MirroredMemory::~MirroredMemory()
+{
+	if (mData != nullptr)
+		munmap(mData, mSize * 2);
+}
+
+#endif
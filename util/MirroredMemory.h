@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Result.h"
+
+// A block of memory mapped twice, back to back, so that data()[i] and data()[i + size()] are
+// the same byte. A ring buffer built on it can hand out any window of up to size() bytes
+// starting anywhere in the ring as a single pointer, with no copying at the wrap.
+class MirroredMemory
+{
+public:
+	// `minSize` is rounded up to a multiple of granularity().
+	static SResult<std::shared_ptr<MirroredMemory>> create(size_t minSize);
+
+	~MirroredMemory();
+
+	// Valid for 2 * size() bytes.
+	uint8_t* data() { return mData; }
+	const uint8_t* data() const { return mData; }
+	size_t size() const { return mSize; }
+
+	// The size of a page on POSIX, or the allocation granularity (normally 64 kB) on Windows.
+	static size_t granularity();
+
+private:
+	MirroredMemory() = default;
+	MirroredMemory(const MirroredMemory&) = delete;
+	MirroredMemory& operator=(const MirroredMemory&) = delete;
+
+	uint8_t* mData = nullptr;
+	size_t mSize = 0;
+#if defined(_WIN32)
+	void* mMapping = nullptr;
+#endif
+};
@@ -0,0 +1,229 @@
+#include "SharedMemory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+using std::string;
+
+#if defined(_WIN32)
+
+namespace
+{
+string LastError(const string& what)
+{
+	return what + " failed: error " + std::to_string(GetLastError());
+}
+
+std::wstring MappingName(const string& name)
+{
+	// Local\ so it doesn't need SeCreateGlobalPrivilege. Names are ASCII identifiers.
+	return L"Local\\" + std::wstring(name.begin(), name.end());
+}
+}
+
+SResult<std::shared_ptr<SharedMemory>> SharedMemory::create(const string& name, size_t size)
+{
+	std::shared_ptr<SharedMemory> mem(new SharedMemory());
+	mem->mName = name;
+	mem->mSize = size;
+	mem->mOwner = true;
+
+	uint64_t size64 = size;
+	mem->mMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+	                                   size64 >> 32, size64 & 0xFFFFFFFF, MappingName(name).c_str());
+	if (mem->mMapping == nullptr)
+		return Err(LastError("CreateFileMappingW"));
+	// Mappings go when their last handle does, so one that exists belongs to a live process.
+	if (GetLastError() == ERROR_ALREADY_EXISTS)
+		return Err("Shared memory '" + name + "' is already in use");
+
+	mem->mData = static_cast<uint8_t*>(MapViewOfFile(mem->mMapping, FILE_MAP_WRITE, 0, 0, size));
+	if (mem->mData == nullptr)
+		return Err(LastError("MapViewOfFile"));
+	return Ok(mem);
+}
+
+SResult<std::shared_ptr<SharedMemory>> SharedMemory::open(const string& name, Access access)
+{
+	std::shared_ptr<SharedMemory> mem(new SharedMemory());
+	mem->mName = name;
+
+	DWORD rights = access == Access::ReadOnly ? FILE_MAP_READ : FILE_MAP_WRITE;
+	mem->mMapping = OpenFileMappingW(rights, FALSE, MappingName(name).c_str());
+	if (mem->mMapping == nullptr)
+		return Err(LastError("OpenFileMappingW"));
+
+	mem->mData = static_cast<uint8_t*>(MapViewOfFile(mem->mMapping, rights, 0, 0, 0));
+	if (mem->mData == nullptr)
+		return Err(LastError("MapViewOfFile"));
+
+	MEMORY_BASIC_INFORMATION info;
+	if (VirtualQuery(mem->mData, &info, sizeof(info)) == 0)
+		return Err(LastError("VirtualQuery"));
+	mem->mSize = info.RegionSize;
+	return Ok(mem);
+}
+
+SharedMemory::~SharedMemory()
+{
+	if (mData != nullptr)
+		UnmapViewOfFile(mData);
+	if (mMapping != nullptr)
+		CloseHandle(mMapping);
+}
+
+#else
+
+namespace
+{
+string ErrnoError(const string& what)
+{
+	return what + " failed: " + strerror(errno);
+}
+
+string ObjectName(const string& name)
+{
+	return "/" + name;
+}
+
+// POSIX shared memory outlives its creator if it crashes, so the creator's process ID goes
+// before the data, so the next one to create it can tell whether it is still running. A
+// cache line, so the data stays aligned.
+const char OWNER_MAGIC[8] = {'U', 'T', 'S', 'H', 'M', 'O', 'W', 'N'};
+
+struct OwnerHeader
+{
+	char magic[8];
+	int64_t pid;
+	uint8_t padding[48];
+};
+
+static_assert(sizeof(OwnerHeader) == 64, "OwnerHeader keeps the data cache line aligned");
+
+// Whether `objectName` was left behind by a process that has exited. If we can't tell
+// (e.g. it is still being created) it isn't.
+bool OwnerIsDead(const string& objectName)
+{
+	int fd = shm_open(objectName.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	bool dead = false;
+	OwnerHeader header;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(header)))
+	{
+		void* data = mmap(nullptr, sizeof(header), PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			memcpy(&header, data, sizeof(header));
+			munmap(data, sizeof(header));
+			// kill() fails with EPERM for a live process of another user.
+			dead = memcmp(header.magic, OWNER_MAGIC, sizeof(header.magic)) == 0 && header.pid > 0 &&
+			       kill(static_cast<pid_t>(header.pid), 0) != 0 && errno == ESRCH;
+		}
+	}
+	close(fd);
+	return dead;
+}
+}
+
+SResult<std::shared_ptr<SharedMemory>> SharedMemory::create(const string& name, size_t size)
+{
+	string objectName = ObjectName(name);
+
+	int fd = shm_open(objectName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		// Only take the name from a process that has gone; otherwise we would pull it out
+		// from under a live ring.
+		if (!OwnerIsDead(objectName))
+			return Err("Shared memory '" + name + "' is already in use");
+		shm_unlink(objectName.c_str());
+		fd = shm_open(objectName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if (fd < 0)
+		return Err(ErrnoError("shm_open"));
+
+	size_t mappedSize = sizeof(OwnerHeader) + size;
+	string error;
+	void* data = MAP_FAILED;
+	if (ftruncate(fd, mappedSize) != 0)
+		error = ErrnoError("ftruncate");
+	else
+	{
+		data = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			error = ErrnoError("mmap");
+	}
+	// The mapping keeps the memory alive.
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		shm_unlink(objectName.c_str());
+		return Err(error);
+	}
+
+	OwnerHeader* header = static_cast<OwnerHeader*>(data);
+	header->pid = getpid();
+	memcpy(header->magic, OWNER_MAGIC, sizeof(header->magic));
+
+	std::shared_ptr<SharedMemory> mem(new SharedMemory());
+	mem->mName = name;
+	mem->mData = static_cast<uint8_t*>(data) + sizeof(OwnerHeader);
+	mem->mSize = size;
+	mem->mOwner = true;
+	return Ok(mem);
+}
+
+SResult<std::shared_ptr<SharedMemory>> SharedMemory::open(const string& name, Access access)
+{
+	bool readOnly = access == Access::ReadOnly;
+	int fd = shm_open(ObjectName(name).c_str(), readOnly ? O_RDONLY : O_RDWR, 0);
+	if (fd < 0)
+		return Err(ErrnoError("shm_open"));
+
+	string error;
+	void* data = MAP_FAILED;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		error = ErrnoError("fstat");
+	else if (st.st_size <= static_cast<off_t>(sizeof(OwnerHeader)))
+		error = "Shared memory '" + name + "' is empty";
+	else
+	{
+		data = mmap(nullptr, st.st_size, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			error = ErrnoError("mmap");
+	}
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return Err(error);
+
+	std::shared_ptr<SharedMemory> mem(new SharedMemory());
+	mem->mName = name;
+	mem->mData = static_cast<uint8_t*>(data) + sizeof(OwnerHeader);
+	mem->mSize = st.st_size - sizeof(OwnerHeader);
+	return Ok(mem);
+}
+
+SharedMemory::~SharedMemory()
+{
+	if (mData != nullptr)
+		munmap(mData - sizeof(OwnerHeader), sizeof(OwnerHeader) + mSize);
+	if (mOwner)
+		shm_unlink(ObjectName(mName).c_str());
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Result.h"
+
+// Memory shared with other processes by name: shm_open() on POSIX, a named file mapping on
+// Windows. The name belongs to whoever created it, and is removed when their SharedMemory is
+// destroyed. Processes that have it open keep their mappings.
+class SharedMemory
+{
+public:
+	enum class Access
+	{
+		ReadOnly,
+		ReadWrite,
+	};
+
+	// Create zeroed memory called `name`. Fails if another process that is still running
+	// has it. On POSIX, memory left behind by a process that crashed is replaced: its
+	// process ID is kept just before data(). `name` should be a plain identifier, without
+	// slashes.
+	static SResult<std::shared_ptr<SharedMemory>> create(const std::string& name, size_t size);
+
+	// Map memory that another process created, all of it.
+	static SResult<std::shared_ptr<SharedMemory>> open(const std::string& name, Access access);
+
+	~SharedMemory();
+
+	// Don't write through this if it was opened ReadOnly.
+	uint8_t* data() { return mData; }
+	const uint8_t* data() const { return mData; }
+	// On Windows this is rounded up to a whole page when opening.
+	size_t size() const { return mSize; }
+	const std::string& name() const { return mName; }
+
+private:
+	SharedMemory() = default;
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	std::string mName;
+	uint8_t* mData = nullptr;
+	size_t mSize = 0;
+	bool mOwner = false;
+#if defined(_WIN32)
+	void* mMapping = nullptr;
+#endif
+};
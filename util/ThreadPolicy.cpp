@@ -0,0 +1,237 @@
+#include "ThreadPolicy.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <string.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#endif
+#endif
+
+using std::string;
+
+namespace
+{
+void AddError(string& errors, const string& s)
+{
+	if (s.empty())
+		return;
+	if (!errors.empty())
+		errors += "; ";
+	errors += s;
+}
+}
+
+#if defined(_WIN32)
+
+SResult<void> ApplyThreadPolicy(const ThreadPolicy& policy)
+{
+	string errors;
+	HANDLE thread = GetCurrentThread();
+
+	int priority = THREAD_PRIORITY_NORMAL;
+	if (policy.scheduling == ThreadPolicy::Scheduling::Fifo)
+		priority = THREAD_PRIORITY_TIME_CRITICAL;
+	else if (policy.scheduling == ThreadPolicy::Scheduling::RoundRobin)
+		priority = THREAD_PRIORITY_HIGHEST;
+	if (!SetThreadPriority(thread, priority))
+		AddError(errors, "SetThreadPriority failed: error " + std::to_string(GetLastError()));
+
+	if (!policy.cpus.empty())
+	{
+		DWORD_PTR mask = 0;
+		for (int cpu : policy.cpus)
+			if (cpu >= 0 && cpu < static_cast<int>(sizeof(mask) * 8))
+				mask |= DWORD_PTR(1) << cpu;
+		if (SetThreadAffinityMask(thread, mask) == 0)
+			AddError(errors, "SetThreadAffinityMask failed: error " + std::to_string(GetLastError()));
+	}
+
+	if (policy.lockMemory)
+		AddError(errors, "Windows can't lock the whole process; use LockedMemory for the buffers instead");
+
+	if (!errors.empty())
+		return Err(errors);
+	return Ok();
+}
+
+#else
+
+namespace
+{
+string ErrnoString(int err)
+{
+	return strerror(err);
+}
+
+#if defined(__APPLE__)
+// macOS doesn't honour SCHED_FIFO for user threads. Its real-time threads are time constraint
+// ones, which any process can have: they get `computation` of every `period`.
+string ApplyMacScheduling(const ThreadPolicy& policy)
+{
+	thread_port_t thread = pthread_mach_thread_np(pthread_self());
+
+	if (policy.scheduling == ThreadPolicy::Scheduling::Normal)
+	{
+		thread_standard_policy_data_t standard;
+		kern_return_t kr = thread_policy_set(thread, THREAD_STANDARD_POLICY,
+		                                     reinterpret_cast<thread_policy_t>(&standard),
+		                                     THREAD_STANDARD_POLICY_COUNT);
+		return kr == KERN_SUCCESS ? string() : "thread_policy_set(THREAD_STANDARD_POLICY) failed: " + std::to_string(kr);
+	}
+
+	mach_timebase_info_data_t timebase;
+	mach_timebase_info(&timebase);
+	auto toAbs = [&](int us) {
+		return static_cast<uint32_t>(static_cast<uint64_t>(us) * 1000 * timebase.denom / timebase.numer);
+	};
+
+	thread_time_constraint_policy_data_t tc;
+	tc.period = toAbs(policy.periodUs);
+	tc.computation = toAbs(policy.computationUs);
+	tc.constraint = toAbs(policy.periodUs);
+	// Round robin lets other real-time threads in part way through.
+	tc.preemptible = policy.scheduling == ThreadPolicy::Scheduling::RoundRobin;
+
+	kern_return_t kr = thread_policy_set(thread, THREAD_TIME_CONSTRAINT_POLICY,
+	                                     reinterpret_cast<thread_policy_t>(&tc),
+	                                     THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+	return kr == KERN_SUCCESS ? string() : "thread_policy_set(THREAD_TIME_CONSTRAINT_POLICY) failed: " + std::to_string(kr);
+}
+#else
+string ApplyPosixScheduling(const ThreadPolicy& policy)
+{
+	int sched = SCHED_OTHER;
+	if (policy.scheduling == ThreadPolicy::Scheduling::Fifo)
+		sched = SCHED_FIFO;
+	else if (policy.scheduling == ThreadPolicy::Scheduling::RoundRobin)
+		sched = SCHED_RR;
+
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	if (sched != SCHED_OTHER)
+		param.sched_priority = policy.priority;
+
+	int err = pthread_setschedparam(pthread_self(), sched, &param);
+	if (err == 0)
+		return string();
+
+	string error = "pthread_setschedparam failed: " + ErrnoString(err);
+#if defined(RLIMIT_RTPRIO)
+	struct rlimit limit;
+	if (err == EPERM && getrlimit(RLIMIT_RTPRIO, &limit) == 0)
+		error += " (real-time priority " + std::to_string(policy.priority) + " needs CAP_SYS_NICE or RLIMIT_RTPRIO of at least that, and it is " +
+		         (limit.rlim_cur == RLIM_INFINITY ? string("unlimited") : std::to_string(limit.rlim_cur)) +
+		         "; raise it with ulimit -r or limits.conf)";
+#endif
+	return error;
+}
+#endif
+
+string ApplyAffinity(const ThreadPolicy& policy)
+{
+	if (policy.cpus.empty())
+		return string();
+
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : policy.cpus)
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	return err == 0 ? string() : "pthread_setaffinity_np failed: " + ErrnoString(err);
+#elif defined(__APPLE__)
+	// Threads with the same tag are put on CPUs that share a cache, where possible. That's the
+	// most macOS offers.
+	thread_affinity_policy_data_t affinity;
+	affinity.affinity_tag = policy.cpus[0] + 1;
+	kern_return_t kr = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+	                                     reinterpret_cast<thread_policy_t>(&affinity),
+	                                     THREAD_AFFINITY_POLICY_COUNT);
+	return kr == KERN_SUCCESS ? string() : "thread_policy_set(THREAD_AFFINITY_POLICY) failed: " + std::to_string(kr);
+#else
+	return "CPU affinity isn't supported on this platform";
+#endif
+}
+
+string LockAllMemory()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+		return string();
+
+	int err = errno;
+	string error = "mlockall failed: " + ErrnoString(err);
+	struct rlimit limit;
+	if ((err == ENOMEM || err == EPERM) && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+		error += " (RLIMIT_MEMLOCK is " + std::to_string(limit.rlim_cur / 1024) + " kB; raise it with ulimit -l or limits.conf)";
+	return error;
+}
+}
+
+SResult<void> ApplyThreadPolicy(const ThreadPolicy& policy)
+{
+	string errors;
+
+#if defined(__APPLE__)
+	AddError(errors, ApplyMacScheduling(policy));
+#else
+	AddError(errors, ApplyPosixScheduling(policy));
+#endif
+	AddError(errors, ApplyAffinity(policy));
+	if (policy.lockMemory)
+		AddError(errors, LockAllMemory());
+
+	if (!errors.empty())
+		return Err(errors);
+	return Ok();
+}
+
+#endif
+
+void ThreadPolicyRequest::set(const ThreadPolicy& policy)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mPolicy = policy;
+	mPending = true;
+}
+
+void ThreadPolicyRequest::applyIfPending()
+{
+	if (!mPending.load(std::memory_order_acquire))
+		return;
+
+	ThreadPolicy policy;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		policy = mPolicy;
+		mPending = false;
+	}
+
+	auto result = ApplyThreadPolicy(policy);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mApplied = true;
+	mError = result ? string() : result.unwrap_err();
+}
+
+SResult<void> ThreadPolicyRequest::status() const
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	if (!mApplied)
+		return Err(string("No thread policy has been applied yet"));
+	if (!mError.empty())
+	{
+		string error = mError;
+		return Err(error);
+	}
+	return Ok();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Result.h"
+
+// How a latency-sensitive thread (an isochronous stream, or a device's callback thread)
+// should be scheduled.
+struct ThreadPolicy
+{
+	enum class Scheduling
+	{
+		Normal,
+		// Runs until it blocks, ahead of every normal thread.
+		Fifo,
+		// The same, but shares time with real-time threads of the same priority.
+		RoundRobin,
+	};
+
+	Scheduling scheduling = Scheduling::Normal;
+
+	// For Fifo and RoundRobin. 1 to 99 on Linux; on Windows anything above 0 means time
+	// critical. macOS ignores it and uses a time constraint policy of `periodUs` instead.
+	int priority = 10;
+
+	// On macOS, how often the thread needs to run, and the most it needs each time.
+	int periodUs = 1000;
+	int computationUs = 250;
+
+	// The CPUs the thread may run on, or empty for any. macOS only takes this as a hint.
+	std::vector<int> cpus;
+
+	// Lock every page of the process, current and future, so the thread never waits for one
+	// to be paged in. This affects the whole process.
+	bool lockMemory = false;
+};
+
+// Apply a policy to the calling thread. Everything that can be applied is; the error lists
+// the rest and what privilege or limit is missing.
+SResult<void> ApplyThreadPolicy(const ThreadPolicy& policy);
+
+// Lets any thread ask a looping thread to apply a policy to itself, since some platforms
+// can only change the calling thread.
+class ThreadPolicyRequest
+{
+public:
+	void set(const ThreadPolicy& policy);
+
+	// Call on the thread itself, e.g. once per loop. This is cheap if nothing was set.
+	void applyIfPending();
+
+	// The result of the last policy applied, or an error if one hasn't been yet.
+	SResult<void> status() const;
+
+private:
+	std::atomic_bool mPending{false};
+	mutable std::mutex mMutex;
+	ThreadPolicy mPolicy;
+	bool mApplied = false;
+	std::string mError;
+};
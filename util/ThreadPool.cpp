@@ -0,0 +1,166 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads)
+{
+	if (numThreads < 1)
+		numThreads = 1;
+
+	for (int i = 0; i < numThreads; ++i)
+		threads.emplace_back([this] { run(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+	stop();
+}
+
+void ThreadPool::post(std::function<void()> job, JobPriority priority)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (quit)
+			return;
+		jobs[static_cast<int>(priority)].push_back(std::move(job));
+		++numJobs;
+	}
+	condition.notify_one();
+}
+
+void ThreadPool::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		quit = true;
+		for (auto& queue : jobs)
+			queue.clear();
+		numJobs = 0;
+	}
+	condition.notify_all();
+
+	for (std::thread& t : threads)
+		if (t.joinable())
+			t.join();
+}
+
+int ThreadPool::numThreads() const
+{
+	return threads.size();
+}
+
+void ThreadPool::run()
+{
+	for (;;)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&] { return quit || numJobs > 0; });
+			if (quit)
+				return;
+			for (auto& queue : jobs)
+			{
+				if (queue.empty())
+					continue;
+				job = std::move(queue.front());
+				queue.pop_front();
+				--numJobs;
+				break;
+			}
+		}
+		job();
+	}
+}
+
+Strand::Strand(ThreadPool& pool) : pool(pool)
+{
+}
+
+void Strand::post(std::function<void()> job, JobPriority priority)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	jobs[static_cast<int>(priority)].push_back(std::move(job));
+
+	// If a job is running it will schedule the next one when it finishes.
+	if (running)
+		return;
+
+	// Otherwise make sure there's a runNext() queued at least at this priority.
+	if (runQueuedAt(priority))
+		return;
+
+	schedule();
+}
+
+int Strand::pending() const
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	int n = running ? 1 : 0;
+	for (auto& queue : jobs)
+		n += queue.size();
+	return n;
+}
+
+std::deque<std::function<void()>>* Strand::bestQueue()
+{
+	for (auto& queue : jobs)
+		if (!queue.empty())
+			return &queue;
+	return nullptr;
+}
+
+bool Strand::runQueuedAt(JobPriority priority) const
+{
+	for (int p = 0; p <= static_cast<int>(priority); ++p)
+		if (queuedRuns[p] > 0)
+			return true;
+	return false;
+}
+
+void Strand::schedule()
+{
+	auto* queue = bestQueue();
+	if (queue == nullptr)
+		return;
+	JobPriority priority = static_cast<JobPriority>(queue - jobs.data());
+
+	++queuedRuns[static_cast<int>(priority)];
+
+	// Keep the strand alive until the job has run. Posting with our lock held is fine
+	// because the pool never calls back into us with its own lock held.
+	std::shared_ptr<Strand> self = shared_from_this();
+	pool.post([self, priority] { self->runNext(priority); }, priority);
+}
+
+void Strand::runNext(JobPriority priority)
+{
+	std::function<void()> job;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		--queuedRuns[static_cast<int>(priority)];
+
+		// Another runNext() got here first; it will reschedule us if needed.
+		if (running)
+			return;
+
+		auto* queue = bestQueue();
+		if (queue == nullptr)
+			return;
+
+		job = std::move(queue->front());
+		queue->pop_front();
+		running = true;
+	}
+
+	job();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	running = false;
+	auto* queue = bestQueue();
+	if (queue == nullptr)
+		return;
+	// A runNext() that is already queued will pick up the remaining jobs, unless
+	// something more urgent arrived while we were busy. The runs still queued may be
+	// at a lower priority than the one that just ran.
+	if (!runQueuedAt(static_cast<JobPriority>(queue - jobs.data())))
+		schedule();
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <functional>
+#include <array>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+// Jobs are run in priority order. Within a priority they are first-in first-out.
+enum class JobPriority
+{
+	// Things the user is waiting for, e.g. they clicked "Receive".
+	Interactive = 0,
+	// Keeping streams fed.
+	Streaming = 1,
+	// Periodic enumeration, prefetching, etc.
+	Background = 2,
+};
+
+static const int NUM_JOB_PRIORITIES = 3;
+
+// A fixed-size pool of threads that run jobs from a shared queue. The jobs are
+// expected to be blocking USB requests, so there's no point in anything cleverer
+// than a single queue - the time spent taking the lock is nothing compared to a
+// control transfer.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int numThreads);
+	// Calls stop().
+	~ThreadPool();
+
+	// Queue a job. Jobs posted after stop() are silently dropped.
+	void post(std::function<void()> job, JobPriority priority = JobPriority::Interactive);
+
+	// Wait for running jobs to finish, discard queued ones and join the threads.
+	// It's harmless to call this more than once.
+	void stop();
+
+	int numThreads() const;
+
+private:
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void run();
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	// One queue per JobPriority.
+	std::array<std::deque<std::function<void()>>, NUM_JOB_PRIORITIES> jobs;
+	int numJobs = 0;
+	bool quit = false;
+
+	std::vector<std::thread> threads;
+};
+
+// Runs jobs on a ThreadPool one at a time, in priority order and then in the order
+// they were posted. Different strands run concurrently. We use one strand per device, so requests to a device
+// stay in order but a device that takes seconds to answer only holds up itself.
+//
+// After each job the strand goes to the back of the pool's queue, so a strand with
+// lots of work can't starve the others. The strand runs its highest priority job
+// first, and is queued on the pool at that priority, so an interactive request
+// overtakes background work both on its own device and on the others.
+//
+// Must be created with std::make_shared. The pool must outlive the strand.
+class Strand : public std::enable_shared_from_this<Strand>
+{
+public:
+	explicit Strand(ThreadPool& pool);
+
+	// Run `job` once all the jobs of the same or higher priority previously posted
+	// to this strand have finished.
+	void post(std::function<void()> job, JobPriority priority = JobPriority::Interactive);
+
+	// The number of jobs queued or running.
+	int pending() const;
+
+private:
+	Strand(const Strand&) = delete;
+	Strand& operator=(const Strand&) = delete;
+
+	// Run the next job. This is what is posted to the pool, at `priority`.
+	void runNext(JobPriority priority);
+
+	// Post runNext() to the pool at the priority of the best job. `mutex` must be locked.
+	void schedule();
+
+	// Get the queue of the highest priority job, or null if there are none. `mutex` must be locked.
+	std::deque<std::function<void()>>* bestQueue();
+
+	// Whether a runNext() is queued on the pool at `priority` or better. `mutex` must be locked.
+	bool runQueuedAt(JobPriority priority) const;
+
+	ThreadPool& pool;
+
+	mutable std::mutex mutex;
+	std::array<std::deque<std::function<void()>>, NUM_JOB_PRIORITIES> jobs;
+	// True while one of our jobs is running.
+	bool running = false;
+	// The number of runNext() calls queued on the pool at each priority. More than one can
+	// be queued if a higher priority job arrives while we are waiting.
+	std::array<int, NUM_JOB_PRIORITIES> queuedRuns{};
+};